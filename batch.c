@@ -0,0 +1,341 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "bitmap.h"
+#include "cache.h"
+#include "process.h"
+#include "threadpool.h"
+
+#define BATCH_IO_THREADS      2
+#define BATCH_LOOKAHEAD_SCALE 2 //! Images in flight per compute thread
+
+struct Batch_t;
+
+struct BatchJob_t
+{
+	const char *Input;
+	const char *Output;
+	struct Batch_t *Batch;
+	struct BmpCtx_t Image;
+	struct BGRAf_t  RMSE;
+};
+
+struct Batch_t
+{
+	const struct ProcessOpts_t *Opts;
+	const char *CacheDir;
+	struct ThreadPool_t *ComputePool;
+	struct ThreadPool_t *IOPool;
+	struct BatchJob_t *Jobs;
+	int nJobs;
+	int nStarted;
+	int nFinished;
+	int nFailed;
+	pthread_mutex_t Lock;
+	pthread_cond_t  AllFinished;
+};
+
+static void Batch_LoadTask(void *Arg);
+
+//! Report a job, and start loading the next one in its place
+static void Batch_Finish(struct BatchJob_t *Job, const char *Error)
+{
+	struct Batch_t *Batch = Job->Batch;
+
+	pthread_mutex_lock(&Batch->Lock);
+	if(Error)
+	{
+		printf("%s: %s\n", Job->Input, Error);
+		Batch->nFailed++;
+	}
+	else
+	{
+		struct BGRAf_t PSNR = Process_PSNR(Job->RMSE);
+		printf("%s -> %s: PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}\n", Job->Input, Job->Output, PSNR.b, PSNR.g, PSNR.r, PSNR.a);
+	}
+
+	struct BatchJob_t *Next = NULL;
+	if(Batch->nStarted < Batch->nJobs) Next = &Batch->Jobs[Batch->nStarted++];
+	if(++Batch->nFinished == Batch->nJobs) pthread_cond_broadcast(&Batch->AllFinished);
+	pthread_mutex_unlock(&Batch->Lock);
+
+	if(Next && !ThreadPool_Submit(Batch->IOPool, Batch_LoadTask, Next))
+		Batch_Finish(Next, "Out of memory - Image not processed");
+}
+
+static void Batch_WriteTask(void *Arg)
+{
+	struct BatchJob_t *Job = Arg;
+	int Ok = BmpCtx_ToFile(&Job->Image, Job->Output);
+	BmpCtx_Destroy(&Job->Image);
+	Batch_Finish(Job, Ok ? NULL : "Unable to write output file");
+}
+
+static void Batch_ComputeTask(void *Arg)
+{
+	struct BatchJob_t *Job = Arg;
+	int Error, Hit;
+	if(Job->Batch->CacheDir) Error = Cache_ProcessImage(Job->Batch->CacheDir, &Job->Image, Job->Batch->Opts, &Job->RMSE, NULL, &Hit);
+	else Error = Process_Image(&Job->Image, Job->Batch->Opts, &Job->RMSE, NULL);
+	if(Error != PROCESS_OK)
+	{
+		BmpCtx_Destroy(&Job->Image);
+		Batch_Finish(Job, Process_ErrorString(Error, Job->Batch->Opts));
+	}
+	else if(!ThreadPool_Submit(Job->Batch->IOPool, Batch_WriteTask, Job))
+	{
+		Batch_WriteTask(Job);
+	}
+}
+
+static void Batch_LoadTask(void *Arg)
+{
+	struct BatchJob_t *Job = Arg;
+	if(!BmpCtx_FromFile(&Job->Image, Job->Input))
+	{
+		Batch_Finish(Job, "Unable to read input file");
+	}
+	else if(!ThreadPool_Submit(Job->Batch->ComputePool, Batch_ComputeTask, Job))
+	{
+		BmpCtx_Destroy(&Job->Image);
+		Batch_Finish(Job, "Out of memory - Image not processed");
+	}
+}
+
+int Batch_Run(const char *const *Paths, int nJobs, const struct ProcessOpts_t *Opts, int nThreads, const char *CacheDir)
+{
+	int i;
+	if(nJobs <= 0) return 0;
+
+	struct Batch_t Batch;
+	memset(&Batch, 0, sizeof(Batch));
+	Batch.Opts        = Opts;
+	Batch.CacheDir    = CacheDir;
+	Batch.nJobs       = nJobs;
+	Batch.ComputePool = ThreadPool_Global(nThreads);
+	Batch.IOPool      = ThreadPool_Create(BATCH_IO_THREADS);
+	Batch.Jobs        = calloc(nJobs, sizeof(struct BatchJob_t));
+	if(!Batch.ComputePool || !Batch.IOPool || !Batch.Jobs)
+	{
+		printf("Out of memory - Images not processed\n");
+		ThreadPool_Destroy(Batch.IOPool);
+		free(Batch.Jobs);
+		return nJobs;
+	}
+	pthread_mutex_init(&Batch.Lock, NULL);
+	pthread_cond_init(&Batch.AllFinished, NULL);
+
+	for(i=0;i<nJobs;i++)
+	{
+		Batch.Jobs[i].Input  = Paths[i*2+0];
+		Batch.Jobs[i].Output = Paths[i*2+1];
+		Batch.Jobs[i].Batch  = &Batch;
+	}
+
+	//! Bound the number of decoded images held at once
+	int nLookahead = ThreadPool_nThreads(Batch.ComputePool) * BATCH_LOOKAHEAD_SCALE;
+	printf("Processing %d images on %d threads...\n", nJobs, ThreadPool_nThreads(Batch.ComputePool));
+
+	pthread_mutex_lock(&Batch.Lock);
+	int nInitial = nJobs < nLookahead ? nJobs : nLookahead;
+	Batch.nStarted = nInitial;
+	pthread_mutex_unlock(&Batch.Lock);
+	for(i=0;i<nInitial;i++)
+	{
+		if(!ThreadPool_Submit(Batch.IOPool, Batch_LoadTask, &Batch.Jobs[i]))
+			Batch_Finish(&Batch.Jobs[i], "Out of memory - Image not processed");
+	}
+
+	pthread_mutex_lock(&Batch.Lock);
+	while(Batch.nFinished < nJobs) pthread_cond_wait(&Batch.AllFinished, &Batch.Lock);
+	pthread_mutex_unlock(&Batch.Lock);
+
+	ThreadPool_Destroy(Batch.IOPool);
+	pthread_cond_destroy(&Batch.AllFinished);
+	pthread_mutex_destroy(&Batch.Lock);
+	free(Batch.Jobs);
+	return Batch.nFailed;
+}
+
+/**************************************/
+
+struct SeqFrame_t
+{
+	const char *Input;
+	const char *Output;
+	struct BmpCtx_t Image;
+	int  Ok;
+	int *nWriteFailed; //! Writes are never concurrent, so this is not locked
+};
+
+static void Batch_SeqLoadTask(void *Arg)
+{
+	struct SeqFrame_t *Frame = Arg;
+	Frame->Ok = BmpCtx_FromFile(&Frame->Image, Frame->Input);
+}
+
+static void Batch_SeqWriteTask(void *Arg)
+{
+	struct SeqFrame_t *Frame = Arg;
+	if(!BmpCtx_ToFile(&Frame->Image, Frame->Output))
+	{
+		printf("%s: Unable to write output file\n", Frame->Output);
+		(*Frame->nWriteFailed)++;
+	}
+	BmpCtx_Destroy(&Frame->Image);
+}
+
+int Batch_RunSequence(const char *const *Paths, int nJobs, const struct ProcessOpts_t *Opts)
+{
+	int i;
+	if(nJobs <= 0) return 0;
+
+	//! Frames depend on each other, so only I/O overlaps with processing:
+	//! while frame i is processed, frame i+1 loads and frame i-1 is written
+	struct SeqFrame_t Frames[3];
+	struct ThreadPool_t *IOPool = ThreadPool_Create(BATCH_IO_THREADS);
+	if(!IOPool)
+	{
+		printf("Out of memory - Images not processed\n");
+		return nJobs;
+	}
+	printf("Processing %d frames in sequence...\n", nJobs);
+
+	struct ProcessSeq_t Seq;
+	Process_SeqInit(&Seq);
+	int nFailed = 0, nWriteFailed = 0;
+	for(i=0;i<3;i++) Frames[i].nWriteFailed = &nWriteFailed;
+	Frames[0].Input  = Paths[0];
+	Frames[0].Output = Paths[1];
+	Batch_SeqLoadTask(&Frames[0]);
+	for(i=0;i<nJobs;i++)
+	{
+		struct SeqFrame_t *Frame = &Frames[i%3];
+		if(i+1 < nJobs)
+		{
+			struct SeqFrame_t *Next = &Frames[(i+1)%3];
+			Next->Input  = Paths[(i+1)*2+0];
+			Next->Output = Paths[(i+1)*2+1];
+			if(!ThreadPool_Submit(IOPool, Batch_SeqLoadTask, Next)) Batch_SeqLoadTask(Next);
+		}
+
+		const char *Error = NULL;
+		if(!Frame->Ok)
+		{
+			Error = "Unable to read input file";
+		}
+		else
+		{
+			struct BGRAf_t RMSE;
+			int Result = Process_Frame(&Frame->Image, Opts, &Seq, &RMSE);
+			if(Result != PROCESS_OK)
+			{
+				Error = Process_ErrorString(Result, Opts);
+				BmpCtx_Destroy(&Frame->Image);
+			}
+			else
+			{
+				struct BGRAf_t PSNR = Process_PSNR(RMSE);
+				int nTiles = (Frame->Image.Width / Opts->TileW) * (Frame->Image.Height / Opts->TileH);
+				printf("%s -> %s: PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}, %d/%d tiles reused\n", Frame->Input, Frame->Output, PSNR.b, PSNR.g, PSNR.r, PSNR.a, Seq.nTilesKept, nTiles);
+			}
+		}
+
+		//! Wait for the next frame (and the previous write) before queuing this one
+		ThreadPool_Wait(IOPool);
+		if(Error)
+		{
+			printf("%s: %s\n", Frame->Input, Error);
+			nFailed++;
+		}
+		else if(!ThreadPool_Submit(IOPool, Batch_SeqWriteTask, Frame)) Batch_SeqWriteTask(Frame);
+	}
+	ThreadPool_Wait(IOPool);
+	nFailed += nWriteFailed;
+
+	ThreadPool_Destroy(IOPool);
+	Process_SeqDestroy(&Seq);
+	return nFailed;
+}
+
+/**************************************/
+
+//! Read the next (optionally quoted) token from a line
+static char *NextToken(char **Line)
+{
+	char *s = *Line, *Token;
+	while(isspace((unsigned char)*s)) s++;
+	if(!*s) return NULL;
+
+	if(*s == '"')
+	{
+		Token = ++s;
+		while(*s && *s != '"') s++;
+	}
+	else
+	{
+		Token = s;
+		while(*s && !isspace((unsigned char)*s)) s++;
+	}
+	if(*s) *s++ = '\0';
+	*Line = s;
+	return Token;
+}
+
+int Batch_ReadManifest(const char *Filename, char ***PathsOut)
+{
+	FILE *File = fopen(Filename, "r"); if(!File) return -1;
+
+	char Line[4096];
+	char **Paths = NULL;
+	int nJobs = 0, Capacity = 0;
+	while(fgets(Line, sizeof(Line), File))
+	{
+		char *s = Line;
+		char *In  = NextToken(&s); if(!In || *In == '#') continue;
+		char *Out = NextToken(&s);
+		if(!Out)
+		{
+			printf("Manifest line has no output: %s\n", In);
+			continue;
+		}
+
+		if(nJobs == Capacity)
+		{
+			Capacity = Capacity ? Capacity*2 : 64;
+			char **p = realloc(Paths, Capacity * 2 * sizeof(char*));
+			if(!p) break;
+			Paths = p;
+		}
+		Paths[nJobs*2+0] = strdup(In);
+		Paths[nJobs*2+1] = strdup(Out);
+		if(!Paths[nJobs*2+0] || !Paths[nJobs*2+1])
+		{
+			free(Paths[nJobs*2+0]);
+			free(Paths[nJobs*2+1]);
+			break;
+		}
+		nJobs++;
+	}
+
+	int Ok = !ferror(File) && feof(File);
+	fclose(File);
+	if(!Ok)
+	{
+		Batch_FreeManifest(Paths, nJobs);
+		return -1;
+	}
+	*PathsOut = Paths;
+	return nJobs;
+}
+
+void Batch_FreeManifest(char **Paths, int nJobs)
+{
+	int i;
+	if(!Paths) return;
+	for(i=0;i<nJobs*2;i++) free(Paths[i]);
+	free(Paths);
+}
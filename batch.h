@@ -0,0 +1,23 @@
+#pragma once
+
+#include "process.h"
+
+//! Process many images across the process-wide thread pool
+//! NOTE: Paths holds nJobs input/output pairs (Input0, Output0, ...)
+//! NOTE: Upcoming images are decoded, and finished images written, on
+//! background I/O threads while the workers compute
+//! NOTE: If CacheDir is not NULL, results are looked up in and stored to
+//! that cache directory (see Cache_ProcessImage())
+//! NOTE: Returns the number of images that failed
+int Batch_Run(const char *const *Paths, int nJobs, const struct ProcessOpts_t *Opts, int nThreads, const char *CacheDir);
+
+//! Process an animation, one frame after another
+//! NOTE: Each frame is warm-started from the previous one (see Process_Frame())
+//! NOTE: Returns the number of frames that failed
+int Batch_RunSequence(const char *const *Paths, int nJobs, const struct ProcessOpts_t *Opts);
+
+//! Read a manifest of input/output pairs, one pair per line
+//! NOTE: Paths may be double-quoted; lines starting with # are ignored
+//! NOTE: Returns the number of pairs (or -1 on failure); free with Batch_FreeManifest()
+int Batch_ReadManifest(const char *Filename, char ***Paths);
+void Batch_FreeManifest(char **Paths, int nJobs);
@@ -0,0 +1,387 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+#include "bitmap.h"
+#include "colourspace.h"
+#include "mem.h"
+#include "process.h"
+#include "qualetize.h"
+#include "tiles.h"
+
+//! Benchmark: generates deterministic synthetic images, times each
+//! processing stage, and writes the results to stdout as JSON
+//! (progress goes to stderr, so the output can be redirected)
+
+#define BENCH_SEED 0x2545F491u
+
+/**************************************/
+
+static double Bench_Time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER Freq, Count;
+	QueryPerformanceFrequency(&Freq);
+	QueryPerformanceCounter(&Count);
+	return (double)Count.QuadPart / Freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1.0e-9;
+#endif
+}
+
+static uint32_t Rand_Next(uint32_t *State)
+{
+	uint32_t x = *State; //! xorshift32
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *State = x;
+}
+
+static int Rand_Range(uint32_t *State, int n)
+{
+	return (int)(Rand_Next(State) % (uint32_t)n);
+}
+
+static uint8_t Clamp8(int x)
+{
+	return (x < 0) ? 0 : (x > 255) ? 255 : x;
+}
+
+/**************************************/
+
+//! Smooth gradients across the whole image
+static void Gen_Gradient(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	int x, y;
+	int w = Img->Width, h = Img->Height;
+	int Phase = Rand_Range(Seed, 256);
+	for(y=0;y<h;y++) for(x=0;x<w;x++)
+	{
+		struct BGRA8_t *p = &Img->PxBGR[(size_t)y*w + x];
+		p->b = x * 255 / (w-1);
+		p->g = y * 255 / (h-1);
+		p->r = (x + y + Phase) * 255 / (w + h + 255);
+		p->a = 255;
+	}
+}
+
+//! Photo-like: value noise at a few octaves over a gradient, plus grain
+static void Gen_Photo(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	int x, y, c, Oct;
+	int w = Img->Width, h = Img->Height;
+	enum { LATTICE = 17 };
+	uint8_t Lattice[4][LATTICE][LATTICE][3];
+	for(Oct=0;Oct<4;Oct++) for(y=0;y<LATTICE;y++) for(x=0;x<LATTICE;x++) for(c=0;c<3;c++)
+		Lattice[Oct][y][x][c] = Rand_Next(Seed);
+
+	for(y=0;y<h;y++) for(x=0;x<w;x++)
+	{
+		float v[3] = {x*96.0f/w, y*96.0f/h, (x+y)*48.0f/(w+h)};
+		for(Oct=0;Oct<4;Oct++)
+		{
+			int   Cells = 2 << Oct;
+			float Amp   = 128.0f / (1 << Oct);
+			float fx = (float)x * Cells / w, fy = (float)y * Cells / h;
+			int   ix = (int)fx, iy = (int)fy;
+			fx -= ix, fy -= iy;
+			fx = fx*fx*(3-2*fx), fy = fy*fy*(3-2*fy);
+			for(c=0;c<3;c++)
+			{
+				float a = Lattice[Oct][iy  ][ix][c] + (Lattice[Oct][iy  ][ix+1][c] - Lattice[Oct][iy  ][ix][c])*fx;
+				float b = Lattice[Oct][iy+1][ix][c] + (Lattice[Oct][iy+1][ix+1][c] - Lattice[Oct][iy+1][ix][c])*fx;
+				v[c] += (a + (b-a)*fy) * Amp / 255.0f;
+			}
+		}
+		struct BGRA8_t *p = &Img->PxBGR[(size_t)y*w + x];
+		p->b = Clamp8((int)v[0] + Rand_Range(Seed, 9) - 4);
+		p->g = Clamp8((int)v[1] + Rand_Range(Seed, 9) - 4);
+		p->r = Clamp8((int)v[2] + Rand_Range(Seed, 9) - 4);
+		p->a = 255;
+	}
+}
+
+//! Pixel art: few colours, in flat blocks and outlined shapes
+static void Gen_PixelArt(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	int i, x, y;
+	int w = Img->Width, h = Img->Height;
+	struct BGRA8_t Pal[12];
+	for(i=0;i<12;i++) Pal[i] = (struct BGRA8_t){Rand_Next(Seed), Rand_Next(Seed), Rand_Next(Seed), 255};
+
+	for(y=0;y<h;y++) for(x=0;x<w;x++)
+		Img->PxBGR[(size_t)y*w + x] = Pal[((x/16) + (y/16)*3) % 4];
+
+	int nShapes = w*h / 1024;
+	for(i=0;i<nShapes;i++)
+	{
+		int x0 = Rand_Range(Seed, w), y0 = Rand_Range(Seed, h);
+		int x1 = x0 + 4 + Rand_Range(Seed, 20), y1 = y0 + 4 + Rand_Range(Seed, 20);
+		struct BGRA8_t Fill = Pal[4 + Rand_Range(Seed, 7)];
+		for(y=y0;y<y1 && y<h;y++) for(x=x0;x<x1 && x<w;x++)
+		{
+			int Edge = (x == x0 || y == y0 || x == x1-1 || y == y1-1);
+			Img->PxBGR[(size_t)y*w + x] = Edge ? Pal[11] : Fill;
+		}
+	}
+}
+
+//! Sprite sheet: shaded sprites on a transparent background
+static void Gen_Sprites(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	int x, y, sx, sy;
+	int w = Img->Width, h = Img->Height;
+	for(y=0;y<h;y++) for(x=0;x<w;x++)
+		Img->PxBGR[(size_t)y*w + x] = (struct BGRA8_t){0,0,0,0};
+
+	for(sy=0;sy+32<=h;sy+=32) for(sx=0;sx+32<=w;sx+=32)
+	{
+		struct BGRA8_t Base = {Rand_Next(Seed), Rand_Next(Seed), Rand_Next(Seed), 255};
+		int Rad = 8 + Rand_Range(Seed, 7);
+		for(y=0;y<32;y++) for(x=0;x<32;x++)
+		{
+			int dx = x-16, dy = y-16;
+			int d2 = dx*dx + dy*dy;
+			if(d2 >= Rad*Rad) continue;
+
+			int Shade = 64 - (dx + dy) * 4; //! Lit from the top-left, in 4 steps
+			Shade = (Shade / 32) * 32;
+			Img->PxBGR[(size_t)(sy+y)*w + (sx+x)] = (struct BGRA8_t){
+				Clamp8(Base.b * Shade / 64),
+				Clamp8(Base.g * Shade / 64),
+				Clamp8(Base.r * Shade / 64),
+				(d2 >= (Rad-1)*(Rad-1)) ? 128 : 255
+			};
+		}
+	}
+}
+
+static const struct
+{
+	const char *Name;
+	void (*Generate)(struct BmpCtx_t *Img, uint32_t *Seed);
+} Images[] = {
+	{"gradient",  Gen_Gradient},
+	{"photo",     Gen_Photo},
+	{"pixelart",  Gen_PixelArt},
+	{"sprites",   Gen_Sprites},
+};
+
+static const struct { int w, h; } Sizes[] = {
+	{256, 256},
+	{512, 512},
+};
+
+static const struct { int np, ps, tw, th; } Configs[] = {
+	{16, 16,  8,  8}, //! GBA/NDS text BG
+	{ 8, 16, 16, 16},
+	{ 4, 64,  8,  8},
+	{ 1,256,  8,  8}, //! Single 8-bit palette
+};
+
+static const struct { const char *Name; int Mode; float Level; } Dithers[] = {
+	{"none",   DITHER_NONE,                0.0f},
+	{"floyd",  DITHER_FLOYDSTEINBERG,      1.0f},
+	{"tfloyd", DITHER_TILE_FLOYDSTEINBERG, 1.0f},
+	{"ord2",   DITHER_ORDERED(1),          0.5f},
+	{"ord4",   DITHER_ORDERED(2),          0.5f},
+	{"ord8",   DITHER_ORDERED(3),          0.5f},
+	{"ord16",  DITHER_ORDERED(4),          0.5f},
+	{"ord32",  DITHER_ORDERED(5),          0.5f},
+	{"ord64",  DITHER_ORDERED(6),          0.5f},
+};
+
+#define COUNTOF(x) (int)(sizeof(x) / sizeof(x[0]))
+
+/**************************************/
+
+static void PrintStage(const char *Name, double Sec, double MPx, int Last)
+{
+	printf("\t\t\t\t\"%s\": {\"sec\": %.6f, \"mpx_s\": %.3f}%s\n", Name, Sec, MPx / Sec, Last ? "" : ",");
+}
+
+static void PrintPSNRValue(float x, int Last)
+{
+	//! JSON has no infinity; a lossless channel is given as null
+	if(isinf(x) || isnan(x)) printf("null%s", Last ? "" : ", ");
+	else printf("%.3f%s", x, Last ? "" : ", ");
+}
+
+//! Run every stage on one image and configuration
+//! NOTE: Each stage is timed as the best of nRepeat runs
+static int Bench_Run(const char *Name, const struct BmpCtx_t *Img, int np, int ps, int tw, int th, int nRepeat, int IntegerMode, int CoarseFactor, int First)
+{
+	int i, d, Rep;
+	int w = Img->Width, h = Img->Height;
+	double MPx = (double)w*h / 1.0e6;
+	int PalUnused = 1;
+	struct BGRA8_t BitRange = {0x1F,0x1F,0x1F,0x01};
+
+	struct TilesData_t *TilesData = NULL;
+	uint8_t *PxData = Mem_Alloc((size_t)w*h);
+	struct BGRAf_t Centroids[BMP_PALETTE_COLOURS];
+	struct BGRAf_t Palette[BMP_PALETTE_COLOURS];
+	struct BGRAf_t PaletteSpread[BMP_PALETTE_COLOURS];
+	struct YCoCg16_t Palette16[BMP_PALETTE_COLOURS];
+	if(!PxData) return 0;
+
+	double tTiles = 1.0e30, tQuantTiles = 1.0e30, tQuantColours = 1.0e30;
+	for(Rep=0;Rep<nRepeat;Rep++)
+	{
+		double t0 = Bench_Time();
+		Mem_Free(TilesData);
+		TilesData = TilesData_FromBitmap(Img, tw, th, IntegerMode);
+		if(!TilesData)
+		{
+			Mem_Free(PxData);
+			return 0;
+		}
+		TilesData->CoarseFactor = CoarseFactor;
+		double t1 = Bench_Time();
+		TilesData_QuantizeTiles(TilesData, NULL, np, 0);
+		double t2 = Bench_Time();
+		memset(Centroids, 0, sizeof(Centroids));
+		TilesData_QuantizeColours(TilesData, Centroids, np, ps, PalUnused, 0, NULL);
+		double t3 = Bench_Time();
+
+		if(t1-t0 < tTiles)        tTiles        = t1-t0;
+		if(t2-t1 < tQuantTiles)   tQuantTiles   = t2-t1;
+		if(t3-t2 < tQuantColours) tQuantColours = t3-t2;
+	}
+
+	printf("%s\t\t{\n", First ? "" : ",\n");
+	printf("\t\t\t\"image\": \"%s\",\n", Name);
+	printf("\t\t\t\"width\": %d, \"height\": %d, \"np\": %d, \"ps\": %d, \"tw\": %d, \"th\": %d,\n", w, h, np, ps, tw, th);
+	printf("\t\t\t\"stages\": {\n");
+	PrintStage("convert_to_tiles",  tTiles,        MPx, 0);
+	PrintStage("quantize_tiles",    tQuantTiles,   MPx, 0);
+	PrintStage("quantize_colours",  tQuantColours, MPx, 1);
+	printf("\t\t\t},\n");
+
+	printf("\t\t\t\"remap\": {\n");
+	for(d=0;d<COUNTOF(Dithers);d++)
+	{
+		double tRemap = 1.0e30;
+		struct BGRAf_t SqErr = {0,0,0,0};
+		for(Rep=0;Rep<nRepeat;Rep++)
+		{
+			double t0 = Bench_Time();
+			memcpy(Palette, Centroids, sizeof(Palette));
+			Qualetize_PreparePalettes(Palette, PaletteSpread, np, ps, PalUnused, &BitRange, Dithers[d].Mode, Dithers[d].Level, false);
+			if(IntegerMode) Qualetize_Palette16(Palette16, Palette, np*ps);
+
+			struct BGRAf_t *PxDiffuse = TilesData->PxTemp;
+			for(i=0;i<w*2;i++) PxDiffuse[i] = (struct BGRAf_t){0,0,0,0};
+			SqErr = (struct BGRAf_t){0,0,0,0};
+			Qualetize_RemapRows(
+				Img->PxBGR,
+				NULL,
+				PxData,
+				w,
+				h,
+				0,
+				h,
+				tw,
+				th,
+				TilesData->TilePalIdx,
+				NULL,
+				Palette,
+				IntegerMode ? Palette16 : NULL,
+				PaletteSpread,
+				ps,
+				PalUnused,
+				0,
+				Dithers[d].Mode,
+				Dithers[d].Level,
+				PxDiffuse,
+				&SqErr
+			);
+			double t1 = Bench_Time();
+			if(t1-t0 < tRemap) tRemap = t1-t0;
+		}
+
+		SqErr = BGRAf_Divi(&SqErr, (float)w*h);
+		SqErr = BGRAf_Sqrt(&SqErr);
+		struct BGRAf_t PSNR = Process_PSNR(SqErr);
+		printf("\t\t\t\t\"%s\": {\"sec\": %.6f, \"mpx_s\": %.3f, \"psnr\": [", Dithers[d].Name, tRemap, MPx / tRemap);
+		PrintPSNRValue(PSNR.b, 0);
+		PrintPSNRValue(PSNR.g, 0);
+		PrintPSNRValue(PSNR.r, 0);
+		PrintPSNRValue(PSNR.a, 1);
+		printf("]}%s\n", (d+1 < COUNTOF(Dithers)) ? "," : "");
+	}
+	printf("\t\t\t}\n");
+	printf("\t\t}");
+
+	Mem_Free(TilesData);
+	Mem_Free(PxData);
+	return 1;
+}
+
+int main(int argc, const char *argv[])
+{
+	int i, s, c;
+	int nRepeat = 1;
+	int nSizes  = COUNTOF(Sizes);
+	int IntegerMode = 0;
+	int CoarseFactor = 1;
+	for(i=1;i<argc;i++)
+	{
+		if(!strncmp(argv[i], "-repeat:", 8)) nRepeat = atoi(argv[i]+8);
+		else if(!strcmp(argv[i], "-quick")) nSizes = 1;
+		else if(!strcmp(argv[i], "-int"))   IntegerMode = 1;
+		else if(!strncmp(argv[i], "-coarse:", 8)) CoarseFactor = atoi(argv[i]+8);
+		else
+		{
+			fprintf(stderr,
+				"Usage: tilequant_bench [-quick] [-int] [-coarse:1] [-repeat:1] > bench.json\n"
+				"    -quick    - Only run the smallest image size\n"
+				"    -int      - Use the integer colour pipeline\n"
+				"    -coarse:n - Cluster at 1/n resolution before refining\n"
+				"    -repeat:n - Time each stage as the best of n runs\n"
+			);
+			return 1;
+		}
+	}
+	if(nRepeat < 1) nRepeat = 1;
+	if(CoarseFactor < 1) CoarseFactor = 1;
+
+	printf("{\n\t\"benchmark\": \"tilequant\",\n\t\"repeat\": %d,\n\t\"pipeline\": \"%s\",\n\t\"coarse\": %d,\n\t\"results\": [\n", nRepeat, IntegerMode ? "integer" : "float", CoarseFactor);
+	int First = 1;
+	for(i=0;i<COUNTOF(Images);i++) for(s=0;s<nSizes;s++)
+	{
+		struct BmpCtx_t Img;
+		if(!BmpCtx_Create(&Img, Sizes[s].w, Sizes[s].h, 0))
+		{
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		uint32_t Seed = BENCH_SEED ^ (uint32_t)(i*0x9E3779B9u);
+		Images[i].Generate(&Img, &Seed);
+
+		for(c=0;c<COUNTOF(Configs);c++)
+		{
+			fprintf(stderr, "%s %dx%d -np:%d -ps:%d -tw:%d -th:%d\n", Images[i].Name, Sizes[s].w, Sizes[s].h, Configs[c].np, Configs[c].ps, Configs[c].tw, Configs[c].th);
+			if(!Bench_Run(Images[i].Name, &Img, Configs[c].np, Configs[c].ps, Configs[c].tw, Configs[c].th, nRepeat, IntegerMode, CoarseFactor, First))
+			{
+				fprintf(stderr, "Out of memory\n");
+				BmpCtx_Destroy(&Img);
+				return -1;
+			}
+			First = 0;
+		}
+		BmpCtx_Destroy(&Img);
+	}
+	printf("\n\t]\n}\n");
+	return 0;
+}
@@ -1,15 +1,41 @@
+#define _FILE_OFFSET_BITS 64
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include "bitmap.h"
 #include "colourspace.h"
+#include "mem.h"
 
-#define CLEAR_CONTEXT(Ctx)  \
-	Ctx->Width  = 0,    \
-	Ctx->Height = 0,    \
-	Ctx->ColPal = NULL, \
-	Ctx->PxBGR  = NULL
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#ifdef _WIN32
+# define FSEEK64 _fseeki64
+# define FTELL64 _ftelli64
+#else
+# define FSEEK64 fseeko
+# define FTELL64 ftello
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define BMP_HAVE_SSSE3 1
+#endif
+
+#define CLEAR_CONTEXT(Ctx)   \
+	Ctx->Width   = 0,    \
+	Ctx->Height  = 0,    \
+	Ctx->ColPal  = NULL, \
+	Ctx->PxBGR   = NULL, \
+	Ctx->MapData = NULL, \
+	Ctx->MapSize = 0
 
 #define DESTROY_AND_RETURN(Ctx, ...) \
 	do {                         \
@@ -17,6 +43,9 @@
 		return __VA_ARGS__;  \
 	} while(0)
 
+#define BI_RGB       0
+#define BI_BITFIELDS 3
+
 #pragma pack(push,1)
 struct BMFH_t
 {
@@ -29,8 +58,8 @@ struct BMFH_t
 struct BMIH_t
 {
 	uint32_t Size;
-	uint32_t Width;
-	uint32_t Height;
+	int32_t  Width;
+	int32_t  Height;
 	uint16_t nPlanes;
 	uint16_t BitCnt;
 	uint32_t CompType;
@@ -42,100 +71,330 @@ struct BMIH_t
 };
 #pragma pack(pop)
 
+struct BmpLayout_t
+{
+	int Width, Height;
+	int BitCnt, TopDown;
+	int nCol;
+	uint64_t PalOffs;
+	uint64_t Offs;
+	uint64_t RowBytes;
+	uint64_t Stride;
+};
+
+/**************************************/
+
+static void *MapFile(const char *Filename, size_t *Size)
+{
+	void *Data = NULL;
+#ifdef _WIN32
+	HANDLE File = CreateFileA(Filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(File == INVALID_HANDLE_VALUE) return NULL;
+
+	LARGE_INTEGER FileSize;
+	if(GetFileSizeEx(File, &FileSize) && FileSize.QuadPart > 0 && (uint64_t)FileSize.QuadPart <= SIZE_MAX)
+	{
+		HANDLE Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(Mapping)
+		{
+			Data = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(Mapping);
+			*Size = (size_t)FileSize.QuadPart;
+		}
+	}
+	CloseHandle(File);
+#else
+	int File = open(Filename, O_RDONLY); if(File < 0) return NULL;
+
+	struct stat FileStat;
+	if(!fstat(File, &FileStat) && FileStat.st_size > 0 && (uint64_t)FileStat.st_size <= SIZE_MAX)
+	{
+		Data = mmap(NULL, (size_t)FileStat.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+		if(Data == MAP_FAILED) Data = NULL;
+		else
+		{
+			*Size = (size_t)FileStat.st_size;
+#ifdef MADV_SEQUENTIAL
+			madvise(Data, *Size, MADV_SEQUENTIAL);
+#endif
+		}
+	}
+	close(File);
+#endif
+	if(Data) Mem_Track(*Size); //! Counted while mapped, as pages become resident when read
+	return Data;
+}
+
+static void UnmapFile(void *Data, size_t Size)
+{
+	if(!Data) return;
+	Mem_Untrack(Size);
+#ifdef _WIN32
+	UnmapViewOfFile(Data);
+#else
+	munmap(Data, Size);
+#endif
+}
+
+static inline int IsMapped(const struct BmpCtx_t *Ctx, const void *Ptr)
+{
+	const uint8_t *p = Ptr, *Base = Ctx->MapData;
+	return Base && p >= Base && p < Base + Ctx->MapSize;
+}
+
+/**************************************/
+
+static void ExpandBGR24_Scalar(struct BGRA8_t *Dst, const uint8_t *Src, size_t n)
+{
+	size_t i;
+	for(i=0;i<n;i++)
+	{
+		Dst[i].b = Src[0];
+		Dst[i].g = Src[1];
+		Dst[i].r = Src[2];
+		Dst[i].a = 255;
+		Src += 3;
+	}
+}
+
+#ifdef BMP_HAVE_SSSE3
+__attribute__((target("ssse3")))
+static void ExpandBGR24_SSSE3(struct BGRA8_t *Dst, const uint8_t *Src, size_t n)
+{
+	const __m128i Shuf  = _mm_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+	const __m128i Alpha = _mm_set1_epi32((int)0xFF000000);
+
+	//! 16 pixels (48 bytes) per iteration, so we never read past the row
+	size_t i;
+	for(i=0; i+16<=n; i+=16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(Src +  0));
+		__m128i b = _mm_loadu_si128((const __m128i*)(Src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(Src + 32));
+		__m128i p0 = _mm_shuffle_epi8(a, Shuf);
+		__m128i p1 = _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), Shuf);
+		__m128i p2 = _mm_shuffle_epi8(_mm_alignr_epi8(c, b,  8), Shuf);
+		__m128i p3 = _mm_shuffle_epi8(_mm_srli_si128(c, 4),      Shuf);
+		_mm_storeu_si128((__m128i*)(Dst +  0), _mm_or_si128(p0, Alpha));
+		_mm_storeu_si128((__m128i*)(Dst +  4), _mm_or_si128(p1, Alpha));
+		_mm_storeu_si128((__m128i*)(Dst +  8), _mm_or_si128(p2, Alpha));
+		_mm_storeu_si128((__m128i*)(Dst + 12), _mm_or_si128(p3, Alpha));
+		Src += 48, Dst += 16;
+	}
+	ExpandBGR24_Scalar(Dst, Src, n-i);
+}
+#endif
+
+static void ExpandBGR24(struct BGRA8_t *Dst, const uint8_t *Src, size_t n)
+{
+#ifdef BMP_HAVE_SSSE3
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		ExpandBGR24_SSSE3(Dst, Src, n);
+		return;
+	}
+#endif
+	ExpandBGR24_Scalar(Dst, Src, n);
+}
+
+/**************************************/
+
 int BmpCtx_Create(struct BmpCtx_t *Ctx, int w, int h, int PalCol)
 {
+	size_t nPx = (size_t)w * h;
+	CLEAR_CONTEXT(Ctx);
 	Ctx->Width  = w;
 	Ctx->Height = h;
 	if(PalCol)
 	{
-		Ctx->ColPal = calloc(PalCol, sizeof(struct BGRA8_t));
-		Ctx->PxIdx  = calloc(w * h,  sizeof(uint8_t));
+		Ctx->ColPal = Mem_Calloc(PalCol, sizeof(struct BGRA8_t));
+		Ctx->PxIdx  = Mem_Calloc(nPx,    sizeof(uint8_t));
 		if(!Ctx->ColPal || !Ctx->PxIdx) DESTROY_AND_RETURN(Ctx, 0);
 	}
 	else
 	{
 		Ctx->ColPal = NULL;
-		Ctx->PxBGR  = calloc(w * h, sizeof(struct BGRA8_t));
+		Ctx->PxBGR  = Mem_Calloc(nPx, sizeof(struct BGRA8_t));
 		if(!Ctx->PxBGR) DESTROY_AND_RETURN(Ctx, 0);
 	}
-	
+
 	return 1;
 }
 
 void BmpCtx_Destroy(struct BmpCtx_t *Ctx)
 {
-	free(Ctx->ColPal);
-	free(Ctx->PxBGR);
+	if(!IsMapped(Ctx, Ctx->ColPal)) Mem_Free(Ctx->ColPal);
+	if(!IsMapped(Ctx, Ctx->PxBGR))  Mem_Free(Ctx->PxBGR);
+	UnmapFile(Ctx->MapData, Ctx->MapSize);
 	CLEAR_CONTEXT(Ctx);
 }
 
+void BmpCtx_SetIndexed(struct BmpCtx_t *Ctx, struct BGRA8_t *ColPal, uint8_t *PxIdx)
+{
+	int w = Ctx->Width, h = Ctx->Height;
+	BmpCtx_Destroy(Ctx);
+	Ctx->Width  = w;
+	Ctx->Height = h;
+	Ctx->ColPal = ColPal;
+	Ctx->PxIdx  = PxIdx;
+}
+
+//! Validate headers and work out where everything is in the file
+//! NOTE: Hdr must hold at least HdrSize bytes from the start of the file
+static int ParseLayout(struct BmpLayout_t *Layout, const uint8_t *Hdr, size_t HdrSize, uint64_t FileSize)
+{
+	struct BMFH_t bmFH;
+	struct BMIH_t bmIH;
+	if(HdrSize < sizeof(bmFH) + sizeof(bmIH)) return 0;
+	memcpy(&bmFH, Hdr, sizeof(bmFH));
+	memcpy(&bmIH, Hdr + sizeof(bmFH), sizeof(bmIH));
+	if(bmFH.Type != ('B'|'M'<<8) || bmIH.Size < sizeof(bmIH) || bmIH.Size > HdrSize - sizeof(bmFH))
+		return 0;
+	if(bmIH.Width <= 0 || bmIH.Height == 0 || bmIH.Height == INT32_MIN)
+		return 0;
+	if(bmIH.BitCnt != 8 && bmIH.BitCnt != 24 && bmIH.BitCnt != 32)
+		return 0;
+	if(bmIH.CompType != BI_RGB)
+	{
+		//! Only accept bitfields that describe the usual BGRA layout
+		uint32_t Masks[3];
+		if(bmIH.CompType != BI_BITFIELDS || bmIH.BitCnt != 32 || HdrSize < sizeof(bmFH) + sizeof(bmIH) + sizeof(Masks))
+			return 0;
+		memcpy(Masks, Hdr + sizeof(bmFH) + sizeof(bmIH), sizeof(Masks));
+		if(Masks[0] != 0x00FF0000 || Masks[1] != 0x0000FF00 || Masks[2] != 0x000000FF)
+			return 0;
+	}
+
+	Layout->TopDown  = bmIH.Height < 0;
+	Layout->Width    = bmIH.Width;
+	Layout->Height   = Layout->TopDown ? -bmIH.Height : bmIH.Height;
+	Layout->BitCnt   = bmIH.BitCnt;
+	Layout->Offs     = bmFH.Offs;
+	Layout->RowBytes = (uint64_t)Layout->Width * (bmIH.BitCnt / 8);
+	Layout->Stride   = ((uint64_t)Layout->Width * bmIH.BitCnt + 31) / 32 * 4;
+	if(Layout->Offs > FileSize || (FileSize - Layout->Offs) / Layout->Stride < (uint64_t)Layout->Height)
+		return 0;
+
+	Layout->PalOffs = 0;
+	Layout->nCol    = 0;
+	if(bmIH.BitCnt == 8)
+	{
+		Layout->PalOffs = sizeof(bmFH) + bmIH.Size;
+		Layout->nCol    = (bmIH.ColUsed && bmIH.ColUsed < BMP_PALETTE_COLOURS) ? bmIH.ColUsed : BMP_PALETTE_COLOURS;
+		if(Layout->PalOffs + Layout->nCol*sizeof(struct BGRA8_t) > HdrSize) return 0;
+	}
+	return 1;
+}
+
+static void ReadPalette(struct BGRA8_t *ColPal, const struct BmpLayout_t *Layout, const uint8_t *Hdr)
+{
+	int i, nCol = Layout->nCol;
+	memset(ColPal, 0, BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+	memcpy(ColPal, Hdr + Layout->PalOffs, nCol * sizeof(struct BGRA8_t));
+
+	//! The fourth palette byte is reserved; only treat it as alpha if it was used
+	uint8_t AlphaUsed = 0;
+	for(i=0;i<nCol;i++) AlphaUsed |= ColPal[i].a;
+	if(!AlphaUsed) for(i=0;i<nCol;i++) ColPal[i].a = 255;
+}
+
 int BmpCtx_FromFile(struct BmpCtx_t *Ctx, const char *Filename)
 {
 	CLEAR_CONTEXT(Ctx);
 
-	FILE *File = fopen(Filename, "rb"); if(!File) return 0;
-	struct BMFH_t bmFH; fread(&bmFH, 1, sizeof(bmFH), File);
-	struct BMIH_t bmIH; fread(&bmIH, 1, sizeof(bmIH), File);
-	Ctx->Width  = bmIH.Width;
-	Ctx->Height = bmIH.Height;
+	size_t MapSize = 0;
+	const uint8_t *Map = MapFile(Filename, &MapSize); if(!Map) return 0;
+	Ctx->MapData = (void*)Map;
+	Ctx->MapSize = MapSize;
+
+	struct BmpLayout_t Layout;
+	if(!ParseLayout(&Layout, Map, MapSize, MapSize)) DESTROY_AND_RETURN(Ctx, 0);
+
+	int    TopDown  = Layout.TopDown;
+	int    w = Ctx->Width  = Layout.Width;
+	int    h = Ctx->Height = Layout.Height;
+	size_t nPx      = (size_t)w * h;
+	size_t RowBytes = Layout.RowBytes;
+	size_t Stride   = Layout.Stride;
 
-	int nPx = Ctx->Width*Ctx->Height;
-	if(bmFH.Type == ('B'|'M'<<8)) switch(bmIH.BitCnt) {
+	//! Row y of the image (top-down) as stored in the file
+	const uint8_t *Px = Map + Layout.Offs;
+#define SRC_ROW(y) (Px + (TopDown ? (size_t)(y) : (size_t)(h-1-(y))) * Stride)
+
+	int y;
+	int Direct = TopDown && Stride == RowBytes;
+	switch(Layout.BitCnt) {
 		case 8:
 		{
-			Ctx->ColPal = malloc(BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+			Ctx->ColPal = Mem_Alloc(BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
 			if(!Ctx->ColPal) break;
-			fread(Ctx->ColPal, BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t), File);
+			ReadPalette(Ctx->ColPal, &Layout, Map);
 
-			fseek(File, bmFH.Offs, SEEK_SET);
-			Ctx->PxIdx = malloc(nPx * sizeof(uint8_t));
+			if(Direct)
+			{
+				Ctx->PxIdx = (uint8_t*)SRC_ROW(0);
+				break;
+			}
+
+			Ctx->PxIdx = Mem_Alloc(nPx * sizeof(uint8_t));
 			if(!Ctx->PxIdx) break;
-			fread(Ctx->PxIdx, sizeof(uint8_t), nPx, File);
+			for(y=0;y<h;y++) memcpy(Ctx->PxIdx + (size_t)y*w, SRC_ROW(y), RowBytes);
 		} break;
 
 		case 24:
 		{
-			struct BGRA8_t *PxBGR = Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
+			struct BGRA8_t *PxBGR = Ctx->PxBGR = Mem_Alloc(nPx * sizeof(struct BGRA8_t));
 			if(!PxBGR) break;
-
-			int i;
-			for(i=0;i<nPx;i++)
-			{
-				struct { uint8_t b, g, r; }  Col;
-				fread(&Col, 1, 3, File);
-
-				PxBGR[i].b = Col.b;
-				PxBGR[i].g = Col.g;
-				PxBGR[i].r = Col.r;
-				PxBGR[i].a = 255;
-			}
+			for(y=0;y<h;y++) ExpandBGR24(PxBGR + (size_t)y*w, SRC_ROW(y), w);
 		} break;
 
 		case 32:
 		{
-			Ctx->PxBGR = malloc(nPx * sizeof(struct BGRA8_t));
+			if(Direct)
+			{
+				Ctx->PxBGR = (struct BGRA8_t*)SRC_ROW(0);
+				break;
+			}
+
+			Ctx->PxBGR = Mem_Alloc(nPx * sizeof(struct BGRA8_t));
 			if(!Ctx->PxBGR) break;
-			fread(Ctx->PxBGR, sizeof(struct BGRA8_t), nPx, File);
+			for(y=0;y<h;y++) memcpy(Ctx->PxBGR + (size_t)y*w, SRC_ROW(y), RowBytes);
 		} break;
 	}
+#undef SRC_ROW
 
-	fclose(File);
-	if(Ctx->PxBGR || (Ctx->ColPal && Ctx->PxIdx)) return 1;
-	else DESTROY_AND_RETURN(Ctx, 0);
+	if(!Ctx->PxBGR || (Layout.BitCnt == 8 && !Ctx->ColPal))
+		DESTROY_AND_RETURN(Ctx, 0);
+
+	//! Release the mapping now if nothing points into it anymore
+	if(!IsMapped(Ctx, Ctx->PxBGR))
+	{
+		UnmapFile(Ctx->MapData, Ctx->MapSize);
+		Ctx->MapData = NULL;
+		Ctx->MapSize = 0;
+	}
+	return 1;
 }
 
 int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename)
 {
-	int nPx = Ctx->Width*Ctx->Height;
+	size_t nPx = (size_t)Ctx->Width*Ctx->Height;
 	if(!nPx || (!Ctx->PxBGR && !(Ctx->ColPal && Ctx->PxIdx)))
 		return 0;
 
+	size_t PxSize   = Ctx->ColPal ? sizeof(uint8_t) : sizeof(struct BGRA8_t);
+	size_t RowBytes = Ctx->Width * PxSize;
+	size_t Stride   = (RowBytes + 3) &~ 3;
+	size_t PalSize  = Ctx->ColPal ? BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t) : 0;
+	size_t FileSize = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + PalSize + Stride*Ctx->Height;
+	if(FileSize > UINT32_MAX) return 0;
+
 	FILE *File = fopen(Filename, "wb"); if(!File) return 0;
 	struct BMFH_t bmFH; memset(&bmFH, 0, sizeof(bmFH));
 	struct BMIH_t bmIH; memset(&bmIH, 0, sizeof(bmIH));
 	bmFH.Type     = 'B'|'M'<<8;
-	bmFH.Size     = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + BMP_PALETTE_COLOURS*(Ctx->ColPal ? sizeof(struct BGRA8_t) : 0) + nPx*(Ctx->ColPal ? sizeof(uint8_t) : sizeof(struct BGRA8_t));
-	bmFH.Offs     = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + BMP_PALETTE_COLOURS*(Ctx->ColPal ? sizeof(struct BGRA8_t) : 0);
+	bmFH.Size     = FileSize;
+	bmFH.Offs     = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + PalSize;
 	bmIH.Size     = sizeof(struct BMIH_t);
 	bmIH.Width    = Ctx->Width;
 	bmIH.Height   = Ctx->Height;
@@ -147,11 +406,175 @@ int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename)
 	if(Ctx->ColPal)
 		fwrite(Ctx->ColPal, BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t), File);
 
-	if(Ctx->ColPal)
-		fwrite(Ctx->PxIdx, nPx, sizeof(uint8_t), File);
-	else
-		fwrite(Ctx->PxBGR, nPx, sizeof(struct BGRA8_t), File);
+	//! Rows are stored bottom-up, padded to 4 bytes
+	int y;
+	static const uint8_t Padding[3] = {0,0,0};
+	const uint8_t *Px = Ctx->ColPal ? (const uint8_t*)Ctx->PxIdx : (const uint8_t*)Ctx->PxBGR;
+	for(y=Ctx->Height-1;y>=0;y--)
+	{
+		fwrite(Px + (size_t)y*RowBytes, 1, RowBytes, File);
+		fwrite(Padding, 1, Stride - RowBytes, File);
+	}
+
+	int Ok = !ferror(File);
+	if(fclose(File)) Ok = 0;
+	return Ok;
+}
+
+/**************************************/
 
-	fclose(File);
+static int BmpStream_Reserve(struct BmpStream_t *Stream, size_t Size)
+{
+	if(Size <= Stream->RowBufSize) return 1;
+	uint8_t *RowBuf = Mem_Realloc(Stream->RowBuf, Size);
+	if(!RowBuf) return 0;
+	Stream->RowBuf     = RowBuf;
+	Stream->RowBufSize = Size;
 	return 1;
 }
+
+int BmpStream_Open(struct BmpStream_t *Stream, const char *Filename)
+{
+	memset(Stream, 0, sizeof(*Stream));
+
+	FILE *File = fopen(Filename, "rb"); if(!File) return 0;
+	Stream->File = File;
+
+	//! Read everything up to the pixel data, to get at the palette
+	struct BMFH_t bmFH;
+	struct BMIH_t bmIH;
+	struct BmpLayout_t Layout;
+	if(fread(&bmFH, sizeof(bmFH), 1, File) != 1 || fread(&bmIH, sizeof(bmIH), 1, File) != 1)
+		goto Error;
+	if(bmIH.Size > 0x10000 || FSEEK64(File, 0, SEEK_END)) goto Error;
+	int64_t FileSize = FTELL64(File);
+	size_t  HdrSize  = sizeof(bmFH) + bmIH.Size + 3*sizeof(uint32_t) + BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t);
+	if(HdrSize > bmFH.Offs && bmFH.Offs >= sizeof(bmFH) + sizeof(bmIH)) HdrSize = bmFH.Offs;
+	if(FileSize < 0 || (uint64_t)FileSize < HdrSize) HdrSize = FileSize < 0 ? 0 : (size_t)FileSize;
+	if(!BmpStream_Reserve(Stream, HdrSize) || FSEEK64(File, 0, SEEK_SET)) goto Error;
+	if(fread(Stream->RowBuf, 1, HdrSize, File) != HdrSize) goto Error;
+	if(!ParseLayout(&Layout, Stream->RowBuf, HdrSize, FileSize)) goto Error;
+
+	Stream->Width   = Layout.Width;
+	Stream->Height  = Layout.Height;
+	Stream->BitCnt  = Layout.BitCnt;
+	Stream->TopDown = Layout.TopDown;
+	Stream->Offs    = Layout.Offs;
+	Stream->Stride  = Layout.Stride;
+	if(Layout.BitCnt == 8) ReadPalette(Stream->ColPal, &Layout, Stream->RowBuf);
+	return 1;
+
+Error:
+	BmpStream_Close(Stream);
+	return 0;
+}
+
+int BmpStream_Create(struct BmpStream_t *Stream, const char *Filename, int w, int h, const struct BGRA8_t *ColPal)
+{
+	memset(Stream, 0, sizeof(*Stream));
+
+	FILE *File = fopen(Filename, "wb"); if(!File) return 0;
+	Stream->File    = File;
+	Stream->Width   = w;
+	Stream->Height  = h;
+	Stream->BitCnt  = 8;
+	Stream->Writing = 1;
+	Stream->Offs    = sizeof(struct BMFH_t) + sizeof(struct BMIH_t) + BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t);
+	Stream->Stride  = ((uint64_t)w + 3) &~ 3;
+	memcpy(Stream->ColPal, ColPal, sizeof(Stream->ColPal));
+
+	//! Files over 4GiB can't store their size; readers ignore it anyway
+	uint64_t FileSize = Stream->Offs + Stream->Stride*h;
+	struct BMFH_t bmFH; memset(&bmFH, 0, sizeof(bmFH));
+	struct BMIH_t bmIH; memset(&bmIH, 0, sizeof(bmIH));
+	bmFH.Type     = 'B'|'M'<<8;
+	bmFH.Size     = FileSize > UINT32_MAX ? 0 : FileSize;
+	bmFH.Offs     = Stream->Offs;
+	bmIH.Size     = sizeof(struct BMIH_t);
+	bmIH.Width    = w;
+	bmIH.Height   = h;
+	bmIH.nPlanes  = 1;
+	bmIH.BitCnt   = 8;
+	fwrite(&bmFH, 1, sizeof(bmFH), File);
+	fwrite(&bmIH, 1, sizeof(bmIH), File);
+	fwrite(ColPal, BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t), File);
+	if(ferror(File))
+	{
+		BmpStream_Close(Stream);
+		return 0;
+	}
+	return 1;
+}
+
+int BmpStream_ReadRows(struct BmpStream_t *Stream, int y, int nRows, struct BGRA8_t *PxBGR)
+{
+	if(Stream->Writing || Stream->Error || y < 0 || nRows < 0 || y+nRows > Stream->Height)
+		return 0;
+
+	//! Rows in a band are contiguous in the file, just maybe reversed
+	size_t   Size  = Stream->Stride * nRows;
+	uint64_t First = Stream->TopDown ? (uint64_t)y : (uint64_t)(Stream->Height - y - nRows);
+	if(!BmpStream_Reserve(Stream, Size) ||
+	   FSEEK64(Stream->File, Stream->Offs + First*Stream->Stride, SEEK_SET) ||
+	   fread(Stream->RowBuf, 1, Size, Stream->File) != Size)
+	{
+		Stream->Error = 1;
+		return 0;
+	}
+
+	int r, x, w = Stream->Width;
+	for(r=0;r<nRows;r++)
+	{
+		const uint8_t  *Src = Stream->RowBuf + (Stream->TopDown ? r : nRows-1-r) * Stream->Stride;
+		struct BGRA8_t *Dst = PxBGR + (size_t)r*w;
+		switch(Stream->BitCnt)
+		{
+			case 8:  for(x=0;x<w;x++) Dst[x] = Stream->ColPal[Src[x]]; break;
+			case 24: ExpandBGR24(Dst, Src, w); break;
+			case 32: memcpy(Dst, Src, (size_t)w * sizeof(struct BGRA8_t)); break;
+		}
+	}
+	return 1;
+}
+
+int BmpStream_WriteRows(struct BmpStream_t *Stream, int y, int nRows, const uint8_t *PxIdx)
+{
+	if(!Stream->Writing || Stream->Error || y < 0 || nRows < 0 || y+nRows > Stream->Height)
+		return 0;
+
+	//! Assemble the band bottom-up, so it's written with one call
+	int r, w = Stream->Width;
+	size_t Size = Stream->Stride * nRows;
+	if(!BmpStream_Reserve(Stream, Size))
+	{
+		Stream->Error = 1;
+		return 0;
+	}
+	memset(Stream->RowBuf, 0, Size);
+	for(r=0;r<nRows;r++)
+	{
+		memcpy(Stream->RowBuf + (nRows-1-r)*Stream->Stride, PxIdx + (size_t)r*w, w);
+	}
+
+	uint64_t First = Stream->Height - y - nRows;
+	if(FSEEK64(Stream->File, Stream->Offs + First*Stream->Stride, SEEK_SET) ||
+	   fwrite(Stream->RowBuf, 1, Size, Stream->File) != Size)
+	{
+		Stream->Error = 1;
+		return 0;
+	}
+	return 1;
+}
+
+int BmpStream_Close(struct BmpStream_t *Stream)
+{
+	int Ok = !Stream->Error;
+	if(Stream->File)
+	{
+		if(ferror(Stream->File)) Ok = 0;
+		if(fclose(Stream->File)) Ok = 0;
+	}
+	Mem_Free(Stream->RowBuf);
+	memset(Stream, 0, sizeof(*Stream));
+	return Ok;
+}
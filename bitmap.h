@@ -1,5 +1,7 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include "colourspace.h"
 
 #define BMP_PALETTE_COLOURS 256
@@ -13,9 +15,45 @@ struct BmpCtx_t
 		uint8_t *PxIdx;
 		struct BGRA8_t *PxBGR;
 	};
+	void  *MapData; //! File mapping that pixel data may point into (or NULL)
+	size_t MapSize;
 };
 
 int BmpCtx_Create(struct BmpCtx_t *Ctx, int w, int h, int PalCol);
 void BmpCtx_Destroy(struct BmpCtx_t *Ctx);
 int BmpCtx_FromFile(struct BmpCtx_t *Ctx, const char *Filename);
 int BmpCtx_ToFile(const struct BmpCtx_t *Ctx, const char *Filename);
+
+//! Replace image data with an indexed image
+//! NOTE: The previous image data (and file mapping) is released, and
+//! ownership of ColPal and PxIdx passes to the context
+void BmpCtx_SetIndexed(struct BmpCtx_t *Ctx, struct BGRA8_t *ColPal, uint8_t *PxIdx);
+
+//! Row-streamed BMP access, for images too large to hold in memory
+struct BmpStream_t
+{
+	FILE *File;
+	int   Width, Height;
+	int   BitCnt, TopDown;
+	int   Writing, Error;
+	uint64_t Offs, Stride;
+	struct BGRA8_t ColPal[BMP_PALETTE_COLOURS];
+	uint8_t *RowBuf;
+	size_t   RowBufSize;
+};
+
+//! Open a BMP file to read rows from
+int BmpStream_Open(struct BmpStream_t *Stream, const char *Filename);
+
+//! Create an 8-bit BMP file to write rows to
+int BmpStream_Create(struct BmpStream_t *Stream, const char *Filename, int w, int h, const struct BGRA8_t *ColPal);
+
+//! Read rows [y, y+nRows) as BGRA8 (top-down)
+int BmpStream_ReadRows(struct BmpStream_t *Stream, int y, int nRows, struct BGRA8_t *PxBGR);
+
+//! Write rows [y, y+nRows) of palette indices (top-down)
+int BmpStream_WriteRows(struct BmpStream_t *Stream, int y, int nRows, const uint8_t *PxIdx);
+
+//! Close the stream
+//! NOTE: Returns 0 if any read/write failed
+int BmpStream_Close(struct BmpStream_t *Stream);
@@ -0,0 +1,250 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "cache.h"
+#include "mem.h"
+#include "process.h"
+#include "tiles.h"
+
+#ifdef _WIN32
+# include <process.h>
+# define GETPID _getpid
+#else
+# include <unistd.h>
+# define GETPID getpid
+#endif
+
+#define CACHE_MAGIC 0x31435154 //! "TQC1" (native byte order, so foreign entries just miss)
+#define CACHE_EXT   ".tqc"
+
+//! Entry header; followed by the palette, indices and tile palette indices
+struct CacheHeader_t
+{
+	uint32_t Magic;
+	uint32_t Width, Height;
+	uint32_t nTiles;
+	struct CacheKey_t Key;
+	struct BGRAf_t RMSE;
+};
+
+/**************************************/
+
+//! Two independent multiply-rotate lanes over 64-bit words
+struct CacheHasher_t
+{
+	uint64_t h[2];
+};
+
+static void Hasher_Init(struct CacheHasher_t *H)
+{
+	H->h[0] = 0x9E3779B97F4A7C15ull;
+	H->h[1] = 0xC2B2AE3D27D4EB4Full;
+}
+
+static inline uint64_t Rotl64(uint64_t x, int n)
+{
+	return (x << n) | (x >> (64-n));
+}
+
+static inline void Hasher_Word(struct CacheHasher_t *H, uint64_t x)
+{
+	H->h[0] = Rotl64(H->h[0] ^ (x * 0x87C37B91114253D5ull), 31) * 0x9FB21C651E98DF25ull;
+	H->h[1] = Rotl64(H->h[1] ^ (x * 0x4CF5AD432745937Full), 29) * 0xFF51AFD7ED558CCDull;
+}
+
+static void Hasher_Bytes(struct CacheHasher_t *H, const void *Data, size_t Size)
+{
+	const uint8_t *p = Data;
+	uint64_t x;
+	for(; Size >= 8; p += 8, Size -= 8)
+	{
+		memcpy(&x, p, 8);
+		Hasher_Word(H, x);
+	}
+	x = Size; //! Tail, tagged with its length
+	while(Size--) x = x << 8 | p[Size];
+	Hasher_Word(H, x);
+}
+
+static inline uint64_t FMix64(uint64_t x)
+{
+	x ^= x >> 33; x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33; x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+static void Hasher_Final(struct CacheHasher_t *H, struct CacheKey_t *Key)
+{
+	Key->Hash[0] = FMix64(H->h[0] + H->h[1]);
+	Key->Hash[1] = FMix64(H->h[1] ^ Rotl64(H->h[0], 17));
+}
+
+/**************************************/
+
+void Cache_Key(struct CacheKey_t *Key, const struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts)
+{
+	size_t n;
+	size_t nPx = (size_t)Image->Width * Image->Height;
+	struct CacheHasher_t H;
+	Hasher_Init(&H);
+
+	//! Options are packed into words, as struct padding is undefined
+	float DitherLevel = Opts->DitherLevel;
+	uint32_t DitherBits;
+	memcpy(&DitherBits, &DitherLevel, sizeof(DitherBits));
+	uint32_t Words[] =
+	{
+		PROCESS_OUTPUT_VERSION,
+		Image->Width,
+		Image->Height,
+		Image->ColPal != NULL,
+		Opts->nPalettes,
+		Opts->nColoursPerPalette,
+		Opts->nUnusedColoursPerPalette,
+		Opts->TileW,
+		Opts->TileH,
+		Opts->BitRange.b | Opts->BitRange.g << 8 | Opts->BitRange.r << 16 | (uint32_t)Opts->BitRange.a << 24,
+		Opts->DitherMode,
+		DitherBits,
+		Opts->OrderColours,
+		Opts->IntegerMode,
+		Opts->CoarseFactor,
+		Opts->ReassignPasses,
+		Opts->AlphaThreshold,
+		Opts->ExactTiles,
+		Opts->FixedPalette != NULL,
+	};
+	Hasher_Bytes(&H, Words, sizeof(Words));
+	if(Opts->FixedPalette) Hasher_Bytes(&H, Opts->FixedPalette, Opts->nPalettes * Opts->nColoursPerPalette * sizeof(struct BGRA8_t));
+
+	//! Decoded pixels, two at a time
+	if(Image->ColPal)
+	{
+		for(n=0; n+1<nPx; n+=2)
+		{
+			uint64_t x = 0;
+			memcpy((uint8_t*)&x + 0, &Image->ColPal[Image->PxIdx[n+0]], 4);
+			memcpy((uint8_t*)&x + 4, &Image->ColPal[Image->PxIdx[n+1]], 4);
+			Hasher_Word(&H, x);
+		}
+		if(n < nPx) Hasher_Bytes(&H, &Image->ColPal[Image->PxIdx[n]], 4);
+	}
+	else Hasher_Bytes(&H, Image->PxBGR, nPx * sizeof(struct BGRA8_t));
+
+	Hasher_Final(&H, Key);
+}
+
+void Cache_EntryPath(char *Path, size_t PathSize, const char *Dir, const struct CacheKey_t *Key)
+{
+	snprintf(Path, PathSize, "%s/%016llx%016llx" CACHE_EXT, Dir, (unsigned long long)Key->Hash[0], (unsigned long long)Key->Hash[1]);
+}
+
+int Cache_Load(const char *Dir, const struct CacheKey_t *Key, struct BmpCtx_t *Image, struct BGRAf_t *RMSE, int32_t **TilePalIdx)
+{
+	char Path[4096];
+	Cache_EntryPath(Path, sizeof(Path), Dir, Key);
+	FILE *File = fopen(Path, "rb");
+	if(!File) return 0;
+
+	struct CacheHeader_t Header;
+	size_t nPx = (size_t)Image->Width * Image->Height;
+	if(fread(&Header, sizeof(Header), 1, File) != 1 ||
+	   Header.Magic  != CACHE_MAGIC ||
+	   Header.Width  != (uint32_t)Image->Width ||
+	   Header.Height != (uint32_t)Image->Height ||
+	   Header.nTiles > nPx ||
+	   memcmp(&Header.Key, Key, sizeof(*Key)))
+	{
+		fclose(File);
+		return 0;
+	}
+
+	struct BGRA8_t *ColPal = Mem_Alloc(BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+	uint8_t        *PxIdx  = Mem_Alloc(nPx * sizeof(uint8_t));
+	int32_t        *TilePal = Mem_Alloc((Header.nTiles ? Header.nTiles : 1) * sizeof(int32_t));
+	int Ok =
+		ColPal && PxIdx && TilePal &&
+		fread(ColPal,  sizeof(struct BGRA8_t), BMP_PALETTE_COLOURS, File) == BMP_PALETTE_COLOURS &&
+		fread(PxIdx,   sizeof(uint8_t),        nPx,                 File) == nPx &&
+		fread(TilePal, sizeof(int32_t),        Header.nTiles,       File) == Header.nTiles;
+	fclose(File);
+	if(!Ok)
+	{
+		Mem_Free(TilePal);
+		Mem_Free(PxIdx);
+		Mem_Free(ColPal);
+		return 0;
+	}
+
+	BmpCtx_SetIndexed(Image, ColPal, PxIdx);
+	*RMSE = Header.RMSE;
+	if(TilePalIdx) *TilePalIdx = TilePal;
+	else Mem_Free(TilePal);
+	return 1;
+}
+
+int Cache_Store(const char *Dir, const struct CacheKey_t *Key, const struct BmpCtx_t *Image, struct BGRAf_t RMSE, const int32_t *TilePalIdx, int nTiles)
+{
+	static atomic_uint TempCounter;
+	char Path[4096], TempPath[4096 + 64];
+	Cache_EntryPath(Path, sizeof(Path), Dir, Key);
+	snprintf(TempPath, sizeof(TempPath), "%s.%d.%u.tmp", Path, (int)GETPID(), atomic_fetch_add(&TempCounter, 1));
+
+	struct CacheHeader_t Header;
+	memset(&Header, 0, sizeof(Header));
+	Header.Magic  = CACHE_MAGIC;
+	Header.Width  = Image->Width;
+	Header.Height = Image->Height;
+	Header.nTiles = nTiles;
+	Header.Key    = *Key;
+	Header.RMSE   = RMSE;
+
+	FILE *File = fopen(TempPath, "wb");
+	if(!File) return 0;
+	size_t nPx = (size_t)Image->Width * Image->Height;
+	int Ok =
+		fwrite(&Header,       sizeof(Header),         1,                   File) == 1 &&
+		fwrite(Image->ColPal, sizeof(struct BGRA8_t), BMP_PALETTE_COLOURS, File) == BMP_PALETTE_COLOURS &&
+		fwrite(Image->PxIdx,  sizeof(uint8_t),        nPx,                 File) == nPx &&
+		fwrite(TilePalIdx,    sizeof(int32_t),        nTiles,              File) == (size_t)nTiles;
+	Ok = (fclose(File) == 0) && Ok;
+
+	//! NOTE: Where rename() cannot replace an existing file, another
+	//! process has stored the same entry, so losing the race is fine
+	if(!Ok || rename(TempPath, Path) != 0)
+	{
+		remove(TempPath);
+		return 0;
+	}
+	return 1;
+}
+
+int Cache_ProcessImage(const char *Dir, struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct BGRAf_t *RMSE, int32_t **TilePalIdx, int *Hit)
+{
+	//! Results under a time budget depend on timing, so aren't cached
+	int Cacheable = (Opts->TimeBudget <= 0);
+
+	struct CacheKey_t Key;
+	if(Cacheable) Cache_Key(&Key, Image, Opts);
+	*Hit = Cacheable && Cache_Load(Dir, &Key, Image, RMSE, TilePalIdx);
+	if(*Hit) return PROCESS_OK;
+
+	struct TilesData_t *TilesData;
+	int Error = Process_Image(Image, Opts, RMSE, &TilesData);
+	if(Error != PROCESS_OK) return Error;
+
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	if(Cacheable) Cache_Store(Dir, &Key, Image, *RMSE, TilesData->TilePalIdx, nTiles);
+	if(TilePalIdx)
+	{
+		*TilePalIdx = Mem_Alloc((nTiles ? nTiles : 1) * sizeof(int32_t));
+		if(*TilePalIdx) memcpy(*TilePalIdx, TilesData->TilePalIdx, nTiles * sizeof(int32_t));
+	}
+	Mem_Free(TilesData);
+	if(TilePalIdx && !*TilePalIdx) return PROCESS_ERR_MEMORY;
+	return PROCESS_OK;
+}
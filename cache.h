@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "process.h"
+
+//! Key of a cache entry
+//! NOTE: Hash of the decoded pixels, every option that affects the output,
+//! and PROCESS_OUTPUT_VERSION
+struct CacheKey_t
+{
+	uint64_t Hash[2];
+};
+
+//! Compute the key for an image (before processing) and its options
+void Cache_Key(struct CacheKey_t *Key, const struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts);
+
+//! Get the file name of an entry
+void Cache_EntryPath(char *Path, size_t PathSize, const char *Dir, const struct CacheKey_t *Key);
+
+//! Look up a result
+//! NOTE: On a hit, Image is replaced with the stored indexed image, and
+//! (if TilePalIdx is not NULL) the tile palette indices are stored to
+//! *TilePalIdx, to be Mem_Free()d by the caller
+//! NOTE: Returns 0 on a miss (including unreadable or damaged entries)
+int Cache_Load(const char *Dir, const struct CacheKey_t *Key, struct BmpCtx_t *Image, struct BGRAf_t *RMSE, int32_t **TilePalIdx);
+
+//! Store a result
+//! NOTE: Entries are written to a temporary file and renamed into place,
+//! so processes sharing the directory never see partial entries
+int Cache_Store(const char *Dir, const struct CacheKey_t *Key, const struct BmpCtx_t *Image, struct BGRAf_t RMSE, const int32_t *TilePalIdx, int nTiles);
+
+//! Process_Image() through a cache directory
+//! NOTE: On a hit (*Hit = 1), the stored result is used without processing
+//! NOTE: If TilePalIdx is not NULL, the tile palette indices are stored to
+//! *TilePalIdx, to be Mem_Free()d by the caller
+//! NOTE: Failing to store an entry is not an error
+//! NOTE: Results with a TimeBudget depend on timing, so are never cached
+int Cache_ProcessImage(const char *Dir, struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct BGRAf_t *RMSE, int32_t **TilePalIdx, int *Hit);
@@ -231,8 +231,85 @@ static inline struct BGRAf_t BGRAf_Abs(const struct BGRAf_t *x)
 	return Out;
 }
 
+static inline struct BGRAf_t BGRAf_Min(const struct BGRAf_t *a, const struct BGRAf_t *b)
+{
+	struct BGRAf_t Out;
+	Out.b = (a->b < b->b) ? a->b : b->b;
+	Out.g = (a->g < b->g) ? a->g : b->g;
+	Out.r = (a->r < b->r) ? a->r : b->r;
+	Out.a = (a->a < b->a) ? a->a : b->a;
+	return Out;
+}
+
+static inline struct BGRAf_t BGRAf_Max(const struct BGRAf_t *a, const struct BGRAf_t *b)
+{
+	struct BGRAf_t Out;
+	Out.b = (a->b > b->b) ? a->b : b->b;
+	Out.g = (a->g > b->g) ? a->g : b->g;
+	Out.r = (a->r > b->r) ? a->r : b->r;
+	Out.a = (a->a > b->a) ? a->a : b->a;
+	return Out;
+}
+
 static inline float BGRAf_ColDistance(const struct BGRAf_t *a, const struct BGRAf_t *b)
 {
 	struct BGRAf_t d = BGRAf_Sub(a, b);
 	return BGRAf_Len2(&d);
 }
+
+/**************************************/
+
+//! Integer YCoCg (lossless YCoCg-R), in the same channel order as BGRAf_AsYCoCg()
+//! NOTE: Y and A span 0..255, and Cg and Co span -255..255 (twice the float scale)
+struct YCoCg16_t { int16_t y, cg, co, a; };
+
+static inline struct YCoCg16_t YCoCg16_FromBGRA8(const struct BGRA8_t *x)
+{
+	int Co = x->r - x->b;
+	int t  = x->b + (Co >> 1);
+	int Cg = x->g - t;
+	int Y  = t + (Cg >> 1);
+	return (struct YCoCg16_t){(int16_t)Y, (int16_t)Cg, (int16_t)Co, x->a};
+}
+
+static inline struct BGRA8_t BGRA8_FromYCoCg16(const struct YCoCg16_t *x)
+{
+	int t = x->y - (x->cg >> 1);
+	int g = x->cg + t;
+	int b = t - (x->co >> 1);
+	int r = b + x->co;
+	return (struct BGRA8_t)
+	{
+		(uint8_t)COLOURSPACE_CLIP(b, 0, 255),
+		(uint8_t)COLOURSPACE_CLIP(g, 0, 255),
+		(uint8_t)COLOURSPACE_CLIP(r, 0, 255),
+		(uint8_t)COLOURSPACE_CLIP(x->a, 0, 255)
+	};
+}
+
+//! Convert from float YCoCg (as from BGRAf_AsYCoCg())
+static inline struct YCoCg16_t YCoCg16_FromYCoCgf(const struct BGRAf_t *x)
+{
+	return (struct YCoCg16_t)
+	{
+		(int16_t)lrintf(x->b * 255.0f),
+		(int16_t)lrintf(x->g * 510.0f),
+		(int16_t)lrintf(x->r * 510.0f),
+		(int16_t)lrintf(x->a * 255.0f)
+	};
+}
+
+static inline struct BGRAf_t BGRAf_FromYCoCg16(const struct YCoCg16_t *x)
+{
+	return (struct BGRAf_t){x->y * (1.0f/255), x->cg * (1.0f/510), x->co * (1.0f/510), x->a * (1.0f/255)};
+}
+
+//! Squared distance, scaled to match BGRAf_ColDistance() (times 510^2)
+static inline int32_t YCoCg16_ColDistance(const struct YCoCg16_t *a, const struct YCoCg16_t *b)
+{
+	int32_t dy = a->y  - b->y;
+	int32_t dg = a->cg - b->cg;
+	int32_t dr = a->co - b->co;
+	int32_t da = a->a  - b->a;
+	return 4*dy*dy + dg*dg + dr*dr + 4*da*da;
+}
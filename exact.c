@@ -0,0 +1,317 @@
+#include <stdint.h>
+#include <string.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "exact.h"
+#include "mem.h"
+#include "tiles.h"
+
+#define EXACT_PENDING (-2) //! Tile (with few enough colours) not yet placed
+#define EXACT_COMPLEX (-1) //! Tile left to clustering
+
+#define EXACT_CAND_FREE 0
+#define EXACT_CAND_OPEN 1 //! Candidate palette from the current round
+#define EXACT_CAND_KEPT 2
+
+//! Per-channel snapping of 8-bit colours to BitRange (as palette entries are)
+struct ExactSnap_t
+{
+	uint8_t b[256], g[256], r[256], a[256];
+};
+
+static void ExactSnap_Init(struct ExactSnap_t *Snap, const struct BGRA8_t *BitRange)
+{
+	int i;
+	for(i=0;i<256;i++)
+	{
+		struct BGRAf_t f = BGRAf_FromBGRA8(&(struct BGRA8_t){i,i,i,i});
+		struct BGRA8_t s = BGRA_FromBGRAf(&f, BitRange);
+		Snap->b[i] = s.b, Snap->g[i] = s.g, Snap->r[i] = s.r, Snap->a[i] = s.a;
+	}
+}
+
+static inline uint32_t ExactSnap_Key(const struct ExactSnap_t *Snap, struct BGRA8_t p)
+{
+	return Snap->b[p.b] | Snap->g[p.g] << 8 | Snap->r[p.r] << 16 | (uint32_t)Snap->a[p.a] << 24;
+}
+
+static inline uint32_t Exact_Hash(uint32_t Key)
+{
+	return Key * 0x9E3779B1u;
+}
+
+static inline struct BGRA8_t Exact_Pixel(const struct BmpCtx_t *Image, size_t Offs)
+{
+	return Image->ColPal ? Image->ColPal[Image->PxIdx[Offs]] : Image->PxBGR[Offs];
+}
+
+//! Number of keys of sorted set a that are also in sorted set b
+static int Exact_Overlap(const uint32_t *a, int na, const uint32_t *b, int nb)
+{
+	int i = 0, j = 0, n = 0;
+	while(i < na && j < nb)
+	{
+		if     (a[i] < b[j]) i++;
+		else if(a[i] > b[j]) j++;
+		else n++, i++, j++;
+	}
+	return n;
+}
+
+//! Merge sorted set a into sorted set b (which has room for the union)
+static int Exact_Union(const uint32_t *a, int na, uint32_t *b, int nb)
+{
+	int i = na-1, j = nb-1;
+	int n = nb + na - Exact_Overlap(a, na, b, nb);
+	int k = n-1;
+	while(i >= 0)
+	{
+		if     (j >= 0 && b[j] >  a[i]) b[k--] = b[j--];
+		else if(j >= 0 && b[j] == a[i]) b[k--] = b[j--], i--;
+		else b[k--] = a[i--];
+	}
+	return n;
+}
+
+/**************************************/
+
+//! Collect the colour set of each tile (sorted), or -1 for tiles with more
+//! than nSlots colours (or that aren't visible)
+static void Exact_CollectTiles(const struct BmpCtx_t *Image, const struct TilesData_t *TilesData, const struct ExactSnap_t *Snap, int nSlots, uint32_t *TileKeys, int32_t *TileCnt)
+{
+	int t, x, y, i;
+	int TileW = TilesData->TileW, TileH = TilesData->TileH;
+	int ImgW  = Image->Width;
+
+	//! Small open-addressed set, cleared by tagging slots with the tile
+	uint32_t HashKey[2*BMP_PALETTE_COLOURS];
+	int32_t  HashTag[2*BMP_PALETTE_COLOURS];
+	uint32_t HashMask = 1;
+	while(HashMask+1 < (uint32_t)nSlots*2) HashMask = HashMask*2 + 1;
+	for(i=0; i<(int)HashMask+1; i++) HashTag[i] = -1;
+
+	for(t=0; t<TilesData->TilesX*TilesData->TilesY; t++)
+	{
+		int n = 0;
+		uint32_t *Keys = TileKeys + (size_t)t*nSlots;
+		if(!TilesData_TileVisible(TilesData, t)) n = -1;
+
+		size_t Offs0 = (size_t)(t / TilesData->TilesX)*TileH*ImgW + (size_t)(t % TilesData->TilesX)*TileW;
+		uint32_t Prev = 0;
+		int HavePrev = 0;
+		for(y=0; n>=0 && y<TileH; y++) for(x=0; n>=0 && x<TileW; x++)
+		{
+			uint32_t Key = ExactSnap_Key(Snap, Exact_Pixel(Image, Offs0 + (size_t)y*ImgW + x));
+			if(HavePrev && Key == Prev) continue;
+			Prev = Key, HavePrev = 1;
+
+			uint32_t h = Exact_Hash(Key) >> 16 & HashMask;
+			while(HashTag[h] == t && HashKey[h] != Key) h = (h+1) & HashMask;
+			if(HashTag[h] == t) continue;
+			if(n == nSlots)
+			{
+				n = -1;
+				break;
+			}
+			HashTag[h] = t, HashKey[h] = Key;
+
+			//! Insertion keeps the set sorted (sets are small)
+			for(i=n++; i>0 && Keys[i-1] > Key; i--) Keys[i] = Keys[i-1];
+			Keys[i] = Key;
+		}
+		TileCnt[t] = n;
+	}
+}
+
+//! Put each pending tile into the candidate palette that shares the most
+//! of its colours and has room for the rest, or else into a new one
+//! NOTE: Returns the number of tiles placed
+static int Exact_Pack(const uint32_t *TileKeys, const int32_t *TileCnt, const int32_t *Order, int nOrder, int nSlots, int nCand, uint32_t *CandKeys, int32_t *CandCnt, int32_t *CandTiles, uint8_t *CandState, int32_t *TilePal)
+{
+	int i, p;
+	int nPlaced = 0;
+	for(i=0; i<nOrder; i++)
+	{
+		int t = Order[i];
+		if(TilePal[t] != EXACT_PENDING) continue;
+		const uint32_t *Keys = TileKeys + (size_t)t*nSlots;
+		int n = TileCnt[t];
+
+		//! A palette holding every colour can't be beaten
+		int Best = -1, BestOverlap = -1, Free = -1;
+		for(p=0; p<nCand && BestOverlap < n; p++)
+		{
+			if(CandState[p] == EXACT_CAND_FREE)
+			{
+				if(Free < 0) Free = p;
+				continue;
+			}
+			int Overlap = Exact_Overlap(Keys, n, CandKeys + (size_t)p*nSlots, CandCnt[p]);
+			if(CandCnt[p] + n - Overlap <= nSlots && Overlap > BestOverlap) Best = p, BestOverlap = Overlap;
+		}
+		for(; Best < 0 && Free < 0 && p<nCand; p++) if(CandState[p] == EXACT_CAND_FREE) Free = p;
+		if(Best < 0 && Free >= 0)
+		{
+			Best = Free;
+			CandState[Best] = EXACT_CAND_OPEN, CandCnt[Best] = 0, CandTiles[Best] = 0;
+		}
+		if(Best < 0) continue;
+
+		CandCnt[Best] = Exact_Union(Keys, n, CandKeys + (size_t)Best*nSlots, CandCnt[Best]);
+		CandTiles[Best]++;
+		TilePal[t] = Best;
+		nPlaced++;
+	}
+	return nPlaced;
+}
+
+int Exact_PackTiles(const struct BmpCtx_t *Image, struct TilesData_t *TilesData, struct BGRAf_t *Palette, uint8_t *TileExact, int MaxTilePals, int MaxPalSize, int PalUnused, const struct BGRA8_t *BitRange)
+{
+	int t, i, j, Round;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	int nSlots = MaxPalSize - PalUnused;
+	int nCand  = MaxTilePals * EXACT_CANDIDATES_PER_PALETTE;
+	if(nSlots < 1 || MaxTilePals < 1) return 0;
+
+	struct ExactSnap_t Snap;
+	ExactSnap_Init(&Snap, BitRange);
+
+	size_t nAlloc = nTiles ? nTiles : 1;
+	uint32_t *TileKeys  = Mem_Alloc(nAlloc * nSlots * sizeof(uint32_t));
+	int32_t  *TileCnt   = Mem_Alloc(nAlloc * sizeof(int32_t));
+	int32_t  *TilePal   = Mem_Alloc(nAlloc * sizeof(int32_t));
+	int32_t  *Order     = Mem_Alloc(nAlloc * sizeof(int32_t));
+	uint32_t *CandKeys  = Mem_Alloc((size_t)nCand * nSlots * sizeof(uint32_t));
+	int32_t  *CandCnt   = Mem_Alloc((size_t)nCand * sizeof(int32_t));
+	int32_t  *CandTiles = Mem_Alloc((size_t)nCand * sizeof(int32_t));
+	int32_t  *CandPal   = Mem_Alloc((size_t)nCand * sizeof(int32_t));
+	uint8_t  *CandState = Mem_Calloc(nCand, sizeof(uint8_t));
+	int Ok = TileKeys && TileCnt && TilePal && Order && CandKeys && CandCnt && CandTiles && CandPal && CandState;
+	int nPals = 0;
+	if(Ok)
+	{
+		Exact_CollectTiles(Image, TilesData, &Snap, nSlots, TileKeys, TileCnt);
+
+		//! Largest sets first (counting sort, so ties stay in tile order)
+		int nOrder = 0, nVisible = 0;
+		for(i=nSlots; i>=1; i--) for(t=0; t<nTiles; t++) if(TileCnt[t] == i) Order[nOrder++] = t;
+		for(t=0; t<nTiles; t++)
+		{
+			nVisible += TilesData_TileVisible(TilesData, t);
+			TilePal[t] = (TileCnt[t] > 0) ? EXACT_PENDING : EXACT_COMPLEX;
+		}
+
+		//! Candidate palettes are only kept while they hold at least as many
+		//! tiles as the palettes left would get on average, so tiles with
+		//! colours of their own (eg. smooth gradients) don't use up palettes
+		//! that clustering makes better use of; tiles of dropped candidates
+		//! are clustered, and the space freed goes to the next round
+		int nLeft = nVisible, nPending = nOrder;
+		for(Round=0; Round<EXACT_PACK_ROUNDS && nPending; Round++)
+		{
+			nPending -= Exact_Pack(TileKeys, TileCnt, Order, nOrder, nSlots, nCand, CandKeys, CandCnt, CandTiles, CandState, TilePal);
+
+			int nKept = 0;
+			for(;;)
+			{
+				int Best = -1;
+				for(i=0; i<nCand; i++) if(CandState[i] == EXACT_CAND_OPEN && (Best < 0 || CandTiles[i] > CandTiles[Best])) Best = i;
+				if(Best < 0) break;
+
+				int c = CandTiles[Best];
+				int nFree = MaxTilePals - nPals;
+				if(nFree < 1 || (nLeft > c && nFree < 2) || (int64_t)c*nFree < nLeft) break;
+				CandState[Best] = EXACT_CAND_KEPT, CandPal[Best] = nPals++;
+				nLeft -= c, nKept++;
+			}
+			for(i=0; i<nCand; i++) if(CandState[i] == EXACT_CAND_OPEN) CandState[i] = EXACT_CAND_FREE;
+			for(i=0; i<nOrder; i++)
+			{
+				t = Order[i];
+				if(TilePal[t] >= 0 && CandState[TilePal[t]] == EXACT_CAND_FREE) TilePal[t] = EXACT_COMPLEX;
+			}
+			if(!nKept) break;
+		}
+
+		//! Exact palettes go last, with unused colour slots repeating the
+		//! first colour, followed by the reserved entries
+		int First = MaxTilePals - nPals;
+		for(i=0; i<nCand; i++) if(CandState[i] == EXACT_CAND_KEPT)
+		{
+			struct BGRAf_t *Pal = Palette + (size_t)(First+CandPal[i])*MaxPalSize;
+			for(j=0; j<nSlots; j++)
+			{
+				uint32_t Key = CandKeys[(size_t)i*nSlots + (j < CandCnt[i] ? j : 0)];
+				struct BGRA8_t s = {Key, Key >> 8, Key >> 16, Key >> 24};
+				struct BGRAf_t p = BGRAf_FromBGRA(&s, BitRange);
+				Pal[j] = BGRAf_AsYCoCg(&p);
+			}
+			for(j=nSlots; j<MaxPalSize; j++)
+				Pal[j] = BGRAf_AsYCoCg(&(struct BGRAf_t){1,1,1,0});
+		}
+		for(t=0; t<nTiles; t++) if(TilePal[t] >= 0 && CandState[TilePal[t]] == EXACT_CAND_KEPT)
+		{
+			TilesData->TilePalIdx[t] = First + CandPal[TilePal[t]];
+			TileExact[t] = 1;
+		}
+	}
+
+	Mem_Free(CandState);
+	Mem_Free(CandPal);
+	Mem_Free(CandTiles);
+	Mem_Free(CandCnt);
+	Mem_Free(CandKeys);
+	Mem_Free(Order);
+	Mem_Free(TilePal);
+	Mem_Free(TileCnt);
+	Mem_Free(TileKeys);
+	return Ok ? nPals : -1;
+}
+
+void Exact_RemapTiles(const struct BmpCtx_t *Image, const struct TilesData_t *TilesData, uint8_t *TileExact, uint8_t *PxData, const struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, const struct BGRA8_t *BitRange)
+{
+	int t, i, x, y;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	int TileW  = TilesData->TileW, TileH = TilesData->TileH;
+	int ImgW   = Image->Width;
+
+	struct ExactSnap_t Snap;
+	ExactSnap_Init(&Snap, BitRange);
+
+	//! One lookup over the entries of every palette with exact tiles,
+	//! keyed by the entry's colour and palette
+	uint8_t  Used[BMP_PALETTE_COLOURS] = {0};
+	uint32_t SlotKey[EXACT_LOOKUP_SIZE];
+	int16_t  SlotIdx[EXACT_LOOKUP_SIZE];
+	for(i=0; i<EXACT_LOOKUP_SIZE; i++) SlotIdx[i] = -1;
+	for(t=0; t<nTiles; t++) if(TileExact[t]) Used[TilesData->TilePalIdx[t]] = 1;
+	for(i=0; i<MaxTilePals*MaxPalSize; i++) if(Used[i / MaxPalSize])
+	{
+		struct BGRAf_t p = BGRAf_FromYCoCg(&Palette[i]);
+		struct BGRA8_t s = BGRA_FromBGRAf(&p, BitRange);
+		uint32_t Key = s.b | s.g << 8 | s.r << 16 | (uint32_t)s.a << 24;
+		uint32_t h = Exact_Hash(Key ^ Exact_Hash(i / MaxPalSize)) % EXACT_LOOKUP_SIZE;
+		while(SlotIdx[h] >= 0 && !(SlotKey[h] == Key && SlotIdx[h] / MaxPalSize == i / MaxPalSize)) h = (h+1) % EXACT_LOOKUP_SIZE;
+		if(SlotIdx[h] < 0) SlotKey[h] = Key, SlotIdx[h] = i;
+	}
+
+	for(t=0; t<nTiles; t++) if(TileExact[t])
+	{
+		int PalIdx = TilesData->TilePalIdx[t];
+		uint32_t PalHash = Exact_Hash(PalIdx);
+		size_t Offs0 = (size_t)(t / TilesData->TilesX)*TileH*ImgW + (size_t)(t % TilesData->TilesX)*TileW;
+		for(y=0; TileExact[t] && y<TileH; y++) for(x=0; x<TileW; x++)
+		{
+			size_t Offs = Offs0 + (size_t)y*ImgW + x;
+			uint32_t Key = ExactSnap_Key(&Snap, Exact_Pixel(Image, Offs));
+			uint32_t h = Exact_Hash(Key ^ PalHash) % EXACT_LOOKUP_SIZE;
+			while(SlotIdx[h] >= 0 && !(SlotKey[h] == Key && SlotIdx[h] / MaxPalSize == PalIdx)) h = (h+1) % EXACT_LOOKUP_SIZE;
+			if(SlotIdx[h] < 0)
+			{
+				TileExact[t] = 0;
+				break;
+			}
+			PxData[Offs] = SlotIdx[h];
+		}
+	}
+}
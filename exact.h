@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "tiles.h"
+
+#define EXACT_CANDIDATES_PER_PALETTE 16 //! Candidate palettes packed per palette, before the best are kept
+#define EXACT_PACK_ROUNDS             4 //! Rounds of packing, each into the candidates dropped by the last
+#define EXACT_LOOKUP_SIZE          1024 //! Slots of the colour lookup of the exact palettes (> 2*BMP_PALETTE_COLOURS)
+
+//! Give tiles with few colours palettes that hold them exactly
+//! NOTE: Tiles with at most MaxPalSize-PalUnused colours (at BitRange
+//! depth) are packed, largest colour sets first, into the palette that
+//! already shares the most of their colours (so subsets and near-subsets
+//! merge), and a palette is only opened when none has room
+//! NOTE: A palette is only kept while it holds at least as many tiles as
+//! the palettes still free would get on average, so images where few
+//! tiles share colours are left to clustering
+//! NOTE: Exact palettes are the last of the MaxTilePals palettes, laid
+//! out as TilesData_QuantizeColours() does; their tiles get TileExact[n]
+//! set and their palette in TilesData->TilePalIdx
+//! NOTE: Tiles that are not visible (see TilesData_t::AlphaThreshold)
+//! are not packed
+//! NOTE: Returns the number of exact palettes, or -1 on failure
+int Exact_PackTiles(const struct BmpCtx_t *Image, struct TilesData_t *TilesData, struct BGRAf_t *Palette, uint8_t *TileExact, int MaxTilePals, int MaxPalSize, int PalUnused, const struct BGRA8_t *BitRange);
+
+//! Remap the exact tiles of an image by looking their colours up in
+//! their palettes, with no distance search
+//! NOTE: Palette is as after Qualetize_PreparePalettes() (which may have
+//! reordered its entries); tiles with a colour that isn't found have
+//! TileExact[n] cleared, to be remapped as usual
+void Exact_RemapTiles(const struct BmpCtx_t *Image, const struct TilesData_t *TilesData, uint8_t *TileExact, uint8_t *PxData, const struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, const struct BGRA8_t *BitRange);
@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "colourspace.h"
+#include "export.h"
+
+#define TILEMAP_MAX_TILES    1024
+#define TILEMAP_MAX_PALETTES 16
+
+static int BitCount(uint8_t x)
+{
+	int n = 0;
+	while(x) n += x&1, x >>= 1;
+	return n;
+}
+
+static int CloseFile(FILE *File)
+{
+	int Ok = !ferror(File);
+	if(fclose(File)) Ok = 0;
+	return Ok;
+}
+
+int Export_Tiles(const char *Filename, const uint8_t *PxData, int ImgW, int ImgH, int TileW, int TileH, int MaxPalSize, int BitsPerPx)
+{
+	if(BitsPerPx != 4 && BitsPerPx != 8) return 0;
+	if(BitsPerPx == 4 && (MaxPalSize > 16 || (TileW*TileH) % 2)) return 0;
+
+	int tx, ty, px, py;
+	int nTileX = ImgW / TileW;
+	int nTileY = ImgH / TileH;
+	size_t TileSize = (size_t)TileW*TileH * BitsPerPx / 8;
+	uint8_t *Tile = malloc(TileSize); if(!Tile) return 0;
+
+	FILE *File = fopen(Filename, "wb");
+	if(!File)
+	{
+		free(Tile);
+		return 0;
+	}
+
+	for(ty=0;ty<nTileY;ty++) for(tx=0;tx<nTileX;tx++)
+	{
+		uint8_t *Dst = Tile;
+		for(py=0;py<TileH;py++)
+		{
+			const uint8_t *Src = PxData + (size_t)(ty*TileH+py)*ImgW + tx*TileW;
+			if(BitsPerPx == 8)
+			{
+				for(px=0;px<TileW;px++) *Dst++ = Src[px];
+			}
+			else for(px=0;px<TileW;px++)
+			{
+				int n = py*TileW + px;
+				uint8_t c = Src[px] % MaxPalSize;
+				if(n&1) Dst[n/2] |= c << 4;
+				else    Dst[n/2]  = c;
+			}
+		}
+		fwrite(Tile, 1, TileSize, File);
+	}
+
+	free(Tile);
+	return CloseFile(File);
+}
+
+int Export_Palette(const char *Filename, const struct BGRA8_t *Palette, int nColours, const struct BGRA8_t *BitRange)
+{
+	int i, b;
+	int rBits = BitCount(BitRange->r);
+	int gBits = BitCount(BitRange->g);
+	int bBits = BitCount(BitRange->b);
+	int aBits = BitCount(BitRange->a);
+	int nBytes = (rBits + gBits + bBits + aBits + 7) / 8;
+
+	FILE *File = fopen(Filename, "wb"); if(!File) return 0;
+	for(i=0;i<nColours;i++)
+	{
+		//! Palette is already snapped; this just recovers the n-bit values
+		uint64_t r = (Palette[i].r * BitRange->r + 127) / 255;
+		uint64_t g = (Palette[i].g * BitRange->g + 127) / 255;
+		uint64_t bl= (Palette[i].b * BitRange->b + 127) / 255;
+		uint64_t a = (Palette[i].a * BitRange->a + 127) / 255;
+		uint64_t v = r | g << rBits | bl << (rBits+gBits) | a << (rBits+gBits+bBits);
+
+		uint8_t Entry[8];
+		for(b=0;b<nBytes;b++) Entry[b] = (uint8_t)(v >> (b*8));
+		fwrite(Entry, 1, nBytes, File);
+	}
+	return CloseFile(File);
+}
+
+int Export_ReadPalette(const char *Filename, struct BGRA8_t *Palette, int MaxColours, const struct BGRA8_t *BitRange)
+{
+	int i, b;
+	int rBits = BitCount(BitRange->r);
+	int gBits = BitCount(BitRange->g);
+	int bBits = BitCount(BitRange->b);
+	int aBits = BitCount(BitRange->a);
+	int nBytes = (rBits + gBits + bBits + aBits + 7) / 8;
+
+	FILE *File = fopen(Filename, "rb"); if(!File) return 0;
+	uint8_t Entry[8];
+	for(i=0;i<MaxColours && fread(Entry, nBytes, 1, File);i++)
+	{
+		uint64_t v = 0;
+		for(b=0;b<nBytes;b++) v |= (uint64_t)Entry[b] << (b*8);
+
+		uint64_t r = v & BitRange->r; v >>= rBits;
+		uint64_t g = v & BitRange->g; v >>= gBits;
+		uint64_t bl= v & BitRange->b; v >>= bBits;
+		uint64_t a = v & BitRange->a;
+		Palette[i].r = BitRange->r ? (r *255 + BitRange->r/2) / BitRange->r : 0;
+		Palette[i].g = BitRange->g ? (g *255 + BitRange->g/2) / BitRange->g : 0;
+		Palette[i].b = BitRange->b ? (bl*255 + BitRange->b/2) / BitRange->b : 0;
+		Palette[i].a = BitRange->a ? (a *255 + BitRange->a/2) / BitRange->a : 255;
+	}
+	if(!CloseFile(File)) return 0;
+	return i;
+}
+
+int Export_Tilemap(const char *Filename, const int32_t *TilePalIdx, int nTiles, int MaxTilePals)
+{
+	if(nTiles > TILEMAP_MAX_TILES || MaxTilePals > TILEMAP_MAX_PALETTES) return 0;
+
+	int i;
+	FILE *File = fopen(Filename, "wb"); if(!File) return 0;
+	for(i=0;i<nTiles;i++)
+	{
+		uint16_t v = (uint16_t)(i | TilePalIdx[i] << 12);
+		uint8_t Entry[2] = {(uint8_t)v, (uint8_t)(v >> 8)};
+		fwrite(Entry, 1, 2, File);
+	}
+	return CloseFile(File);
+}
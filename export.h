@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include "colourspace.h"
+
+//! Write tile pixel data in tile order, packed at 4 or 8 bits per pixel
+//! NOTE: PxData holds full palette indices (PalIdx*MaxPalSize + PalCol);
+//! at 4bpp, only PalCol is stored (low nibble first), so MaxPalSize<=16
+int Export_Tiles(const char *Filename, const uint8_t *PxData, int ImgW, int ImgH, int TileW, int TileH, int MaxPalSize, int BitsPerPx);
+
+//! Write the palette in the target bit layout
+//! NOTE: Channels are packed R,G,B,A from the LSB up, with the widths
+//! given by BitRange (eg. 5551 gives BGR555 plus an alpha bit), and
+//! stored little-endian in as few bytes as fit
+int Export_Palette(const char *Filename, const struct BGRA8_t *Palette, int nColours, const struct BGRA8_t *BitRange);
+
+//! Read a palette written by Export_Palette() with the same BitRange
+//! NOTE: Channels with no bits read as 0 (or 255 for alpha)
+//! NOTE: Returns the number of colours read (up to MaxColours), or 0 on failure
+int Export_ReadPalette(const char *Filename, struct BGRA8_t *Palette, int MaxColours, const struct BGRA8_t *BitRange);
+
+//! Write the tilemap as 16-bit GBA/NDS-style entries
+//! NOTE: Bits 0-9 hold the tile index and bits 12-15 the palette index
+int Export_Tilemap(const char *Filename, const int32_t *TilePalIdx, int nTiles, int MaxTilePals);
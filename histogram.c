@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "colourspace.h"
+#include "histogram.h"
+#include "mem.h"
+
+#define HIST_MIN_CAPACITY 256
+
+static inline uint32_t PackColour(struct BGRA8_t Col, int Shift)
+{
+	return (uint32_t)(Col.b >> Shift)       |
+	       (uint32_t)(Col.g >> Shift) <<  8 |
+	       (uint32_t)(Col.r >> Shift) << 16 |
+	       (uint32_t)(Col.a >> Shift) << 24 ;
+}
+
+static inline uint32_t HashKey(uint32_t Key)
+{
+	Key ^= Key >> 16; Key *= 0x7FEB352Du;
+	Key ^= Key >> 15; Key *= 0x846CA68Bu;
+	Key ^= Key >> 16;
+	return Key;
+}
+
+static void InsertKey(struct ColourHist_t *Hist, uint32_t Key, uint32_t Count)
+{
+	uint32_t Mask = Hist->Capacity - 1;
+	uint32_t Slot = HashKey(Key) & Mask;
+	for(;;)
+	{
+		struct ColourHistEntry_t *e = &Hist->Entries[Slot];
+		if(!e->Count)
+		{
+			e->Key   = Key;
+			e->Count = Count;
+			Hist->nEntries++;
+			return;
+		}
+		if(e->Key == Key)
+		{
+			e->Count = (e->Count > UINT32_MAX - Count) ? UINT32_MAX : e->Count + Count;
+			return;
+		}
+		Slot = (Slot + 1) & Mask;
+	}
+}
+
+//! Rebuild into a new table, optionally dropping more precision
+static int Rehash(struct ColourHist_t *Hist, uint32_t Capacity, int ExtraShift)
+{
+	struct ColourHistEntry_t *Old = Hist->Entries;
+	uint32_t OldCapacity = Hist->Capacity;
+
+	Hist->Entries = Mem_Calloc(Capacity, sizeof(struct ColourHistEntry_t));
+	if(!Hist->Entries)
+	{
+		Hist->Entries = Old;
+		return 0;
+	}
+	Hist->Capacity = Capacity;
+	Hist->nEntries = 0;
+	Hist->Shift   += ExtraShift;
+
+	uint32_t i, m = (0xFFu >> ExtraShift) * 0x01010101u;
+	for(i=0;i<OldCapacity;i++) if(Old[i].Count)
+	{
+		InsertKey(Hist, (Old[i].Key >> ExtraShift) & m, Old[i].Count);
+	}
+	Mem_Free(Old);
+	return 1;
+}
+
+int ColourHist_Init(struct ColourHist_t *Hist, uint32_t MaxEntries)
+{
+	Hist->nEntries   = 0;
+	Hist->Capacity   = HIST_MIN_CAPACITY;
+	Hist->MaxEntries = MaxEntries < HIST_MIN_CAPACITY/2 ? HIST_MIN_CAPACITY/2 : MaxEntries;
+	Hist->Shift      = 0;
+	Hist->Entries    = Mem_Calloc(Hist->Capacity, sizeof(struct ColourHistEntry_t));
+	return Hist->Entries != NULL;
+}
+
+void ColourHist_Destroy(struct ColourHist_t *Hist)
+{
+	Mem_Free(Hist->Entries);
+	memset(Hist, 0, sizeof(*Hist));
+}
+
+int ColourHist_Add(struct ColourHist_t *Hist, struct BGRA8_t Col, uint32_t Count)
+{
+	if(!Count) return 1;
+
+	//! Keep the load factor under 1/2; once at the limit, drop a bit of
+	//! precision from each channel instead (which merges up to 16 colours
+	//! into one, and never adds any, so the table needn't grow)
+	if(Hist->nEntries >= Hist->Capacity/2)
+	{
+		int Ok;
+		if(Hist->nEntries >= Hist->MaxEntries && Hist->Shift < 7)
+			Ok = Rehash(Hist, Hist->Capacity, 1);
+		else
+			Ok = Rehash(Hist, Hist->Capacity*2, 0);
+		if(!Ok) return 0;
+	}
+
+	InsertKey(Hist, PackColour(Col, Hist->Shift), Count);
+	return 1;
+}
+
+struct BGRA8_t ColourHist_Colour(const struct ColourHist_t *Hist, uint32_t Slot)
+{
+	return ColourHist_KeyColour(Hist->Entries[Slot].Key, Hist->Shift);
+}
+
+struct BGRA8_t ColourHist_KeyColour(uint32_t Key, int Shift)
+{
+	//! Reconstruct at the centre of the reduced colour's range
+	uint32_t Half = Shift ? (1u << (Shift-1)) : 0;
+	struct BGRA8_t Col;
+	Col.b = (( Key        & 0xFF) << Shift) + Half;
+	Col.g = (((Key >>  8) & 0xFF) << Shift) + Half;
+	Col.r = (((Key >> 16) & 0xFF) << Shift) + Half;
+	Col.a = (((Key >> 24) & 0xFF) << Shift) + Half;
+	return Col;
+}
+
+int ColourHist_Merge(struct ColourHist_t *Dst, const struct ColourHist_t *Src)
+{
+	uint32_t i;
+	for(i=0;i<Src->Capacity;i++) if(Src->Entries[i].Count)
+	{
+		if(!ColourHist_Add(Dst, ColourHist_Colour(Src, i), Src->Entries[i].Count))
+			return 0;
+	}
+	return 1;
+}
+
+int ColourHist_ToData(const struct ColourHist_t *Hist, struct BGRAf_t *Data, uint32_t *Weights)
+{
+	uint32_t i;
+	int n = 0;
+	for(i=0;i<Hist->Capacity;i++) if(Hist->Entries[i].Count)
+	{
+		struct BGRA8_t Col = ColourHist_Colour(Hist, i);
+		struct BGRAf_t Px  = BGRAf_FromBGRA8(&Col);
+		Data[n]    = BGRAf_AsYCoCg(&Px);
+		Weights[n] = Hist->Entries[i].Count;
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include "colourspace.h"
+
+struct ColourHistEntry_t
+{
+	uint32_t Key;   //! Packed BGRA8 colour, reduced by Shift bits per channel
+	uint32_t Count;
+};
+
+struct ColourHist_t
+{
+	uint32_t nEntries;
+	uint32_t Capacity;   //! Number of slots (power of two)
+	uint32_t MaxEntries; //! Precision is dropped once this is exceeded
+	int      Shift;      //! Bits dropped from each channel
+	struct ColourHistEntry_t *Entries;
+};
+
+//! Create an empty histogram
+//! NOTE: Memory use is bounded by MaxEntries distinct colours
+int ColourHist_Init(struct ColourHist_t *Hist, uint32_t MaxEntries);
+void ColourHist_Destroy(struct ColourHist_t *Hist);
+
+//! Add Count occurrences of a colour
+int ColourHist_Add(struct ColourHist_t *Hist, struct BGRA8_t Col, uint32_t Count);
+
+//! Get the colour represented by a slot
+//! NOTE: Empty slots have a Count of 0
+struct BGRA8_t ColourHist_Colour(const struct ColourHist_t *Hist, uint32_t Slot);
+
+//! Get the colour represented by a key at a given precision
+struct BGRA8_t ColourHist_KeyColour(uint32_t Key, int Shift);
+
+//! Add every colour of Src to Dst
+//! NOTE: Colours from a coarser Src are added at the centre of their range
+int ColourHist_Merge(struct ColourHist_t *Dst, const struct ColourHist_t *Src);
+
+//! Export the histogram as weighted YCoCg data for quantization
+//! NOTE: Data and Weights need nEntries entries; returns the number written
+int ColourHist_ToData(const struct ColourHist_t *Hist, struct BGRAf_t *Data, uint32_t *Weights);
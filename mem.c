@@ -0,0 +1,96 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+//! Each allocation is prefixed by its size, padded to keep alignment
+#define MEM_HEADER_SIZE sizeof(max_align_t)
+
+static atomic_size_t MemCurrent;
+static atomic_size_t MemPeak;
+
+void Mem_Track(size_t Size)
+{
+	size_t Now  = atomic_fetch_add(&MemCurrent, Size) + Size;
+	size_t Peak = atomic_load(&MemPeak);
+	while(Now > Peak && !atomic_compare_exchange_weak(&MemPeak, &Peak, Now));
+}
+
+void Mem_Untrack(size_t Size)
+{
+	atomic_fetch_sub(&MemCurrent, Size);
+}
+
+void *Mem_Alloc(size_t Size)
+{
+	if(Size > (size_t)-1 - MEM_HEADER_SIZE) return NULL;
+	unsigned char *p = malloc(MEM_HEADER_SIZE + Size); if(!p) return NULL;
+	memcpy(p, &Size, sizeof(Size));
+	Mem_Track(Size);
+	return p + MEM_HEADER_SIZE;
+}
+
+void *Mem_Calloc(size_t n, size_t Size)
+{
+	if(Size && n > (size_t)-1 / Size) return NULL;
+	void *p = Mem_Alloc(n * Size); if(!p) return NULL;
+	memset(p, 0, n * Size);
+	return p;
+}
+
+void *Mem_Realloc(void *p, size_t Size)
+{
+	if(!p) return Mem_Alloc(Size);
+	if(Size > (size_t)-1 - MEM_HEADER_SIZE) return NULL;
+
+	size_t OldSize;
+	unsigned char *Base = (unsigned char*)p - MEM_HEADER_SIZE;
+	memcpy(&OldSize, Base, sizeof(OldSize));
+	Base = realloc(Base, MEM_HEADER_SIZE + Size); if(!Base) return NULL;
+	memcpy(Base, &Size, sizeof(Size));
+	Mem_Untrack(OldSize);
+	Mem_Track(Size);
+	return Base + MEM_HEADER_SIZE;
+}
+
+void Mem_Free(void *p)
+{
+	if(!p) return;
+
+	size_t Size;
+	unsigned char *Base = (unsigned char*)p - MEM_HEADER_SIZE;
+	memcpy(&Size, Base, sizeof(Size));
+	Mem_Untrack(Size);
+	free(Base);
+}
+
+size_t Mem_Current(void)
+{
+	return atomic_load(&MemCurrent);
+}
+
+size_t Mem_Peak(void)
+{
+	return atomic_load(&MemPeak);
+}
+
+size_t Mem_ParseSize(const char *Str)
+{
+	char *End;
+	double Value = strtod(Str, &End);
+	if(End == Str || Value <= 0.0) return 0;
+
+	double Scale = 1024.0*1024.0;
+	switch(*End)
+	{
+		case 'k': case 'K': Scale = 1024.0;                      End++; break;
+		case 'm': case 'M': Scale = 1024.0*1024.0;               End++; break;
+		case 'g': case 'G': Scale = 1024.0*1024.0*1024.0;        End++; break;
+		case 'b': case 'B': Scale = 1.0;                         End++; break;
+	}
+	if(*End == 'i' || *End == 'I') End++;
+	if(*End == 'b' || *End == 'B') End++;
+	if(*End) return 0;
+	return (size_t)(Value * Scale);
+}
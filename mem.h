@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+//! Tracked allocations, for reporting and budgeting memory use
+//! NOTE: Memory from Mem_Alloc()/Mem_Calloc()/Mem_Realloc() must be
+//! released with Mem_Free(); all functions are thread-safe
+void *Mem_Alloc(size_t Size);
+void *Mem_Calloc(size_t n, size_t Size);
+void *Mem_Realloc(void *p, size_t Size);
+void  Mem_Free(void *p);
+
+//! Account for memory not allocated through Mem_*() (eg. file mappings)
+void Mem_Track(size_t Size);
+void Mem_Untrack(size_t Size);
+
+//! Get the memory currently in use, and the most in use at once
+size_t Mem_Current(void);
+size_t Mem_Peak(void);
+
+//! Parse a size such as "512M" (K/M/G suffixes; no suffix means MiB)
+//! NOTE: Returns 0 if the string is not a valid size
+size_t Mem_ParseSize(const char *Str);
@@ -0,0 +1,729 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "export.h"
+#include "mem.h"
+#include "process.h"
+#include "qualetize.h"
+#include "quantize.h"
+#include "stream.h"
+#include "tiles.h"
+
+void Process_DefaultOpts(struct ProcessOpts_t *Opts)
+{
+	Opts->nPalettes                = 16;
+	Opts->nColoursPerPalette       = 16;
+	Opts->nUnusedColoursPerPalette = 1;
+	Opts->TileW                    = 8;
+	Opts->TileH                    = 8;
+	Opts->BitRange                 = (struct BGRA8_t){0x1F,0x1F,0x1F,0x01};
+	Opts->DitherMode               = DITHER_FLOYDSTEINBERG;
+	Opts->DitherLevel              = 1.0f;
+	Opts->OrderColours             = false;
+	Opts->FixedPalette             = NULL;
+	Opts->IntegerMode              = false;
+	Opts->CoarseFactor             = 1;
+	Opts->TimeBudget               = 0;
+	Opts->ReassignPasses           = 0;
+	Opts->AlphaThreshold           = 0;
+	Opts->ExactTiles               = false;
+}
+
+int Process_LoadPalette(struct ProcessOpts_t *Opts, struct BGRA8_t *Palette, const char *Filename)
+{
+	int nColours;
+	size_t Len = strlen(Filename);
+	if(Len >= 4 && (!strcmp(Filename+Len-4, ".bmp") || !strcmp(Filename+Len-4, ".BMP")))
+	{
+		struct BmpCtx_t Bmp;
+		if(!BmpCtx_FromFile(&Bmp, Filename)) return 0;
+		if(!Bmp.ColPal)
+		{
+			BmpCtx_Destroy(&Bmp);
+			return 0;
+		}
+		memcpy(Palette, Bmp.ColPal, BMP_PALETTE_COLOURS*sizeof(struct BGRA8_t));
+		BmpCtx_Destroy(&Bmp);
+		nColours = BMP_PALETTE_COLOURS;
+	}
+	else nColours = Export_ReadPalette(Filename, Palette, BMP_PALETTE_COLOURS, &Opts->BitRange);
+
+	int nPalettes = nColours / Opts->nColoursPerPalette;
+	if(nPalettes < 1) return 0;
+	if(Opts->nPalettes > nPalettes) Opts->nPalettes = nPalettes;
+	Opts->FixedPalette = Palette;
+	return 1;
+}
+
+static void Process_ImageFixed(const struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct TilesData_t *TilesData, uint8_t *PxData, struct BGRAf_t *Palette, struct BGRAf_t *RMSE)
+{
+	int i;
+	int ImgW = Image->Width;
+	int ImgH = Image->Height;
+	int nColours = Opts->nPalettes * Opts->nColoursPerPalette;
+	for(i=0;i<nColours;i++)
+	{
+		struct BGRAf_t p = BGRAf_FromBGRA8(&Opts->FixedPalette[i]);
+		Palette[i] = BGRAf_AsYCoCg(&p);
+	}
+
+	Qualetize_AssignPalettes(TilesData, Palette, Opts->nPalettes, Opts->nColoursPerPalette, Opts->nUnusedColoursPerPalette);
+
+	struct YCoCg16_t Palette16[BMP_PALETTE_COLOURS];
+	for(i=0;i<nColours;i++) Palette16[i] = YCoCg16_FromBGRA8(&Opts->FixedPalette[i]);
+
+	struct BGRAf_t PaletteSpread[BMP_PALETTE_COLOURS];
+	if(DITHER_IS_ORDERED(Opts->DitherMode))
+		Qualetize_PaletteSpread(Palette, PaletteSpread, Opts->nPalettes, Opts->nColoursPerPalette, Opts->nUnusedColoursPerPalette, Opts->DitherLevel);
+
+	struct BGRAf_t *PxDiffuse = TilesData->PxTemp;
+	for(i=0; i<ImgW*2; i++) PxDiffuse[i] = (struct BGRAf_t){0,0,0,0};
+	struct BGRAf_t SqErr = (struct BGRAf_t){0,0,0,0};
+	Qualetize_RemapRows(
+		Image->ColPal ? Image->ColPal : Image->PxBGR,
+		Image->ColPal ? Image->PxIdx  : NULL,
+		PxData,
+		ImgW,
+		ImgH,
+		0,
+		ImgH,
+		TilesData->TileW,
+		TilesData->TileH,
+		TilesData->TilePalIdx,
+		NULL,
+		Palette,
+		Opts->IntegerMode ? Palette16 : NULL,
+		PaletteSpread,
+		Opts->nColoursPerPalette,
+		Opts->nUnusedColoursPerPalette,
+		TilesData->AlphaThreshold,
+		Opts->DitherMode,
+		Opts->DitherLevel,
+		PxDiffuse,
+		&SqErr
+	);
+
+	//! Output the bank exactly as given
+	struct BGRA8_t *PalBGR = (struct BGRA8_t*)Palette;
+	for(i=0;i<BMP_PALETTE_COLOURS;i++) PalBGR[i] = (i < nColours) ? Opts->FixedPalette[i] : (struct BGRA8_t){0,0,0,0};
+
+	SqErr = BGRAf_Divi(&SqErr, (float)ImgW*ImgH);
+	*RMSE = BGRAf_Sqrt(&SqErr);
+}
+
+//! Quantize an image whose tile data has been prepared, storing the
+//! indexed result to Out (which may be Image)
+static int Process_Tiles(const struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct TilesData_t *TilesData, double Start, struct BmpCtx_t *Out, struct BGRAf_t *RMSE)
+{
+	uint8_t *PxData = Mem_Alloc((size_t)Image->Width * Image->Height * sizeof(uint8_t));
+	struct BGRAf_t* Palette = Mem_Calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
+
+	if(!PxData || !Palette)
+	{
+		Mem_Free(Palette);
+		Mem_Free(PxData);
+		return PROCESS_ERR_MEMORY;
+	}
+	TilesData->CoarseFactor   = Opts->CoarseFactor;
+	TilesData->ReassignPasses = Opts->ReassignPasses;
+	TilesData->AlphaThreshold = Opts->AlphaThreshold;
+	TilesData->ExactTiles     = Opts->ExactTiles;
+	if(Opts->TimeBudget > 0) TilesData->Deadline = Start + Opts->TimeBudget*(1.0 - PROCESS_REMAP_BUDGET_SHARE)/1000.0;
+
+	if(Opts->FixedPalette) Process_ImageFixed(Image, Opts, TilesData, PxData, Palette, RMSE);
+	else *RMSE = Qualetize
+	(
+		(struct BmpCtx_t*)Image, //! Only read, as the image isn't replaced here
+		TilesData,
+		PxData,
+		Palette,
+		Opts->nPalettes,
+		Opts->nColoursPerPalette,
+		Opts->nUnusedColoursPerPalette,
+		&Opts->BitRange,
+		Opts->DitherMode,
+		Opts->DitherLevel,
+		0,
+		Opts->OrderColours
+	);
+
+	//! Both paths leave the output palette in Palette
+	BmpCtx_SetIndexed(Out, (struct BGRA8_t*)Palette, PxData);
+	return PROCESS_OK;
+}
+
+int Process_Image(struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct BGRAf_t *RMSE, struct TilesData_t **TilesDataOut)
+{
+	if(Image->Width%Opts->TileW || Image->Height%Opts->TileH)
+		return PROCESS_ERR_TILESIZE;
+
+	double Start = QuantCluster_Time();
+	struct TilesData_t* TilesData = TilesData_FromBitmap(Image, Opts->TileW, Opts->TileH, Opts->IntegerMode);
+	if(!TilesData)
+		return PROCESS_ERR_MEMORY;
+
+	int Error = Process_Tiles(Image, Opts, TilesData, Start, Image, RMSE);
+	if(Error == PROCESS_OK && TilesDataOut) *TilesDataOut = TilesData;
+	else Mem_Free(TilesData);
+	return Error;
+}
+
+int Process_ImageShared(const struct BmpCtx_t *Image, const struct TilesData_t *Tiles, const struct ProcessOpts_t *Opts, struct BmpCtx_t *Out, struct BGRAf_t *RMSE, struct TilesData_t **TilesDataOut)
+{
+	if(Image->Width%Opts->TileW || Image->Height%Opts->TileH)
+		return PROCESS_ERR_TILESIZE;
+
+	double Start = QuantCluster_Time();
+	struct TilesData_t* TilesData = TilesData_Share(Tiles, Opts->IntegerMode);
+	if(!TilesData)
+		return PROCESS_ERR_MEMORY;
+
+	memset(Out, 0, sizeof(*Out));
+	Out->Width  = Image->Width;
+	Out->Height = Image->Height;
+	int Error = Process_Tiles(Image, Opts, TilesData, Start, Out, RMSE);
+	if(Error == PROCESS_OK && TilesDataOut) *TilesDataOut = TilesData;
+	else Mem_Free(TilesData);
+	return Error;
+}
+
+void Process_WorkInit(struct ProcessWork_t *Work)
+{
+	memset(Work, 0, sizeof(*Work));
+}
+
+void Process_WorkDestroy(struct ProcessWork_t *Work)
+{
+	Mem_Free(Work->TilesBuf);
+	memset(Work, 0, sizeof(*Work));
+}
+
+int Process_ImageWork(struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct ProcessWork_t *Work, struct BGRAf_t *RMSE, struct TilesData_t **TilesDataOut)
+{
+	if(Image->Width%Opts->TileW || Image->Height%Opts->TileH)
+		return PROCESS_ERR_TILESIZE;
+
+	//! The buffer only grows, so similar images reuse the same pages
+	double Start = QuantCluster_Time();
+	size_t Size = TilesData_MemorySize(Image->Width, Image->Height, Opts->TileW, Opts->TileH, Opts->IntegerMode);
+	if(Size > Work->TilesBufSize)
+	{
+		Mem_Free(Work->TilesBuf);
+		Work->TilesBuf     = Mem_Alloc(Size);
+		Work->TilesBufSize = Work->TilesBuf ? Size : 0;
+		if(!Work->TilesBuf)
+			return PROCESS_ERR_MEMORY;
+	}
+	struct TilesData_t* TilesData = TilesData_FromBitmapBuffer(Work->TilesBuf, Image, Opts->TileW, Opts->TileH, Opts->IntegerMode);
+
+	int Error = Process_Tiles(Image, Opts, TilesData, Start, Image, RMSE);
+	if(TilesDataOut) *TilesDataOut = (Error == PROCESS_OK) ? TilesData : NULL;
+	return Error;
+}
+
+void Process_SeqInit(struct ProcessSeq_t *Seq)
+{
+	memset(Seq, 0, sizeof(*Seq));
+}
+
+void Process_SeqDestroy(struct ProcessSeq_t *Seq)
+{
+	Mem_Free(Seq->PxSrc);
+	Mem_Free(Seq->PxIdx);
+	Mem_Free(Seq->TilePalIdx);
+	Mem_Free(Seq->TileKeep);
+	Process_SeqInit(Seq);
+}
+
+static inline struct BGRA8_t GetPixel(const struct BmpCtx_t *Image, size_t Idx)
+{
+	return Image->ColPal ? Image->ColPal[Image->PxIdx[Idx]] : Image->PxBGR[Idx];
+}
+
+static int TileUnchanged(const struct BmpCtx_t *Image, const struct BGRA8_t *PxPrev, int tx, int ty, int TileW, int TileH)
+{
+	int x, y;
+	for(y=ty*TileH; y<(ty+1)*TileH; y++) for(x=tx*TileW; x<(tx+1)*TileW; x++)
+	{
+		size_t Idx = (size_t)y*Image->Width + x;
+		struct BGRA8_t p = GetPixel(Image, Idx);
+		if(memcmp(&p, &PxPrev[Idx], sizeof(p))) return 0;
+	}
+	return 1;
+}
+
+int Process_Frame(struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct ProcessSeq_t *Seq, struct BGRAf_t *RMSE)
+{
+	int i, tx, ty, y;
+	size_t n;
+	if(Image->Width%Opts->TileW || Image->Height%Opts->TileH)
+		return PROCESS_ERR_TILESIZE;
+
+	int ImgW = Image->Width;
+	int ImgH = Image->Height;
+	int TileW = Opts->TileW, TilesX = ImgW / Opts->TileW;
+	int TileH = Opts->TileH, TilesY = ImgH / Opts->TileH;
+	int MaxPalSize = Opts->nColoursPerPalette;
+	size_t nPx = (size_t)ImgW * ImgH;
+	size_t nTiles = (size_t)TilesX * TilesY;
+
+	//! Restart the sequence if the frame size changes
+	if(Seq->Width != ImgW || Seq->Height != ImgH)
+	{
+		Process_SeqDestroy(Seq);
+		Seq->Width      = ImgW;
+		Seq->Height     = ImgH;
+		Seq->PxSrc      = Mem_Alloc(nPx    * sizeof(struct BGRA8_t));
+		Seq->PxIdx      = Mem_Alloc(nPx    * sizeof(uint8_t));
+		Seq->TilePalIdx = Mem_Alloc(nTiles * sizeof(int32_t));
+		Seq->TileKeep   = Mem_Alloc(nTiles * sizeof(uint8_t));
+		if(!Seq->PxSrc || !Seq->PxIdx || !Seq->TilePalIdx || !Seq->TileKeep)
+		{
+			Process_SeqDestroy(Seq);
+			return PROCESS_ERR_MEMORY;
+		}
+	}
+	int Seeded = (Seq->nFrames > 0);
+
+	struct TilesData_t* TilesData = TilesData_FromBitmap(Image, TileW, TileH, 0);
+	uint8_t *PxData = Mem_Alloc(nPx * sizeof(uint8_t));
+	struct BGRAf_t* Palette = Mem_Calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
+	if(!TilesData || !PxData || !Palette)
+	{
+		Mem_Free(Palette);
+		Mem_Free(PxData);
+		Mem_Free(TilesData);
+		return PROCESS_ERR_MEMORY;
+	}
+	TilesData->CoarseFactor   = Opts->CoarseFactor;
+	TilesData->AlphaThreshold = Opts->AlphaThreshold;
+
+	for(ty=0;ty<TilesY;ty++) for(tx=0;tx<TilesX;tx++)
+	{
+		Seq->TileKeep[ty*TilesX+tx] = Seeded && TileUnchanged(Image, Seq->PxSrc, tx, ty, TileW, TileH);
+	}
+
+	//! Unchanged tiles stay on their palette, so that it is fitted to them
+	if(Seeded) memcpy(Palette, Seq->Centroids, sizeof(Seq->Centroids));
+	int Ok = TilesData_QuantizeTiles(TilesData, Seq->TileCentroids, Opts->nPalettes, Seeded);
+	if(Ok)
+	{
+		for(n=0;n<nTiles;n++) if(Seq->TileKeep[n]) TilesData->TilePalIdx[n] = Seq->TilePalIdx[n];
+		Ok = TilesData_QuantizeColours(TilesData, Palette, Opts->nPalettes, MaxPalSize, Opts->nUnusedColoursPerPalette, Seeded, NULL);
+	}
+	if(!Ok)
+	{
+		Mem_Free(Palette);
+		Mem_Free(PxData);
+		Mem_Free(TilesData);
+		return PROCESS_ERR_MEMORY;
+	}
+	memcpy(Seq->Centroids, Palette, sizeof(Seq->Centroids));
+
+	struct BGRAf_t PaletteSpread[BMP_PALETTE_COLOURS];
+	Qualetize_PreparePalettes(Palette, PaletteSpread, Opts->nPalettes, MaxPalSize, Opts->nUnusedColoursPerPalette, &Opts->BitRange, Opts->DitherMode, Opts->DitherLevel, Opts->OrderColours);
+
+	struct BGRA8_t ColPal[BMP_PALETTE_COLOURS];
+	for(i=0; i<BMP_PALETTE_COLOURS; i++)
+	{
+		struct BGRAf_t x = BGRAf_FromYCoCg(&Palette[i]);
+		ColPal[i] = BGRA8_FromBGRAf(&x);
+	}
+
+	//! Previous indices are only valid if their palette came out the same
+	Seq->nTilesKept = 0;
+	for(ty=0;ty<TilesY;ty++) for(tx=0;tx<TilesX;tx++)
+	{
+		uint8_t *Keep = &Seq->TileKeep[ty*TilesX+tx];
+		if(!*Keep) continue;
+
+		int PalIdx = TilesData->TilePalIdx[ty*TilesX+tx];
+		if(memcmp(&ColPal[PalIdx*MaxPalSize], &Seq->ColPal[PalIdx*MaxPalSize], MaxPalSize*sizeof(struct BGRA8_t)))
+		{
+			*Keep = 0;
+			continue;
+		}
+		for(y=ty*TileH; y<(ty+1)*TileH; y++)
+		{
+			size_t Offs = (size_t)y*ImgW + tx*TileW;
+			memcpy(PxData + Offs, Seq->PxIdx + Offs, TileW);
+		}
+		Seq->nTilesKept++;
+	}
+
+	struct BGRAf_t *PxDiffuse = TilesData->PxTemp;
+	for(i=0; i<ImgW*2; i++) PxDiffuse[i] = (struct BGRAf_t){0,0,0,0};
+	struct BGRAf_t SqErr = (struct BGRAf_t){0,0,0,0};
+	Qualetize_RemapRows(
+		Image->ColPal ? Image->ColPal : Image->PxBGR,
+		Image->ColPal ? Image->PxIdx  : NULL,
+		PxData,
+		ImgW,
+		ImgH,
+		0,
+		ImgH,
+		TileW,
+		TileH,
+		TilesData->TilePalIdx,
+		Seq->TileKeep,
+		Palette,
+		NULL,
+		PaletteSpread,
+		MaxPalSize,
+		Opts->nUnusedColoursPerPalette,
+		TilesData->AlphaThreshold,
+		Opts->DitherMode,
+		Opts->DitherLevel,
+		PxDiffuse,
+		&SqErr
+	);
+
+	memcpy(Seq->TilePalIdx, TilesData->TilePalIdx, nTiles * sizeof(int32_t));
+	for(n=0;n<nPx;n++) Seq->PxSrc[n] = GetPixel(Image, n);
+	memcpy(Seq->PxIdx, PxData, nPx);
+	memcpy(Seq->ColPal, ColPal, sizeof(ColPal));
+	Seq->nFrames++;
+	Mem_Free(TilesData);
+
+	struct BGRA8_t *PalBGR = (struct BGRA8_t*)Palette;
+	memcpy(PalBGR, ColPal, sizeof(ColPal));
+	BmpCtx_SetIndexed(Image, PalBGR, PxData);
+
+	SqErr = BGRAf_Divi(&SqErr, (float)ImgW*ImgH);
+	*RMSE = BGRAf_Sqrt(&SqErr);
+	return PROCESS_OK;
+}
+
+static int TilesDiffer(const struct BmpCtx_t *Image, const struct BmpCtx_t *PrevSrc, int tx, int ty, int TileW, int TileH)
+{
+	int x, y;
+	for(y=ty*TileH; y<(ty+1)*TileH; y++) for(x=tx*TileW; x<(tx+1)*TileW; x++)
+	{
+		size_t Idx = (size_t)y*Image->Width + x;
+		struct BGRA8_t a = GetPixel(Image, Idx), b = GetPixel(PrevSrc, Idx);
+		if(memcmp(&a, &b, sizeof(a))) return 1;
+	}
+	return 0;
+}
+
+//! Get the palette that a tile of an indexed image uses, if it only uses
+//! entries of one of nPalettes palettes of MaxPalSize colours (else -1)
+static int TileBankPalette(const struct BmpCtx_t *Image, int tx, int ty, int TileW, int TileH, int nPalettes, int MaxPalSize)
+{
+	int x, y;
+	int PalIdx = Image->PxIdx[(size_t)ty*TileH*Image->Width + tx*TileW] / MaxPalSize;
+	if(PalIdx >= nPalettes) return -1;
+	for(y=ty*TileH; y<(ty+1)*TileH; y++) for(x=tx*TileW; x<(tx+1)*TileW; x++)
+	{
+		if(Image->PxIdx[(size_t)y*Image->Width + x] / MaxPalSize != PalIdx) return -1;
+	}
+	return PalIdx;
+}
+
+//! Re-fit the palette entries that no unchanged tile uses to the pixels
+//! of the changed tiles on that palette (k-means over those entries only)
+static void Process_UpdateRefine(
+	const struct BmpCtx_t *Prev,
+	const struct ProcessOpts_t *Opts,
+	const int32_t *DirtyTiles,
+	const int32_t *DirtyPal,
+	int nDirty,
+	const struct BGRAf_t *TilePx,
+	struct BGRAf_t *Palette,
+	struct BGRA8_t *ColPal
+) {
+	int i, j, d, p, Pass;
+	size_t n;
+	int ImgW = Prev->Width, ImgH = Prev->Height;
+	int TileW = Opts->TileW, TilesX = ImgW / TileW;
+	int TileH = Opts->TileH;
+	int nPxTile = TileW * TileH;
+	int MaxPalSize = Opts->nColoursPerPalette;
+	int nColours = MaxPalSize - Opts->nUnusedColoursPerPalette;
+
+	//! Entries used by unchanged tiles must not move
+	size_t Used[BMP_PALETTE_COLOURS] = {0};
+	for(n=0; n<(size_t)ImgW*ImgH; n++) Used[Prev->PxIdx[n]]++;
+	for(d=0; d<nDirty; d++)
+	{
+		int tx = DirtyTiles[d] % TilesX, ty = DirtyTiles[d] / TilesX;
+		for(j=0;j<TileH;j++) for(i=0;i<TileW;i++) Used[Prev->PxIdx[(size_t)(ty*TileH+j)*ImgW + tx*TileW+i]]--;
+	}
+
+	for(p=0; p<Opts->nPalettes; p++)
+	{
+		struct BGRAf_t *Pal = Palette + p*MaxPalSize;
+		int nFree = 0;
+		for(j=0;j<nColours;j++) nFree += !Used[p*MaxPalSize+j];
+		if(!nFree) continue;
+
+		for(Pass=0; Pass<MAX_PALETTE_QUANTIZATION_PASSES; Pass++)
+		{
+			struct BGRAf_t Sum[BMP_PALETTE_COLOURS];
+			int   Cnt[BMP_PALETTE_COLOURS];
+			float WorstDst = -1.0f;
+			const struct BGRAf_t *Worst = NULL; //! Pixel furthest from its entry
+			for(j=0;j<nColours;j++) Sum[j] = (struct BGRAf_t){0,0,0,0}, Cnt[j] = 0;
+
+			for(d=0; d<nDirty; d++) if(DirtyPal[d] == p)
+			{
+				const struct BGRAf_t *Px = TilePx + (size_t)d*nPxTile;
+				for(i=0;i<nPxTile;i++)
+				{
+					int   MinIdx = 0;
+					float MinDst = 8.0e37f;
+					for(j=0;j<nColours;j++)
+					{
+						float Dst = BGRAf_ColDistance(&Px[i], &Pal[j]);
+						if(Dst < MinDst) MinIdx = j, MinDst = Dst;
+					}
+					Sum[MinIdx] = BGRAf_Add(&Sum[MinIdx], &Px[i]);
+					Cnt[MinIdx]++;
+					if(MinDst > WorstDst) Worst = &Px[i], WorstDst = MinDst;
+				}
+			}
+			if(!Worst) break;
+
+			//! An empty entry restarts on the worst-served pixel (one per pass)
+			int Moved = 0, Restarted = 0;
+			for(j=0;j<nColours;j++) if(!Used[p*MaxPalSize+j])
+			{
+				struct BGRAf_t c;
+				if(Cnt[j]) c = BGRAf_Divi(&Sum[j], (float)Cnt[j]);
+				else if(!Restarted++) c = *Worst;
+				else continue;
+				if(memcmp(&c, &Pal[j], sizeof(c))) Pal[j] = c, Moved = 1;
+			}
+			if(!Moved) break;
+		}
+
+		//! Snap to the output bit depth, as for a full quantization
+		for(j=0;j<nColours;j++) if(!Used[p*MaxPalSize+j])
+		{
+			struct BGRAf_t x = BGRAf_FromYCoCg(&Pal[j]);
+			struct BGRA8_t q = BGRA_FromBGRAf(&x, &Opts->BitRange);
+			x = BGRAf_FromBGRA(&q, &Opts->BitRange);
+			ColPal[p*MaxPalSize+j] = BGRA8_FromBGRAf(&x);
+			x = BGRAf_FromBGRA8(&ColPal[p*MaxPalSize+j]);
+			Pal[j] = BGRAf_AsYCoCg(&x);
+		}
+	}
+}
+
+int Process_Update(struct BmpCtx_t *Image, const struct BmpCtx_t *Prev, const struct BmpCtx_t *PrevSrc, const struct ProcessRect_t *Dirty, bool Refine, const struct ProcessOpts_t *Opts, struct BGRAf_t *RMSE, int32_t **TilePalIdx, int *nUpdated)
+{
+	int i, d, tx, ty, x, y;
+	size_t n;
+	if(Image->Width%Opts->TileW || Image->Height%Opts->TileH)
+		return PROCESS_ERR_TILESIZE;
+	if(!Prev->ColPal || Prev->Width != Image->Width || Prev->Height != Image->Height ||
+	   (PrevSrc && (PrevSrc->Width != Image->Width || PrevSrc->Height != Image->Height)))
+		return PROCESS_ERR_PREVIOUS;
+
+	int ImgW = Image->Width;
+	int ImgH = Image->Height;
+	int TileW = Opts->TileW, TilesX = ImgW / Opts->TileW;
+	int TileH = Opts->TileH, TilesY = ImgH / Opts->TileH;
+	int nPxTile = TileW * TileH;
+	int MaxPalSize = Opts->nColoursPerPalette;
+	size_t nPx = (size_t)ImgW * ImgH;
+	size_t nTiles = (size_t)TilesX * TilesY;
+
+	int32_t *DirtyTiles = Mem_Alloc(nTiles * sizeof(int32_t));
+	if(!DirtyTiles)
+		return PROCESS_ERR_MEMORY;
+
+	//! Finding the changed tiles is the only pass over the whole image
+	//! NOTE: This also checks that Prev was made with the same palette
+	//! layout, since its palettes are taken from that: every tile must lie
+	//! in one palette, and palettes no tile uses must not be all zero (as
+	//! the entries past the bank that Prev was made with are)
+	int nDirty = 0;
+	uint8_t PalUsed[BMP_PALETTE_COLOURS] = {0};
+	for(ty=0;ty<TilesY;ty++) for(tx=0;tx<TilesX;tx++)
+	{
+		int PalIdx = TileBankPalette(Prev, tx, ty, TileW, TileH, Opts->nPalettes, MaxPalSize);
+		if(PalIdx < 0)
+		{
+			Mem_Free(DirtyTiles);
+			return PROCESS_ERR_PREVIOUS;
+		}
+		PalUsed[PalIdx] = 1;
+
+		int IsDirty = Dirty &&
+			tx*TileW < Dirty->x + Dirty->w && (tx+1)*TileW > Dirty->x &&
+			ty*TileH < Dirty->y + Dirty->h && (ty+1)*TileH > Dirty->y;
+		if(!IsDirty && PrevSrc) IsDirty = TilesDiffer(Image, PrevSrc, tx, ty, TileW, TileH);
+		if(IsDirty) DirtyTiles[nDirty++] = ty*TilesX + tx;
+	}
+	for(i=0;i<Opts->nPalettes;i++) if(!PalUsed[i])
+	{
+		static const struct BGRA8_t Zero[BMP_PALETTE_COLOURS];
+		if(!memcmp(Prev->ColPal + i*MaxPalSize, Zero, MaxPalSize * sizeof(struct BGRA8_t)))
+		{
+			Mem_Free(DirtyTiles);
+			return PROCESS_ERR_PREVIOUS;
+		}
+	}
+
+	uint8_t        *PxData    = Mem_Alloc(nPx * sizeof(uint8_t));
+	struct BGRA8_t *ColPal    = Mem_Alloc(BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+	struct BGRAf_t *TilePx    = Mem_Alloc((nDirty ? nDirty : 1) * (size_t)nPxTile * sizeof(struct BGRAf_t));
+	int32_t        *DirtyPal  = Mem_Alloc((nDirty ? nDirty : 1) * sizeof(int32_t));
+	struct BGRAf_t *PxDiffuse = Mem_Alloc(TileW*2 * sizeof(struct BGRAf_t));
+	int32_t        *TilePal   = TilePalIdx ? Mem_Alloc(nTiles * sizeof(int32_t)) : NULL;
+	if(!PxData || !ColPal || !TilePx || !DirtyPal || !PxDiffuse || (TilePalIdx && !TilePal))
+	{
+		Mem_Free(TilePal);
+		Mem_Free(PxDiffuse);
+		Mem_Free(DirtyPal);
+		Mem_Free(TilePx);
+		Mem_Free(ColPal);
+		Mem_Free(PxData);
+		Mem_Free(DirtyTiles);
+		return PROCESS_ERR_MEMORY;
+	}
+	memcpy(PxData, Prev->PxIdx,  nPx);
+	memcpy(ColPal, Prev->ColPal, BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t));
+
+	struct BGRAf_t Palette[BMP_PALETTE_COLOURS];
+	for(i=0;i<BMP_PALETTE_COLOURS;i++)
+	{
+		struct BGRAf_t p = BGRAf_FromBGRA8(&ColPal[i]);
+		Palette[i] = BGRAf_AsYCoCg(&p);
+	}
+
+	//! Changed tiles take the best of the existing palettes
+	for(d=0;d<nDirty;d++)
+	{
+		tx = DirtyTiles[d] % TilesX, ty = DirtyTiles[d] / TilesX;
+		struct BGRAf_t *Px = TilePx + (size_t)d*nPxTile;
+		for(y=ty*TileH; y<(ty+1)*TileH; y++) for(x=tx*TileW; x<(tx+1)*TileW; x++)
+		{
+			struct BGRA8_t p = GetPixel(Image, (size_t)y*ImgW + x);
+			struct BGRAf_t c = BGRAf_FromBGRA8(&p);
+			*Px++ = BGRAf_AsYCoCg(&c);
+		}
+		DirtyPal[d] = Qualetize_BestPalette(TilePx + (size_t)d*nPxTile, nPxTile, Palette, Opts->nPalettes, MaxPalSize, Opts->nUnusedColoursPerPalette);
+	}
+	if(Refine) Process_UpdateRefine(Prev, Opts, DirtyTiles, DirtyPal, nDirty, TilePx, Palette, ColPal);
+
+	struct YCoCg16_t Palette16[BMP_PALETTE_COLOURS];
+	if(Opts->IntegerMode) Qualetize_Palette16(Palette16, Palette, BMP_PALETTE_COLOURS);
+	struct BGRAf_t PaletteSpread[BMP_PALETTE_COLOURS];
+	if(DITHER_IS_ORDERED(Opts->DitherMode))
+		Qualetize_PaletteSpread(Palette, PaletteSpread, Opts->nPalettes, MaxPalSize, Opts->nUnusedColoursPerPalette, Opts->DitherLevel);
+
+	struct BGRAf_t SqErr = (struct BGRAf_t){0,0,0,0};
+	for(d=0;d<nDirty;d++)
+	{
+		Qualetize_RemapTile(
+			Image->ColPal ? Image->ColPal : Image->PxBGR,
+			Image->ColPal ? Image->PxIdx  : NULL,
+			PxData,
+			ImgW,
+			DirtyTiles[d] % TilesX,
+			DirtyTiles[d] / TilesX,
+			TileW,
+			TileH,
+			DirtyPal[d],
+			Palette,
+			Opts->IntegerMode ? Palette16 : NULL,
+			PaletteSpread,
+			MaxPalSize,
+			Opts->nUnusedColoursPerPalette,
+			0,
+			Opts->DitherMode,
+			Opts->DitherLevel,
+			PxDiffuse,
+			&SqErr
+		);
+	}
+
+	//! Every index in a tile lies in its palette
+	if(TilePalIdx)
+	{
+		for(n=0;n<nTiles;n++)
+			TilePal[n] = PxData[(n / TilesX)*TileH*(size_t)ImgW + (n % TilesX)*TileW] / MaxPalSize;
+		*TilePalIdx = TilePal;
+	}
+
+	Mem_Free(PxDiffuse);
+	Mem_Free(DirtyPal);
+	Mem_Free(TilePx);
+	Mem_Free(DirtyTiles);
+	BmpCtx_SetIndexed(Image, ColPal, PxData);
+
+	if(nDirty) SqErr = BGRAf_Divi(&SqErr, (float)nDirty*nPxTile);
+	*RMSE = BGRAf_Sqrt(&SqErr);
+	*nUpdated = nDirty;
+	return PROCESS_OK;
+}
+
+size_t Process_EstimateMemory(int Width, int Height, int BitCnt, const struct ProcessOpts_t *Opts)
+{
+	size_t nPx = (size_t)Width * Height;
+	size_t Source = (BitCnt <= 8) ? nPx * sizeof(uint8_t) + BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t) : nPx * sizeof(struct BGRA8_t);
+	return
+		Source +
+		TilesData_MemorySize(Width, Height, Opts->TileW, Opts->TileH, Opts->IntegerMode) +
+		nPx * sizeof(uint8_t) +                        // PxData
+		BMP_PALETTE_COLOURS * sizeof(struct BGRAf_t);  // Palette
+}
+
+int Process_PlanMemory(int Width, int Height, int BitCnt, const struct ProcessOpts_t *Opts, size_t MaxMem, bool CanStream, int *StripTiles, int *HistEntries, size_t *Estimate)
+{
+	int Plan;
+	size_t PlanEstimate[3];
+	struct ProcessOpts_t Compact = *Opts;
+	Compact.IntegerMode = true;
+	PlanEstimate[PROCESS_PLAN_FULL]    = Process_EstimateMemory(Width, Height, BitCnt, Opts);
+	PlanEstimate[PROCESS_PLAN_COMPACT] = Process_EstimateMemory(Width, Height, BitCnt, &Compact);
+	*StripTiles = Stream_PlanStrip(Width, Height, Opts->TileW, Opts->TileH, Opts->nPalettes, Opts->nColoursPerPalette, MaxMem, HistEntries, &PlanEstimate[PROCESS_PLAN_STREAM]);
+
+	//! Take the first plan that fits, or failing that, the smallest
+	int Best = PROCESS_PLAN_FULL;
+	for(Plan=PROCESS_PLAN_FULL;Plan<=PROCESS_PLAN_STREAM;Plan++)
+	{
+		if(Plan == PROCESS_PLAN_COMPACT && Opts->IntegerMode) continue;
+		if(Plan == PROCESS_PLAN_STREAM  && !CanStream) continue;
+		if(PlanEstimate[Plan] <= MaxMem)
+		{
+			Best = Plan;
+			break;
+		}
+		if(PlanEstimate[Plan] < PlanEstimate[Best]) Best = Plan;
+	}
+	*Estimate = PlanEstimate[Best];
+	return Best;
+}
+
+const char *Process_ErrorString(int Error, const struct ProcessOpts_t *Opts)
+{
+	static _Thread_local char Buffer[64];
+	switch(Error)
+	{
+		case PROCESS_OK:
+			return "No error";
+		case PROCESS_ERR_TILESIZE:
+			snprintf(Buffer, sizeof(Buffer), "Image not a multiple of tile size (%dx%d)", Opts->TileW, Opts->TileH);
+			return Buffer;
+		case PROCESS_ERR_MEMORY:
+			return "Out of memory - Image not processed";
+		case PROCESS_ERR_PREVIOUS:
+			return "Previous output does not match the image and options (or is not 8-bit)";
+	}
+	return "Unknown error";
+}
+
+struct BGRAf_t Process_PSNR(struct BGRAf_t RMSE)
+{
+	RMSE.b = -0x1.15F2CFp3f*logf(RMSE.b / 255.0f); //! -20*Log10[RMSE/255] == -20/Log[10] * Log[RMSE/255]
+	RMSE.g = -0x1.15F2CFp3f*logf(RMSE.g / 255.0f);
+	RMSE.r = -0x1.15F2CFp3f*logf(RMSE.r / 255.0f);
+	RMSE.a = -0x1.15F2CFp3f*logf(RMSE.a / 255.0f);
+	return RMSE;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdbool.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "tiles.h"
+
+//! Bump whenever the output for the same input and options changes
+//! (this invalidates cached results)
+#define PROCESS_OUTPUT_VERSION 2
+
+#define PROCESS_OK           0
+#define PROCESS_ERR_TILESIZE 1
+#define PROCESS_ERR_MEMORY   2
+#define PROCESS_ERR_PREVIOUS 3
+
+#define PROCESS_REMAP_BUDGET_SHARE 0.25 //! Share of TimeBudget kept for remapping
+
+#define PROCESS_PLAN_FULL    0 //! Process_Image() as requested
+#define PROCESS_PLAN_COMPACT 1 //! Process_Image() with IntegerMode
+#define PROCESS_PLAN_STREAM  2 //! Stream_Qualetize()
+
+//! Options affecting how an image is processed
+struct ProcessOpts_t
+{
+	int   nPalettes;
+	int   nColoursPerPalette;
+	int   nUnusedColoursPerPalette;
+	int   TileW, TileH;
+	struct BGRA8_t BitRange;
+	int   DitherMode;
+	float DitherLevel;
+	bool  OrderColours;
+	const struct BGRA8_t *FixedPalette; //! Palette bank to remap to instead of quantizing (or NULL)
+	bool  IntegerMode;                  //! Use the integer colour pipeline (not for sequences or streaming)
+	int   CoarseFactor;                 //! Cluster at 1/CoarseFactor resolution before refining (1 = off)
+	int   TimeBudget;                   //! Milliseconds for Process_Image() (0 = none)
+	int   ReassignPasses;               //! Passes moving tiles to the palette with least remap error (0 = off; not for sequences or streaming)
+	int   AlphaThreshold;               //! Pixels with alpha below this take the transparent entry (0 = off)
+	bool  ExactTiles;                   //! Give tiles with few colours exact palettes (not for sequences or streaming)
+};
+
+//! Set default options
+void Process_DefaultOpts(struct ProcessOpts_t *Opts);
+
+//! Quantize an image, replacing it with the indexed result
+//! NOTE: With a FixedPalette, clustering is skipped and each tile just
+//! takes the palette that remaps it with the least error
+//! NOTE: With a TimeBudget, clustering stops early to leave time for the
+//! remap (which always runs in full), and TilesData->TimedOut is set if
+//! that stopped it before convergence
+//! NOTE: If TilesDataOut is not NULL, the tile data (eg. for TilePalIdx)
+//! is stored there and must be Mem_Free()d by the caller
+//! NOTE: Returns PROCESS_OK or PROCESS_ERR_*
+int Process_Image(struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct BGRAf_t *RMSE, struct TilesData_t **TilesDataOut);
+
+//! As Process_Image(), but with the tiles already converted from Image (by
+//! TilesData_FromBitmap(), with the tile size in Opts), and the indexed
+//! result stored to Out instead of replacing Image
+//! NOTE: Image and Tiles are only read, so one conversion can be shared by
+//! several option sets processed at once (eg. for a parameter sweep)
+//! NOTE: If TilesDataOut is not NULL, the tile data (eg. for TilePalIdx)
+//! is stored there and must be Mem_Free()d by the caller
+int Process_ImageShared(const struct BmpCtx_t *Image, const struct TilesData_t *Tiles, const struct ProcessOpts_t *Opts, struct BmpCtx_t *Out, struct BGRAf_t *RMSE, struct TilesData_t **TilesDataOut);
+
+//! Buffers kept between images, so that repeated requests (eg. from a
+//! server) avoid allocating and page-faulting fresh memory each time
+struct ProcessWork_t
+{
+	void  *TilesBuf;
+	size_t TilesBufSize;
+};
+
+void Process_WorkInit(struct ProcessWork_t *Work);
+void Process_WorkDestroy(struct ProcessWork_t *Work);
+
+//! As Process_Image(), with the tile data kept in Work
+//! NOTE: *TilesDataOut (if not NULL) points into Work, and is only valid
+//! until Work is next used
+int Process_ImageWork(struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct ProcessWork_t *Work, struct BGRAf_t *RMSE, struct TilesData_t **TilesDataOut);
+
+//! State carried between the frames of an animation
+struct ProcessSeq_t
+{
+	int nFrames;
+	int Width, Height;
+	int nTilesKept;                                     //! Tiles reused in the last frame
+	struct BGRAf_t  TileCentroids[BMP_PALETTE_COLOURS]; //! Tile palette centroids
+	struct BGRAf_t  Centroids[BMP_PALETTE_COLOURS];     //! Colour centroids (before bit depth reduction)
+	struct BGRA8_t  ColPal[BMP_PALETTE_COLOURS];        //! Final palette
+	struct BGRA8_t *PxSrc;      //! Source pixels
+	uint8_t        *PxIdx;      //! Output pixels
+	int32_t        *TilePalIdx; //! Tile palette indices
+	uint8_t        *TileKeep;   //! Temporary (tiles to reuse)
+};
+
+//! Start a new sequence
+void Process_SeqInit(struct ProcessSeq_t *Seq);
+
+//! Release a sequence
+void Process_SeqDestroy(struct ProcessSeq_t *Seq);
+
+//! Quantize the next frame of a sequence, replacing it with the indexed result
+//! NOTE: Clustering is seeded from the previous frame's centroids, and
+//! tiles with unchanged pixels and an unchanged palette keep their previous
+//! palette and indices (including with Floyd-Steinberg dithering, which
+//! keeps static areas from flickering)
+//! NOTE: Returns PROCESS_OK or PROCESS_ERR_*
+int Process_Frame(struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts, struct ProcessSeq_t *Seq, struct BGRAf_t *RMSE);
+
+//! Rectangle of image pixels
+struct ProcessRect_t
+{
+	int x, y, w, h;
+};
+
+//! Requantize only the tiles of Image that changed since Prev (the indexed
+//! output for an earlier version of it), replacing Image with the result
+//! NOTE: Changed tiles are those overlapping Dirty (if not NULL), and those
+//! whose pixels differ from PrevSrc (the earlier input, if not NULL)
+//! NOTE: Prev must have been made with the same tile size and palette
+//! layout (nPalettes, nColoursPerPalette and nUnusedColoursPerPalette);
+//! PROCESS_ERR_PREVIOUS is returned if its tiles or palettes don't fit it
+//! NOTE: Prev's palettes are kept, each changed tile takes the one that
+//! remaps it with the least error, and other tiles keep their indices, so
+//! the work done scales with the number of changed tiles
+//! NOTE: With Refine, palette entries that no unchanged tile uses are
+//! re-fitted to the changed tiles on that palette
+//! NOTE: RMSE only covers the changed tiles, and their number is stored to
+//! *nUpdated; Floyd-Steinberg error does not diffuse out of changed tiles
+//! NOTE: If TilePalIdx is not NULL, the tile palette indices are stored to
+//! *TilePalIdx, to be Mem_Free()d by the caller
+//! NOTE: Returns PROCESS_OK or PROCESS_ERR_*
+int Process_Update(struct BmpCtx_t *Image, const struct BmpCtx_t *Prev, const struct BmpCtx_t *PrevSrc, const struct ProcessRect_t *Dirty, bool Refine, const struct ProcessOpts_t *Opts, struct BGRAf_t *RMSE, int32_t **TilePalIdx, int *nUpdated);
+
+//! Load a palette bank from an indexed BMP or a raw palette (.pal, in the
+//! -bgra bit layout), and set FixedPalette and nPalettes to match
+//! NOTE: The bank is split into palettes of nColoursPerPalette colours;
+//! nPalettes is limited to the number of whole palettes in the file
+//! NOTE: Palette must hold BMP_PALETTE_COLOURS entries, and outlive Opts
+int Process_LoadPalette(struct ProcessOpts_t *Opts, struct BGRA8_t *Palette, const char *Filename);
+
+//! Estimate the peak memory use of Process_Image() (including the source
+//! image, which has BitCnt bits per pixel)
+size_t Process_EstimateMemory(int Width, int Height, int BitCnt, const struct ProcessOpts_t *Opts);
+
+//! Choose how to process an image within MaxMem bytes
+//! NOTE: Strategies are tried in order: as requested, with the (smaller)
+//! integer pipeline, and finally streaming with the tallest strip that fits
+//! (see Stream_PlanStrip(), and only when CanStream); if none fit, the
+//! smallest estimate is taken
+//! NOTE: Returns a PROCESS_PLAN_* value, with its estimate in *Estimate
+//! (which exceeds MaxMem when nothing fits); *StripTiles and *HistEntries
+//! are only meaningful for PROCESS_PLAN_STREAM
+int Process_PlanMemory(int Width, int Height, int BitCnt, const struct ProcessOpts_t *Opts, size_t MaxMem, bool CanStream, int *StripTiles, int *HistEntries, size_t *Estimate);
+
+//! Get a description of a PROCESS_ERR_* code
+const char *Process_ErrorString(int Error, const struct ProcessOpts_t *Opts);
+
+//! Convert RMSE (as returned by Qualetize) to PSNR in dB
+struct BGRAf_t Process_PSNR(struct BGRAf_t RMSE);
@@ -1,9 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include "bitmap.h"
 #include "colourspace.h"
+#include "exact.h"
+#include "mem.h"
 #include "qualetize.h"
+#include "threadpool.h"
 #include "tiles.h"
 
 #define MEASURE_PSNR 1
@@ -25,11 +29,37 @@ static int FindPaletteEntry(const struct BGRAf_t *Px, const struct BGRAf_t *Pal,
 	return MinIdx;
 }
 
+static int FindPaletteEntry16(const struct YCoCg16_t *Px, const struct YCoCg16_t *Pal, int MaxPalSize, int PalUnused)
+{
+	int     i;
+	int     MinIdx = 0;
+	int32_t MinDst = INT32_MAX;
+	for(i=PalUnused-1; i<MaxPalSize; i++)
+	{
+		int32_t Dst = YCoCg16_ColDistance(Px, &Pal[i]);
+		if(Dst < MinDst)
+		{
+			MinIdx = i;
+			MinDst = Dst;
+		}
+	}
+	return MinIdx;
+}
+
+//! Most transparent entry of a palette (the last, on ties), which the
+//! reserved entries are unless there are none
+static int TransparentEntry(const struct BGRAf_t *Pal, int MaxPalSize)
+{
+	int i, Idx = 0;
+	for(i=1; i<MaxPalSize; i++) if(Pal[i].a <= Pal[Idx].a) Idx = i;
+	return Idx;
+}
+
 static void OrderPalettes(struct BGRAf_t *Pal, int MaxTilePals, int MaxPalSize)
 {
 	int   i, j;
 	bool swapped = true;
-	
+
 	while(swapped == true)
 	{
 		swapped = false;
@@ -39,10 +69,10 @@ static void OrderPalettes(struct BGRAf_t *Pal, int MaxTilePals, int MaxPalSize)
 			{
 				struct BGRAf_t p1 = BGRAf_FromYCoCg(&Pal[i * MaxPalSize + j + 0]);
 				struct BGRAf_t p2 = BGRAf_FromYCoCg(&Pal[i * MaxPalSize + j + 1]);
-				
+
 				float i1 = BGRAf_Dot(&(const struct BGRAf_t) {0.33f, 0.33f, 0.33f, 0.0f}, &p1);
 				float i2 = BGRAf_Dot(&(const struct BGRAf_t) {0.33f, 0.33f, 0.33f, 0.0f}, &p2);
-				
+
 				if(i1 > i2)
 				{
 					swapped = true;
@@ -54,24 +84,54 @@ static void OrderPalettes(struct BGRAf_t *Pal, int MaxTilePals, int MaxPalSize)
 	}
 }
 
-struct BGRAf_t Qualetize(
-	struct BmpCtx_t *Image,
-	struct TilesData_t *TilesData,
-	uint8_t *PxData,
+void Qualetize_PaletteSpread(
+	const struct BGRAf_t *Palette,
+	struct BGRAf_t *PaletteSpread,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	float DitherLevel
+) {
+	int i;
+	for(i=0;i<MaxTilePals;i++)
+	{
+		int n;
+		struct BGRAf_t Mean = (struct BGRAf_t){0,0,0,0};
+		for(n=PalUnused;n<MaxPalSize;n++) Mean = BGRAf_Add(&Mean, &Palette[i*MaxPalSize+n]);
+		Mean = BGRAf_Divi(&Mean, MaxPalSize-PalUnused);
+
+		struct BGRAf_t Spread = {0,0,0,0}, SpreadW = {0,0,0,0};
+		for(n=PalUnused; n<MaxPalSize; n++)
+		{
+			struct BGRAf_t d = BGRAf_Sub(&Palette[i*MaxPalSize+n], &Mean);
+			               d = BGRAf_Abs(&d);
+			struct BGRAf_t w = BGRAf_Sqrt(&d);
+			               d = BGRAf_Mul(&d, &w);
+			Spread  = BGRAf_Add(&Spread,  &d);
+			SpreadW = BGRAf_Add(&SpreadW, &w);
+		}
+
+		Spread = BGRAf_DivSafe(&Spread, &SpreadW, NULL);
+#ifdef DITHER_NO_ALPHA
+		Spread.a = 0.0f;
+#endif
+		PaletteSpread[i] = BGRAf_Muli(&Spread, DitherLevel);
+	}
+}
+
+void Qualetize_PreparePalettes(
 	struct BGRAf_t *Palette,
+	struct BGRAf_t *PaletteSpread,
 	int   MaxTilePals,
 	int   MaxPalSize,
 	int   PalUnused,
 	const struct BGRA8_t *BitRange,
 	int   DitherType,
 	float DitherLevel,
-	int   ReplaceImage,
 	bool  OrderColours
 ) {
 	int i;
 
-	TilesData_QuantizePalettes(TilesData, Palette, MaxTilePals, MaxPalSize, PalUnused);
-
 	struct BGRAf_t DitherVal = BGRAf_FromBGRA(&(const struct BGRA8_t){1,1,1,0}, BitRange);
 	DitherVal = BGRAf_Muli(&DitherVal, 0.25f);
 	for(i=0; i<MaxTilePals*MaxPalSize; i++)
@@ -86,86 +146,392 @@ struct BGRAf_t Qualetize(
 		Palette[i] = BGRAf_AsYCoCg(&p);
 	}
 
+	if(DITHER_IS_ORDERED(DitherType))
+	{
+		Qualetize_PaletteSpread(Palette, PaletteSpread, MaxTilePals, MaxPalSize, PalUnused, DitherLevel);
+	}
+
+	if(OrderColours)
+	{
+		OrderPalettes(Palette, MaxTilePals, MaxPalSize);
+	}
+}
+
+void Qualetize_AssignPalettes(
+	struct TilesData_t *TilesData,
+	const struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused
+) {
+	int t;
+	int nPxTile = TilesData->TileW  * TilesData->TileH;
+	int nTiles  = TilesData->TilesX * TilesData->TilesY;
+	for(t=0;t<nTiles;t++)
+	{
+		if(!TilesData_TileVisible(TilesData, t))
+		{
+			TilesData->TilePalIdx[t] = 0;
+			continue;
+		}
+		TilesData->TilePalIdx[t] = Qualetize_BestPalette(TilesData->TilePxPtr[t].PxBGRAf, nPxTile, Palette, MaxTilePals, MaxPalSize, PalUnused);
+	}
+}
+
+int Qualetize_BestPalette(
+	const struct BGRAf_t *Px,
+	int   nPx,
+	const struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused
+) {
+	int p, n;
+	int   BestPal = 0;
+	float BestErr = 8.0e37f;
+	for(p=0;p<MaxTilePals;p++)
+	{
+		const struct BGRAf_t *Pal = Palette + p*MaxPalSize;
+
+		//! Stop as soon as this palette can't beat the best so far
+		float Err = 0.0f;
+		for(n=0;n<nPx && Err < BestErr;n++)
+		{
+			int PalCol = FindPaletteEntry(&Px[n], Pal, MaxPalSize, PalUnused);
+			Err += BGRAf_ColDistance(&Px[n], &Pal[PalCol]);
+		}
+		if(Err < BestErr) BestPal = p, BestErr = Err;
+	}
+	return BestPal;
+}
+
+void Qualetize_Palette16(struct YCoCg16_t *Palette16, const struct BGRAf_t *Palette, int nColours)
+{
+	int i;
+	for(i=0;i<nColours;i++)
+	{
+		struct BGRAf_t p = BGRAf_FromYCoCg(&Palette[i]);
+		struct BGRA8_t p8 = BGRA8_FromBGRAf(&p);
+		Palette16[i] = YCoCg16_FromBGRA8(&p8);
+	}
+}
+
+//! Ordered dither threshold (-0.5 to +0.5) at image position (x,y)
+static inline float OrderedThreshold(int x, int y, int DitherType)
+{
+	int Threshold = 0, xKey = x, yKey = x^y;
+	int Bit = DitherType-1; do {
+		Threshold = Threshold*2 + (yKey & 1), yKey >>= 1;
+		Threshold = Threshold*2 + (xKey & 1), xKey >>= 1;
+	} while(--Bit >= 0);
+	return Threshold * (1.0f / (1 << (2*DitherType))) - 0.5f;
+}
+
+//! Remap one tile, with Floyd-Steinberg error diffused only within it
+//! NOTE: PxSrc (or PxSrcIdx), PxData point to the tile's first pixel, in
+//! rows of Stride pixels; (ImgX,ImgY) is its position for ordered dither
+//! NOTE: Keep tiles keep the indices already in PxData, and only measure
+//! their error
+TILES_KERNEL void RemapTile(
+	const struct BGRA8_t *PxSrc,
+	const uint8_t *PxSrcIdx,
+	uint8_t *PxData,
+	int   Stride,
+	int   ImgX,
+	int   ImgY,
+	int   PalIdx,
+	int   Keep,
+	const struct BGRAf_t *Palette,
+	const struct YCoCg16_t *Palette16,
+	const struct BGRAf_t *PaletteSpread,
+	int   MaxPalSize,
+	int   PalUnused,
+	int   AlphaThreshold,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *PxDiffuse,
+	struct BGRAf_t *SqErr,
+	int   TileW,
+	int   TileH
+) {
 	int x, y;
-	int ImgW = Image->Width;
-	int ImgH = Image->Height;
-	int TileW = TilesData->TileW;
-	int TileH = TilesData->TileH;
-	int32_t *TilePalIdx = TilesData->TilePalIdx;
-#if MEASURE_PSNR
-	      struct BGRAf_t  RMSE     = (struct BGRAf_t){0,0,0,0};
+	int Diffuse = (DitherType == DITHER_FLOYDSTEINBERG || DITHER_IS_TILED(DitherType));
+	int TransIdx = -1;
+#if !MEASURE_PSNR
+	(void)SqErr;
 #endif
-	const        uint8_t *PxSrcIdx = Image->ColPal ? Image->PxIdx  : NULL;
-	const struct BGRA8_t *PxSrcBGR = Image->ColPal ? Image->ColPal : Image->PxBGR;
+	if(Diffuse) for(x=0; x<TileW*2; x++) PxDiffuse[x] = (struct BGRAf_t){0,0,0,0};
 
-	struct BGRAf_t *PxDiffuse     = TilesData->PxData;
-	struct BGRAf_t *PaletteSpread = TilesData->PxData;
-	if(DitherType != DITHER_NONE)
+	for(y=0;y<TileH;y++)
 	{
-		if(DitherType == DITHER_FLOYDSTEINBERG)
+		struct BGRAf_t *DiffuseCur = PxDiffuse + ( y   &1)*TileW;
+		struct BGRAf_t *DiffuseNxt = PxDiffuse + ((y+1)&1)*TileW;
+		if(Diffuse) for(x=0;x<TileW;x++) DiffuseNxt[x] = (struct BGRAf_t){0,0,0,0};
+
+		//! Serpentine scans odd rows right-to-left, mirroring the kernel
+		int Dir = (DitherType == DITHER_TILE_SERPENTINE && (y&1)) ? -1 : +1;
+		size_t RowOffs = (size_t)y*Stride;
+		int i;
+		for(i=0;i<TileW;i++)
 		{
-			for(y=0;y<ImgH;y++)
+			x = (Dir > 0) ? i : (TileW-1 - i);
+			struct BGRA8_t p = PxSrcIdx ? PxSrc[PxSrcIdx[RowOffs + x]] : PxSrc[RowOffs + x];
+			if(p.a < AlphaThreshold)
+			{
+				if(TransIdx < 0) TransIdx = TransparentEntry(Palette + PalIdx*MaxPalSize, MaxPalSize);
+				if(!Keep) PxData[RowOffs + x] = PalIdx*MaxPalSize + TransIdx;
+				continue;
+			}
+
+			struct BGRAf_t Px_Original = BGRAf_FromBGRA8(&p);
+			Px_Original = BGRAf_AsYCoCg(&Px_Original);
+			struct BGRAf_t Px = Px_Original;
+
+			if(Diffuse)
+			{
+				struct BGRAf_t Dif = DiffuseCur[x];
+	#ifdef DITHER_NO_ALPHA
+				Dif.a = 0.0f;
+	#endif
+				Dif = BGRAf_Muli(&Dif, DitherLevel);
+				Px  = BGRAf_Add (&Px, &Dif);
+			}
+			else if(DITHER_IS_ORDERED(DitherType))
 			{
-				for(x=0;x<ImgW;x++)
+				struct BGRAf_t DitherVal = BGRAf_Muli(&PaletteSpread[PalIdx], OrderedThreshold(ImgX+x, ImgY+y, DitherType));
+				Px = BGRAf_Add(&Px, &DitherVal);
+			}
+
+			if(!Keep)
+			{
+				int PalCol;
+				if(Palette16)
+				{
+					struct YCoCg16_t Px16 = (DitherType == DITHER_NONE) ? YCoCg16_FromBGRA8(&p) : YCoCg16_FromYCoCgf(&Px);
+					PalCol = FindPaletteEntry16(&Px16, Palette16 + PalIdx*MaxPalSize, MaxPalSize, PalUnused);
+				}
+				else PalCol = FindPaletteEntry(&Px, Palette + PalIdx*MaxPalSize, MaxPalSize, PalUnused);
+				PxData[RowOffs + x] = PalIdx*MaxPalSize + PalCol;
+			}
+			struct BGRAf_t Error = BGRAf_Sub(&Px_Original, &Palette[PxData[RowOffs + x]]);
+
+			if(Diffuse)
+			{
+				struct BGRAf_t t;
+				if(x-Dir >= 0 && x-Dir < TileW)
+				{
+					t = BGRAf_Muli(&Error, 3.0f/16);
+					DiffuseNxt[x-Dir] = BGRAf_Add(&DiffuseNxt[x-Dir], &t);
+				}
+				t = BGRAf_Muli(&Error, 5.0f/16);
+				DiffuseNxt[x] = BGRAf_Add(&DiffuseNxt[x], &t);
+				if(x+Dir >= 0 && x+Dir < TileW)
 				{
-					PxDiffuse[y*ImgW+x] = (struct BGRAf_t){0,0,0,0};
+					t = BGRAf_Muli(&Error, 1.0f/16);
+					DiffuseNxt[x+Dir] = BGRAf_Add(&DiffuseNxt[x+Dir], &t);
+					t = BGRAf_Muli(&Error, 7.0f/16);
+					DiffuseCur[x+Dir] = BGRAf_Add(&DiffuseCur[x+Dir], &t);
 				}
 			}
+
+			#if MEASURE_PSNR
+				Error = BGRAf_FromYCoCg(&Error);
+				Error = BGRAf_Mul(&Error, &Error);
+				*SqErr = BGRAf_Add(SqErr, &Error);
+			#endif
 		}
-		else
+	}
+}
+
+//! Remap a band of an indexed image with no dither, by table lookup
+//! NOTE: Without dither, a pixel's index only depends on its source colour
+//! and its tile's palette, so each (palette, source colour) pair is
+//! searched once, when first seen, with the same result as RemapRows()
+//! NOTE: Returns 0 (having remapped nothing) if the table can't be allocated
+TILES_KERNEL int RemapRowsIndexed(
+	const struct BGRA8_t *ColPal,
+	const uint8_t *PxSrcIdx,
+	uint8_t *PxData,
+	int   ImgW,
+	int   y0,
+	int   nRows,
+	const int32_t *TilePalIdx,
+	const uint8_t *TileKeep,
+	const struct BGRAf_t *Palette,
+	const struct YCoCg16_t *Palette16,
+	int   MaxPalSize,
+	int   PalUnused,
+	int   AlphaThreshold,
+	struct BGRAf_t *SqErr,
+	int   TileW,
+	int   TileH
+) {
+	int x, y;
+	size_t nEntries = (size_t)(BMP_PALETTE_COLOURS / MaxPalSize) * BMP_PALETTE_COLOURS;
+	struct BGRAf_t *MapErr = Mem_Alloc(nEntries * (sizeof(struct BGRAf_t) + sizeof(int16_t)));
+	if(!MapErr) return 0;
+	int16_t *Map = (int16_t*)(MapErr + nEntries);
+	memset(Map, 0xFF, nEntries * sizeof(int16_t));
+#if MEASURE_PSNR
+	struct BGRAf_t RMSE = *SqErr;
+#else
+	(void)SqErr;
+#endif
+
+	//! Source colours are converted once
+	struct BGRAf_t SrcYCoCg[BMP_PALETTE_COLOURS];
+	for(x=0;x<BMP_PALETTE_COLOURS;x++)
+	{
+		SrcYCoCg[x] = BGRAf_FromBGRA8(&ColPal[x]);
+		SrcYCoCg[x] = BGRAf_AsYCoCg(&SrcYCoCg[x]);
+	}
+
+	int TransIdx[BMP_PALETTE_COLOURS];
+	if(AlphaThreshold) for(x=0; x<BMP_PALETTE_COLOURS; x++) TransIdx[x] = -1;
+
+	for(y=y0;y<y0+nRows;y++)
+	{
+		size_t RowOffs = (size_t)(y-y0)*ImgW;
+		for(x=0;x<ImgW;x++)
 		{
-			for(i=0;i<MaxTilePals;i++)
+			size_t TileIdx = (size_t)(y/TileH)*(ImgW/TileW) + (x/TileW);
+			int PalIdx = TilePalIdx[TileIdx];
+			int SrcIdx = PxSrcIdx[RowOffs + x];
+			if(ColPal[SrcIdx].a < AlphaThreshold)
 			{
-				int n;
-				struct BGRAf_t Mean = (struct BGRAf_t){0,0,0,0};
-				for(n=PalUnused;n<MaxPalSize;n++) Mean = BGRAf_Add(&Mean, &Palette[i*MaxPalSize+n]);
-				Mean = BGRAf_Divi(&Mean, MaxPalSize-PalUnused);
+				if(TransIdx[PalIdx] < 0) TransIdx[PalIdx] = TransparentEntry(Palette + PalIdx*MaxPalSize, MaxPalSize);
+				if(!TileKeep || !TileKeep[TileIdx]) PxData[RowOffs + x] = PalIdx*MaxPalSize + TransIdx[PalIdx];
+				continue;
+			}
 
-				struct BGRAf_t Spread = {0,0,0,0}, SpreadW = {0,0,0,0};
-				for(n=PalUnused; n<MaxPalSize; n++)
+			struct BGRAf_t Error;
+			if(TileKeep && TileKeep[TileIdx])
+			{
+				Error = BGRAf_Sub(&SrcYCoCg[SrcIdx], &Palette[PxData[RowOffs + x]]);
+				Error = BGRAf_FromYCoCg(&Error);
+				Error = BGRAf_Mul(&Error, &Error);
+			}
+			else
+			{
+				size_t Entry = (size_t)PalIdx*BMP_PALETTE_COLOURS + SrcIdx;
+				if(Map[Entry] < 0)
 				{
-					struct BGRAf_t d = BGRAf_Sub(&Palette[i*MaxPalSize+n], &Mean);
-							   d = BGRAf_Abs(&d);
-					struct BGRAf_t w = BGRAf_Sqrt(&d);
-							   d = BGRAf_Mul(&d, &w);
-					Spread  = BGRAf_Add(&Spread,  &d);
-					SpreadW = BGRAf_Add(&SpreadW, &w);
+					int PalCol;
+					if(Palette16)
+					{
+						struct YCoCg16_t Px16 = YCoCg16_FromBGRA8(&ColPal[SrcIdx]);
+						PalCol = FindPaletteEntry16(&Px16, Palette16 + PalIdx*MaxPalSize, MaxPalSize, PalUnused);
+					}
+					else PalCol = FindPaletteEntry(&SrcYCoCg[SrcIdx], Palette + PalIdx*MaxPalSize, MaxPalSize, PalUnused);
+					Map[Entry] = PalIdx*MaxPalSize + PalCol;
+
+					Error = BGRAf_Sub(&SrcYCoCg[SrcIdx], &Palette[Map[Entry]]);
+					Error = BGRAf_FromYCoCg(&Error);
+					MapErr[Entry] = BGRAf_Mul(&Error, &Error);
 				}
-				
-				Spread = BGRAf_DivSafe(&Spread, &SpreadW, NULL);
-	#ifdef DITHER_NO_ALPHA
-				Spread.a = 0.0f;
-	#endif
-				PaletteSpread[i] = BGRAf_Muli(&Spread, DitherLevel);
+				PxData[RowOffs + x] = Map[Entry];
+				Error = MapErr[Entry];
 			}
+			#if MEASURE_PSNR
+				RMSE = BGRAf_Add(&RMSE, &Error);
+			#endif
 		}
 	}
 
-	if(OrderColours)
+#if MEASURE_PSNR
+	*SqErr = RMSE;
+#endif
+	Mem_Free(MapErr);
+	return 1;
+}
+
+TILES_KERNEL void RemapRows(
+	const struct BGRA8_t *PxSrc,
+	const uint8_t *PxSrcIdx,
+	uint8_t *PxData,
+	int   ImgW,
+	int   ImgH,
+	int   y0,
+	int   nRows,
+	const int32_t *TilePalIdx,
+	const uint8_t *TileKeep,
+	const struct BGRAf_t *Palette,
+	const struct YCoCg16_t *Palette16,
+	const struct BGRAf_t *PaletteSpread,
+	int   MaxPalSize,
+	int   PalUnused,
+	int   AlphaThreshold,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *PxDiffuse,
+	struct BGRAf_t *SqErr,
+	int   TileW,
+	int   TileH
+) {
+	int x, y;
+#if MEASURE_PSNR
+	struct BGRAf_t RMSE = *SqErr;
+#else
+	(void)SqErr;
+#endif
+
+	//! Transparent entry of each palette, found as first needed
+	int TransIdx[BMP_PALETTE_COLOURS];
+	if(AlphaThreshold) for(x=0; x<BMP_PALETTE_COLOURS; x++) TransIdx[x] = -1;
+
+	//! Indexed source colours are converted once
+	struct BGRAf_t SrcYCoCg[BMP_PALETTE_COLOURS];
+	if(PxSrcIdx) for(x=0;x<BMP_PALETTE_COLOURS;x++)
 	{
-		OrderPalettes(Palette, MaxTilePals, MaxPalSize);
+		SrcYCoCg[x] = BGRAf_FromBGRA8(&PxSrc[x]);
+		SrcYCoCg[x] = BGRAf_AsYCoCg(&SrcYCoCg[x]);
 	}
 
-	for(y=0;y<ImgH;y++)
+	for(y=y0;y<y0+nRows;y++)
 	{
+		//! Floyd-Steinberg only ever needs the current and next row of error
+		struct BGRAf_t *DiffuseCur = PxDiffuse + (size_t)( y   &1)*ImgW;
+		struct BGRAf_t *DiffuseNxt = PxDiffuse + (size_t)((y+1)&1)*ImgW;
+		if(DitherType == DITHER_FLOYDSTEINBERG)
+		{
+			for(x=0;x<ImgW;x++) DiffuseNxt[x] = (struct BGRAf_t){0,0,0,0};
+		}
+
+		size_t RowOffs = (size_t)(y-y0)*ImgW;
 		for(x=0;x<ImgW;x++)
 		{
-			int PalIdx = TilePalIdx[(y/TileH)*(ImgW/TileW) + (x/TileW)];
+			size_t TileIdx = (size_t)(y/TileH)*(ImgW/TileW) + (x/TileW);
+			int PalIdx = TilePalIdx[TileIdx];
 
 			struct BGRAf_t Px, Px_Original;
 
 			struct BGRA8_t p;
-			if(PxSrcIdx) p = PxSrcBGR[PxSrcIdx[y*ImgW + x]];
-			else         p = PxSrcBGR[         y*ImgW + x ];
-			Px_Original = BGRAf_FromBGRA8(&p);
-			Px_Original = BGRAf_AsYCoCg(&Px_Original);
+			int SrcIdx = PxSrcIdx ? PxSrcIdx[RowOffs + x] : 0;
+			if(PxSrcIdx) p = PxSrc[SrcIdx];
+			else         p = PxSrc[RowOffs + x];
+
+			//! Transparent pixels go straight to the transparent entry,
+			//! and neither diffuse nor count towards the error
+			if(p.a < AlphaThreshold)
+			{
+				if(TransIdx[PalIdx] < 0) TransIdx[PalIdx] = TransparentEntry(Palette + PalIdx*MaxPalSize, MaxPalSize);
+				if(!TileKeep || !TileKeep[TileIdx]) PxData[RowOffs + x] = PalIdx*MaxPalSize + TransIdx[PalIdx];
+				continue;
+			}
+
+			if(PxSrcIdx) Px_Original = SrcYCoCg[SrcIdx];
+			else
+			{
+				Px_Original = BGRAf_FromBGRA8(&p);
+				Px_Original = BGRAf_AsYCoCg(&Px_Original);
+			}
 			Px = Px_Original;
 
 			if(DitherType != DITHER_NONE)
 			{
 				if(DitherType == DITHER_FLOYDSTEINBERG)
 				{
-					struct BGRAf_t Dif = PxDiffuse[y*ImgW + x];
+					struct BGRAf_t Dif = DiffuseCur[x];
 	#ifdef DITHER_NO_ALPHA
 					Dif.a = 0.0f;
 	#endif
@@ -174,20 +540,24 @@ struct BGRAf_t Qualetize(
 				}
 				else
 				{
-					int Threshold = 0, xKey = x, yKey = x^y;
-					int Bit = DitherType-1; do {
-						Threshold = Threshold*2 + (yKey & 1), yKey >>= 1;
-						Threshold = Threshold*2 + (xKey & 1), xKey >>= 1;
-					} while(--Bit >= 0);
-					float fThres = Threshold * (1.0f / (1 << (2*DitherType))) - 0.5f;
-					struct BGRAf_t DitherVal = BGRAf_Muli(&PaletteSpread[PalIdx], fThres);
+					struct BGRAf_t DitherVal = BGRAf_Muli(&PaletteSpread[PalIdx], OrderedThreshold(x, y, DitherType));
 					Px = BGRAf_Add(&Px, &DitherVal);
 				}
 			}
 
-			int PalCol = FindPaletteEntry(&Px, Palette + PalIdx*MaxPalSize, MaxPalSize, PalUnused);
-			PxData[y*ImgW + x] = PalIdx*MaxPalSize + PalCol;
-			struct BGRAf_t Error = BGRAf_Sub(&Px_Original, &Palette[PxData[y*ImgW + x]]);
+			if(!TileKeep || !TileKeep[TileIdx])
+			{
+				int PalCol;
+				if(Palette16)
+				{
+					//! Undithered pixels convert losslessly, without going through float
+					struct YCoCg16_t Px16 = (DitherType == DITHER_NONE) ? YCoCg16_FromBGRA8(&p) : YCoCg16_FromYCoCgf(&Px);
+					PalCol = FindPaletteEntry16(&Px16, Palette16 + PalIdx*MaxPalSize, MaxPalSize, PalUnused);
+				}
+				else PalCol = FindPaletteEntry(&Px, Palette + PalIdx*MaxPalSize, MaxPalSize, PalUnused);
+				PxData[RowOffs + x] = PalIdx*MaxPalSize + PalCol;
+			}
+			struct BGRAf_t Error = BGRAf_Sub(&Px_Original, &Palette[PxData[RowOffs + x]]);
 
 			if(DitherType == DITHER_FLOYDSTEINBERG)
 			{
@@ -196,26 +566,26 @@ struct BGRAf_t Qualetize(
 					if(x > 0)
 					{
 						struct BGRAf_t t = BGRAf_Muli(&Error, 3.0f/16);
-						PxDiffuse[(y+1)*ImgW+(x-1)] = BGRAf_Add(&PxDiffuse[(y+1)*ImgW+(x-1)], &t);
+						DiffuseNxt[x-1] = BGRAf_Add(&DiffuseNxt[x-1], &t);
 					}
 					if(1)
 					{
 						struct BGRAf_t t = BGRAf_Muli(&Error, 5.0f/16);
-						PxDiffuse[(y+1)*ImgW+(x  )] = BGRAf_Add(&PxDiffuse[(y+1)*ImgW+(x  )], &t);
+						DiffuseNxt[x  ] = BGRAf_Add(&DiffuseNxt[x  ], &t);
 					}
 					if(x+1 < ImgW)
 					{
 						struct BGRAf_t t = BGRAf_Muli(&Error, 1.0f/16);
-						PxDiffuse[(y+1)*ImgW+(x+1)] = BGRAf_Add(&PxDiffuse[(y+1)*ImgW+(x+1)], &t);
+						DiffuseNxt[x+1] = BGRAf_Add(&DiffuseNxt[x+1], &t);
 					}
 				}
 				if(x+1 < ImgW)
 				{
 						struct BGRAf_t t = BGRAf_Muli(&Error, 7.0f/16);
-						PxDiffuse[(y  )*ImgW+(x+1)] = BGRAf_Add(&PxDiffuse[(y  )*ImgW+(x+1)], &t);
+						DiffuseCur[x+1] = BGRAf_Add(&DiffuseCur[x+1], &t);
 				}
 			}
-			
+
 			#if MEASURE_PSNR
 				Error = BGRAf_FromYCoCg(&Error);
 				Error = BGRAf_Mul(&Error, &Error);
@@ -224,6 +594,219 @@ struct BGRAf_t Qualetize(
 		}
 	}
 
+#if MEASURE_PSNR
+	*SqErr = RMSE;
+#endif
+}
+
+//! A band remapped with tile-local dither, split into jobs
+//! NOTE: Job n remaps tile rows n, n+nJobs, ..., with its own TileW*2
+//! entries of PxDiffuse and its own error sum, so the result does not
+//! depend on which thread runs which job
+struct RemapTilesJob_t
+{
+	const struct BGRA8_t *PxSrc;
+	const uint8_t *PxSrcIdx;
+	uint8_t *PxData;
+	int   ImgW, y0, nTileRows, nJobs;
+	int   TileW, TileH;
+	const int32_t *TilePalIdx;
+	const uint8_t *TileKeep;
+	const struct BGRAf_t *Palette;
+	const struct YCoCg16_t *Palette16;
+	int   MaxPalSize, PalUnused, AlphaThreshold;
+	int   DitherType;
+	float DitherLevel;
+	struct BGRAf_t *PxDiffuse;
+	struct BGRAf_t JobErr[QUALETIZE_TILE_JOBS];
+};
+
+TILES_KERNEL void RemapTileRows(struct RemapTilesJob_t *Job, int JobIdx, int TileW, int TileH)
+{
+	int tx, ty;
+	int TilesX = Job->ImgW / TileW;
+	struct BGRAf_t *PxDiffuse = Job->PxDiffuse + (size_t)JobIdx*TileW*2;
+	struct BGRAf_t  SqErr     = (struct BGRAf_t){0,0,0,0};
+	for(ty=JobIdx; ty<Job->nTileRows; ty+=Job->nJobs)
+	{
+		size_t RowOffs  = (size_t)ty*TileH*Job->ImgW;
+		size_t TileBase = (size_t)(Job->y0/TileH + ty)*TilesX;
+		for(tx=0; tx<TilesX; tx++)
+		{
+			size_t Offs = RowOffs + (size_t)tx*TileW;
+			RemapTile(
+				Job->PxSrcIdx ? Job->PxSrc : Job->PxSrc + Offs,
+				Job->PxSrcIdx ? Job->PxSrcIdx + Offs : NULL,
+				Job->PxData + Offs,
+				Job->ImgW,
+				tx*TileW,
+				Job->y0 + ty*TileH,
+				Job->TilePalIdx[TileBase + tx],
+				Job->TileKeep && Job->TileKeep[TileBase + tx],
+				Job->Palette,
+				Job->Palette16,
+				NULL,
+				Job->MaxPalSize,
+				Job->PalUnused,
+				Job->AlphaThreshold,
+				Job->DitherType,
+				Job->DitherLevel,
+				PxDiffuse,
+				&SqErr,
+				TileW,
+				TileH
+			);
+		}
+	}
+	Job->JobErr[JobIdx] = SqErr;
+}
+
+static void RemapTilesJob(void *Arg, int JobIdx)
+{
+	struct RemapTilesJob_t *Job = Arg;
+	TILES_DISPATCH(Job->TileW, Job->TileH, RemapTileRows, Job, JobIdx);
+}
+
+void Qualetize_RemapRows(
+	const struct BGRA8_t *PxSrc,
+	const uint8_t *PxSrcIdx,
+	uint8_t *PxData,
+	int   ImgW,
+	int   ImgH,
+	int   y0,
+	int   nRows,
+	int   TileW,
+	int   TileH,
+	const int32_t *TilePalIdx,
+	const uint8_t *TileKeep,
+	const struct BGRAf_t *Palette,
+	const struct YCoCg16_t *Palette16,
+	const struct BGRAf_t *PaletteSpread,
+	int   MaxPalSize,
+	int   PalUnused,
+	int   AlphaThreshold,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *PxDiffuse,
+	struct BGRAf_t *SqErr
+) {
+	if(DITHER_IS_TILED(DitherType))
+	{
+		//! PxDiffuse (ImgW*2 entries) holds TileW*2 for each of TilesX jobs
+		int i;
+		struct RemapTilesJob_t Job;
+		Job.PxSrc          = PxSrc;
+		Job.PxSrcIdx       = PxSrcIdx;
+		Job.PxData         = PxData;
+		Job.ImgW           = ImgW;
+		Job.y0             = y0;
+		Job.nTileRows      = nRows / TileH;
+		Job.TileW          = TileW;
+		Job.TileH          = TileH;
+		Job.TilePalIdx     = TilePalIdx;
+		Job.TileKeep       = TileKeep;
+		Job.Palette        = Palette;
+		Job.Palette16      = Palette16;
+		Job.MaxPalSize     = MaxPalSize;
+		Job.PalUnused      = PalUnused;
+		Job.AlphaThreshold = AlphaThreshold;
+		Job.DitherType     = DitherType;
+		Job.DitherLevel    = DitherLevel;
+		Job.PxDiffuse      = PxDiffuse;
+		Job.nJobs          = Job.nTileRows;
+		if(Job.nJobs > ImgW/TileW)          Job.nJobs = ImgW/TileW;
+		if(Job.nJobs > QUALETIZE_TILE_JOBS) Job.nJobs = QUALETIZE_TILE_JOBS;
+		ThreadPool_For(ThreadPool_Global(0), Job.nJobs, RemapTilesJob, &Job);
+		for(i=0; i<Job.nJobs; i++) *SqErr = BGRAf_Add(SqErr, &Job.JobErr[i]);
+		(void)ImgH;
+		(void)PaletteSpread;
+		return;
+	}
+	if(PxSrcIdx && DitherType == DITHER_NONE && (size_t)ImgW*nRows >= (size_t)(BMP_PALETTE_COLOURS / MaxPalSize) * BMP_PALETTE_COLOURS)
+	{
+		int Done = 0;
+		TILES_DISPATCH(TileW, TileH, Done = RemapRowsIndexed, PxSrc, PxSrcIdx, PxData, ImgW, y0, nRows, TilePalIdx, TileKeep, Palette, Palette16, MaxPalSize, PalUnused, AlphaThreshold, SqErr);
+		if(Done) return;
+	}
+	TILES_DISPATCH(TileW, TileH, RemapRows, PxSrc, PxSrcIdx, PxData, ImgW, ImgH, y0, nRows, TilePalIdx, TileKeep, Palette, Palette16, PaletteSpread, MaxPalSize, PalUnused, AlphaThreshold, DitherType, DitherLevel, PxDiffuse, SqErr);
+}
+
+struct BGRAf_t Qualetize(
+	struct BmpCtx_t *Image,
+	struct TilesData_t *TilesData,
+	uint8_t *PxData,
+	struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	int   ReplaceImage,
+	bool  OrderColours
+) {
+	int i;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+
+	//! Tiles with few colours get exact palettes first, and the rest are
+	//! clustered into the palettes left
+	//! NOTE: PxTemp only holds every tile value with 2+ pixel tiles
+	int nClusterPals = MaxTilePals;
+	uint8_t *TileExact = NULL;
+	if(TilesData->ExactTiles && TilesData->TileW*TilesData->TileH > 1)
+	{
+		TileExact = Mem_Calloc(nTiles ? nTiles : 1, sizeof(uint8_t));
+		int nExactPals = TileExact ? Exact_PackTiles(Image, TilesData, Palette, TileExact, MaxTilePals, MaxPalSize, PalUnused, BitRange) : -1;
+		if(nExactPals < 0)
+		{
+			Mem_Free(TileExact);
+			TileExact = NULL;
+		}
+		else nClusterPals -= nExactPals;
+	}
+
+	TilesData->TileFixed = TileExact;
+	if(nClusterPals > 0) TilesData_QuantizePalettes(TilesData, Palette, nClusterPals, MaxPalSize, PalUnused);
+	else for(i=0; i<nTiles; i++) if(!TileExact[i]) TilesData->TilePalIdx[i] = 0; //! Only invisible tiles are left
+	TilesData->TileFixed = NULL;
+
+	struct BGRAf_t PaletteSpread[BMP_PALETTE_COLOURS];
+	Qualetize_PreparePalettes(Palette, PaletteSpread, MaxTilePals, MaxPalSize, PalUnused, BitRange, DitherType, DitherLevel, OrderColours);
+
+	int ImgW = Image->Width;
+	int ImgH = Image->Height;
+	if(TileExact) Exact_RemapTiles(Image, TilesData, TileExact, PxData, Palette, MaxTilePals, MaxPalSize, BitRange);
+	struct BGRAf_t  RMSE      = (struct BGRAf_t){0,0,0,0};
+	struct BGRAf_t *PxDiffuse = TilesData->PxTemp; //! Palette quantization is done with this buffer
+	for(i=0; i<ImgW*2; i++) PxDiffuse[i] = (struct BGRAf_t){0,0,0,0};
+
+	struct YCoCg16_t Palette16[BMP_PALETTE_COLOURS];
+	if(TilesData->IntegerMode) Qualetize_Palette16(Palette16, Palette, BMP_PALETTE_COLOURS);
+	Qualetize_RemapRows(
+		Image->ColPal ? Image->ColPal : Image->PxBGR,
+		Image->ColPal ? Image->PxIdx  : NULL,
+		PxData,
+		ImgW,
+		ImgH,
+		0,
+		ImgH,
+		TilesData->TileW,
+		TilesData->TileH,
+		TilesData->TilePalIdx,
+		TileExact,
+		Palette,
+		TilesData->IntegerMode ? Palette16 : NULL,
+		PaletteSpread,
+		MaxPalSize,
+		PalUnused,
+		TilesData->AlphaThreshold,
+		DitherType,
+		DitherLevel,
+		PxDiffuse,
+		&RMSE
+	);
+	Mem_Free(TileExact);
+
 	struct BGRA8_t *PalBGR = (struct BGRA8_t*)Palette;
 	for(i=0; i<BMP_PALETTE_COLOURS; i++)
 	{
@@ -233,24 +816,59 @@ struct BGRAf_t Qualetize(
 
 	if(ReplaceImage)
 	{
-		if(Image->ColPal)
-		{
-			free(Image->ColPal);
-			free(Image->PxIdx);
-		}
-		else
-		{
-			free(Image->PxBGR);
-		}
-		Image->ColPal = PalBGR;
-		Image->PxIdx  = PxData;
+		BmpCtx_SetIndexed(Image, PalBGR, PxData);
 	}
 
 	#if MEASURE_PSNR
-		RMSE = BGRAf_Divi(&RMSE, ImgW*ImgH);
+		RMSE = BGRAf_Divi(&RMSE, (float)ImgW*ImgH);
 		RMSE = BGRAf_Sqrt(&RMSE);
 		return RMSE;
 	#else
 		return (struct BGRAf_t){0,0,0,0};
 	#endif
 }
+
+void Qualetize_RemapTile(
+	const struct BGRA8_t *PxSrc,
+	const uint8_t *PxSrcIdx,
+	uint8_t *PxData,
+	int   ImgW,
+	int   tx,
+	int   ty,
+	int   TileW,
+	int   TileH,
+	int   PalIdx,
+	const struct BGRAf_t *Palette,
+	const struct YCoCg16_t *Palette16,
+	const struct BGRAf_t *PaletteSpread,
+	int   MaxPalSize,
+	int   PalUnused,
+	int   AlphaThreshold,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *PxDiffuse,
+	struct BGRAf_t *SqErr
+) {
+	int ImgX = tx*TileW, ImgY = ty*TileH;
+	size_t Offs = (size_t)ImgY*ImgW + ImgX;
+	TILES_DISPATCH(TileW, TileH, RemapTile,
+		PxSrcIdx ? PxSrc : PxSrc + Offs,
+		PxSrcIdx ? PxSrcIdx + Offs : NULL,
+		PxData + Offs,
+		ImgW,
+		ImgX,
+		ImgY,
+		PalIdx,
+		0,
+		Palette,
+		Palette16,
+		PaletteSpread,
+		MaxPalSize,
+		PalUnused,
+		AlphaThreshold,
+		DitherType,
+		DitherLevel,
+		PxDiffuse,
+		SqErr
+	);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include "bitmap.h"
 #include "colourspace.h"
 #include "tiles.h"
@@ -7,8 +8,15 @@
 #define DITHER_NONE           ( 0)
 #define DITHER_ORDERED(n)     ( n)
 #define DITHER_FLOYDSTEINBERG (-1)
+#define DITHER_TILE_FLOYDSTEINBERG (-2) //! Floyd-Steinberg, diffusing only within each tile
+#define DITHER_TILE_SERPENTINE     (-3) //! As above, with odd tile rows scanned right-to-left
 #define DITHER_NO_ALPHA
 
+#define DITHER_IS_ORDERED(x) ((x) > 0)
+#define DITHER_IS_TILED(x)   ((x) == DITHER_TILE_FLOYDSTEINBERG || (x) == DITHER_TILE_SERPENTINE)
+
+#define QUALETIZE_TILE_JOBS 64 //! Most jobs a tile-local dither remap is split into
+
 struct BGRAf_t Qualetize
 (
 	struct BmpCtx_t *Image,
@@ -24,3 +32,141 @@ struct BGRAf_t Qualetize
 	int   ReplaceImage,
 	bool  Order
 );
+
+//! Snap quantized palettes to the output bit depth, compute the
+//! ordered-dither spread of each palette, and optionally order colours
+//! NOTE: PaletteSpread needs MaxTilePals entries
+void Qualetize_PreparePalettes
+(
+	struct BGRAf_t *Palette,
+	struct BGRAf_t *PaletteSpread,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	bool  Order
+);
+
+//! Compute the ordered-dither spread of each palette
+//! NOTE: This is done by Qualetize_PreparePalettes() for ordered dither modes
+void Qualetize_PaletteSpread
+(
+	const struct BGRAf_t *Palette,
+	struct BGRAf_t *PaletteSpread,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	float DitherLevel
+);
+
+//! Assign each tile the palette that remaps it with the least error
+//! NOTE: For fixed palettes, in place of TilesData_QuantizeTiles()
+//! NOTE: Tiles with no visible pixels (see TilesData_t::AlphaThreshold)
+//! are given palette 0
+void Qualetize_AssignPalettes
+(
+	struct TilesData_t *TilesData,
+	const struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused
+);
+
+//! Find the palette that remaps a tile's pixels (YCoCg) with the least error
+int Qualetize_BestPalette
+(
+	const struct BGRAf_t *Px,
+	int   nPx,
+	const struct BGRAf_t *Palette,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused
+);
+
+//! Convert a (bit depth reduced) YCoCg palette for integer remapping
+void Qualetize_Palette16
+(
+	struct YCoCg16_t *Palette16,
+	const struct BGRAf_t *Palette,
+	int   nColours
+);
+
+//! Remap a band of image rows to palette indices
+//! NOTE: PxSrc (or PxSrcIdx, with PxSrc as its colour table) and PxData
+//! point to the first row of the band, which is row y0 of an ImgW*ImgH
+//! image; TilePalIdx covers the whole image
+//! NOTE: PxDiffuse holds two rows of diffused error (ImgW*2 entries),
+//! which must be cleared before the first band of an image
+//! NOTE: Tiles with TileKeep[n] set (if not NULL) keep the indices already
+//! in PxData, which still diffuse their error
+//! NOTE: If Palette16 is not NULL (see Qualetize_Palette16()), palette
+//! entries are searched with integer arithmetic
+//! NOTE: Undithered indexed sources are remapped through a table of
+//! (source colour, palette) pairs, each searched once
+//! NOTE: Pixels with alpha below AlphaThreshold (if not 0) take their
+//! palette's most transparent entry, with no error
+//! NOTE: With tile-local dither modes (DITHER_IS_TILED()), no error
+//! crosses a tile edge, so the band (which must then be whole tile rows)
+//! is remapped in parallel on the global thread pool; the output does not
+//! depend on the number of threads
+//! NOTE: Squared error (in RGBA space) is accumulated into SqErr
+void Qualetize_RemapRows
+(
+	const struct BGRA8_t *PxSrc,
+	const uint8_t *PxSrcIdx,
+	uint8_t *PxData,
+	int   ImgW,
+	int   ImgH,
+	int   y0,
+	int   nRows,
+	int   TileW,
+	int   TileH,
+	const int32_t *TilePalIdx,
+	const uint8_t *TileKeep,
+	const struct BGRAf_t *Palette,
+	const struct YCoCg16_t *Palette16,
+	const struct BGRAf_t *PaletteSpread,
+	int   MaxPalSize,
+	int   PalUnused,
+	int   AlphaThreshold,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *PxDiffuse,
+	struct BGRAf_t *SqErr
+);
+
+//! Remap a single tile (tx,ty) of an image to palette PalIdx
+//! NOTE: PxSrc (or PxSrcIdx, with PxSrc as its colour table) and PxData
+//! cover the whole image, with rows of ImgW pixels; only this tile is
+//! read and written
+//! NOTE: Ordered dithering follows image coordinates, as in a full remap,
+//! but Floyd-Steinberg error only diffuses within the tile (PxDiffuse
+//! holds TileW*2 entries), so tile-local modes give the same result here
+//! as in a full remap
+//! NOTE: Pixels with alpha below AlphaThreshold (if not 0) take the
+//! palette's most transparent entry, with no error
+//! NOTE: Squared error (in RGBA space) is accumulated into SqErr
+void Qualetize_RemapTile
+(
+	const struct BGRA8_t *PxSrc,
+	const uint8_t *PxSrcIdx,
+	uint8_t *PxData,
+	int   ImgW,
+	int   tx,
+	int   ty,
+	int   TileW,
+	int   TileH,
+	int   PalIdx,
+	const struct BGRAf_t *Palette,
+	const struct YCoCg16_t *Palette16,
+	const struct BGRAf_t *PaletteSpread,
+	int   MaxPalSize,
+	int   PalUnused,
+	int   AlphaThreshold,
+	int   DitherType,
+	float DitherLevel,
+	struct BGRAf_t *PxDiffuse,
+	struct BGRAf_t *SqErr
+);
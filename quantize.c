@@ -1,19 +1,28 @@
+#include <stddef.h>
+#include <time.h>
 #include "colourspace.h"
 #include "quantize.h"
 
+#define DATA_WEIGHT(n) (DataWeights ? DataWeights[n] : 1)
+
 static inline void QuantCluster_ClearTraining(struct QuantCluster_t *x)
 {
 	x->nPoints = 0;
 	x->Train = x->DistCenter = x->DistWeight = (struct BGRAf_t){0,0,0,0};
 }
 
-static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct BGRAf_t *Data)
+static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct BGRAf_t *Data, uint32_t Weight)
 {
+	//! NOTE: Scaling by a weight of 1 is exact, so unweighted data is unaffected
+	float w = (float)Weight;
 	struct BGRAf_t Dist = BGRAf_Sub( Data, &Dst->Centroid);
 	               Dist = BGRAf_Mul(&Dist, &Dist);
 	struct BGRAf_t wData = BGRAf_Mul(Data, &Dist);
-	Dst->nPoints++;
-	Dst->Train       = BGRAf_Add(&Dst->Train, Data);
+	struct BGRAf_t Value = BGRAf_Muli(Data, w);
+	wData = BGRAf_Muli(&wData, w);
+	Dist  = BGRAf_Muli(&Dist,  w);
+	Dst->nPoints    += Weight;
+	Dst->Train       = BGRAf_Add(&Dst->Train, &Value);
 	Dst->DistCenter  = BGRAf_Add(&Dst->DistCenter, &wData);
 	Dst->DistWeight  = BGRAf_Add(&Dst->DistWeight, &Dist);
 }
@@ -21,10 +30,10 @@ static inline void QuantCluster_Train(struct QuantCluster_t *Dst, const struct B
 static inline int QuantCluster_Resolve(struct QuantCluster_t *x)
 {
 	if(x->nPoints) x->Centroid = BGRAf_Divi(&x->Train, x->nPoints);
-	return x->nPoints;
+	return x->nPoints != 0;
 }
 
-static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCluster, int DstCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters)
+static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCluster, int DstCluster, const struct BGRAf_t *Data, const uint32_t *DataWeights, int nData, int32_t *DataClusters)
 {
 	Clusters[DstCluster].Centroid = BGRAf_DivSafe(&Clusters[SrcCluster].DistCenter, &Clusters[SrcCluster].DistWeight, &Clusters[SrcCluster].Centroid);
 
@@ -39,11 +48,11 @@ static inline void QuantCluster_Split(struct QuantCluster_t *Clusters, int SrcCl
 			float DistDst = BGRAf_ColDistance(&Data[n], &Clusters[DstCluster].Centroid);
 			if(DistSrc < DistDst)
 			{
-				QuantCluster_Train(&Clusters[SrcCluster], &Data[n]);
+				QuantCluster_Train(&Clusters[SrcCluster], &Data[n], DATA_WEIGHT(n));
 			}
 			else
 			{
-				QuantCluster_Train(&Clusters[DstCluster], &Data[n]);
+				QuantCluster_Train(&Clusters[DstCluster], &Data[n], DATA_WEIGHT(n));
 				DataClusters[n] = DstCluster;
 			}
 		}
@@ -76,26 +85,118 @@ static int QuantCluster_InsertToDistortionList(struct QuantCluster_t *Clusters,
 	return Head;
 }
 
-void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses)
+double QuantCluster_Time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1.0e-9;
+}
+
+static inline int DeadlinePassed(double Deadline)
+{
+	return Deadline != 0.0 && QuantCluster_Time() >= Deadline;
+}
+
+int QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses, double Deadline)
+{
+	return QuantCluster_QuantizeWeighted(Clusters, nCluster, Data, NULL, nData, DataClusters, nPasses, Deadline);
+}
+
+//! Run refinement passes over nClusterCur clusters
+//! NOTE: Stops early once no point changes cluster and no cluster is empty,
+//! as all further passes would then give the same result
+//! NOTE: At least one pass is always run, so DataClusters is valid; returns
+//! 0 if the deadline stopped it before convergence
+static int QuantCluster_Refine(struct QuantCluster_t *Clusters, int nClusterCur, const struct BGRAf_t *Data, const uint32_t *DataWeights, int nData, int32_t *DataClusters, int nPasses, double Deadline, int *MaxDistClusterOut, int *EmptyClusterOut)
 {
 	int i, j;
-	if(!nData) return;
+	int Pass;
+	int Ok = 1;
+	int MaxDistCluster = *MaxDistClusterOut;
+	int EmptyCluster   = *EmptyClusterOut;
+	for(Pass=0;Pass<nPasses;Pass++)
+	{
+		if(Pass && DeadlinePassed(Deadline))
+		{
+			Ok = 0;
+			break;
+		}
+		for(i=0;i<nClusterCur;i++)
+		{
+			QuantCluster_ClearTraining(&Clusters[i]);
+		}
+		int nChanged = 0;
+		for(i=0;i<nData;i++)
+		{
+			int   BestIdx  = -1;
+			float BestDist = 8.0e37f;
+			for(j=0; j<nClusterCur; j++)
+			{
+				float Dist = BGRAf_ColDistance(&Data[i], &Clusters[j].Centroid);
+				if(Dist < BestDist) BestIdx = j, BestDist = Dist;
+			}
+			nChanged += (DataClusters[i] != BestIdx);
+			DataClusters[i] = BestIdx;
+			QuantCluster_Train(&Clusters[BestIdx], &Data[i], DATA_WEIGHT(i));
+		}
 
-	QuantCluster_ClearTraining(&Clusters[0]);
+		int nResolves  =  0;
+		MaxDistCluster = -1;
+		EmptyCluster   = -1;
+		for(i=0;i<nClusterCur;i++)
+		{
+			if(QuantCluster_Resolve(&Clusters[i]))
+			{
+				MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, i, MaxDistCluster);
+				nResolves++;
+			}
+			else
+			{
+				Clusters[i].Prev = EmptyCluster;
+				EmptyCluster = i;
+			}
+		}
+		if(!nChanged && EmptyCluster == -1) break;
+
+		while(EmptyCluster != -1 && MaxDistCluster != -1)
+		{
+			int SrcCluster = MaxDistCluster; MaxDistCluster = Clusters[SrcCluster].Prev;
+			int DstCluster = EmptyCluster;   EmptyCluster   = Clusters[DstCluster].Prev;
+			MaxDistCluster = Clusters[SrcCluster].Prev;
+			QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, DataWeights, nData, DataClusters);
+			MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, SrcCluster, MaxDistCluster);
+			MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, DstCluster, MaxDistCluster);
+		}
+	}
+	*MaxDistClusterOut = MaxDistCluster;
+	*EmptyClusterOut   = EmptyCluster;
+	return Ok;
+}
+
+int QuantCluster_QuantizeWeighted(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, const uint32_t *DataWeights, int nData, int32_t *DataClusters, int nPasses, double Deadline)
+{
+	int i;
+	if(!nData) return 1;
+
+	int64_t nTotal = 0;
+	Clusters[0].Centroid = (struct BGRAf_t){0,0,0,0};
 	for(i=0;i<nData;i++)
 	{
+		struct BGRAf_t Value = BGRAf_Muli(&Data[i], (float)DATA_WEIGHT(i));
 		DataClusters[i] = 0;
-		Clusters[0].Centroid = BGRAf_Add(&Clusters[0].Centroid, &Data[i]);
+		Clusters[0].Centroid = BGRAf_Add(&Clusters[0].Centroid, &Value);
+		nTotal += DATA_WEIGHT(i);
 	}
-	Clusters[0].Centroid = BGRAf_Divi(&Clusters[0].Centroid, nData);;
+	if(!nTotal) return 1;
+	Clusters[0].Centroid = BGRAf_Divi(&Clusters[0].Centroid, nTotal);
 
 	QuantCluster_ClearTraining(&Clusters[0]);
 	for(i=0;i<nData;i++)
 	{
-		QuantCluster_Train(&Clusters[0], &Data[i]);
+		QuantCluster_Train(&Clusters[0], &Data[i], DATA_WEIGHT(i));
 	}
 	if(BGRAf_Len2(&Clusters[0].DistWeight) == 0.0f)
-		return;
+		return 1;
 	Clusters[0].Prev = -1;
 
 	int nClusterCur = 1;
@@ -103,6 +204,13 @@ void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const
 	int EmptyCluster = -1;
 	while(MaxDistCluster != -1 && nClusterCur < nCluster)
 	{
+		if(nClusterCur > 1 && DeadlinePassed(Deadline))
+		{
+			//! Clusters that were never split into get a valid (if unused) centroid
+			for(i=nClusterCur;i<nCluster;i++) Clusters[i].Centroid = Clusters[0].Centroid;
+			return 0;
+		}
+
 		int N = nClusterCur;
 		for(i=0; i<N; i++)
 		{
@@ -112,62 +220,35 @@ void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const
 
 			int SrcCluster = MaxDistCluster;
 			MaxDistCluster = Clusters[SrcCluster].Prev;
-			QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, nData, DataClusters);
+			QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, DataWeights, nData, DataClusters);
 			MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, SrcCluster, MaxDistCluster);
 			MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, DstCluster, MaxDistCluster);
 
+			//! NOTE: Clusters with no distortion are not listed, so the list may now be empty
+			if(MaxDistCluster == -1) break;
 			MaxDistCluster = Clusters[MaxDistCluster].Prev;
 			if(MaxDistCluster == -1) break;
 
 			if(nClusterCur >= nCluster) break;
 		}
 
-		int Pass;
-		for(Pass=0;Pass<nPasses;Pass++)
+		if(!QuantCluster_Refine(Clusters, nClusterCur, Data, DataWeights, nData, DataClusters, nPasses, Deadline, &MaxDistCluster, &EmptyCluster))
 		{
-			for(i=0;i<nClusterCur;i++)
-			{
-				QuantCluster_ClearTraining(&Clusters[i]);
-			}
-			for(i=0;i<nData;i++)
-			{
-				int   BestIdx  = -1;
-				float BestDist = 8.0e37f;
-				for(j=0; j<nClusterCur; j++)
-				{
-					float Dist = BGRAf_ColDistance(&Data[i], &Clusters[j].Centroid);
-					if(Dist < BestDist) BestIdx = j, BestDist = Dist;
-				}
-				DataClusters[i] = BestIdx;
-				QuantCluster_Train(&Clusters[BestIdx], &Data[i]);
-			}
-
-			int nResolves  =  0;
-			MaxDistCluster = -1;
-			EmptyCluster   = -1;
-			for(i=0;i<nClusterCur;i++)
-			{
-				if(QuantCluster_Resolve(&Clusters[i]))
-				{
-					MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, i, MaxDistCluster);
-					nResolves++;
-				}
-				else
-				{
-					Clusters[i].Prev = EmptyCluster;
-					EmptyCluster = i;
-				}
-			}
-
-			while(EmptyCluster != -1 && MaxDistCluster != -1)
-			{
-				int SrcCluster = MaxDistCluster; MaxDistCluster = Clusters[SrcCluster].Prev;
-				int DstCluster = EmptyCluster;   EmptyCluster   = Clusters[DstCluster].Prev;
-				MaxDistCluster = Clusters[SrcCluster].Prev;
-				QuantCluster_Split(Clusters, SrcCluster, DstCluster, Data, nData, DataClusters);
-				MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, SrcCluster, MaxDistCluster);
-				MaxDistCluster = QuantCluster_InsertToDistortionList(Clusters, DstCluster, MaxDistCluster);
-			}
+			for(i=nClusterCur;i<nCluster;i++) Clusters[i].Centroid = Clusters[0].Centroid;
+			return 0;
 		}
 	}
+	return 1;
+}
+
+int QuantCluster_QuantizeSeeded(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, const uint32_t *DataWeights, int nData, int32_t *DataClusters, int nPasses, double Deadline)
+{
+	int i;
+	if(!nData) return 1;
+
+	//! Seeds with no points are refilled by splitting, as when refining
+	for(i=0;i<nData;i++) DataClusters[i] = -1;
+	int MaxDistCluster = -1;
+	int EmptyCluster   = -1;
+	return QuantCluster_Refine(Clusters, nCluster, Data, DataWeights, nData, DataClusters, nPasses, Deadline, &MaxDistCluster, &EmptyCluster);
 }
@@ -1,16 +1,33 @@
 #pragma once
 
-#include "Colourspace.h"
+#include <stdint.h>
+#include "colourspace.h"
 
 struct QuantCluster_t
 {
 	int Prev;
-	int nPoints;
+	int64_t nPoints;
 	struct BGRAf_t Centroid;
 	struct BGRAf_t Train;
 	struct BGRAf_t DistCenter;
 	struct BGRAf_t DistWeight;
 };
 
+//! Get a monotonic time in seconds (for deadlines)
+double QuantCluster_Time(void);
+
 //! Perform total vector quantization
-void QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses);
+//! NOTE: If Deadline is not 0, quantization stops once QuantCluster_Time()
+//! reaches it, leaving the best centroids found so far (any clusters not
+//! yet split into duplicate the first); returns 0 if it was cut short
+int QuantCluster_Quantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses, double Deadline);
+
+//! Perform total vector quantization of weighted data
+//! NOTE: Each point counts as DataWeights[n] points (eg. histogram bins)
+int QuantCluster_QuantizeWeighted(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, const uint32_t *DataWeights, int nData, int32_t *DataClusters, int nPasses, double Deadline);
+
+//! Perform vector quantization starting from existing centroids
+//! NOTE: Clusters[0..nCluster-1].Centroid must be set on entry (eg. to
+//! the result for a similar data set); no splitting from one cluster is done
+//! NOTE: Deadline is as for QuantCluster_Quantize()
+int QuantCluster_QuantizeSeeded(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, const uint32_t *DataWeights, int nData, int32_t *DataClusters, int nPasses, double Deadline);
@@ -0,0 +1,241 @@
+#include <stddef.h>
+#include "colourspace.h"
+#include "quantize.h"
+#include "quantize16.h"
+
+//! Channel weights of YCoCg16_ColDistance()
+static const int32_t ChannelWeight[4] = {4, 1, 1, 4};
+
+static inline void YCoCg16_ToArray(const struct YCoCg16_t *x, int32_t *Out)
+{
+	Out[0] = x->y, Out[1] = x->cg, Out[2] = x->co, Out[3] = x->a;
+}
+
+static inline int16_t RoundDiv(int64_t a, int64_t b)
+{
+	return (int16_t)((a >= 0) ? (a + b/2) / b : -((-a + b/2) / b));
+}
+
+static inline void QuantCluster16_ClearTraining(struct QuantCluster16_t *x)
+{
+	int c;
+	x->nPoints = 0;
+	for(c=0;c<4;c++) x->Train[c] = x->DistCenter[c] = x->DistWeight[c] = 0;
+}
+
+static inline void QuantCluster16_Train(struct QuantCluster16_t *Dst, const struct YCoCg16_t *Data)
+{
+	int c;
+	int32_t d[4], m[4];
+	YCoCg16_ToArray(Data, d);
+	YCoCg16_ToArray(&Dst->Centroid, m);
+	Dst->nPoints++;
+	for(c=0;c<4;c++)
+	{
+		int64_t Dist = (int64_t)ChannelWeight[c] * (d[c] - m[c]) * (d[c] - m[c]);
+		Dst->Train[c]      += d[c];
+		Dst->DistCenter[c] += d[c] * Dist;
+		Dst->DistWeight[c] += Dist;
+	}
+}
+
+static inline int QuantCluster16_Resolve(struct QuantCluster16_t *x)
+{
+	if(x->nPoints)
+	{
+		x->Centroid.y  = RoundDiv(x->Train[0], x->nPoints);
+		x->Centroid.cg = RoundDiv(x->Train[1], x->nPoints);
+		x->Centroid.co = RoundDiv(x->Train[2], x->nPoints);
+		x->Centroid.a  = RoundDiv(x->Train[3], x->nPoints);
+	}
+	return x->nPoints != 0;
+}
+
+static inline void QuantCluster16_Split(struct QuantCluster16_t *Clusters, int SrcCluster, int DstCluster, const struct YCoCg16_t *Data, int nData, int32_t *DataClusters)
+{
+	int c, n;
+	struct QuantCluster16_t *Src = &Clusters[SrcCluster];
+	int32_t m[4];
+	int16_t Split[4];
+	YCoCg16_ToArray(&Src->Centroid, m);
+	for(c=0;c<4;c++) Split[c] = Src->DistWeight[c] ? RoundDiv(Src->DistCenter[c], Src->DistWeight[c]) : m[c];
+	Clusters[DstCluster].Centroid = (struct YCoCg16_t){Split[0], Split[1], Split[2], Split[3]};
+
+	QuantCluster16_ClearTraining(&Clusters[SrcCluster]);
+	QuantCluster16_ClearTraining(&Clusters[DstCluster]);
+	for(n=0;n<nData;n++)
+	{
+		if(DataClusters[n] == SrcCluster)
+		{
+			int32_t DistSrc = YCoCg16_ColDistance(&Data[n], &Clusters[SrcCluster].Centroid);
+			int32_t DistDst = YCoCg16_ColDistance(&Data[n], &Clusters[DstCluster].Centroid);
+			if(DistSrc < DistDst)
+			{
+				QuantCluster16_Train(&Clusters[SrcCluster], &Data[n]);
+			}
+			else
+			{
+				QuantCluster16_Train(&Clusters[DstCluster], &Data[n]);
+				DataClusters[n] = DstCluster;
+			}
+		}
+	}
+	QuantCluster16_Resolve(&Clusters[SrcCluster]);
+	QuantCluster16_Resolve(&Clusters[DstCluster]);
+}
+
+static inline double SplitDistortionMetric(const struct QuantCluster16_t *x)
+{
+	//! NOTE: Computed in double, as the squared sums overflow 64 bits
+	int c;
+	double Sum = 0.0;
+	for(c=0;c<4;c++) Sum += (double)x->DistWeight[c] * x->DistWeight[c];
+	return Sum;
+}
+
+static int QuantCluster16_InsertToDistortionList(struct QuantCluster16_t *Clusters, int Idx, int Head)
+{
+	int Next = -1;
+	int Prev = Head;
+	double Dist = SplitDistortionMetric(&Clusters[Idx]);
+	if(Dist != 0.0)
+	{
+		while(Prev != -1 && Dist < SplitDistortionMetric(&Clusters[Prev]))
+		{
+			Next = Prev;
+			Prev = Clusters[Prev].Prev;
+		}
+		Clusters[Idx].Prev = Prev;
+		if(Next != -1) Clusters[Next].Prev = Idx;
+		else Head = Idx;
+	}
+	return Head;
+}
+
+static int QuantCluster16_Refine(struct QuantCluster16_t *Clusters, int nClusterCur, const struct YCoCg16_t *Data, int nData, int32_t *DataClusters, int nPasses, double Deadline, int *MaxDistClusterOut, int *EmptyClusterOut)
+{
+	int i, j;
+	int Pass;
+	int Ok = 1;
+	int MaxDistCluster = *MaxDistClusterOut;
+	int EmptyCluster   = *EmptyClusterOut;
+	for(Pass=0;Pass<nPasses;Pass++)
+	{
+		if(Pass && Deadline != 0.0 && QuantCluster_Time() >= Deadline)
+		{
+			Ok = 0;
+			break;
+		}
+		for(i=0;i<nClusterCur;i++)
+		{
+			QuantCluster16_ClearTraining(&Clusters[i]);
+		}
+		int nChanged = 0;
+		for(i=0;i<nData;i++)
+		{
+			int     BestIdx  = -1;
+			int32_t BestDist = INT32_MAX;
+			for(j=0; j<nClusterCur; j++)
+			{
+				int32_t Dist = YCoCg16_ColDistance(&Data[i], &Clusters[j].Centroid);
+				if(Dist < BestDist) BestIdx = j, BestDist = Dist;
+			}
+			nChanged += (DataClusters[i] != BestIdx);
+			DataClusters[i] = BestIdx;
+			QuantCluster16_Train(&Clusters[BestIdx], &Data[i]);
+		}
+
+		MaxDistCluster = -1;
+		EmptyCluster   = -1;
+		for(i=0;i<nClusterCur;i++)
+		{
+			if(QuantCluster16_Resolve(&Clusters[i]))
+			{
+				MaxDistCluster = QuantCluster16_InsertToDistortionList(Clusters, i, MaxDistCluster);
+			}
+			else
+			{
+				Clusters[i].Prev = EmptyCluster;
+				EmptyCluster = i;
+			}
+		}
+		if(!nChanged && EmptyCluster == -1) break;
+
+		while(EmptyCluster != -1 && MaxDistCluster != -1)
+		{
+			int SrcCluster = MaxDistCluster;
+			int DstCluster = EmptyCluster; EmptyCluster = Clusters[DstCluster].Prev;
+			MaxDistCluster = Clusters[SrcCluster].Prev;
+			QuantCluster16_Split(Clusters, SrcCluster, DstCluster, Data, nData, DataClusters);
+			MaxDistCluster = QuantCluster16_InsertToDistortionList(Clusters, SrcCluster, MaxDistCluster);
+			MaxDistCluster = QuantCluster16_InsertToDistortionList(Clusters, DstCluster, MaxDistCluster);
+		}
+	}
+	*MaxDistClusterOut = MaxDistCluster;
+	*EmptyClusterOut   = EmptyCluster;
+	return Ok;
+}
+
+int QuantCluster16_Quantize(struct QuantCluster16_t *Clusters, int nCluster, const struct YCoCg16_t *Data, int nData, int32_t *DataClusters, int nPasses, double Deadline)
+{
+	int i, c;
+	if(!nData) return 1;
+
+	int64_t Sum[4] = {0,0,0,0};
+	for(i=0;i<nData;i++)
+	{
+		int32_t d[4];
+		YCoCg16_ToArray(&Data[i], d);
+		for(c=0;c<4;c++) Sum[c] += d[c];
+		DataClusters[i] = 0;
+	}
+	Clusters[0].Centroid = (struct YCoCg16_t){RoundDiv(Sum[0], nData), RoundDiv(Sum[1], nData), RoundDiv(Sum[2], nData), RoundDiv(Sum[3], nData)};
+
+	QuantCluster16_ClearTraining(&Clusters[0]);
+	for(i=0;i<nData;i++)
+	{
+		QuantCluster16_Train(&Clusters[0], &Data[i]);
+	}
+	if(SplitDistortionMetric(&Clusters[0]) == 0.0)
+		return 1;
+	Clusters[0].Prev = -1;
+
+	int nClusterCur = 1;
+	int MaxDistCluster = 0;
+	int EmptyCluster = -1;
+	while(MaxDistCluster != -1 && nClusterCur < nCluster)
+	{
+		if(nClusterCur > 1 && Deadline != 0.0 && QuantCluster_Time() >= Deadline)
+		{
+			for(i=nClusterCur;i<nCluster;i++) Clusters[i].Centroid = Clusters[0].Centroid;
+			return 0;
+		}
+
+		int N = nClusterCur;
+		for(i=0; i<N; i++)
+		{
+			int DstCluster = EmptyCluster;
+			if(DstCluster == -1) DstCluster = nClusterCur++;
+			else EmptyCluster = Clusters[DstCluster].Prev;
+
+			int SrcCluster = MaxDistCluster;
+			MaxDistCluster = Clusters[SrcCluster].Prev;
+			QuantCluster16_Split(Clusters, SrcCluster, DstCluster, Data, nData, DataClusters);
+			MaxDistCluster = QuantCluster16_InsertToDistortionList(Clusters, SrcCluster, MaxDistCluster);
+			MaxDistCluster = QuantCluster16_InsertToDistortionList(Clusters, DstCluster, MaxDistCluster);
+
+			if(MaxDistCluster == -1) break;
+			MaxDistCluster = Clusters[MaxDistCluster].Prev;
+			if(MaxDistCluster == -1) break;
+
+			if(nClusterCur >= nCluster) break;
+		}
+
+		if(!QuantCluster16_Refine(Clusters, nClusterCur, Data, nData, DataClusters, nPasses, Deadline, &MaxDistCluster, &EmptyCluster))
+		{
+			for(i=nClusterCur;i<nCluster;i++) Clusters[i].Centroid = Clusters[0].Centroid;
+			return 0;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include "colourspace.h"
+
+//! Integer counterpart of QuantCluster_t
+struct QuantCluster16_t
+{
+	int Prev;
+	int64_t nPoints;
+	struct YCoCg16_t Centroid;
+	int64_t Train[4];
+	int64_t DistCenter[4];
+	int64_t DistWeight[4];
+};
+
+//! Perform total vector quantization of integer YCoCg data
+//! NOTE: Same algorithm as QuantCluster_Quantize(), with integer distances
+//! and accumulators; centroids are rounded to the integer lattice
+//! NOTE: Deadline is as for QuantCluster_Quantize(); returns 0 if cut short
+int QuantCluster16_Quantize(struct QuantCluster16_t *Clusters, int nCluster, const struct YCoCg16_t *Data, int nData, int32_t *DataClusters, int nPasses, double Deadline);
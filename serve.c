@@ -0,0 +1,421 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "mem.h"
+#include "process.h"
+#include "qualetize.h"
+#include "serve.h"
+#include "threadpool.h"
+
+#ifdef _WIN32
+# include <fcntl.h>
+# include <io.h>
+#else
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif
+
+struct Serve_t
+{
+	struct ThreadPool_t   *Pool;
+	struct ProcessWork_t **IdleWork; //! Workspaces not in use (at most one per compute thread)
+	int nIdleWork, MaxIdleWork;
+	int nConns;
+	pthread_mutex_t Lock;
+	pthread_cond_t  NoConns;
+};
+
+struct ServeConn_t
+{
+	struct Serve_t *Serve;
+	FILE *In, *Out;
+
+	//! Current request
+	struct ProcessOpts_t Opts;
+	struct BmpCtx_t Image;
+	int Status;
+	int TilesX, TilesY;
+	struct BGRAf_t RMSE;
+	uint8_t *TilePal; //! Grows as needed
+	size_t   TilePalSize;
+
+	int Done;
+	pthread_mutex_t Lock;
+	pthread_cond_t  Finished;
+};
+
+static uint32_t GetWord(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void PutWord(uint8_t *p, uint32_t x)
+{
+	p[0] = x, p[1] = x >> 8, p[2] = x >> 16, p[3] = x >> 24;
+}
+
+static float WordToFloat(uint32_t x)
+{
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+static uint32_t FloatToWord(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	return x;
+}
+
+static struct ProcessWork_t *Serve_TakeWork(struct Serve_t *Serve)
+{
+	struct ProcessWork_t *Work = NULL;
+	pthread_mutex_lock(&Serve->Lock);
+	if(Serve->nIdleWork) Work = Serve->IdleWork[--Serve->nIdleWork];
+	pthread_mutex_unlock(&Serve->Lock);
+	if(!Work && (Work = Mem_Alloc(sizeof(struct ProcessWork_t))) != NULL) Process_WorkInit(Work);
+	return Work;
+}
+
+static void Serve_ReturnWork(struct Serve_t *Serve, struct ProcessWork_t *Work)
+{
+	pthread_mutex_lock(&Serve->Lock);
+	if(Serve->nIdleWork < Serve->MaxIdleWork) Serve->IdleWork[Serve->nIdleWork++] = Work, Work = NULL;
+	pthread_mutex_unlock(&Serve->Lock);
+	if(Work)
+	{
+		Process_WorkDestroy(Work);
+		Mem_Free(Work);
+	}
+}
+
+static void Serve_ComputeTask(void *Arg)
+{
+	struct ServeConn_t *Conn = Arg;
+	struct ProcessWork_t *Work = Serve_TakeWork(Conn->Serve);
+	if(!Work) Conn->Status = PROCESS_ERR_MEMORY;
+	else
+	{
+		struct TilesData_t *TilesData;
+		Conn->Status = Process_ImageWork(&Conn->Image, &Conn->Opts, Work, &Conn->RMSE, &TilesData);
+		if(Conn->Status == PROCESS_OK)
+		{
+			//! Copied out now, as the workspace goes back to the pool
+			int n, nTiles = Conn->TilesX * Conn->TilesY;
+			for(n=0;n<nTiles;n++) Conn->TilePal[n] = (uint8_t)TilesData->TilePalIdx[n];
+		}
+		Serve_ReturnWork(Conn->Serve, Work);
+	}
+
+	pthread_mutex_lock(&Conn->Lock);
+	Conn->Done = 1;
+	pthread_cond_signal(&Conn->Finished);
+	pthread_mutex_unlock(&Conn->Lock);
+}
+
+//! Set the options of a request
+//! NOTE: Returns 0 if any are invalid
+static int Serve_ParseOpts(struct ProcessOpts_t *Opts, const uint8_t *Header)
+{
+	//! Counts are bounded before anything is multiplied or cast to int
+	uint32_t nPalettes    = GetWord(Header + 3*4);
+	uint32_t nColours     = GetWord(Header + 4*4);
+	uint32_t CoarseFactor = GetWord(Header + 12*4);
+	uint32_t TimeBudget   = GetWord(Header + 13*4);
+	if(nPalettes < 1 || nPalettes > BMP_PALETTE_COLOURS || nColours < 1 || nColours > BMP_PALETTE_COLOURS) return 0;
+	if(nPalettes * nColours > BMP_PALETTE_COLOURS) return 0;
+	if(CoarseFactor > INT_MAX || TimeBudget > INT_MAX) return 0;
+
+	Process_DefaultOpts(Opts);
+	Opts->nPalettes                = (int)nPalettes;
+	Opts->nColoursPerPalette       = (int)nColours;
+	Opts->nUnusedColoursPerPalette = (int)GetWord(Header + 5*4);
+	Opts->TileW                    = (int)GetWord(Header + 6*4);
+	Opts->TileH                    = (int)GetWord(Header + 7*4);
+	Opts->DitherMode               = (int32_t)GetWord(Header + 9*4);
+	Opts->DitherLevel              = WordToFloat(GetWord(Header + 10*4));
+	Opts->OrderColours             = (GetWord(Header + 11*4) & SERVE_FLAG_ORDER)   != 0;
+	Opts->IntegerMode              = (GetWord(Header + 11*4) & SERVE_FLAG_INTEGER) != 0;
+	Opts->ReassignPasses           = (GetWord(Header + 11*4) & SERVE_FLAG_REASSIGN) ? SERVE_REASSIGN_PASSES : 0;
+	Opts->CoarseFactor             = (int)CoarseFactor;
+	Opts->TimeBudget               = (int)TimeBudget;
+
+	int c;
+	uint8_t Bits[4];
+	uint32_t BitDepth = GetWord(Header + 8*4);
+	for(c=0;c<4;c++)
+	{
+		Bits[c] = (BitDepth >> (c*8)) & 0xFF;
+		if(Bits[c] < 1 || Bits[c] > 8) return 0;
+	}
+	Opts->BitRange = (struct BGRA8_t){(1 << Bits[0]) - 1, (1 << Bits[1]) - 1, (1 << Bits[2]) - 1, (1 << Bits[3]) - 1};
+
+	if(Opts->CoarseFactor == 0) Opts->CoarseFactor = 1;
+	return
+		Opts->nUnusedColoursPerPalette >= 1 && Opts->nUnusedColoursPerPalette < Opts->nColoursPerPalette &&
+		Opts->TileW >= 1 && Opts->TileW <= SERVE_MAX_DIMENSION &&
+		Opts->TileH >= 1 && Opts->TileH <= SERVE_MAX_DIMENSION &&
+		Opts->DitherMode >= DITHER_TILE_SERPENTINE && Opts->DitherMode <= DITHER_ORDERED(6) &&
+		Opts->CoarseFactor >= 1 && Opts->TimeBudget >= 0;
+}
+
+static int Serve_WriteResponse(struct ServeConn_t *Conn)
+{
+	uint8_t Header[SERVE_RESPONSE_WORDS*4];
+	PutWord(Header + 0*4, SERVE_RESPONSE_MAGIC);
+	PutWord(Header + 1*4, Conn->Status);
+	PutWord(Header + 2*4, Conn->Image.Width);
+	PutWord(Header + 3*4, Conn->Image.Height);
+	PutWord(Header + 4*4, Conn->TilesX);
+	PutWord(Header + 5*4, Conn->TilesY);
+	PutWord(Header + 6*4, FloatToWord(Conn->RMSE.b));
+	PutWord(Header + 7*4, FloatToWord(Conn->RMSE.g));
+	PutWord(Header + 8*4, FloatToWord(Conn->RMSE.r));
+	PutWord(Header + 9*4, FloatToWord(Conn->RMSE.a));
+
+	int Ok = fwrite(Header, sizeof(Header), 1, Conn->Out) == 1;
+	if(Ok && Conn->Status == PROCESS_OK)
+	{
+		size_t nPx    = (size_t)Conn->Image.Width * Conn->Image.Height;
+		size_t nTiles = (size_t)Conn->TilesX * Conn->TilesY;
+		Ok = fwrite(Conn->Image.ColPal, sizeof(struct BGRA8_t), BMP_PALETTE_COLOURS, Conn->Out) == BMP_PALETTE_COLOURS &&
+		     fwrite(Conn->Image.PxIdx,  sizeof(uint8_t), nPx,    Conn->Out) == nPx &&
+		     fwrite(Conn->TilePal,      sizeof(uint8_t), nTiles, Conn->Out) == nTiles;
+	}
+	return fflush(Conn->Out) == 0 && Ok;
+}
+
+//! Read, process and answer one request
+//! NOTE: Returns 0 once the connection should be closed
+static int Serve_Request(struct ServeConn_t *Conn)
+{
+	uint8_t Header[SERVE_REQUEST_WORDS*4];
+	if(fread(Header, sizeof(Header), 1, Conn->In) != 1)
+		return 0;
+
+	uint32_t w = GetWord(Header + 1*4);
+	uint32_t h = GetWord(Header + 2*4);
+	memset(&Conn->Image, 0, sizeof(Conn->Image));
+	Conn->RMSE   = (struct BGRAf_t){0,0,0,0};
+	Conn->TilesX = Conn->TilesY = 0;
+	if(GetWord(Header) != SERVE_REQUEST_MAGIC || w < 1 || w > SERVE_MAX_DIMENSION || h < 1 || h > SERVE_MAX_DIMENSION)
+	{
+		//! The size of the pixel data is unknown, so framing is lost
+		Conn->Status = SERVE_ERR_REQUEST;
+		Serve_WriteResponse(Conn);
+		return 0;
+	}
+
+	if(!BmpCtx_Create(&Conn->Image, w, h, 0))
+	{
+		Conn->Status = PROCESS_ERR_MEMORY;
+		Serve_WriteResponse(Conn);
+		return 0;
+	}
+	if(fread(Conn->Image.PxBGR, sizeof(struct BGRA8_t), (size_t)w*h, Conn->In) != (size_t)w*h)
+	{
+		BmpCtx_Destroy(&Conn->Image);
+		return 0;
+	}
+
+	if(!Serve_ParseOpts(&Conn->Opts, Header)) Conn->Status = SERVE_ERR_REQUEST;
+	else if(w % Conn->Opts.TileW || h % Conn->Opts.TileH) Conn->Status = PROCESS_ERR_TILESIZE;
+	else
+	{
+		Conn->TilesX = w / Conn->Opts.TileW;
+		Conn->TilesY = h / Conn->Opts.TileH;
+		size_t nTiles = (size_t)Conn->TilesX * Conn->TilesY;
+		if(nTiles > Conn->TilePalSize)
+		{
+			Mem_Free(Conn->TilePal);
+			Conn->TilePal     = Mem_Alloc(nTiles);
+			Conn->TilePalSize = Conn->TilePal ? nTiles : 0;
+		}
+
+		Conn->Done = 0;
+		if(!Conn->TilePal || !ThreadPool_Submit(Conn->Serve->Pool, Serve_ComputeTask, Conn))
+			Conn->Status = PROCESS_ERR_MEMORY;
+		else
+		{
+			pthread_mutex_lock(&Conn->Lock);
+			while(!Conn->Done) pthread_cond_wait(&Conn->Finished, &Conn->Lock);
+			pthread_mutex_unlock(&Conn->Lock);
+		}
+	}
+
+	int Ok = Serve_WriteResponse(Conn);
+	BmpCtx_Destroy(&Conn->Image);
+	return Ok;
+}
+
+static struct ServeConn_t *Serve_OpenConn(struct Serve_t *Serve, FILE *In, FILE *Out)
+{
+	struct ServeConn_t *Conn = Mem_Calloc(1, sizeof(struct ServeConn_t));
+	if(!Conn) return NULL;
+	Conn->Serve = Serve;
+	Conn->In    = In;
+	Conn->Out   = Out;
+	pthread_mutex_init(&Conn->Lock, NULL);
+	pthread_cond_init(&Conn->Finished, NULL);
+	return Conn;
+}
+
+static void Serve_CloseConn(struct ServeConn_t *Conn)
+{
+	pthread_cond_destroy(&Conn->Finished);
+	pthread_mutex_destroy(&Conn->Lock);
+	Mem_Free(Conn->TilePal);
+	Mem_Free(Conn);
+}
+
+#ifndef _WIN32
+
+static void *Serve_ConnThread(void *Arg)
+{
+	struct ServeConn_t *Conn = Arg;
+	struct Serve_t *Serve = Conn->Serve;
+	while(Serve_Request(Conn));
+	fclose(Conn->In);
+	fclose(Conn->Out);
+	Serve_CloseConn(Conn);
+
+	pthread_mutex_lock(&Serve->Lock);
+	if(--Serve->nConns == 0) pthread_cond_signal(&Serve->NoConns);
+	pthread_mutex_unlock(&Serve->Lock);
+	return NULL;
+}
+
+static int Serve_Listen(struct Serve_t *Serve, const char *SocketPath)
+{
+	struct sockaddr_un Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	if(strlen(SocketPath) >= sizeof(Addr.sun_path))
+	{
+		fprintf(stderr, "Socket path too long\n");
+		return 0;
+	}
+	strcpy(Addr.sun_path, SocketPath);
+
+	//! Replace a socket left behind by a previous server (but nothing else)
+	struct stat st;
+	if(stat(SocketPath, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(SocketPath);
+
+	int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(Fd < 0 || bind(Fd, (struct sockaddr*)&Addr, sizeof(Addr)) < 0 || listen(Fd, SOMAXCONN) < 0)
+	{
+		fprintf(stderr, "Unable to listen on %s: %s\n", SocketPath, strerror(errno));
+		if(Fd >= 0) close(Fd);
+		return 0;
+	}
+
+	//! Clients that disconnect early must not end the server
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "Listening on %s (%d threads)...\n", SocketPath, ThreadPool_nThreads(Serve->Pool));
+	for(;;)
+	{
+		int ConnFd = accept(Fd, NULL, NULL);
+		if(ConnFd < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "Unable to accept connection: %s\n", strerror(errno));
+			break;
+		}
+
+		//! Separate streams for each direction, so buffering doesn't mix
+		int WriteFd = dup(ConnFd);
+		FILE *In  = fdopen(ConnFd, "rb");
+		FILE *Out = (WriteFd >= 0) ? fdopen(WriteFd, "wb") : NULL;
+		struct ServeConn_t *Conn = (In && Out) ? Serve_OpenConn(Serve, In, Out) : NULL;
+
+		pthread_t Thread;
+		pthread_mutex_lock(&Serve->Lock);
+		Serve->nConns++;
+		pthread_mutex_unlock(&Serve->Lock);
+		if(Conn && pthread_create(&Thread, NULL, Serve_ConnThread, Conn) == 0)
+		{
+			pthread_detach(Thread);
+			continue;
+		}
+		pthread_mutex_lock(&Serve->Lock);
+		Serve->nConns--;
+		pthread_mutex_unlock(&Serve->Lock);
+		if(Conn) Serve_CloseConn(Conn);
+		if(In)  fclose(In);  else close(ConnFd);
+		if(Out) fclose(Out); else if(WriteFd >= 0) close(WriteFd);
+	}
+
+	close(Fd);
+	unlink(SocketPath);
+
+	pthread_mutex_lock(&Serve->Lock);
+	while(Serve->nConns) pthread_cond_wait(&Serve->NoConns, &Serve->Lock);
+	pthread_mutex_unlock(&Serve->Lock);
+	return 1;
+}
+
+#endif
+
+int Serve_Run(const char *SocketPath, int nThreads)
+{
+	struct Serve_t Serve;
+	memset(&Serve, 0, sizeof(Serve));
+	Serve.Pool        = ThreadPool_Global(nThreads);
+	Serve.MaxIdleWork = Serve.Pool ? ThreadPool_nThreads(Serve.Pool) : 0;
+	Serve.IdleWork    = Mem_Calloc(Serve.MaxIdleWork ? Serve.MaxIdleWork : 1, sizeof(struct ProcessWork_t*));
+	if(!Serve.Pool || !Serve.IdleWork)
+	{
+		fprintf(stderr, "Out of memory - Server not started\n");
+		Mem_Free(Serve.IdleWork);
+		return 0;
+	}
+	pthread_mutex_init(&Serve.Lock, NULL);
+	pthread_cond_init(&Serve.NoConns, NULL);
+
+	int Ok = 1;
+	if(SocketPath)
+	{
+#ifdef _WIN32
+		fprintf(stderr, "Sockets are not available on this platform; use -serve alone for stdin/stdout\n");
+		Ok = 0;
+#else
+		Ok = Serve_Listen(&Serve, SocketPath);
+#endif
+	}
+	else
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdin),  _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		struct ServeConn_t *Conn = Serve_OpenConn(&Serve, stdin, stdout);
+		if(!Conn) Ok = 0;
+		else
+		{
+			while(Serve_Request(Conn));
+			Serve_CloseConn(Conn);
+		}
+	}
+
+	//! Wait for any compute still running before releasing workspaces
+	ThreadPool_Wait(Serve.Pool);
+	while(Serve.nIdleWork)
+	{
+		struct ProcessWork_t *Work = Serve.IdleWork[--Serve.nIdleWork];
+		Process_WorkDestroy(Work);
+		Mem_Free(Work);
+	}
+	Mem_Free(Serve.IdleWork);
+	pthread_cond_destroy(&Serve.NoConns);
+	pthread_mutex_destroy(&Serve.Lock);
+	return Ok;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+//! Quantization server, for tools that make many small requests
+//!
+//! Requests and responses are framed as little-endian 32-bit words,
+//! followed by byte data. A request is:
+//!  SERVE_REQUEST_MAGIC, Width, Height,
+//!  nPalettes, nColoursPerPalette, nUnusedColoursPerPalette, TileW, TileH,
+//!  BitDepth (bits per channel: b | g<<8 | r<<16 | a<<24),
+//!  DitherMode (DITHER_* value), DitherLevel (float bits),
+//!  Flags (SERVE_FLAG_*), CoarseFactor (0 = off), TimeBudget (ms, 0 = none),
+//!  then Width*Height BGRA pixels (4 bytes each, top-down)
+//! (nUnusedColoursPerPalette must be at least 1, as on the command line)
+//! and the response is:
+//!  SERVE_RESPONSE_MAGIC, Status (PROCESS_OK, PROCESS_ERR_* or SERVE_ERR_*),
+//!  Width, Height, TilesX, TilesY, RMSE (4 words of float bits: Y, Cg, Co, A),
+//!  then only if Status is PROCESS_OK:
+//!  BMP_PALETTE_COLOURS BGRA palette entries (4 bytes each),
+//!  Width*Height palette indices (1 byte each, top-down),
+//!  TilesX*TilesY tile palette numbers (1 byte each)
+//! Any number of requests may be sent on one connection, and are answered
+//! in order; the connection is closed after a malformed request.
+
+#define SERVE_REQUEST_MAGIC  0x314A5154 //! "TQJ1"
+#define SERVE_RESPONSE_MAGIC 0x31525154 //! "TQR1"
+#define SERVE_REQUEST_WORDS  14
+#define SERVE_RESPONSE_WORDS 10
+
+#define SERVE_FLAG_ORDER   (1 << 0) //! Order colours in palettes
+#define SERVE_FLAG_INTEGER (1 << 1) //! Use the integer colour pipeline
+#define SERVE_FLAG_REASSIGN (1 << 2) //! Reassign tiles by remap error (SERVE_REASSIGN_PASSES passes)
+
+#define SERVE_REASSIGN_PASSES 2
+
+#define SERVE_ERR_REQUEST 16 //! Invalid options
+
+#define SERVE_MAX_DIMENSION 16384
+
+//! Serve requests on a Unix domain socket, or on stdin/stdout if
+//! SocketPath is NULL, with compute spread across the process-wide pool
+//! NOTE: Each connection is read and written on its own thread; tile
+//! buffers are kept warm between requests on the compute threads
+//! NOTE: Runs until the socket fails (or stdin is closed); returns 0 if
+//! the server could not be started
+int Serve_Run(const char *SocketPath, int nThreads);
@@ -0,0 +1,379 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "histogram.h"
+#include "mem.h"
+#include "process.h"
+#include "qualetize.h"
+#include "quantize.h"
+#include "stats.h"
+#include "tiles.h"
+
+#define STATS_MAGIC 0x31535154 //! "TQS1"
+
+struct StatsHeader_t
+{
+	uint32_t Magic;
+	int32_t  TileW, TileH;
+	int32_t  nClasses;
+};
+
+//! Class header; followed by nEntries histogram entries
+struct StatsClassHeader_t
+{
+	uint64_t nTiles;
+	struct BGRAf_t TileValue;
+	int32_t  Shift;
+	uint32_t nEntries;
+};
+
+//! Mean of weighted tile values, summed in double precision
+struct StatsMean_t
+{
+	double b, g, r, a;
+	uint64_t n;
+};
+
+static inline void StatsMean_Add(struct StatsMean_t *Mean, const struct BGRAf_t *x, uint64_t n)
+{
+	Mean->b += (double)x->b * n;
+	Mean->g += (double)x->g * n;
+	Mean->r += (double)x->r * n;
+	Mean->a += (double)x->a * n;
+	Mean->n += n;
+}
+
+static inline struct BGRAf_t StatsMean_Get(const struct StatsMean_t *Mean)
+{
+	double n = Mean->n ? (double)Mean->n : 1.0;
+	return (struct BGRAf_t){Mean->b / n, Mean->g / n, Mean->r / n, Mean->a / n};
+}
+
+/**************************************/
+
+void Stats_Init(struct Stats_t *Stats, int TileW, int TileH)
+{
+	Stats->TileW    = TileW;
+	Stats->TileH    = TileH;
+	Stats->nClasses = 0;
+	Stats->Classes  = NULL;
+}
+
+void Stats_Destroy(struct Stats_t *Stats)
+{
+	int i;
+	for(i=0;i<Stats->nClasses;i++) ColourHist_Destroy(&Stats->Classes[i].Hist);
+	Mem_Free(Stats->Classes);
+	Stats->nClasses = 0;
+	Stats->Classes  = NULL;
+}
+
+//! Combine the classes into at most nTarget, by clustering their tile values
+//! NOTE: On failure, Stats is left unchanged
+static int Stats_Reduce(struct Stats_t *Stats, int nTarget)
+{
+	int i;
+	int n = Stats->nClasses;
+	if(n <= nTarget) return 1;
+
+	struct BGRAf_t        *Data     = Mem_Alloc(n * sizeof(struct BGRAf_t));
+	uint32_t              *Weights  = Mem_Alloc(n * sizeof(uint32_t));
+	int32_t               *Group    = Mem_Alloc(n * sizeof(int32_t));
+	struct StatsMean_t    *Means    = Mem_Calloc(nTarget, sizeof(struct StatsMean_t));
+	struct QuantCluster_t *Clusters = Mem_Calloc(nTarget, sizeof(struct QuantCluster_t));
+	struct StatsClass_t   *Classes  = Mem_Calloc(nTarget, sizeof(struct StatsClass_t));
+	int Ok = Data && Weights && Group && Means && Clusters && Classes;
+	if(Ok)
+	{
+		for(i=0;i<n;i++)
+		{
+			Data[i]    = Stats->Classes[i].TileValue;
+			Weights[i] = (Stats->Classes[i].nTiles > UINT32_MAX) ? UINT32_MAX : (uint32_t)Stats->Classes[i].nTiles;
+		}
+		QuantCluster_QuantizeWeighted(Clusters, nTarget, Data, Weights, n, Group, MAX_PALETTE_INDICES_PASSES, 0.0);
+		for(i=0;i<n;i++) StatsMean_Add(&Means[Group[i]], &Stats->Classes[i].TileValue, Stats->Classes[i].nTiles);
+	}
+
+	//! Groups that received no classes are dropped
+	int nClasses = 0;
+	for(i=0; Ok && i<nTarget; i++) if(Means[i].n)
+	{
+		int j;
+		struct StatsClass_t *Class = &Classes[nClasses++];
+		Class->nTiles    = Means[i].n;
+		Class->TileValue = StatsMean_Get(&Means[i]);
+		Ok = ColourHist_Init(&Class->Hist, STATS_HISTOGRAM_ENTRIES / nTarget);
+		for(j=0; Ok && j<n; j++) if(Group[j] == i)
+			Ok = ColourHist_Merge(&Class->Hist, &Stats->Classes[j].Hist);
+	}
+
+	if(Ok)
+	{
+		struct StatsClass_t *Old = Stats->Classes;
+		Stats->Classes = Classes, Classes = Old;
+		Stats->nClasses = nClasses, nClasses = n;
+	}
+	if(Classes) for(i=0;i<nClasses;i++) ColourHist_Destroy(&Classes[i].Hist);
+	Mem_Free(Classes);
+	Mem_Free(Clusters);
+	Mem_Free(Means);
+	Mem_Free(Group);
+	Mem_Free(Weights);
+	Mem_Free(Data);
+	return Ok;
+}
+
+/**************************************/
+
+int Stats_FromImage(struct Stats_t *Stats, const struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts)
+{
+	int i, x, y;
+	int ImgW  = Image->Width;
+	int ImgH  = Image->Height;
+	int TileW = Opts->TileW;
+	int TileH = Opts->TileH;
+	Stats_Init(Stats, TileW, TileH);
+	if(TileW <= 0 || TileH <= 0 || ImgW%TileW || ImgH%TileH) return PROCESS_ERR_TILESIZE;
+
+	struct TilesData_t *TilesData = TilesData_Convert(Image, TileW, TileH);
+	if(!TilesData) return PROCESS_ERR_MEMORY;
+	int nTileX = TilesData->TilesX;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+
+	//! Tiles with no visible pixels are left out, as when quantizing
+	int nVisible = 0;
+	TilesData->AlphaThreshold = Opts->AlphaThreshold;
+	for(i=0;i<nTiles;i++) if(TilesData_TileVisible(TilesData, i)) TilesData->TileValue[nVisible++] = TilesData->TileValue[i];
+	if(!nVisible)
+	{
+		Mem_Free(TilesData);
+		return PROCESS_OK;
+	}
+
+	int nClasses = Opts->nPalettes * STATS_CLASSES_PER_PALETTE;
+	if(nClasses > STATS_MAX_CLASSES) nClasses = STATS_MAX_CLASSES;
+	if(nClasses > nVisible) nClasses = nVisible;
+	int32_t               *TileClass = Mem_Alloc(nTiles * sizeof(int32_t));
+	struct StatsMean_t    *Means     = Mem_Calloc(nClasses, sizeof(struct StatsMean_t));
+	struct QuantCluster_t *Clusters  = Mem_Calloc(nClasses, sizeof(struct QuantCluster_t));
+	Stats->Classes = Mem_Calloc(nClasses, sizeof(struct StatsClass_t));
+	int Ok = TileClass && Means && Clusters && Stats->Classes;
+	if(Ok)
+	{
+		Stats->nClasses = nClasses;
+		QuantCluster_Quantize(Clusters, nClasses, TilesData->TileValue, nVisible, TileClass, MAX_PALETTE_INDICES_PASSES, 0.0);
+		for(i=0;i<nVisible;i++) StatsMean_Add(&Means[TileClass[i]], &TilesData->TileValue[i], 1);
+
+		//! Spread the classes back out over all tiles (-1 if left out)
+		int k = nVisible;
+		for(i=nTiles-1;i>=0;i--) TileClass[i] = TilesData_TileVisible(TilesData, i) ? TileClass[--k] : -1;
+		for(i=0; Ok && i<nClasses; i++)
+		{
+			Stats->Classes[i].nTiles    = Means[i].n;
+			Stats->Classes[i].TileValue = StatsMean_Get(&Means[i]);
+			Ok = ColourHist_Init(&Stats->Classes[i].Hist, STATS_HISTOGRAM_ENTRIES / nClasses);
+		}
+	}
+	Mem_Free(Clusters);
+	Mem_Free(Means);
+	Mem_Free(TilesData);
+
+	for(y=0; Ok && y<ImgH; y++)
+	{
+		const int32_t *RowClass = TileClass + (y/TileH)*nTileX;
+		for(x=0; Ok && x<ImgW;)
+		{
+			//! Add runs of identical colours in one go
+			size_t Offs = (size_t)y*ImgW;
+			struct BGRA8_t Col = Image->ColPal ? Image->ColPal[Image->PxIdx[Offs+x]] : Image->PxBGR[Offs+x];
+			int n = 1;
+			int xEnd = (x/TileW + 1) * TileW;
+			if(Image->ColPal) while(x+n < xEnd && Image->PxIdx[Offs+x+n] == Image->PxIdx[Offs+x]) n++;
+			else while(x+n < xEnd && !memcmp(&Image->PxBGR[Offs+x+n], &Col, sizeof(Col))) n++;
+			if(RowClass[x/TileW] >= 0 && Col.a >= Opts->AlphaThreshold)
+				Ok = ColourHist_Add(&Stats->Classes[RowClass[x/TileW]].Hist, Col, n);
+			x += n;
+		}
+	}
+	Mem_Free(TileClass);
+	if(!Ok)
+	{
+		Stats_Destroy(Stats);
+		return PROCESS_ERR_MEMORY;
+	}
+
+	//! Classes that were never split into are dropped
+	int nKept = 0;
+	for(i=0;i<Stats->nClasses;i++)
+	{
+		if(Stats->Classes[i].nTiles) Stats->Classes[nKept++] = Stats->Classes[i];
+		else ColourHist_Destroy(&Stats->Classes[i].Hist);
+	}
+	Stats->nClasses = nKept;
+	return PROCESS_OK;
+}
+
+int Stats_Merge(struct Stats_t *Dst, struct Stats_t *Src)
+{
+	if(Dst->TileW != Src->TileW || Dst->TileH != Src->TileH) return 0;
+	if(!Src->nClasses) return 1;
+
+	int n = Dst->nClasses + Src->nClasses;
+	struct StatsClass_t *Classes = Mem_Realloc(Dst->Classes, n * sizeof(struct StatsClass_t));
+	if(!Classes) return 0;
+	memcpy(Classes + Dst->nClasses, Src->Classes, Src->nClasses * sizeof(struct StatsClass_t));
+	Dst->Classes  = Classes;
+	Dst->nClasses = n;
+	Mem_Free(Src->Classes);
+	Src->Classes  = NULL;
+	Src->nClasses = 0;
+
+	//! Reducing to half the limit leaves room for the next merges
+	if(n > STATS_MAX_CLASSES) return Stats_Reduce(Dst, STATS_MAX_CLASSES/2);
+	return 1;
+}
+
+int Stats_BuildPalettes(struct Stats_t *Stats, const struct ProcessOpts_t *Opts, struct BGRA8_t *PalBGR)
+{
+	int i, j;
+	int MaxTilePals = Opts->nPalettes;
+	int MaxPalSize  = Opts->nColoursPerPalette;
+	int PalUnused   = Opts->nUnusedColoursPerPalette;
+	if(!Stats->nClasses || MaxTilePals < 1 || MaxPalSize <= PalUnused || MaxTilePals*MaxPalSize > BMP_PALETTE_COLOURS) return 0;
+	if(!Stats_Reduce(Stats, MaxTilePals)) return 0;
+
+	struct BGRAf_t Palette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+	struct BGRAf_t PaletteSpread[BMP_PALETTE_COLOURS];
+	struct QuantCluster_t *Clusters = Mem_Calloc(MaxPalSize, sizeof(struct QuantCluster_t));
+	if(!Clusters) return 0;
+	for(i=0;i<MaxTilePals;i++)
+	{
+		struct BGRAf_t *Pal = Palette + i*MaxPalSize;
+
+		//! With fewer classes than palettes, the spare palettes repeat the
+		//! last one (remapping picks either, so the output is the same)
+		if(i >= Stats->nClasses)
+		{
+			memcpy(Pal, Pal - MaxPalSize, MaxPalSize * sizeof(struct BGRAf_t));
+			continue;
+		}
+
+		const struct ColourHist_t *Hist = &Stats->Classes[i].Hist;
+		int nData = Hist->nEntries;
+		struct BGRAf_t *Data        = Mem_Alloc((size_t)nData * sizeof(struct BGRAf_t));
+		uint32_t       *Weights     = Mem_Alloc((size_t)nData * sizeof(uint32_t));
+		int32_t        *DataCluster = Mem_Alloc((size_t)nData * sizeof(int32_t));
+		if(!Data || !Weights || !DataCluster)
+		{
+			Mem_Free(DataCluster);
+			Mem_Free(Weights);
+			Mem_Free(Data);
+			Mem_Free(Clusters);
+			return 0;
+		}
+
+		nData = ColourHist_ToData(Hist, Data, Weights);
+		memset(Clusters, 0, MaxPalSize * sizeof(struct QuantCluster_t));
+		QuantCluster_QuantizeWeighted(Clusters, MaxPalSize-PalUnused, Data, Weights, nData, DataCluster, MAX_PALETTE_QUANTIZATION_PASSES, 0.0);
+		Mem_Free(DataCluster);
+		Mem_Free(Weights);
+		Mem_Free(Data);
+
+		for(j=0; j<MaxPalSize-PalUnused; j++)
+			*Pal++ = Clusters[j].Centroid;
+
+		for(j=0; j<PalUnused; j++)
+			*Pal++ = BGRAf_AsYCoCg(&(struct BGRAf_t){1,1,1,0});
+	}
+	Mem_Free(Clusters);
+
+	Qualetize_PreparePalettes(Palette, PaletteSpread, MaxTilePals, MaxPalSize, PalUnused, &Opts->BitRange, Opts->DitherMode, Opts->DitherLevel, Opts->OrderColours);
+	for(i=0;i<MaxTilePals*MaxPalSize;i++)
+	{
+		struct BGRAf_t x = BGRAf_FromYCoCg(&Palette[i]);
+		PalBGR[i] = BGRA8_FromBGRAf(&x);
+	}
+	return 1;
+}
+
+/**************************************/
+
+int Stats_Write(const struct Stats_t *Stats, const char *Filename)
+{
+	int i;
+	uint32_t j;
+	FILE *File = fopen(Filename, "wb");
+	if(!File) return 0;
+
+	struct StatsHeader_t Header = {STATS_MAGIC, Stats->TileW, Stats->TileH, Stats->nClasses};
+	int Ok = (fwrite(&Header, sizeof(Header), 1, File) == 1);
+	for(i=0; Ok && i<Stats->nClasses; i++)
+	{
+		const struct StatsClass_t *Class = &Stats->Classes[i];
+		struct StatsClassHeader_t ClassHeader;
+		memset(&ClassHeader, 0, sizeof(ClassHeader));
+		ClassHeader.nTiles    = Class->nTiles;
+		ClassHeader.TileValue = Class->TileValue;
+		ClassHeader.Shift     = Class->Hist.Shift;
+		ClassHeader.nEntries  = Class->Hist.nEntries;
+		Ok = (fwrite(&ClassHeader, sizeof(ClassHeader), 1, File) == 1);
+
+		//! Only the used slots are stored
+		for(j=0; Ok && j<Class->Hist.Capacity; j++) if(Class->Hist.Entries[j].Count)
+			Ok = (fwrite(&Class->Hist.Entries[j], sizeof(struct ColourHistEntry_t), 1, File) == 1);
+	}
+	Ok = (fclose(File) == 0) && Ok;
+	if(!Ok) remove(Filename);
+	return Ok;
+}
+
+int Stats_Read(struct Stats_t *Stats, const char *Filename)
+{
+	int i;
+	uint32_t j;
+	FILE *File = fopen(Filename, "rb");
+	if(!File) return 0;
+
+	struct StatsHeader_t Header;
+	if(fread(&Header, sizeof(Header), 1, File) != 1 ||
+	   Header.Magic != STATS_MAGIC ||
+	   Header.TileW <= 0 || Header.TileH <= 0 ||
+	   Header.nClasses < 0 || Header.nClasses > STATS_MAX_CLASSES)
+	{
+		fclose(File);
+		return 0;
+	}
+
+	Stats_Init(Stats, Header.TileW, Header.TileH);
+	Stats->Classes = Mem_Calloc(Header.nClasses ? Header.nClasses : 1, sizeof(struct StatsClass_t));
+	int Ok = (Stats->Classes != NULL);
+	for(i=0; Ok && i<Header.nClasses; i++)
+	{
+		struct StatsClass_t *Class = &Stats->Classes[i];
+		struct StatsClassHeader_t ClassHeader;
+		Ok = (fread(&ClassHeader, sizeof(ClassHeader), 1, File) == 1) && ClassHeader.Shift >= 0 && ClassHeader.Shift <= 7;
+		if(!Ok) break;
+
+		//! Keep the stored precision, even past the usual share of entries
+		uint32_t MaxEntries = STATS_HISTOGRAM_ENTRIES / Header.nClasses;
+		if(MaxEntries < ClassHeader.nEntries) MaxEntries = ClassHeader.nEntries;
+		Class->nTiles    = ClassHeader.nTiles;
+		Class->TileValue = ClassHeader.TileValue;
+		Ok = ColourHist_Init(&Class->Hist, MaxEntries);
+		if(!Ok) break;
+		Stats->nClasses++;
+		Class->Hist.Shift = ClassHeader.Shift;
+		for(j=0; Ok && j<ClassHeader.nEntries; j++)
+		{
+			struct ColourHistEntry_t Entry;
+			Ok = (fread(&Entry, sizeof(Entry), 1, File) == 1) &&
+			     ColourHist_Add(&Class->Hist, ColourHist_KeyColour(Entry.Key, ClassHeader.Shift), Entry.Count);
+		}
+	}
+	fclose(File);
+	if(!Ok) Stats_Destroy(Stats);
+	return Ok;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "histogram.h"
+#include "process.h"
+
+#define STATS_EXT ".tqs"
+#define STATS_CLASSES_PER_PALETTE 4       //! Tile classes collected per palette, so merged shards can be re-split
+#define STATS_MAX_CLASSES       256       //! Merging reduces to half this once it is exceeded
+#define STATS_HISTOGRAM_ENTRIES (1 << 18) //! Shared between all classes
+
+//! A class of similar tiles
+//! NOTE: This is all palette building needs: tile classes are clustered
+//! into palettes by TileValue (weighted by nTiles), and each palette's
+//! colours are then clustered from the merged histograms of its classes
+struct StatsClass_t
+{
+	uint64_t nTiles;
+	struct BGRAf_t TileValue; //! Mean tile value (as for tile clustering)
+	struct ColourHist_t Hist; //! Colours of the tiles' pixels
+};
+
+//! Palette-building statistics of one or more images
+//! NOTE: Statistics of separate images (or parts of one image) can be
+//! collected independently, written to file, and merged, so that palettes
+//! can be built without holding every pixel in one process
+struct Stats_t
+{
+	int TileW, TileH;
+	int nClasses;
+	struct StatsClass_t *Classes;
+};
+
+//! Initialize empty statistics
+void Stats_Init(struct Stats_t *Stats, int TileW, int TileH);
+void Stats_Destroy(struct Stats_t *Stats);
+
+//! Collect the statistics of an image
+//! NOTE: Tiles are clustered into STATS_CLASSES_PER_PALETTE classes per
+//! palette (Opts->nPalettes), using the tile size in Opts
+//! NOTE: Tiles and pixels left out by Opts->AlphaThreshold are not counted
+//! NOTE: Returns PROCESS_OK or PROCESS_ERR_*
+int Stats_FromImage(struct Stats_t *Stats, const struct BmpCtx_t *Image, const struct ProcessOpts_t *Opts);
+
+//! Merge statistics, moving the classes of Src into Dst (Src is left empty)
+//! NOTE: Past STATS_MAX_CLASSES, similar classes are combined
+//! NOTE: Returns 0 on failure (including different tile sizes)
+int Stats_Merge(struct Stats_t *Dst, struct Stats_t *Src);
+
+//! Build a palette bank of Opts->nPalettes*Opts->nColoursPerPalette colours
+//! NOTE: Stats are reduced to at most Opts->nPalettes classes
+//! NOTE: Colours are snapped to Opts->BitRange, and ordered if requested
+int Stats_BuildPalettes(struct Stats_t *Stats, const struct ProcessOpts_t *Opts, struct BGRA8_t *Palette);
+
+//! Write/read statistics
+//! NOTE: Files are in native byte order, and only read back on machines
+//! that share it (foreign files fail to read)
+int Stats_Write(const struct Stats_t *Stats, const char *Filename);
+int Stats_Read(struct Stats_t *Stats, const char *Filename);
@@ -0,0 +1,282 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "histogram.h"
+#include "mem.h"
+#include "qualetize.h"
+#include "quantize.h"
+#include "stream.h"
+#include "tiles.h"
+
+int Stream_Qualetize(
+	const char *InputFile,
+	const char *OutputFile,
+	int   TileW,
+	int   TileH,
+	int   StripTiles,
+	int   HistEntries,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	bool  OrderColours,
+	struct BGRAf_t *RMSE
+) {
+	int i, j, y;
+	int Ok = 0;
+
+	struct BmpStream_t In, Out;
+	if(!BmpStream_Open(&In, InputFile))
+	{
+		printf("Unable to read input file\n");
+		return 0;
+	}
+	memset(&Out, 0, sizeof(Out));
+
+	int ImgW = In.Width;
+	int ImgH = In.Height;
+	if(ImgW%TileW || ImgH%TileH)
+	{
+		printf("Image not a multiple of tile size (%dx%d)\n", TileW, TileH);
+		BmpStream_Close(&In);
+		return 0;
+	}
+
+	int64_t nTiles64  = (int64_t)(ImgW/TileW) * (ImgH/TileH);
+	int     nTileX    = ImgW / TileW;
+	int     StripRows = StripTiles * TileH;
+	if(nTiles64 > INT_MAX)
+	{
+		printf("Too many tiles in image\n");
+		BmpStream_Close(&In);
+		return 0;
+	}
+	int nTiles = (int)nTiles64;
+
+	int nClusters = MaxTilePals > MaxPalSize ? MaxTilePals : MaxPalSize;
+	struct BGRA8_t        *PxStrip    = Mem_Alloc((size_t)ImgW * StripRows * sizeof(struct BGRA8_t));
+	uint8_t               *PxIdxStrip = Mem_Alloc((size_t)ImgW * StripRows * sizeof(uint8_t));
+	struct BGRAf_t        *PxDiffuse  = Mem_Calloc((size_t)ImgW * 2,        sizeof(struct BGRAf_t));
+	struct BGRAf_t        *TileValue  = Mem_Alloc((size_t)nTiles           * sizeof(struct BGRAf_t));
+	int32_t               *TilePalIdx = Mem_Alloc((size_t)nTiles           * sizeof(int32_t));
+	struct QuantCluster_t *Clusters   = Mem_Calloc(nClusters,                 sizeof(struct QuantCluster_t));
+	struct ColourHist_t   *Hist       = Mem_Calloc(MaxTilePals,               sizeof(struct ColourHist_t));
+	struct BGRAf_t         Palette[BMP_PALETTE_COLOURS] = {{0,0,0,0}};
+	struct BGRAf_t         PaletteSpread[BMP_PALETTE_COLOURS];
+	struct BGRA8_t         PalBGR[BMP_PALETTE_COLOURS];
+	if(!PxStrip || !PxIdxStrip || !PxDiffuse || !TileValue || !TilePalIdx || !Clusters || !Hist)
+	{
+		printf("Out of memory - Image not processed\n");
+		goto Cleanup;
+	}
+
+	struct BmpCtx_t Strip;
+	memset(&Strip, 0, sizeof(Strip));
+	Strip.Width = ImgW;
+	Strip.PxBGR = PxStrip;
+
+	//! Pass 1: Tile values
+	printf("Pass 1: Tile values...\n");
+	for(y=0;y<ImgH;y+=StripRows)
+	{
+		int nRows = (ImgH-y < StripRows) ? (ImgH-y) : StripRows;
+		if(!BmpStream_ReadRows(&In, y, nRows, PxStrip)) goto ReadError;
+
+		Strip.Height = nRows;
+		struct TilesData_t *TilesData = TilesData_Convert(&Strip, TileW, TileH);
+		if(!TilesData)
+		{
+			printf("Out of memory - Image not processed\n");
+			goto Cleanup;
+		}
+		memcpy(TileValue + (size_t)(y/TileH)*nTileX, TilesData->TileValue, (size_t)(nRows/TileH)*nTileX * sizeof(struct BGRAf_t));
+		Mem_Free(TilesData);
+	}
+	QuantCluster_Quantize(Clusters, MaxTilePals, TileValue, nTiles, TilePalIdx, MAX_PALETTE_INDICES_PASSES, 0.0);
+	Mem_Free(TileValue), TileValue = NULL;
+
+	//! Pass 2: Colour statistics for each palette
+	printf("Pass 2: Palette statistics...\n");
+	for(i=0;i<MaxTilePals;i++) if(!ColourHist_Init(&Hist[i], (uint32_t)(HistEntries / MaxTilePals)))
+	{
+		printf("Out of memory - Image not processed\n");
+		goto Cleanup;
+	}
+	for(y=0;y<ImgH;y+=StripRows)
+	{
+		int nRows = (ImgH-y < StripRows) ? (ImgH-y) : StripRows;
+		if(!BmpStream_ReadRows(&In, y, nRows, PxStrip)) goto ReadError;
+
+		int r, x;
+		for(r=0;r<nRows;r++)
+		{
+			const struct BGRA8_t *Row = PxStrip + (size_t)r*ImgW;
+			const int32_t *RowPalIdx = TilePalIdx + (size_t)((y+r)/TileH)*nTileX;
+			for(x=0;x<ImgW;)
+			{
+				//! Add runs of identical colours in one go
+				int n = 1;
+				int PalIdx = RowPalIdx[x/TileW];
+				int xEnd   = (x/TileW + 1) * TileW;
+				while(x+n < xEnd && !memcmp(&Row[x+n], &Row[x], sizeof(struct BGRA8_t))) n++;
+				if(!ColourHist_Add(&Hist[PalIdx], Row[x], n))
+				{
+					printf("Out of memory - Image not processed\n");
+					goto Cleanup;
+				}
+				x += n;
+			}
+		}
+	}
+
+	for(i=0;i<MaxTilePals;i++)
+	{
+		int nData = Hist[i].nEntries;
+		struct BGRAf_t *Data        = Mem_Alloc((size_t)nData * sizeof(struct BGRAf_t));
+		uint32_t       *Weights     = Mem_Alloc((size_t)nData * sizeof(uint32_t));
+		int32_t        *DataCluster = Mem_Alloc((size_t)nData * sizeof(int32_t));
+		if(!Data || !Weights || !DataCluster)
+		{
+			Mem_Free(DataCluster);
+			Mem_Free(Weights);
+			Mem_Free(Data);
+			printf("Out of memory - Image not processed\n");
+			goto Cleanup;
+		}
+
+		nData = ColourHist_ToData(&Hist[i], Data, Weights);
+		ColourHist_Destroy(&Hist[i]);
+		memset(Clusters, 0, nClusters * sizeof(struct QuantCluster_t));
+		QuantCluster_QuantizeWeighted(Clusters, MaxPalSize-PalUnused, Data, Weights, nData, DataCluster, MAX_PALETTE_QUANTIZATION_PASSES, 0.0);
+		Mem_Free(DataCluster);
+		Mem_Free(Weights);
+		Mem_Free(Data);
+
+		struct BGRAf_t *Pal = Palette + i*MaxPalSize;
+		for(j=0; j<MaxPalSize-PalUnused; j++)
+			*Pal++ = Clusters[j].Centroid;
+
+		for(j=0; j<PalUnused; j++)
+			*Pal++ = BGRAf_AsYCoCg(&(struct BGRAf_t){1,1,1,0});
+	}
+	Qualetize_PreparePalettes(Palette, PaletteSpread, MaxTilePals, MaxPalSize, PalUnused, BitRange, DitherType, DitherLevel, OrderColours);
+	for(i=0;i<BMP_PALETTE_COLOURS;i++)
+	{
+		struct BGRAf_t x = BGRAf_FromYCoCg(&Palette[i]);
+		PalBGR[i] = BGRA8_FromBGRAf(&x);
+	}
+
+	//! Pass 3: Remap, writing rows out as they are finished
+	printf("Pass 3: Remapping...\n");
+	if(!BmpStream_Create(&Out, OutputFile, ImgW, ImgH, PalBGR))
+	{
+		printf("Unable to write output file\n");
+		goto Cleanup;
+	}
+	struct BGRAf_t SqErr = {0,0,0,0};
+	for(y=0;y<ImgH;y+=StripRows)
+	{
+		int nRows = (ImgH-y < StripRows) ? (ImgH-y) : StripRows;
+		if(!BmpStream_ReadRows(&In, y, nRows, PxStrip)) goto ReadError;
+
+		Qualetize_RemapRows(
+			PxStrip,
+			NULL,
+			PxIdxStrip,
+			ImgW,
+			ImgH,
+			y,
+			nRows,
+			TileW,
+			TileH,
+			TilePalIdx,
+			NULL,
+			Palette,
+			NULL,
+			PaletteSpread,
+			MaxPalSize,
+			PalUnused,
+			0,
+			DitherType,
+			DitherLevel,
+			PxDiffuse,
+			&SqErr
+		);
+
+		if(!BmpStream_WriteRows(&Out, y, nRows, PxIdxStrip))
+		{
+			printf("Unable to write output file\n");
+			goto Cleanup;
+		}
+	}
+	if(!BmpStream_Close(&Out))
+	{
+		printf("Unable to write output file\n");
+		goto Cleanup;
+	}
+
+	SqErr = BGRAf_Divi(&SqErr, (float)ImgW*ImgH);
+	*RMSE = BGRAf_Sqrt(&SqErr);
+	Ok = 1;
+	goto Cleanup;
+
+ReadError:
+	printf("Unable to read input file\n");
+Cleanup:
+	if(Hist) for(i=0;i<MaxTilePals;i++) ColourHist_Destroy(&Hist[i]);
+	BmpStream_Close(&Out);
+	BmpStream_Close(&In);
+	Mem_Free(Hist);
+	Mem_Free(Clusters);
+	Mem_Free(TilePalIdx);
+	Mem_Free(TileValue);
+	Mem_Free(PxDiffuse);
+	Mem_Free(PxIdxStrip);
+	Mem_Free(PxStrip);
+	return Ok;
+}
+
+size_t Stream_MemorySize(int w, int h, int TileW, int TileH, int StripTiles, int HistEntries, int MaxTilePals, int MaxPalSize)
+{
+	size_t nTiles    = (size_t)(w / TileW) * (h / TileH);
+	size_t StripRows = (size_t)StripTiles * TileH;
+	size_t nClusters = MaxTilePals > MaxPalSize ? MaxTilePals : MaxPalSize;
+	size_t HistData  = (size_t)HistEntries / MaxTilePals;
+	return
+		w * StripRows * (sizeof(struct BGRA8_t) + sizeof(uint8_t)) + // PxStrip, PxIdxStrip
+		w * StripRows * sizeof(struct BGRA8_t) +                     // BmpStream_t row buffer
+		w * 2 * sizeof(struct BGRAf_t)         +                     // PxDiffuse
+		nTiles * (sizeof(struct BGRAf_t) + sizeof(int32_t)) +        // TileValue, TilePalIdx
+		nClusters * sizeof(struct QuantCluster_t) +
+		TilesData_ConvertSize(w, StripRows, TileW, TileH) +          // Pass 1 strip
+		(size_t)HistEntries * 2 * sizeof(struct ColourHistEntry_t) + // Load factor of 1/2
+		HistData * (sizeof(struct BGRAf_t) + sizeof(uint32_t) + sizeof(int32_t));
+}
+
+int Stream_PlanStrip(int w, int h, int TileW, int TileH, int MaxTilePals, int MaxPalSize, size_t MaxMem, int *HistEntries, size_t *Estimate)
+{
+	//! Histograms only lose precision when smaller, so shrink them first
+	int Hist = STREAM_HISTOGRAM_ENTRIES;
+	while(Hist > STREAM_MIN_HISTOGRAM_ENTRIES && Stream_MemorySize(w, h, TileW, TileH, 1, Hist, MaxTilePals, MaxPalSize) > MaxMem)
+		Hist /= 2;
+	*HistEntries = Hist;
+
+	//! Memory grows with the strip height, so find the tallest that fits
+	int Lo = 1, Hi = h / TileH;
+	if(Hi < 1) Hi = 1;
+	while(Lo < Hi)
+	{
+		int Mid = Lo + (Hi - Lo + 1) / 2;
+		if(Stream_MemorySize(w, h, TileW, TileH, Mid, Hist, MaxTilePals, MaxPalSize) <= MaxMem) Lo = Mid;
+		else Hi = Mid - 1;
+	}
+	*Estimate = Stream_MemorySize(w, h, TileW, TileH, Lo, Hist, MaxTilePals, MaxPalSize);
+	return Lo;
+}
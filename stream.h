@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "colourspace.h"
+
+#define STREAM_DEFAULT_STRIP_TILES   4
+#define STREAM_HISTOGRAM_ENTRIES     (1 << 20) //! Shared between all palettes
+#define STREAM_MIN_HISTOGRAM_ENTRIES (1 << 12) //! Memory budgets shrink the histograms no further
+
+//! Quantize an image file directly to an output file, in strips of
+//! tile rows, without ever holding the whole image in memory
+//! NOTE: Memory use is bounded by one strip, plus per-tile data and
+//! per-palette colour histograms that share HistEntries colours
+//! (precision is dropped past that)
+//! NOTE: Returns 0 on failure; otherwise, RMSE is stored to *RMSE
+int Stream_Qualetize
+(
+	const char *InputFile,
+	const char *OutputFile,
+	int   TileW,
+	int   TileH,
+	int   StripTiles,
+	int   HistEntries,
+	int   MaxTilePals,
+	int   MaxPalSize,
+	int   PalUnused,
+	const struct BGRA8_t *BitRange,
+	int   DitherType,
+	float DitherLevel,
+	bool  Order,
+	struct BGRAf_t *RMSE
+);
+
+//! Estimate the peak memory use of Stream_Qualetize()
+size_t Stream_MemorySize(int w, int h, int TileW, int TileH, int StripTiles, int HistEntries, int MaxTilePals, int MaxPalSize);
+
+//! Get the tallest strip (in tile rows) that fits in MaxMem bytes
+//! NOTE: The histograms are first halved (down to
+//! STREAM_MIN_HISTOGRAM_ENTRIES) until a strip of one tile row fits, and
+//! their size is stored to *HistEntries
+//! NOTE: Returns at least 1; *Estimate receives the estimate for the
+//! returned strip height, which may exceed MaxMem
+int Stream_PlanStrip(int w, int h, int TileW, int TileH, int MaxTilePals, int MaxPalSize, size_t MaxMem, int *HistEntries, size_t *Estimate);
@@ -0,0 +1,181 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+#include "process.h"
+#include "quantize.h"
+#include "sweep.h"
+#include "threadpool.h"
+#include "tiles.h"
+
+#define SWEEP_PENDING (-1) //! Error value of configurations not yet processed
+
+struct SweepTask_t
+{
+	const struct BmpCtx_t   *Image;
+	const struct TilesData_t *Tiles;
+	struct SweepConfig_t    *Config;
+};
+
+static void Sweep_Task(void *Arg)
+{
+	struct SweepTask_t   *Task   = Arg;
+	struct SweepConfig_t *Config = Task->Config;
+	struct TilesData_t   *TilesData;
+
+	double Start = QuantCluster_Time();
+	Config->Error = Process_ImageShared(Task->Image, Task->Tiles, &Config->Opts, &Config->Image, &Config->RMSE, &TilesData);
+	if(Config->Error == PROCESS_OK)
+	{
+		size_t nTiles = (size_t)TilesData->TilesX * TilesData->TilesY;
+		Config->TilePalIdx = Mem_Alloc((nTiles ? nTiles : 1) * sizeof(int32_t));
+		if(Config->TilePalIdx) memcpy(Config->TilePalIdx, TilesData->TilePalIdx, nTiles * sizeof(int32_t));
+		else
+		{
+			BmpCtx_Destroy(&Config->Image);
+			Config->Error = PROCESS_ERR_MEMORY;
+		}
+		Mem_Free(TilesData);
+	}
+	Config->Time = QuantCluster_Time() - Start;
+}
+
+int Sweep_Run(const struct BmpCtx_t *Image, struct SweepConfig_t *Configs, int nConfigs, int nThreads)
+{
+	int i, j;
+	struct ThreadPool_t *Pool = ThreadPool_Global(nThreads);
+	struct SweepTask_t *Tasks = calloc(nConfigs ? nConfigs : 1, sizeof(struct SweepTask_t));
+	for(i=0;i<nConfigs;i++)
+	{
+		memset(&Configs[i].Image, 0, sizeof(Configs[i].Image));
+		Configs[i].TilePalIdx = NULL;
+		Configs[i].Error = (Pool && Tasks) ? SWEEP_PENDING : PROCESS_ERR_MEMORY;
+		Configs[i].Time  = 0.0;
+	}
+
+	//! One tile size at a time, so only one conversion is held at once
+	for(i=0;i<nConfigs;i++) if(Configs[i].Error == SWEEP_PENDING)
+	{
+		int TileW = Configs[i].Opts.TileW;
+		int TileH = Configs[i].Opts.TileH;
+		struct TilesData_t *Tiles = NULL;
+		if(TileW > 0 && TileH > 0 && Image->Width%TileW == 0 && Image->Height%TileH == 0)
+		{
+			double Start = QuantCluster_Time();
+			Tiles = TilesData_Convert(Image, TileW, TileH);
+			if(Tiles) printf("Converted %dx%d tiles in %.1fms\n", TileW, TileH, (QuantCluster_Time() - Start) * 1000.0);
+		}
+
+		for(j=i;j<nConfigs;j++)
+		{
+			struct SweepConfig_t *Config = &Configs[j];
+			if(Config->Error != SWEEP_PENDING || Config->Opts.TileW != TileW || Config->Opts.TileH != TileH)
+				continue;
+			if(TileW <= 0 || TileH <= 0 || Image->Width%TileW || Image->Height%TileH) Config->Error = PROCESS_ERR_TILESIZE;
+			else if(!Tiles) Config->Error = PROCESS_ERR_MEMORY;
+			else
+			{
+				Tasks[j] = (struct SweepTask_t){Image, Tiles, Config};
+				if(!ThreadPool_Submit(Pool, Sweep_Task, &Tasks[j])) Sweep_Task(&Tasks[j]);
+			}
+		}
+		ThreadPool_Wait(Pool);
+		Mem_Free(Tiles);
+	}
+	free(Tasks);
+
+	int nFailed = 0;
+	for(i=0;i<nConfigs;i++) if(Configs[i].Error != PROCESS_OK) nFailed++;
+	return nFailed;
+}
+
+void Sweep_Destroy(struct SweepConfig_t *Configs, int nConfigs)
+{
+	int i;
+	for(i=0;i<nConfigs;i++)
+	{
+		BmpCtx_Destroy(&Configs[i].Image);
+		Mem_Free(Configs[i].TilePalIdx);
+		Configs[i].TilePalIdx = NULL;
+	}
+}
+
+double Sweep_PSNR(const struct SweepConfig_t *Config)
+{
+	struct BGRAf_t PSNR = Process_PSNR(Config->RMSE);
+	return ((double)PSNR.b + PSNR.g + PSNR.r) / 3.0;
+}
+
+int Sweep_Best(const struct SweepConfig_t *Configs, int nConfigs, double MinPSNR, int MaxColours)
+{
+	int i, Best = -1;
+	for(i=0;i<nConfigs;i++)
+	{
+		if(Configs[i].Error != PROCESS_OK) continue;
+		double PSNR = Sweep_PSNR(&Configs[i]);
+		int    Size = Configs[i].Opts.nPalettes * Configs[i].Opts.nColoursPerPalette;
+		if((MinPSNR > 0.0 && PSNR < MinPSNR) || (MaxColours > 0 && Size > MaxColours)) continue;
+		if(Best < 0)
+		{
+			Best = i;
+			continue;
+		}
+
+		double BestPSNR = Sweep_PSNR(&Configs[Best]);
+		int    BestSize = Configs[Best].Opts.nPalettes * Configs[Best].Opts.nColoursPerPalette;
+		if(MinPSNR > 0.0)
+		{
+			if(Size < BestSize || (Size == BestSize && PSNR > BestPSNR)) Best = i;
+		}
+		else if(PSNR > BestPSNR) Best = i;
+	}
+	return Best;
+}
+
+/**************************************/
+
+int Sweep_ReadLines(const char *Filename, char ***LinesOut)
+{
+	FILE *File = fopen(Filename, "r"); if(!File) return -1;
+
+	char Line[4096];
+	char **Lines = NULL;
+	int nLines = 0, Capacity = 0;
+	while(fgets(Line, sizeof(Line), File))
+	{
+		char *s = Line, *End;
+		while(isspace((unsigned char)*s)) s++;
+		if(!*s || *s == '#') continue;
+		End = s + strlen(s);
+		while(End > s && isspace((unsigned char)End[-1])) *--End = '\0';
+
+		if(nLines == Capacity)
+		{
+			Capacity = Capacity ? Capacity*2 : 16;
+			char **p = realloc(Lines, Capacity * sizeof(char*));
+			if(!p) break;
+			Lines = p;
+		}
+		if(!(Lines[nLines] = strdup(s))) break;
+		nLines++;
+	}
+
+	int Ok = !ferror(File) && feof(File);
+	fclose(File);
+	if(!Ok)
+	{
+		Sweep_FreeLines(Lines, nLines);
+		return -1;
+	}
+	*LinesOut = Lines;
+	return nLines;
+}
+
+void Sweep_FreeLines(char **Lines, int nLines)
+{
+	int i;
+	if(!Lines) return;
+	for(i=0;i<nLines;i++) free(Lines[i]);
+	free(Lines);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include "bitmap.h"
+#include "colourspace.h"
+#include "process.h"
+
+//! One configuration of a parameter sweep, and its result
+struct SweepConfig_t
+{
+	const char *Label;          //! Description for the report (eg. the options given)
+	struct ProcessOpts_t Opts;
+	int             Error;      //! PROCESS_OK or PROCESS_ERR_*
+	struct BmpCtx_t Image;      //! Indexed result
+	int32_t        *TilePalIdx; //! Tile palette indices
+	struct BGRAf_t  RMSE;
+	double          Time;       //! Seconds spent quantizing (not counting tile conversion)
+};
+
+//! Process one image under many configurations
+//! NOTE: Tiles are converted once for each tile size, and shared by every
+//! configuration using that size; configurations are processed in
+//! parallel on the process-wide pool
+//! NOTE: Results are stored in each configuration, and released with
+//! Sweep_Destroy()
+//! NOTE: Returns the number of configurations that failed
+int Sweep_Run(const struct BmpCtx_t *Image, struct SweepConfig_t *Configs, int nConfigs, int nThreads);
+
+//! Release the results of Sweep_Run()
+void Sweep_Destroy(struct SweepConfig_t *Configs, int nConfigs);
+
+//! Get the PSNR of a result (mean over the colour channels)
+double Sweep_PSNR(const struct SweepConfig_t *Config);
+
+//! Pick the best result
+//! NOTE: Only results with at most MaxColours (nPalettes*nColoursPerPalette)
+//! colours are considered, if MaxColours > 0
+//! NOTE: Without a MinPSNR, this is the result with the highest PSNR;
+//! otherwise it is the one with the fewest colours reaching MinPSNR, with
+//! ties going to the higher PSNR
+//! NOTE: Returns -1 if no result qualifies
+int Sweep_Best(const struct SweepConfig_t *Configs, int nConfigs, double MinPSNR, int MaxColours);
+
+//! Read a sweep file, with one configuration (a list of options) per line
+//! NOTE: Blank lines and lines starting with # are ignored
+//! NOTE: Returns the number of lines (or -1 on failure); free with Sweep_FreeLines()
+int Sweep_ReadLines(const char *Filename, char ***Lines);
+void Sweep_FreeLines(char **Lines, int nLines);
@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include "threadpool.h"
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
+
+struct ThreadPoolTask_t
+{
+	ThreadPool_Func_t Func;
+	void *Arg;
+	struct ThreadPoolTask_t *Next;
+};
+
+struct ThreadPool_t
+{
+	pthread_mutex_t Lock;
+	pthread_cond_t  TaskReady;
+	pthread_cond_t  AllDone;
+	struct ThreadPoolTask_t *Head, *Tail;
+	int nPending; //! Queued and running tasks
+	int Quit;
+	int nThreads;
+	pthread_t *Threads;
+};
+
+//! Shared state of a ThreadPool_For() call
+//! NOTE: Helper tasks may only start after the call has returned, so this
+//! is freed by whichever of the caller and helpers finishes with it last
+struct ThreadPoolFor_t
+{
+	pthread_mutex_t Lock;
+	pthread_cond_t  Done;
+	ThreadPool_ForFunc_t Func;
+	void *Arg;
+	int nItems, NextItem, nDone;
+	int nRefs;
+};
+
+static pthread_mutex_t      GlobalLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadPool_t *GlobalPool;
+
+static void *ThreadPool_Worker(void *Arg)
+{
+	struct ThreadPool_t *Pool = Arg;
+	pthread_mutex_lock(&Pool->Lock);
+	for(;;)
+	{
+		while(!Pool->Head && !Pool->Quit) pthread_cond_wait(&Pool->TaskReady, &Pool->Lock);
+		if(!Pool->Head) break;
+
+		struct ThreadPoolTask_t *Task = Pool->Head;
+		Pool->Head = Task->Next;
+		if(!Pool->Head) Pool->Tail = NULL;
+		pthread_mutex_unlock(&Pool->Lock);
+
+		Task->Func(Task->Arg);
+		free(Task);
+
+		pthread_mutex_lock(&Pool->Lock);
+		if(--Pool->nPending == 0) pthread_cond_broadcast(&Pool->AllDone);
+	}
+	pthread_mutex_unlock(&Pool->Lock);
+	return NULL;
+}
+
+int ThreadPool_CPUCount(void)
+{
+	int n;
+#ifdef _WIN32
+	SYSTEM_INFO Info;
+	GetSystemInfo(&Info);
+	n = Info.dwNumberOfProcessors;
+#else
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n < 1 ? 1 : n;
+}
+
+struct ThreadPool_t *ThreadPool_Create(int nThreads)
+{
+	if(nThreads <= 0) nThreads = ThreadPool_CPUCount();
+
+	struct ThreadPool_t *Pool = calloc(1, sizeof(struct ThreadPool_t));
+	if(!Pool) return NULL;
+	Pool->Threads = calloc(nThreads, sizeof(pthread_t));
+	if(!Pool->Threads)
+	{
+		free(Pool);
+		return NULL;
+	}
+	pthread_mutex_init(&Pool->Lock, NULL);
+	pthread_cond_init(&Pool->TaskReady, NULL);
+	pthread_cond_init(&Pool->AllDone, NULL);
+
+	for(Pool->nThreads=0; Pool->nThreads<nThreads; Pool->nThreads++)
+	{
+		if(pthread_create(&Pool->Threads[Pool->nThreads], NULL, ThreadPool_Worker, Pool)) break;
+	}
+	if(!Pool->nThreads)
+	{
+		ThreadPool_Destroy(Pool);
+		return NULL;
+	}
+	return Pool;
+}
+
+void ThreadPool_Destroy(struct ThreadPool_t *Pool)
+{
+	int i;
+	if(!Pool) return;
+
+	ThreadPool_Wait(Pool);
+	pthread_mutex_lock(&Pool->Lock);
+	Pool->Quit = 1;
+	pthread_cond_broadcast(&Pool->TaskReady);
+	pthread_mutex_unlock(&Pool->Lock);
+	for(i=0;i<Pool->nThreads;i++) pthread_join(Pool->Threads[i], NULL);
+
+	pthread_cond_destroy(&Pool->AllDone);
+	pthread_cond_destroy(&Pool->TaskReady);
+	pthread_mutex_destroy(&Pool->Lock);
+	free(Pool->Threads);
+	free(Pool);
+}
+
+int ThreadPool_Submit(struct ThreadPool_t *Pool, ThreadPool_Func_t Func, void *Arg)
+{
+	struct ThreadPoolTask_t *Task = malloc(sizeof(struct ThreadPoolTask_t));
+	if(!Task) return 0;
+	Task->Func = Func;
+	Task->Arg  = Arg;
+	Task->Next = NULL;
+
+	pthread_mutex_lock(&Pool->Lock);
+	if(Pool->Tail) Pool->Tail->Next = Task;
+	else           Pool->Head       = Task;
+	Pool->Tail = Task;
+	Pool->nPending++;
+	pthread_cond_signal(&Pool->TaskReady);
+	pthread_mutex_unlock(&Pool->Lock);
+	return 1;
+}
+
+void ThreadPool_Wait(struct ThreadPool_t *Pool)
+{
+	pthread_mutex_lock(&Pool->Lock);
+	while(Pool->nPending) pthread_cond_wait(&Pool->AllDone, &Pool->Lock);
+	pthread_mutex_unlock(&Pool->Lock);
+}
+
+//! Run items until none are left (called with For->Lock held)
+static void ThreadPool_ForItems(struct ThreadPoolFor_t *For)
+{
+	while(For->NextItem < For->nItems)
+	{
+		int Item = For->NextItem++;
+		pthread_mutex_unlock(&For->Lock);
+		For->Func(For->Arg, Item);
+		pthread_mutex_lock(&For->Lock);
+		if(++For->nDone == For->nItems) pthread_cond_broadcast(&For->Done);
+	}
+}
+
+static void ThreadPool_ForRelease(struct ThreadPoolFor_t *For)
+{
+	int Last = (--For->nRefs == 0);
+	pthread_mutex_unlock(&For->Lock);
+	if(Last)
+	{
+		pthread_cond_destroy(&For->Done);
+		pthread_mutex_destroy(&For->Lock);
+		free(For);
+	}
+}
+
+static void ThreadPool_ForHelper(void *Arg)
+{
+	struct ThreadPoolFor_t *For = Arg;
+	pthread_mutex_lock(&For->Lock);
+	ThreadPool_ForItems(For);
+	ThreadPool_ForRelease(For);
+}
+
+void ThreadPool_For(struct ThreadPool_t *Pool, int nItems, ThreadPool_ForFunc_t Func, void *Arg)
+{
+	int i;
+	struct ThreadPoolFor_t *For = (Pool && nItems > 1) ? calloc(1, sizeof(struct ThreadPoolFor_t)) : NULL;
+	if(!For)
+	{
+		for(i=0;i<nItems;i++) Func(Arg, i);
+		return;
+	}
+	pthread_mutex_init(&For->Lock, NULL);
+	pthread_cond_init(&For->Done, NULL);
+	For->Func   = Func;
+	For->Arg    = Arg;
+	For->nItems = nItems;
+
+	int nHelpers = (Pool->nThreads < nItems) ? Pool->nThreads : nItems-1;
+	pthread_mutex_lock(&For->Lock);
+	For->nRefs = 1 + nHelpers;
+	pthread_mutex_unlock(&For->Lock);
+	for(i=0;i<nHelpers;i++) if(!ThreadPool_Submit(Pool, ThreadPool_ForHelper, For))
+	{
+		pthread_mutex_lock(&For->Lock);
+		For->nRefs -= nHelpers - i;
+		pthread_mutex_unlock(&For->Lock);
+		break;
+	}
+
+	pthread_mutex_lock(&For->Lock);
+	ThreadPool_ForItems(For);
+	while(For->nDone < For->nItems) pthread_cond_wait(&For->Done, &For->Lock);
+	ThreadPool_ForRelease(For);
+}
+
+int ThreadPool_nThreads(const struct ThreadPool_t *Pool)
+{
+	return Pool->nThreads;
+}
+
+struct ThreadPool_t *ThreadPool_Global(int nThreads)
+{
+	//! Called from inside tasks too, so nThreads is only read under the lock
+	pthread_mutex_lock(&GlobalLock);
+	if(!GlobalPool) GlobalPool = ThreadPool_Create(nThreads);
+	struct ThreadPool_t *Pool = GlobalPool;
+	pthread_mutex_unlock(&GlobalLock);
+	return Pool;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+typedef void (*ThreadPool_Func_t)(void *Arg);
+typedef void (*ThreadPool_ForFunc_t)(void *Arg, int Item);
+
+struct ThreadPool_t;
+
+//! Create a pool of worker threads
+//! NOTE: nThreads <= 0 uses one thread per CPU
+struct ThreadPool_t *ThreadPool_Create(int nThreads);
+
+//! Wait for all tasks to finish, then destroy the pool
+void ThreadPool_Destroy(struct ThreadPool_t *Pool);
+
+//! Queue a task
+//! NOTE: Tasks may submit further tasks
+int ThreadPool_Submit(struct ThreadPool_t *Pool, ThreadPool_Func_t Func, void *Arg);
+
+//! Wait until no tasks are queued or running
+void ThreadPool_Wait(struct ThreadPool_t *Pool);
+
+//! Run Func(Arg, Item) for each Item in [0, nItems), spread over the
+//! pool's threads and the calling thread, returning once all are done
+//! NOTE: The caller works through the items itself and only waits for
+//! items already running, so this may be called from inside a task
+//! NOTE: Items run in no particular order; with no Pool, all run here
+void ThreadPool_For(struct ThreadPool_t *Pool, int nItems, ThreadPool_ForFunc_t Func, void *Arg);
+
+//! Get the number of worker threads
+int ThreadPool_nThreads(const struct ThreadPool_t *Pool);
+
+//! Get the process-wide pool (created on first use)
+//! NOTE: nThreads is only used when the pool is first created, so
+//! programs should make the first call with their thread count
+struct ThreadPool_t *ThreadPool_Global(int nThreads);
+
+//! Get the number of CPUs available
+int ThreadPool_CPUCount(void);
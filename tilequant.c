@@ -3,16 +3,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include "batch.h"
 #include "bitmap.h"
+#include "cache.h"
 #include "colourspace.h"
+#include "export.h"
+#include "mem.h"
+#include "process.h"
 #include "qualetize.h"
+#include "quantize.h"
+#include "serve.h"
+#include "stats.h"
+#include "stream.h"
+#include "sweep.h"
+#include "threadpool.h"
 #include "tiles.h"
 
 #define MEASURE_PSNR 1
 
 #define ARGMATCH(Input, Target) \
 	ArgStr = Input + strlen(Target); \
-	if(!memcmp(Input, Target, strlen(Target)))
+	if(!strncmp(Input, Target, strlen(Target)))
 
 #define DITHERMODE_MATCH(Input, Target, ModeValue, DefaultLevel) \
 	d = mystrcmp(Input, Target); \
@@ -28,14 +39,329 @@ static int mystrcmp(const char *s1, const char *s2)
 	return *s1 - *s2;
 }
 
+static void PrintPSNR(struct BGRAf_t RMSE)
+{
+#if MEASURE_PSNR
+	struct BGRAf_t PSNR = Process_PSNR(RMSE);
+	printf("PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}\n", PSNR.b, PSNR.g, PSNR.r, PSNR.a);
+#else
+	(void)RMSE;
+#endif
+}
+
+//! Write the console output formats that were requested
+//! NOTE: Returns 0 if any failed
+static int WriteExports(const struct BmpCtx_t *Image, const int32_t *TilePalIdx, const struct ProcessOpts_t *Opts, int TileBpp, const char *OutTiles, const char *OutPal, const char *OutMap)
+{
+	int Ok = 1;
+	int nTiles = (Image->Width / Opts->TileW) * (Image->Height / Opts->TileH);
+	if(OutTiles)
+	{
+		printf("Writing tiles...\n");
+		if(!Export_Tiles(OutTiles, Image->PxIdx, Image->Width, Image->Height, Opts->TileW, Opts->TileH, Opts->nColoursPerPalette, TileBpp))
+			printf("Unable to write tiles (%dbpp needs up to %d colours per palette)\n", TileBpp, 1 << TileBpp), Ok = 0;
+	}
+	if(OutPal)
+	{
+		printf("Writing palette...\n");
+		if(!Export_Palette(OutPal, Image->ColPal, Opts->nPalettes*Opts->nColoursPerPalette, &Opts->BitRange))
+			printf("Unable to write palette\n"), Ok = 0;
+	}
+	if(OutMap)
+	{
+		printf("Writing tilemap...\n");
+		if(!Export_Tilemap(OutMap, TilePalIdx, nTiles, Opts->nPalettes))
+			printf("Unable to write tilemap (up to 1024 tiles and 16 palettes)\n"), Ok = 0;
+	}
+	return Ok;
+}
+
+//! Parse an option that sets a field of Opts
+//! NOTE: Returns 0 if Arg is not such an option
+static int ParseProcessOpt(const char *Arg, struct ProcessOpts_t *Opts)
+{
+	int ArgOk = 0;
+	const char *ArgStr;
+	ARGMATCH(Arg, "-np:") ArgOk = 1, Opts->nPalettes = atoi(ArgStr);
+	ARGMATCH(Arg, "-ps:") ArgOk = 1, Opts->nColoursPerPalette = atoi(ArgStr);
+	ARGMATCH(Arg, "-tw:") ArgOk = 1, Opts->TileW = atoi(ArgStr);
+	ARGMATCH(Arg, "-th:") ArgOk = 1, Opts->TileH = atoi(ArgStr);
+	ARGMATCH(Arg, "-bgra:")
+	{
+		ArgOk = 1;
+		Opts->BitRange.b = (1 << (*ArgStr++ - '0')) - 1;
+		Opts->BitRange.g = (1 << (*ArgStr++ - '0')) - 1;
+		Opts->BitRange.r = (1 << (*ArgStr++ - '0')) - 1;
+		Opts->BitRange.a = (1 << (*ArgStr++ - '0')) - 1;
+	}
+
+	ARGMATCH(Arg, "-dither:")
+	{
+		int d;
+		int   DitherMode  = Opts->DitherMode;
+		float DitherLevel = Opts->DitherLevel;
+
+		DITHERMODE_MATCH(ArgStr, "none",   DITHER_NONE,                0.0f);
+		DITHERMODE_MATCH(ArgStr, "floyd",  DITHER_FLOYDSTEINBERG,      1.0f);
+		DITHERMODE_MATCH(ArgStr, "tfloyd", DITHER_TILE_FLOYDSTEINBERG, 1.0f);
+		DITHERMODE_MATCH(ArgStr, "tserp",  DITHER_TILE_SERPENTINE,     1.0f);
+		DITHERMODE_MATCH(ArgStr, "ord2",   DITHER_ORDERED(1),          0.5f);
+		DITHERMODE_MATCH(ArgStr, "ord4",   DITHER_ORDERED(2),          0.5f);
+		DITHERMODE_MATCH(ArgStr, "ord8",   DITHER_ORDERED(3),          0.5f);
+		DITHERMODE_MATCH(ArgStr, "ord16",  DITHER_ORDERED(4),          0.5f);
+		DITHERMODE_MATCH(ArgStr, "ord32",  DITHER_ORDERED(5),          0.5f);
+		DITHERMODE_MATCH(ArgStr, "ord64",  DITHER_ORDERED(6),          0.5f);
+
+		if(!ArgOk) printf("Unrecognized dither mode: %s\n", ArgStr);
+		ArgOk = 1;
+		Opts->DitherMode  = DitherMode;
+		Opts->DitherLevel = DitherLevel;
+	}
+
+	ARGMATCH(Arg, "-order")
+	{
+		ArgOk = 1;
+		Opts->OrderColours = true;
+	}
+
+	ARGMATCH(Arg, "-int") ArgOk = 1, Opts->IntegerMode = true;
+	ARGMATCH(Arg, "-coarse")
+	{
+		ArgOk = 1;
+		Opts->CoarseFactor = (*ArgStr == ':') ? atoi(ArgStr+1) : 2;
+		if(Opts->CoarseFactor < 1) Opts->CoarseFactor = 1;
+	}
+	ARGMATCH(Arg, "-time-budget:") ArgOk = 1, Opts->TimeBudget = atoi(ArgStr);
+	ARGMATCH(Arg, "-reassign")
+	{
+		ArgOk = 1;
+		Opts->ReassignPasses = (*ArgStr == ':') ? atoi(ArgStr+1) : 2;
+		if(Opts->ReassignPasses < 0) Opts->ReassignPasses = 0;
+	}
+	ARGMATCH(Arg, "-exact") ArgOk = 1, Opts->ExactTiles = true;
+	ARGMATCH(Arg, "-alpha")
+	{
+		ArgOk = 1;
+		Opts->AlphaThreshold = (*ArgStr == ':') ? atoi(ArgStr+1) : 1;
+		if(Opts->AlphaThreshold <   0) Opts->AlphaThreshold = 0;
+		if(Opts->AlphaThreshold > 256) Opts->AlphaThreshold = 256;
+	}
+	return ArgOk;
+}
+
+//! Requantize the changed tiles of Image against a previous output
+static int UpdateImage(struct BmpCtx_t *Image, const char *PrevFile, const char *PrevInput, const struct ProcessRect_t *Dirty, bool Refine, const struct ProcessOpts_t *Opts, struct BGRAf_t *RMSE, int32_t **TilePalIdx)
+{
+	struct BmpCtx_t Prev, PrevSrc;
+	if(!BmpCtx_FromFile(&Prev, PrevFile))
+	{
+		printf("Unable to read previous output file\n");
+		return PROCESS_ERR_PREVIOUS;
+	}
+	if(PrevInput && !BmpCtx_FromFile(&PrevSrc, PrevInput))
+	{
+		printf("Unable to read previous input file\n");
+		BmpCtx_Destroy(&Prev);
+		return PROCESS_ERR_PREVIOUS;
+	}
+
+	int nUpdated;
+	int nTiles = (Image->Width / Opts->TileW) * (Image->Height / Opts->TileH);
+	int Error = Process_Update(Image, &Prev, PrevInput ? &PrevSrc : NULL, Dirty, Refine, Opts, RMSE, TilePalIdx, &nUpdated);
+	if(Error == PROCESS_OK) printf("Updated %d/%d tiles\n", nUpdated, nTiles);
+
+	if(PrevInput) BmpCtx_Destroy(&PrevSrc);
+	BmpCtx_Destroy(&Prev);
+	return Error;
+}
+
+//! Process one image under each line of options in SweepFile, report
+//! every result, and write the best (if Output is not NULL)
+static int RunSweep(const char *Input, const char *Output, const char *SweepFile, const struct ProcessOpts_t *BaseOpts, int nThreads, double MinPSNR, int MaxColours, int TileBpp, const char *OutTiles, const char *OutPal, const char *OutMap)
+{
+	int i;
+	char **Lines;
+	int nConfigs = Sweep_ReadLines(SweepFile, &Lines);
+	if(nConfigs <= 0)
+	{
+		printf(nConfigs < 0 ? "Unable to read sweep file\n" : "Sweep file has no configurations\n");
+		return -1;
+	}
+
+	//! Each line starts from the options given on the command line
+	struct SweepConfig_t *Configs = calloc(nConfigs, sizeof(struct SweepConfig_t));
+	char *Line = NULL;
+	for(i=0;Configs && i<nConfigs;i++)
+	{
+		Configs[i].Label = Lines[i];
+		Configs[i].Opts  = *BaseOpts;
+		free(Line);
+		if(!(Line = strdup(Lines[i]))) break;
+
+		char *Arg = Line;
+		while(*(Arg += strspn(Arg, " \t")))
+		{
+			size_t n = strcspn(Arg, " \t");
+			if(Arg[n]) Arg[n++] = '\0';
+			if(!ParseProcessOpt(Arg, &Configs[i].Opts)) printf("Unrecognized sweep option: %s\n", Arg);
+			Arg += n;
+		}
+	}
+	free(Line);
+	if(!Configs || i < nConfigs)
+	{
+		printf("Out of memory - Sweep not run\n");
+		free(Configs);
+		Sweep_FreeLines(Lines, nConfigs);
+		return -1;
+	}
+
+	printf("Reading input file...\n");
+	struct BmpCtx_t Image;
+	if(!BmpCtx_FromFile(&Image, Input))
+	{
+		printf("Unable to read input file\n");
+		free(Configs);
+		Sweep_FreeLines(Lines, nConfigs);
+		return -1;
+	}
+
+	printf("Sweeping %d configurations...\n", nConfigs);
+	Sweep_Run(&Image, Configs, nConfigs, nThreads);
+	BmpCtx_Destroy(&Image);
+	for(i=0;i<nConfigs;i++)
+	{
+		printf("[%d] %s: ", i+1, Configs[i].Label);
+		if(Configs[i].Error != PROCESS_OK) printf("%s\n", Process_ErrorString(Configs[i].Error, &Configs[i].Opts));
+		else
+		{
+			struct BGRAf_t PSNR = Process_PSNR(Configs[i].RMSE);
+			printf("PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}, Time = %.1fms\n", PSNR.b, PSNR.g, PSNR.r, PSNR.a, Configs[i].Time * 1000.0);
+		}
+	}
+
+	int Ok = 1;
+	int Best = Sweep_Best(Configs, nConfigs, MinPSNR, MaxColours);
+	if(Best < 0)
+	{
+		printf("No configuration meets the constraints\n");
+		Ok = 0;
+	}
+	else
+	{
+		struct SweepConfig_t *Config = &Configs[Best];
+		printf("Best: [%d] %s (%.3fdB)\n", Best+1, Config->Label, Sweep_PSNR(Config));
+		if(!TileBpp) TileBpp = (Config->Opts.nColoursPerPalette <= 16) ? 4 : 8;
+		Ok = WriteExports(&Config->Image, Config->TilePalIdx, &Config->Opts, TileBpp, OutTiles, OutPal, OutMap);
+		if(Output)
+		{
+			printf("Writing output file...\n");
+			if(!BmpCtx_ToFile(&Config->Image, Output))
+				printf("\nUnable to write output file\n\n"), Ok = 0;
+		}
+	}
+
+	Sweep_Destroy(Configs, nConfigs);
+	free(Configs);
+	Sweep_FreeLines(Lines, nConfigs);
+	if(!Ok) return -1;
+	printf("Peak memory = %.1fMiB\n", Mem_Peak() / 1048576.0);
+	printf("Done!\n\n");
+	return 0;
+}
+
+//! Collect statistics of images (.bmp) and merge statistics files (.tqs)
+//! into Output, which is written as merged statistics if it is a .tqs
+//! file, or otherwise as a palette bank in the -bgra layout
+static int RunStats(const char *Output, const char *const *Inputs, int nInputs, const struct ProcessOpts_t *Opts)
+{
+	int i;
+	size_t ExtLen = strlen(STATS_EXT);
+	struct Stats_t Total, Stats;
+	Stats_Init(&Total, Opts->TileW, Opts->TileH);
+	for(i=0;i<nInputs;i++)
+	{
+		size_t Len = strlen(Inputs[i]);
+		if(Len >= ExtLen && !strcmp(Inputs[i]+Len-ExtLen, STATS_EXT))
+		{
+			printf("Reading %s...\n", Inputs[i]);
+			if(!Stats_Read(&Stats, Inputs[i]))
+			{
+				printf("Unable to read statistics file\n");
+				break;
+			}
+		}
+		else
+		{
+			printf("Collecting statistics of %s...\n", Inputs[i]);
+			struct BmpCtx_t Image;
+			if(!BmpCtx_FromFile(&Image, Inputs[i]))
+			{
+				printf("Unable to read input file\n");
+				break;
+			}
+			int Error = Stats_FromImage(&Stats, &Image, Opts);
+			BmpCtx_Destroy(&Image);
+			if(Error != PROCESS_OK)
+			{
+				printf("%s\n", Process_ErrorString(Error, Opts));
+				break;
+			}
+		}
+
+		int Ok = Stats_Merge(&Total, &Stats);
+		if(!Ok && (Stats.TileW != Total.TileW || Stats.TileH != Total.TileH))
+			printf("Statistics are for %dx%d tiles (set with -tw/-th)\n", Stats.TileW, Stats.TileH);
+		else if(!Ok)
+			printf("Out of memory - Statistics not merged\n");
+		Stats_Destroy(&Stats);
+		if(!Ok) break;
+	}
+
+	int Ok = (i == nInputs);
+	size_t Len = strlen(Output);
+	if(Ok && Len >= ExtLen && !strcmp(Output+Len-ExtLen, STATS_EXT))
+	{
+		printf("Writing statistics (%d tile classes)...\n", Total.nClasses);
+		if(!Stats_Write(&Total, Output))
+			printf("Unable to write statistics file\n"), Ok = 0;
+	}
+	else if(Ok)
+	{
+		struct BGRA8_t Palette[BMP_PALETTE_COLOURS];
+		printf("Building palettes...\n");
+		if(!Stats_BuildPalettes(&Total, Opts, Palette))
+			printf("Unable to build palettes (no statistics, or out of memory)\n"), Ok = 0;
+		else if(!Export_Palette(Output, Palette, Opts->nPalettes*Opts->nColoursPerPalette, &Opts->BitRange))
+			printf("Unable to write palette\n"), Ok = 0;
+	}
+	Stats_Destroy(&Total);
+	if(!Ok) return -1;
+	printf("Peak memory = %.1fMiB\n", Mem_Peak() / 1048576.0);
+	printf("Done!\n\n");
+	return 0;
+}
+
 int main(int argc, const char *argv[])
 {
-	if(argc < 3)
+	int BatchMode = (argc >= 2 && !memcmp(argv[1], "-batch", 6));
+	int ServeMode = (argc >= 2 && !memcmp(argv[1], "-serve", 6));
+	int StatsMode = (argc >= 2 && !strncmp(argv[1], "-stats:", 7));
+	if(argc < 3 && !BatchMode && !ServeMode)
 	{
 		printf(
 			"\n"
 			"Usage:\n"
 			"    tilequant Input.bmp Output.bmp [options]\n"
+			"    (Output.bmp may be - when only writing console formats)\n"
+			"    tilequant -batch In1.bmp Out1.bmp [In2.bmp Out2.bmp ...] [options]\n"
+			"    tilequant -batch:Manifest.txt [options]\n"
+			"    (Manifest lists one 'Input.bmp Output.bmp' pair per line)\n"
+			"    tilequant -serve[:Socket] [-threads:n]\n"
+			"    (Serves requests on a Unix socket, or stdin/stdout; see serve.h)\n"
+			"    tilequant -stats:Out.tqs In1.bmp [In2.tqs ...] [options]\n"
+			"    (Collects palette statistics of images and merges statistics files;\n"
+			"    if Out is not a .tqs file, a palette bank for -palette: is built)\n"
 			"Options:\n"
 			"    -np:16            - Set number of palettes available\n"
 			"    -ps:16            - Set number of colours per palette\n"
@@ -44,9 +370,34 @@ int main(int argc, const char *argv[])
 			"    -bgra:5551        - Set BGRA bit depth\n"
 			"    -dither:floyd,1.0 - Set dither mode, level\n"
 			"    -order            - Order colours in palettes\n"
+			"    -stream:4         - Stream image in strips of n tile rows\n"
+			"    -out-tiles:x.chr  - Write packed tile data\n"
+			"    -out-pal:x.pal    - Write palette in -bgra bit layout\n"
+			"    -out-map:x.map    - Write tilemap (GBA/NDS format)\n"
+			"    -bpp:4            - Set packed tile bit depth (4 or 8)\n"
+			"    -threads:0        - Set batch worker threads (0 = all CPUs)\n"
+			"    -sequence         - Treat batch images as animation frames\n"
+			"    -palette:x.pal    - Remap to a fixed palette bank (.pal or 8-bit .bmp)\n"
+			"    -int              - Use integer colour arithmetic (float is the reference)\n"
+			"    -coarse:2         - Cluster at reduced resolution first (faster)\n"
+			"    -time-budget:100  - Stop clustering early to finish in n milliseconds\n"
+			"    -reassign:2       - Move tiles to the palette with least remap error (n passes)\n"
+			"    -alpha:1          - Give pixels with alpha below n the transparent entry\n"
+			"    -exact            - Give tiles with few colours exact palettes (lossless)\n"
+			"    -cache:dir        - Reuse results for unchanged images and options\n"
+			"    -max-mem:512M     - Fit memory use to a budget (K/M/G; picks -int/-stream)\n"
+			"    -update:prev.bmp  - Only requantize changed tiles, keeping prev.bmp's palettes\n"
+			"    -dirty:x,y,w,h    - Tiles changed for -update (pixel rectangle)\n"
+			"    -prev-input:x.bmp - Find tiles changed for -update by diffing the old input\n"
+			"    -refine           - Let -update re-fit palette entries only changed tiles use\n"
+			"    -sweep:x.txt      - Try each line of options in x.txt (one decode), keep the best\n"
+			"    -min-psnr:30      - Keep the sweep result with the fewest colours reaching n dB\n"
+			"    -max-colours:64   - Only keep sweep results with up to n colours (np*ps)\n"
 			"Dither modes available (and default level):\n"
 			"    -dither:none       - No dithering\n"
 			"    -dither:floyd,1.0  - Floyd-Steinberg\n"
+			"    -dither:tfloyd,1.0 - Floyd-Steinberg within each tile (remapped in parallel)\n"
+			"    -dither:tserp,1.0  - As tfloyd, with serpentine scan\n"
 			"    -dither:ord2,0.5   - 2x2 ordered dithering\n"
 			"    -dither:ord4,0.5   - 4x4 ordered dithering\n"
 			"    -dither:ord8,0.5   - 8x8 ordered dithering\n"
@@ -58,61 +409,260 @@ int main(int argc, const char *argv[])
 		return 1;
 	}
 
-	int     nPalettes = 16;
-	int     nColoursPerPalette = 16;
-	int     nUnusedColoursPerPalette = 1;
-	int     TileW = 8;
-	int     TileH = 8;
-	uint8_t BitRange[4] = {0x1F,0x1F,0x1F,0x01};
-	int     DitherMode  = DITHER_FLOYDSTEINBERG;
-	float   DitherLevel = 1.0f;
-	bool    OrderColours = false;
-	
+	struct ProcessOpts_t Opts;
+	Process_DefaultOpts(&Opts);
+	int     StripTiles = 0;
+	int     HistEntries = STREAM_HISTOGRAM_ENTRIES;
+	int     TileBpp = 0;
+	int     nThreads = 0;
+	bool    Sequence = false;
+	size_t  MaxMem = 0;
+	const char *InPal = NULL;
+	const char *CacheDir = NULL;
+	const char *SweepFile = NULL;
+	const char *UpdateFile = NULL;
+	const char *PrevInput = NULL;
+	struct ProcessRect_t Dirty;
+	bool    DirtySet = false;
+	bool    Refine = false;
+	double  MinPSNR = 0.0;
+	int     MaxColours = 0;
+	struct BGRA8_t FixedPalette[BMP_PALETTE_COLOURS];
+	const char *OutTiles = NULL;
+	const char *OutPal   = NULL;
+	const char *OutMap   = NULL;
+
+	//! Batch pairs and statistics inputs are given up to the first option
+	int FirstOpt = 3;
+	if(ServeMode) FirstOpt = 2;
+	if(StatsMode)
+	{
+		FirstOpt = 2;
+		while(FirstOpt < argc && argv[FirstOpt][0] != '-') FirstOpt++;
+	}
+	if(BatchMode)
+	{
+		FirstOpt = 2;
+		if(!argv[1][6]) while(FirstOpt < argc && argv[FirstOpt][0] != '-') FirstOpt++;
+	}
+
 	int argi;
-	for(argi=3; argi<argc; argi++)
+	for(argi=FirstOpt; argi<argc; argi++)
 	{
-		int ArgOk = 0;
+		int ArgOk = ParseProcessOpt(argv[argi], &Opts);
 
 		const char *ArgStr;
-		ARGMATCH(argv[argi], "-np:") ArgOk = 1, nPalettes = atoi(ArgStr);
-		ARGMATCH(argv[argi], "-ps:") ArgOk = 1, nColoursPerPalette = atoi(ArgStr);
-		ARGMATCH(argv[argi], "-tw:") ArgOk = 1, TileW = atoi(ArgStr);
-		ARGMATCH(argv[argi], "-th:") ArgOk = 1, TileH = atoi(ArgStr);
-		ARGMATCH(argv[argi], "-bgra:")
+		ARGMATCH(argv[argi], "-stream")
 		{
 			ArgOk = 1;
-			BitRange[0] = (1 << (*ArgStr++ - '0')) - 1;
-			BitRange[1] = (1 << (*ArgStr++ - '0')) - 1;
-			BitRange[2] = (1 << (*ArgStr++ - '0')) - 1;
-			BitRange[3] = (1 << (*ArgStr++ - '0')) - 1;
-		}
-
-		ARGMATCH(argv[argi], "-dither:")
-		{
-			int d;
-	
-			DITHERMODE_MATCH(ArgStr, "none",  DITHER_NONE,           0.0f);
-			DITHERMODE_MATCH(ArgStr, "floyd", DITHER_FLOYDSTEINBERG, 1.0f);
-			DITHERMODE_MATCH(ArgStr, "ord2",  DITHER_ORDERED(1),     0.5f);
-			DITHERMODE_MATCH(ArgStr, "ord4",  DITHER_ORDERED(2),     0.5f);
-			DITHERMODE_MATCH(ArgStr, "ord8",  DITHER_ORDERED(3),     0.5f);
-			DITHERMODE_MATCH(ArgStr, "ord16", DITHER_ORDERED(4),     0.5f);
-			DITHERMODE_MATCH(ArgStr, "ord32", DITHER_ORDERED(5),     0.5f);
-			DITHERMODE_MATCH(ArgStr, "ord64", DITHER_ORDERED(6),     0.5f);
-				
-			if(!ArgOk) printf("Unrecognized dither mode: %s\n", ArgStr);
-			ArgOk = 1;
+			StripTiles = (*ArgStr == ':') ? atoi(ArgStr+1) : STREAM_DEFAULT_STRIP_TILES;
+			if(StripTiles < 1) StripTiles = 1;
 		}
 
-		ARGMATCH(argv[argi], "-order")
+		ARGMATCH(argv[argi], "-out-tiles:") ArgOk = 1, OutTiles = ArgStr;
+		ARGMATCH(argv[argi], "-out-pal:")   ArgOk = 1, OutPal   = ArgStr;
+		ARGMATCH(argv[argi], "-out-map:")   ArgOk = 1, OutMap   = ArgStr;
+		ARGMATCH(argv[argi], "-bpp:")       ArgOk = 1, TileBpp  = atoi(ArgStr);
+		ARGMATCH(argv[argi], "-threads:")   ArgOk = 1, nThreads = atoi(ArgStr);
+		ARGMATCH(argv[argi], "-sequence")   ArgOk = 1, Sequence = true;
+		ARGMATCH(argv[argi], "-palette:")   ArgOk = 1, InPal    = ArgStr;
+		ARGMATCH(argv[argi], "-cache:")     ArgOk = 1, CacheDir = ArgStr;
+		ARGMATCH(argv[argi], "-update:")    ArgOk = 1, UpdateFile = ArgStr;
+		ARGMATCH(argv[argi], "-prev-input:") ArgOk = 1, PrevInput = ArgStr;
+		ARGMATCH(argv[argi], "-refine")     ArgOk = 1, Refine = true;
+		ARGMATCH(argv[argi], "-dirty:")
+		{
+			ArgOk = 1;
+			DirtySet = (sscanf(ArgStr, "%d,%d,%d,%d", &Dirty.x, &Dirty.y, &Dirty.w, &Dirty.h) == 4);
+			if(!DirtySet) printf("Invalid dirty rectangle: %s\n", ArgStr);
+		}
+		ARGMATCH(argv[argi], "-sweep:")     ArgOk = 1, SweepFile = ArgStr;
+		ARGMATCH(argv[argi], "-min-psnr:")  ArgOk = 1, MinPSNR = atof(ArgStr);
+		ARGMATCH(argv[argi], "-max-colours:") ArgOk = 1, MaxColours = atoi(ArgStr);
+		ARGMATCH(argv[argi], "-max-mem:")
 		{
 			ArgOk = 1;
-			OrderColours = true;
+			MaxMem = Mem_ParseSize(ArgStr);
+			if(!MaxMem) printf("Invalid memory size: %s\n", ArgStr);
 		}
 
 		if(!ArgOk) printf("Unrecognized argument: %s\n", ArgStr);
 	}
 
+	//! Create the shared pool now, so that nothing can create it first with
+	//! the default thread count
+	ThreadPool_Global(nThreads);
+
+	//! Requests carry their own options
+	if(ServeMode) return Serve_Run(argv[1][6] == ':' ? argv[1]+7 : NULL, nThreads) ? 0 : -1;
+	if(StatsMode) return RunStats(argv[1]+7, argv+2, FirstOpt-2, &Opts);
+
+	//! Loaded after all options, as it depends on -ps and -bgra
+	if(InPal)
+	{
+		if(StripTiles || Sequence)
+		{
+			printf("Fixed palettes are not available when streaming or in sequence mode\n");
+			return -1;
+		}
+		if(!Process_LoadPalette(&Opts, FixedPalette, InPal))
+		{
+			printf("Unable to read palette file\n");
+			return -1;
+		}
+	}
+
+	if(CacheDir && (StripTiles || Sequence))
+	{
+		printf("Caching is not available when streaming or in sequence mode\n");
+		return -1;
+	}
+
+	if(SweepFile && (BatchMode || StripTiles || Sequence || CacheDir || MaxMem || InPal))
+	{
+		printf("Sweeps are not available in batch mode, or with streaming, caching, memory budgets or fixed palettes\n");
+		return -1;
+	}
+
+	if(UpdateFile && (BatchMode || StripTiles || Sequence || CacheDir || MaxMem || InPal || SweepFile || Opts.TimeBudget))
+	{
+		printf("Updates are not available in batch mode, or with streaming, caching, memory budgets, time budgets, fixed palettes or sweeps\n");
+		return -1;
+	}
+	if(Opts.AlphaThreshold && (StripTiles || UpdateFile))
+	{
+		printf("Alpha thresholds are not available with streaming or updates\n");
+		return -1;
+	}
+	if(Opts.IntegerMode && (StripTiles || Sequence))
+	{
+		printf("The integer pipeline is not available when streaming or in sequence mode\n");
+		return -1;
+	}
+	if(Opts.ReassignPasses && (StripTiles || Sequence))
+	{
+		printf("Tile reassignment is not available when streaming or in sequence mode\n");
+		return -1;
+	}
+	if(Opts.ExactTiles && (StripTiles || Sequence || UpdateFile || InPal))
+	{
+		printf("Exact palettes are not available when streaming, in sequence mode, or with updates or fixed palettes\n");
+		return -1;
+	}
+	if(UpdateFile && !DirtySet && !PrevInput)
+	{
+		printf("Updates need a dirty rectangle or the previous input\n");
+		return -1;
+	}
+
+	if(BatchMode)
+	{
+		if(StripTiles || OutTiles || OutPal || OutMap || MaxMem || Opts.TimeBudget)
+		{
+			printf("Streaming, memory and time budgets, and console output formats are not available in batch mode\n");
+			return -1;
+		}
+
+		int nFailed;
+		if(argv[1][6] == ':')
+		{
+			char **Paths;
+			int nJobs = Batch_ReadManifest(argv[1]+7, &Paths);
+			if(nJobs < 0)
+			{
+				printf("Unable to read manifest file\n");
+				return -1;
+			}
+			if(Sequence) nFailed = Batch_RunSequence((const char *const *)Paths, nJobs, &Opts);
+			else         nFailed = Batch_Run((const char *const *)Paths, nJobs, &Opts, nThreads, CacheDir);
+			Batch_FreeManifest(Paths, nJobs);
+		}
+		else
+		{
+			if((FirstOpt-2) % 2)
+			{
+				printf("Batch input/output files must be given in pairs\n");
+				return -1;
+			}
+			if(Sequence) nFailed = Batch_RunSequence(argv+2, (FirstOpt-2)/2, &Opts);
+			else         nFailed = Batch_Run(argv+2, (FirstOpt-2)/2, &Opts, nThreads, CacheDir);
+		}
+
+		if(nFailed) printf("%d images failed\n", nFailed);
+		printf("Done!\n\n");
+		return nFailed ? -1 : 0;
+	}
+
+	if(Sequence)
+	{
+		printf("Sequence mode is only available in batch mode\n");
+		return -1;
+	}
+
+	bool WriteBmp = strcmp(argv[2], "-") != 0;
+	if(SweepFile) return RunSweep(argv[1], WriteBmp ? argv[2] : NULL, SweepFile, &Opts, nThreads, MinPSNR, MaxColours, TileBpp, OutTiles, OutPal, OutMap);
+	if(!TileBpp) TileBpp = (Opts.nColoursPerPalette <= 16) ? 4 : 8;
+
+	if(MaxMem)
+	{
+		struct BmpStream_t In;
+		if(!BmpStream_Open(&In, argv[1]))
+		{
+			printf("Unable to read input file\n");
+			return -1;
+		}
+		int    w = In.Width, h = In.Height, BitCnt = In.BitCnt;
+		size_t Estimate;
+		BmpStream_Close(&In);
+
+		//! An explicit -stream only needs its strip height chosen
+		int Plan;
+		if(StripTiles) Plan = PROCESS_PLAN_STREAM, StripTiles = Stream_PlanStrip(w, h, Opts.TileW, Opts.TileH, Opts.nPalettes, Opts.nColoursPerPalette, MaxMem, &HistEntries, &Estimate);
+		else Plan = Process_PlanMemory(w, h, BitCnt, &Opts, MaxMem, !(InPal || OutTiles || OutPal || OutMap || !WriteBmp || Opts.AlphaThreshold || Opts.ExactTiles || Opts.IntegerMode || Opts.ReassignPasses), &StripTiles, &HistEntries, &Estimate);
+		if(Plan != PROCESS_PLAN_STREAM) StripTiles = 0;
+		switch(Plan)
+		{
+			case PROCESS_PLAN_FULL:    printf("Memory plan: full image"); break;
+			case PROCESS_PLAN_COMPACT: printf("Memory plan: full image, integer pipeline"); Opts.IntegerMode = true; break;
+			case PROCESS_PLAN_STREAM:  printf("Memory plan: streaming, %d tile rows per strip", StripTiles); break;
+		}
+		printf(" (estimated %.1fMiB of %.1fMiB)\n", Estimate / 1048576.0, MaxMem / 1048576.0);
+		if(Estimate > MaxMem) printf("Warning: Memory budget is too small for this image\n");
+	}
+
+	if(StripTiles)
+	{
+		if(OutTiles || OutPal || OutMap || !WriteBmp || Opts.TimeBudget)
+		{
+			printf("Console output formats and time budgets are not available when streaming\n");
+			return -1;
+		}
+		printf("Streaming input file...\n");
+
+		struct BGRAf_t RMSE;
+		if(!Stream_Qualetize(
+			argv[1],
+			argv[2],
+			Opts.TileW,
+			Opts.TileH,
+			StripTiles,
+			HistEntries,
+			Opts.nPalettes,
+			Opts.nColoursPerPalette,
+			Opts.nUnusedColoursPerPalette,
+			&Opts.BitRange,
+			Opts.DitherMode,
+			Opts.DitherLevel,
+			Opts.OrderColours,
+			&RMSE
+		)) return -1;
+
+		PrintPSNR(RMSE);
+		printf("Peak memory = %.1fMiB\n", Mem_Peak() / 1048576.0);
+		printf("Done!\n\n");
+		return 0;
+	}
+
 	printf("Reading input file...\n");
 
 	struct BmpCtx_t Image;
@@ -121,66 +671,65 @@ int main(int argc, const char *argv[])
 		printf("Unable to read input file\n");
 		return -1;
 	}
-	
-	if(Image.Width%TileW || Image.Height%TileH)
+
+	struct BGRAf_t RMSE;
+	struct TilesData_t *TilesData = NULL;
+	int32_t *TilePalIdx = NULL;
+	double Start = QuantCluster_Time();
+	int Error;
+	if(UpdateFile)
 	{
-		printf("Image not a multiple of tile size (%dx%d)\n", TileW, TileH);
-		BmpCtx_Destroy(&Image);
-		return -1;
+		Error = UpdateImage(&Image, UpdateFile, PrevInput, DirtySet ? &Dirty : NULL, Refine, &Opts, &RMSE, &TilePalIdx);
 	}
-
-	struct TilesData_t* TilesData = TilesData_FromBitmap(&Image, TileW, TileH);
-	uint8_t *PxData = malloc(Image.Width * Image.Height * sizeof(uint8_t));
-	struct BGRAf_t* Palette = calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRAf_t));
-	
-	if(!TilesData || !PxData || !Palette)
+	else if(CacheDir && Opts.TimeBudget <= 0)
+	{
+		int Hit;
+		Error = Cache_ProcessImage(CacheDir, &Image, &Opts, &RMSE, &TilePalIdx, &Hit);
+		if(Error == PROCESS_OK && Hit) printf("Using cached result\n");
+	}
+	else
 	{
-		printf("Out of memory - Image not processed\n");
-		free(Palette);
-		free(PxData);
-		free(TilesData);
+		if(CacheDir) printf("Results under a time budget are not cached\n");
+		Error = Process_Image(&Image, &Opts, &RMSE, &TilesData);
+		if(Error == PROCESS_OK) TilePalIdx = TilesData->TilePalIdx;
+	}
+	if(Error != PROCESS_OK)
+	{
+		printf("%s\n", Process_ErrorString(Error, &Opts));
 		BmpCtx_Destroy(&Image);
 		return -1;
 	}
-	
-	struct BGRAf_t RMSE = Qualetize
-	(
-		&Image,
-		TilesData,
-		PxData,
-		Palette,
-		nPalettes,
-		nColoursPerPalette,
-		nUnusedColoursPerPalette,
-		(const struct BGRA8_t *)BitRange,
-		DitherMode,
-		DitherLevel,
-		1,
-		OrderColours
-	);
-
-	free(TilesData);
+	if(Opts.TimeBudget > 0)
+	{
+		printf(
+			"Time = %.0fms of %dms budget (%s)\n",
+			(QuantCluster_Time() - Start) * 1000.0,
+			Opts.TimeBudget,
+			TilesData->TimedOut ? "clustering cut short" : "clustering converged"
+		);
+	}
 
-#if MEASURE_PSNR
-	RMSE.b = -0x1.15F2CFp3f*logf(RMSE.b / 255.0f); //! -20*Log10[RMSE/255] == -20/Log[10] * Log[RMSE/255]
-	RMSE.g = -0x1.15F2CFp3f*logf(RMSE.g / 255.0f);
-	RMSE.r = -0x1.15F2CFp3f*logf(RMSE.r / 255.0f);
-	RMSE.a = -0x1.15F2CFp3f*logf(RMSE.a / 255.0f);
-	printf("PSNR = {%.3fdB, %.3fdB, %.3fdB, %.3fdB}\n", RMSE.b, RMSE.g, RMSE.r, RMSE.a);
-#else
-	(void)RMSE;
-#endif
+	PrintPSNR(RMSE);
 
-	printf("Writing output file...\n");
+	int Ok = WriteExports(&Image, TilePalIdx, &Opts, TileBpp, OutTiles, OutPal, OutMap);
+	if(TilesData) Mem_Free(TilesData);
+	else Mem_Free(TilePalIdx);
 
-	if(!BmpCtx_ToFile(&Image, argv[2]))
+	if(WriteBmp)
 	{
-		printf("\nUnable to write output file\n\n");
-		BmpCtx_Destroy(&Image);
-		return -1;
+		printf("Writing output file...\n");
+
+		if(!BmpCtx_ToFile(&Image, argv[2]))
+		{
+			printf("\nUnable to write output file\n\n");
+			BmpCtx_Destroy(&Image);
+			return -1;
+		}
 	}
 
 	BmpCtx_Destroy(&Image);
+	if(!Ok) return -1;
+	printf("Peak memory = %.1fMiB\n", Mem_Peak() / 1048576.0);
 	printf("Done!\n\n");
 	return 0;
 }
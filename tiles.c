@@ -1,45 +1,62 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include "mem.h"
 #include "quantize.h"
+#include "quantize16.h"
 #include "tiles.h"
 
-#define MAX_PALETTE_INDICES_PASSES      32
-#define MAX_PALETTE_QUANTIZATION_PASSES 32
-
 #define ALIGN2N(x,N) (((x) + (N)-1) &~ ((N)-1))
 #define DATA_ALIGNMENT 32
 #define DATA_ALIGN(x) ALIGN2N((uintptr_t)(x), DATA_ALIGNMENT)
 
-static inline void ConvertToTiles(struct TilesData_t *TilesData,
+//! NOTE: For indexed images, PxBGR is the colour table and SrcYCoCg holds
+//! its colours already converted, so each pixel is a lookup
+TILES_KERNEL void ConvertToTiles(struct TilesData_t *TilesData,
 	const struct BGRA8_t *PxBGR,
 	const        uint8_t *PxIdx,
-	int TileW,
-	int TileH,
+	const struct BGRAf_t *SrcYCoCg,
 	int nTileX,
-	int nTileY
+	int nTileY,
+	int TileW,
+	int TileH
 )
 {
 	int tx, ty, px, py;
+	size_t Stride = (size_t)nTileX * TileW;
 	union TilePx_t *TilePxPtr = TilesData->TilePxPtr;
 	struct BGRAf_t *TileValue = TilesData->TileValue;
+	uint8_t        *TileAlpha = TilesData->TileAlpha;
 	struct BGRAf_t *PxData    = TilesData->PxData;
 	
 	for(ty=0;ty<nTileY;ty++) for(tx=0;tx<nTileX;tx++)
 	{
 		struct BGRAf_t Mean;
 		
+		uint8_t MaxAlpha = 0;
 		struct BGRAf_t Sum = {0,0,0,0};
 		for(py=0; py<TileH; py++)
 		{
+			size_t RowOffs = ((size_t)ty*TileH+py)*Stride + (size_t)tx*TileW;
+			TILES_UNROLL
 			for(px=0; px<TileW; px++)
 			{
 				struct BGRA8_t pBGR;
-				if(PxIdx) pBGR = PxBGR[PxIdx[(ty*TileH+py)*(nTileX*TileW) + (tx*TileW+px)]];
-				else      pBGR = PxBGR[      (ty*TileH+py)*(nTileX*TileW) + (tx*TileW+px) ];
+				struct BGRAf_t Px;
+				if(PxIdx)
+				{
+					int Idx = PxIdx[RowOffs + px];
+					pBGR = PxBGR[Idx];
+					Px   = SrcYCoCg[Idx];
+				}
+				else
+				{
+					pBGR = PxBGR[RowOffs + px];
+					Px   = BGRAf_FromBGRA8(&pBGR);
+					Px   = BGRAf_AsYCoCg(&Px);
+				}
 
-				struct BGRAf_t Px = BGRAf_FromBGRA8(&pBGR);
-				Px = BGRAf_AsYCoCg(&Px);
+				if(pBGR.a > MaxAlpha) MaxAlpha = pBGR.a;
 				PxData[py*TileW+px] = Px;
 				Sum = BGRAf_Add(&Sum, &Px);
 			}
@@ -51,6 +68,7 @@ static inline void ConvertToTiles(struct TilesData_t *TilesData,
 		struct BGRAf_t SumW = {0,0,0,0};
 		for(py=0; py<TileH; py++)
 		{
+			TILES_UNROLL
 			for(px=0; px<TileW; px++)
 			{
 				struct BGRAf_t Px = PxData[py*TileW+px];
@@ -68,27 +86,49 @@ static inline void ConvertToTiles(struct TilesData_t *TilesData,
 
 		(TilePxPtr++)->PxBGRAf = PxData;
 		*TileValue++ = Value;
+		*TileAlpha++ = MaxAlpha;
 		PxData += TileW*TileH;
 	}
 }
 
-struct TilesData_t *TilesData_FromBitmap(const struct BmpCtx_t *Ctx, int TileW, int TileH)
+//! Size of PxTemp, in units of struct BGRAf_t
+static size_t TempSize(int w, int h, int IntegerMode)
 {
-	int nPx    = Ctx->Width * Ctx->Height;
-	int nTileX = (Ctx->Width  / TileW);
-	int nTileY = (Ctx->Height / TileH);
-	int nTiles = nTileX * nTileY;
-	struct TilesData_t *TilesData = malloc(
+	size_t nPx  = (size_t)w * h;
+	size_t nTemp = IntegerMode ? (nPx+1)/2 : nPx; //! Colours are gathered as YCoCg16_t in IntegerMode
+	return nTemp < (size_t)w*2 ? (size_t)w*2 : nTemp; //! Also used for diffusion rows
+}
+
+//! Size of a TilesData_t allocation, with or without the data used
+//! while quantizing
+static size_t LayoutSize(int w, int h, int TileW, int TileH, int IntegerMode, int ConvertOnly)
+{
+	size_t nPx     = (size_t)w * h;
+	size_t nTiles  = (size_t)(w / TileW) * (h / TileH);
+	size_t nPxTemp = ConvertOnly ? 0 : TempSize(w, h, IntegerMode);
+	size_t nPxIdx  = ConvertOnly ? 0 : nPx;
+	size_t nPalIdx = ConvertOnly ? 0 : nTiles;
+	return
 		DATA_ALIGNMENT-1                          + // Rounding
 		DATA_ALIGN(sizeof(struct TilesData_t))    +
 		DATA_ALIGN(nTiles * sizeof(union TilePx_t)) + // TilePxPtr
 		DATA_ALIGN(nTiles * sizeof(struct BGRAf_t)) + // TileValue
+		DATA_ALIGN(nTiles * sizeof(uint8_t)       ) + // TileAlpha
 		DATA_ALIGN(nPx    * sizeof(struct BGRAf_t)) + // PxData
-		DATA_ALIGN(nPx    * sizeof(struct BGRAf_t)) + // PxTemp
-		DATA_ALIGN(nPx    * sizeof(int32_t)       ) + // PxTempIdx
-		DATA_ALIGN(nTiles * sizeof(int32_t)       )   // TilePalIdx
-	);
-	if(!TilesData) return NULL;
+		DATA_ALIGN(nPxTemp* sizeof(struct BGRAf_t)) + // PxTemp
+		DATA_ALIGN(nPxIdx * sizeof(int32_t)       ) + // PxTempIdx
+		DATA_ALIGN(nPalIdx* sizeof(int32_t)       );  // TilePalIdx
+}
+
+//! Lay out and convert into Buffer (of LayoutSize() bytes)
+static struct TilesData_t *FromBitmapLayout(void *Buffer, const struct BmpCtx_t *Ctx, int TileW, int TileH, int IntegerMode, int ConvertOnly)
+{
+	size_t nPx     = (size_t)Ctx->Width * Ctx->Height;
+	size_t nPxTemp = TempSize(Ctx->Width, Ctx->Height, IntegerMode);
+	int nTileX = (Ctx->Width  / TileW);
+	int nTileY = (Ctx->Height / TileH);
+	int nTiles = nTileX * nTileY;
+	struct TilesData_t *TilesData = Buffer;
 
 	TilesData->TileW      = TileW;
 	TilesData->TileH      = TileH;
@@ -96,73 +136,473 @@ struct TilesData_t *TilesData_FromBitmap(const struct BmpCtx_t *Ctx, int TileW,
 	TilesData->TilesY     = nTileY;
 	TilesData->TilePxPtr  = (union TilePx_t*)DATA_ALIGN(TilesData + 1);
 	TilesData->TileValue  = (struct BGRAf_t*)DATA_ALIGN(TilesData->TilePxPtr + nTiles);
-	TilesData->PxData     = (struct BGRAf_t*)DATA_ALIGN(TilesData->TileValue + nTiles);
-	TilesData->PxTemp     = (struct BGRAf_t*)DATA_ALIGN(TilesData->PxData    + nPx);
-	TilesData->PxTempIdx  = (int32_t       *)DATA_ALIGN(TilesData->PxTemp    + nPx);
-	TilesData->TilePalIdx = (int32_t       *)DATA_ALIGN(TilesData->PxTempIdx + nPx);
+	TilesData->TileAlpha  = (uint8_t       *)DATA_ALIGN(TilesData->TileValue + nTiles);
+	TilesData->PxData     = (struct BGRAf_t*)DATA_ALIGN(TilesData->TileAlpha + nTiles);
+	if(ConvertOnly)
+	{
+		TilesData->PxTemp     = NULL;
+		TilesData->PxTempIdx  = NULL;
+		TilesData->TilePalIdx = NULL;
+	}
+	else
+	{
+		TilesData->PxTemp     = (struct BGRAf_t*)DATA_ALIGN(TilesData->PxData    + nPx);
+		TilesData->PxTempIdx  = (int32_t       *)DATA_ALIGN(TilesData->PxTemp    + nPxTemp);
+		TilesData->TilePalIdx = (int32_t       *)DATA_ALIGN(TilesData->PxTempIdx + nPx);
+	}
+	TilesData->IntegerMode    = IntegerMode;
+	TilesData->CoarseFactor   = 1;
+	TilesData->Deadline       = 0.0;
+	TilesData->TimedOut       = 0;
+	TilesData->ReassignPasses = 0;
+	TilesData->AlphaThreshold = 0;
+	TilesData->ExactTiles     = 0;
+	TilesData->TileFixed      = NULL;
 
-	if(Ctx->ColPal) ConvertToTiles(TilesData, Ctx->ColPal, Ctx->PxIdx, TileW, TileH, nTileX, nTileY);
-	else            ConvertToTiles(TilesData, Ctx->PxBGR,  NULL,       TileW, TileH, nTileX, nTileY);
+	if(Ctx->ColPal)
+	{
+		//! At most BMP_PALETTE_COLOURS source colours, so convert them once
+		int i;
+		struct BGRAf_t SrcYCoCg[BMP_PALETTE_COLOURS];
+		for(i=0;i<BMP_PALETTE_COLOURS;i++)
+		{
+			SrcYCoCg[i] = BGRAf_FromBGRA8(&Ctx->ColPal[i]);
+			SrcYCoCg[i] = BGRAf_AsYCoCg(&SrcYCoCg[i]);
+		}
+		TILES_DISPATCH(TileW, TileH, ConvertToTiles, TilesData, Ctx->ColPal, Ctx->PxIdx, SrcYCoCg, nTileX, nTileY);
+	}
+	else TILES_DISPATCH(TileW, TileH, ConvertToTiles, TilesData, Ctx->PxBGR, NULL, NULL, nTileX, nTileY);
 
 	return TilesData;
 }
 
-int TilesData_QuantizePalettes(struct TilesData_t *TilesData, struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, int PalUnusedEntries)
+size_t TilesData_MemorySize(int w, int h, int TileW, int TileH, int IntegerMode)
 {
-	int i, j, k;
-	int nPxTile = TilesData->TileW  * TilesData->TileH;
-	int nTiles  = TilesData->TilesX * TilesData->TilesY;
+	return LayoutSize(w, h, TileW, TileH, IntegerMode, 0);
+}
 
-	MaxPalSize -= PalUnusedEntries;
+struct TilesData_t *TilesData_FromBitmap(const struct BmpCtx_t *Ctx, int TileW, int TileH, int IntegerMode)
+{
+	void *Buffer = Mem_Alloc(TilesData_MemorySize(Ctx->Width, Ctx->Height, TileW, TileH, IntegerMode));
+	if(!Buffer) return NULL;
+	return FromBitmapLayout(Buffer, Ctx, TileW, TileH, IntegerMode, 0);
+}
 
-	struct QuantCluster_t *Clusters, *_Clusters;
+struct TilesData_t *TilesData_FromBitmapBuffer(void *Buffer, const struct BmpCtx_t *Ctx, int TileW, int TileH, int IntegerMode)
+{
+	return FromBitmapLayout(Buffer, Ctx, TileW, TileH, IntegerMode, 0);
+}
 
-	int nClusters = MaxTilePals;
-	
-	if(MaxPalSize > nClusters)
-		nClusters = MaxPalSize;
-	
-	_Clusters = malloc(DATA_ALIGNMENT-1 + nClusters*sizeof(struct QuantCluster_t));
+size_t TilesData_ConvertSize(int w, int h, int TileW, int TileH)
+{
+	return LayoutSize(w, h, TileW, TileH, 0, 1);
+}
 
+struct TilesData_t *TilesData_Convert(const struct BmpCtx_t *Ctx, int TileW, int TileH)
+{
+	void *Buffer = Mem_Alloc(TilesData_ConvertSize(Ctx->Width, Ctx->Height, TileW, TileH));
+	if(!Buffer) return NULL;
+	return FromBitmapLayout(Buffer, Ctx, TileW, TileH, 0, 1);
+}
+
+struct TilesData_t *TilesData_Share(const struct TilesData_t *Src, int IntegerMode)
+{
+	int w = Src->TilesX * Src->TileW;
+	int h = Src->TilesY * Src->TileH;
+	size_t nPx     = (size_t)w * h;
+	size_t nPxTemp = TempSize(w, h, IntegerMode);
+	size_t nTiles  = (size_t)Src->TilesX * Src->TilesY;
+	struct TilesData_t *TilesData = Mem_Alloc(
+		DATA_ALIGNMENT-1                          + // Rounding
+		DATA_ALIGN(sizeof(struct TilesData_t))    +
+		DATA_ALIGN(nPxTemp* sizeof(struct BGRAf_t)) + // PxTemp
+		DATA_ALIGN(nPx    * sizeof(int32_t)       ) + // PxTempIdx
+		DATA_ALIGN(nTiles * sizeof(int32_t)       )   // TilePalIdx
+	);
+	if(!TilesData) return NULL;
+
+	*TilesData = *Src;
+	TilesData->PxTemp     = (struct BGRAf_t*)DATA_ALIGN(TilesData + 1);
+	TilesData->PxTempIdx  = (int32_t       *)DATA_ALIGN(TilesData->PxTemp    + nPxTemp);
+	TilesData->TilePalIdx = (int32_t       *)DATA_ALIGN(TilesData->PxTempIdx + nPx);
+	TilesData->IntegerMode    = IntegerMode;
+	TilesData->CoarseFactor   = 1;
+	TilesData->Deadline       = 0.0;
+	TilesData->TimedOut       = 0;
+	TilesData->ReassignPasses = 0;
+	TilesData->AlphaThreshold = 0;
+	TilesData->ExactTiles     = 0;
+	TilesData->TileFixed      = NULL;
+	return TilesData;
+}
+
+//! Quantize without seeds, making sure that every centroid is defined
+//! NOTE: Clusters that are never split into are otherwise left as they
+//! were; starting them on a data point lets a later seeded refinement
+//! empty and re-split them as usual
+static int CoarseQuantize(struct QuantCluster_t *Clusters, int nCluster, const struct BGRAf_t *Data, int nData, int32_t *DataClusters, int nPasses, double Deadline)
+{
+	int i;
+	for(i=0; i<nCluster; i++) Clusters[i].Centroid = Data[0];
+	return QuantCluster_Quantize(Clusters, nCluster, Data, nData, DataClusters, nPasses, Deadline);
+}
+
+//! Get the deadline for a stage that gets Share of the remaining time
+static double StageDeadline(const struct TilesData_t *TilesData, double Share)
+{
+	if(TilesData->Deadline == 0.0) return 0.0;
+	double Now = QuantCluster_Time();
+	double Remaining = TilesData->Deadline - Now;
+	return (Remaining > 0.0) ? Now + Remaining*Share : TilesData->Deadline;
+}
+
+//! Gather the pixels of the tiles using palette PalIdx, with each tile
+//! downsampled by averaging Factor*Factor blocks
+static int GatherPalettePixels(const struct TilesData_t *TilesData, int PalIdx, struct BGRAf_t *Dst, int Factor)
+{
+	int j, x, y, bx, by;
+	int TileW  = TilesData->TileW;
+	int TileH  = TilesData->TileH;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+	float Scale = 1.0f / (Factor*Factor);
+
+	int PxCnt = 0;
+	for(j=0; j<nTiles; j++) if(TilesData->TilePalIdx[j] == PalIdx && TilesData_TileClustered(TilesData, j))
+	{
+		const struct BGRAf_t *Src = TilesData->TilePxPtr[j].PxBGRAf;
+		for(y=0; y<TileH; y+=Factor) for(x=0; x<TileW; x+=Factor)
+		{
+			struct BGRAf_t Sum = {0,0,0,0};
+			for(by=0; by<Factor; by++) for(bx=0; bx<Factor; bx++)
+				Sum = BGRAf_Add(&Sum, &Src[(y+by)*TileW + (x+bx)]);
+			Dst[PxCnt++] = BGRAf_Muli(&Sum, Scale);
+		}
+	}
+	return PxCnt;
+}
+
+int TilesData_QuantizeTiles(struct TilesData_t *TilesData, struct BGRAf_t *TileCentroids, int MaxTilePals, int Seeded)
+{
+	int i, k;
+	int nTiles = TilesData->TilesX * TilesData->TilesY;
+
+	struct QuantCluster_t *Clusters, *_Clusters;
+	_Clusters = Mem_Calloc(1, DATA_ALIGNMENT-1 + MaxTilePals*sizeof(struct QuantCluster_t));
 	if(!_Clusters)
 		return 0;
-	
 	Clusters = (struct QuantCluster_t*)DATA_ALIGN(_Clusters);
 
-	QuantCluster_Quantize(Clusters, MaxTilePals, TilesData->TileValue, nTiles, TilesData->TilePalIdx, MAX_PALETTE_INDICES_PASSES);
+	//! Tiles with no visible pixels (or fixed palettes) are left out, by
+	//! gathering the values of the rest into PxTemp (with their palettes
+	//! in PxTempIdx)
+	//! NOTE: PxTemp only holds half the pixels in IntegerMode, which
+	//! 1-pixel tiles may exceed; all tiles are clustered then
+	size_t TempCap = TempSize(TilesData->TilesX*TilesData->TileW, TilesData->TilesY*TilesData->TileH, TilesData->IntegerMode);
+	const struct BGRAf_t *Values = TilesData->TileValue;
+	int32_t *ValuePalIdx = TilesData->TilePalIdx;
+	int nValues = nTiles;
+	if(TilesData->AlphaThreshold || TilesData->TileFixed)
+	{
+		for(i=0, nValues=0; i<nTiles; i++) nValues += TilesData_TileClustered(TilesData, i);
+		if((size_t)nValues > TempCap) nValues = nTiles;
+		if(nValues < nTiles)
+		{
+			for(i=0, k=0; i<nTiles; i++) if(TilesData_TileClustered(TilesData, i)) TilesData->PxTemp[k++] = TilesData->TileValue[i];
+			Values      = TilesData->PxTemp;
+			ValuePalIdx = TilesData->PxTempIdx;
+		}
+	}
+
+	int Converged = 1;
+	double Deadline = StageDeadline(TilesData, TILES_TIME_BUDGET_SHARE);
+	int Step = TilesData->CoarseFactor * TilesData->CoarseFactor;
+	struct BGRAf_t *Coarse = TilesData->PxTemp + (Values == TilesData->PxTemp ? nValues : 0);
+	if(!Seeded && Step > 1 && nValues / Step >= MaxTilePals * MIN_COARSE_POINTS_PER_CLUSTER && (size_t)(Coarse - TilesData->PxTemp) + nValues/Step + 1 <= TempCap)
+	{
+		//! Cluster a reduced set of tile values, then refine over all tiles
+		int nCoarse = 0;
+		for(i=0; i<nValues; i+=Step) Coarse[nCoarse++] = Values[i];
+		Converged &= CoarseQuantize(Clusters, MaxTilePals, Coarse, nCoarse, TilesData->PxTempIdx, MAX_PALETTE_INDICES_PASSES, Deadline);
+		Converged &= QuantCluster_QuantizeSeeded(Clusters, MaxTilePals, Values, NULL, nValues, ValuePalIdx, MAX_COARSE_REFINEMENT_PASSES, Deadline);
+	}
+	else if(Seeded)
+	{
+		for(i=0; i<MaxTilePals; i++) Clusters[i].Centroid = TileCentroids[i];
+		Converged &= QuantCluster_QuantizeSeeded(Clusters, MaxTilePals, Values, NULL, nValues, ValuePalIdx, MAX_PALETTE_INDICES_PASSES, Deadline);
+	}
+	else Converged &= QuantCluster_Quantize(Clusters, MaxTilePals, Values, nValues, ValuePalIdx, MAX_PALETTE_INDICES_PASSES, Deadline);
+	if(!Converged) TilesData->TimedOut = 1;
 
-	for(i=0; i<MaxTilePals; i++)
+	//! Invisible tiles just take the first palette
+	if(ValuePalIdx != TilesData->TilePalIdx) for(i=0, k=0; i<nTiles; i++)
 	{
-		struct BGRAf_t *PxTemp = TilesData->PxTemp;
+		if(TilesData_TileClustered(TilesData, i)) TilesData->TilePalIdx[i] = ValuePalIdx[k++];
+		else if(!TilesData_TileVisible(TilesData, i)) TilesData->TilePalIdx[i] = 0;
+	}
 
-		int PxCnt;
+	if(TileCentroids && nValues)
+	{
+		for(i=0; i<MaxTilePals; i++) TileCentroids[i] = Clusters[i].Centroid;
+	}
+
+	Mem_Free(_Clusters);
+	return 1;
+}
+
+//! Gather the pixels of the tiles using palette PalIdx into PxTemp (as
+//! YCoCg16_t in IntegerMode), storing the number of pixels to *PxCnt
+TILES_KERNEL void GatherPaletteTiles(const struct TilesData_t *TilesData, int PalIdx, int *PxCnt, int TileW, int TileH)
+{
+	int j, k;
+	int nPxTile = TileW * TileH;
+	int nTiles  = TilesData->TilesX * TilesData->TilesY;
+	struct BGRAf_t   *PxTemp   = TilesData->PxTemp;
+	struct YCoCg16_t *PxTemp16 = (struct YCoCg16_t*)PxTemp;
+
+	int n = 0;
+	for(j=0; j<nTiles; j++) if(TilesData->TilePalIdx[j] == PalIdx && TilesData_TileClustered(TilesData, j))
+	{
+		const struct BGRAf_t *Src = TilesData->TilePxPtr[j].PxBGRAf;
+		if(TilesData->AlphaThreshold)
 		{
-			struct BGRAf_t *Dst = PxTemp;
-			for(j=0; j<nTiles; j++)
+			//! Transparent pixels are remapped to the reserved entry, so
+			//! leave them out (BGRAf_t alpha is exactly Alpha/255)
+			float AlphaCut = TilesData->AlphaThreshold / 255.0f;
+			for(k=0; k<nPxTile; k++) if(Src[k].a >= AlphaCut)
 			{
-				if(TilesData->TilePalIdx[j] == i)
-				{
-					const struct BGRAf_t *Src = TilesData->TilePxPtr[j].PxBGRAf;
-					
-					for(k=0; k<nPxTile; k++)
-						*Dst++ = *Src++;
-				}
+				if(TilesData->IntegerMode) PxTemp16[n++] = YCoCg16_FromYCoCgf(&Src[k]);
+				else PxTemp[n++] = Src[k];
 			}
-			PxCnt = Dst - PxTemp;
+			continue;
 		}
-		
+		if(TilesData->IntegerMode)
+		{
+			TILES_UNROLL
+			for(k=0; k<nPxTile; k++) PxTemp16[n+k] = YCoCg16_FromYCoCgf(&Src[k]);
+		}
+		else
+		{
+			TILES_UNROLL
+			for(k=0; k<nPxTile; k++) PxTemp[n+k] = Src[k];
+		}
+		n += nPxTile;
+	}
+	*PxCnt = n;
+}
+
+int TilesData_QuantizeColours(struct TilesData_t *TilesData, struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, int PalUnusedEntries, int Seeded, const uint8_t *Refit)
+{
+	int i, j;
+	int nTiles  = TilesData->TilesX * TilesData->TilesY;
+
+	int PalStride = MaxPalSize;
+	MaxPalSize -= PalUnusedEntries;
+
+	int IntegerMode = TilesData->IntegerMode;
+	struct QuantCluster_t   *Clusters,   *_Clusters;
+	struct QuantCluster16_t *Clusters16;
+	size_t ClusterSize = IntegerMode ? sizeof(struct QuantCluster16_t) : sizeof(struct QuantCluster_t);
+	_Clusters = Mem_Calloc(1, DATA_ALIGNMENT-1 + MaxPalSize*ClusterSize);
+	if(!_Clusters)
+		return 0;
+	Clusters   = (struct QuantCluster_t*)DATA_ALIGN(_Clusters);
+	Clusters16 = (struct QuantCluster16_t*)Clusters;
+
+	int CoarseFactor = TilesData->CoarseFactor;
+	while(CoarseFactor > 1 && (TilesData->TileW % CoarseFactor || TilesData->TileH % CoarseFactor)) CoarseFactor--;
+	if(IntegerMode || Seeded) CoarseFactor = 1;
+
+	//! With a deadline, each palette gets a share of the time left in
+	//! proportion to its pixels (which clustering time scales with)
+	int nTilesLeft = nTiles;
+	int Converged  = 1;
+	for(i=0; i<MaxTilePals; i++, Palette += PalStride)
+	{
+		if(Refit && !Refit[i]) continue;
+
+		int nPalTiles = 0;
+		if(TilesData->Deadline != 0.0) for(j=0; j<nTiles; j++) nPalTiles += (TilesData->TilePalIdx[j] == i);
+		double Deadline = StageDeadline(TilesData, nTilesLeft ? (double)nPalTiles / nTilesLeft : 1.0);
+		nTilesLeft -= nPalTiles;
+		struct BGRAf_t   *PxTemp   = TilesData->PxTemp;
+		struct YCoCg16_t *PxTemp16 = (struct YCoCg16_t*)PxTemp;
+
+		int PxCnt;
+		TILES_DISPATCH(TilesData->TileW, TilesData->TileH, GatherPaletteTiles, TilesData, i, &PxCnt);
+
+		//! NOTE: Unused palettes are left as they were (so seeds persist)
 		if(!PxCnt)
 			continue;
 
-		QuantCluster_Quantize(Clusters, MaxPalSize, PxTemp, PxCnt, TilesData->PxTempIdx, MAX_PALETTE_QUANTIZATION_PASSES);
+		//! NOTE: Downsampled blocks keep their transparent pixels, which
+		//! only shifts the starting point of the full-resolution refinement
+		int CoarseCnt = PxCnt / (CoarseFactor*CoarseFactor);
+		if(CoarseFactor > 1 && CoarseCnt >= MaxPalSize * MIN_COARSE_POINTS_PER_CLUSTER)
+		{
+			//! Most centroid movement happens in the first passes, so do
+			//! those at low resolution and then refine at full resolution
+			CoarseCnt = GatherPalettePixels(TilesData, i, PxTemp, CoarseFactor);
+			Converged &= CoarseQuantize(Clusters, MaxPalSize, PxTemp, CoarseCnt, TilesData->PxTempIdx, MAX_PALETTE_QUANTIZATION_PASSES, Deadline);
+			TILES_DISPATCH(TilesData->TileW, TilesData->TileH, GatherPaletteTiles, TilesData, i, &PxCnt);
+			Converged &= QuantCluster_QuantizeSeeded(Clusters, MaxPalSize, PxTemp, NULL, PxCnt, TilesData->PxTempIdx, MAX_COARSE_REFINEMENT_PASSES, Deadline);
+		}
+		else if(IntegerMode)
+		{
+			Converged &= QuantCluster16_Quantize(Clusters16, MaxPalSize, PxTemp16, PxCnt, TilesData->PxTempIdx, MAX_PALETTE_QUANTIZATION_PASSES, Deadline);
+			for(j=0; j<MaxPalSize; j++)
+				Palette[j] = BGRAf_FromYCoCg16(&Clusters16[j].Centroid);
+		}
+		else if(Seeded)
+		{
+			for(j=0; j<MaxPalSize; j++) Clusters[j].Centroid = Palette[j];
+			Converged &= QuantCluster_QuantizeSeeded(Clusters, MaxPalSize, PxTemp, NULL, PxCnt, TilesData->PxTempIdx, Refit ? MAX_REFIT_PASSES : MAX_PALETTE_QUANTIZATION_PASSES, Deadline);
+		}
+		else Converged &= QuantCluster_Quantize(Clusters, MaxPalSize, PxTemp, PxCnt, TilesData->PxTempIdx, MAX_PALETTE_QUANTIZATION_PASSES, Deadline);
 
-		for(j=0; j<MaxPalSize; j++)
-			*Palette++ = Clusters[j].Centroid;
+		if(!IntegerMode) for(j=0; j<MaxPalSize; j++)
+			Palette[j] = Clusters[j].Centroid;
 
 		for(j=0; j<PalUnusedEntries; j++)
-			*Palette++ = BGRAf_AsYCoCg(&(struct BGRAf_t){1,1,1,0}); //  (struct BGRAf_t){0,0,0,1}; // BGRAf_FromBGRA8(&(struct BGRA8_t){255,0,255,255});
+			Palette[MaxPalSize+j] = BGRAf_AsYCoCg(&(struct BGRAf_t){1,1,1,0}); //  (struct BGRAf_t){0,0,0,1}; // BGRAf_FromBGRA8(&(struct BGRA8_t){255,0,255,255});
 	}
+	if(!Converged) TilesData->TimedOut = 1;
 
-	free(_Clusters);
+	Mem_Free(_Clusters);
+	return 1;
+}
+
+//! Squared distance between two boxes (0 if they overlap)
+static inline float BoxDistance(const struct BGRAf_t *MinA, const struct BGRAf_t *MaxA, const struct BGRAf_t *MinB, const struct BGRAf_t *MaxB)
+{
+	struct BGRAf_t Lo = BGRAf_Sub(MinB, MaxA); //! Gap when B lies above A
+	struct BGRAf_t Hi = BGRAf_Sub(MinA, MaxB); //! Gap when B lies below A
+	struct BGRAf_t Gap = BGRAf_Max(&Lo, &Hi);
+	struct BGRAf_t Zero = {0,0,0,0};
+	Gap = BGRAf_Max(&Gap, &Zero);
+	return BGRAf_Len2(&Gap);
+}
+
+//! Remap error of a tile's pixels on a palette, stopping once it reaches Bound
+//! NOTE: Pixels with alpha below AlphaCut are left out, as the remap gives
+//! them the reserved entry whatever the palette
+static inline float TileRemapError(const struct BGRAf_t *Px, int nPx, const struct BGRAf_t *Pal, int First, int MaxPalSize, float AlphaCut, float Bound)
+{
+	int n, j;
+	float Err = 0.0f;
+	for(n=0; n<nPx && Err < Bound; n++)
+	{
+		if(Px[n].a < AlphaCut) continue;
+		float MinDst = 8.0e37f;
+		for(j=First; j<MaxPalSize; j++)
+		{
+			float Dst = BGRAf_ColDistance(&Px[n], &Pal[j]);
+			if(Dst < MinDst) MinDst = Dst;
+		}
+		Err += MinDst;
+	}
+	return Err;
+}
+
+int TilesData_ReassignTiles(struct TilesData_t *TilesData, const struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, int PalUnusedEntries, uint8_t *Changed)
+{
+	int i, j, t;
+	int nPxTile = TilesData->TileW  * TilesData->TileH;
+	int nTiles  = TilesData->TilesX * TilesData->TilesY;
+	int First   = (PalUnusedEntries > 0) ? PalUnusedEntries-1 : 0; //! Same entries as the remap searches
+	float AlphaCut = TilesData->AlphaThreshold / 255.0f;
+
+	//! Bounding box of each palette's entries
+	struct BGRAf_t PalMin[BMP_PALETTE_COLOURS], PalMax[BMP_PALETTE_COLOURS];
+	for(i=0; i<MaxTilePals; i++)
+	{
+		const struct BGRAf_t *Pal = Palette + i*MaxPalSize;
+		PalMin[i] = PalMax[i] = Pal[First];
+		for(j=First+1; j<MaxPalSize; j++)
+		{
+			PalMin[i] = BGRAf_Min(&PalMin[i], &Pal[j]);
+			PalMax[i] = BGRAf_Max(&PalMax[i], &Pal[j]);
+		}
+		Changed[i] = 0;
+	}
+
+	struct { float Bound; int Pal; } Order[BMP_PALETTE_COLOURS];
+	int nMoved = 0;
+	for(t=0; t<nTiles; t++)
+	{
+		if(TilesData->Deadline != 0.0 && QuantCluster_Time() > TilesData->Deadline) break;
+
+		if(!TilesData_TileClustered(TilesData, t)) continue;
+
+		//! Box of the visible pixels (a visible tile has at least one)
+		const struct BGRAf_t *Px = TilesData->TilePxPtr[t].PxBGRAf;
+		struct BGRAf_t TileMin = { 8.0e37f, 8.0e37f, 8.0e37f, 8.0e37f};
+		struct BGRAf_t TileMax = {-8.0e37f,-8.0e37f,-8.0e37f,-8.0e37f};
+		int nVisible = 0;
+		for(j=0; j<nPxTile; j++) if(Px[j].a >= AlphaCut)
+		{
+			TileMin = BGRAf_Min(&TileMin, &Px[j]);
+			TileMax = BGRAf_Max(&TileMax, &Px[j]);
+			nVisible++;
+		}
+
+		//! Every pixel is at least as far from a palette as the gap
+		//! between their boxes; trying palettes in order of that bound
+		//! finds a good one early, and stops at the first that can't win
+		int nOrder = 0;
+		for(i=0; i<MaxTilePals; i++)
+		{
+			float Bound = BoxDistance(&TileMin, &TileMax, &PalMin[i], &PalMax[i]);
+			if(Bound == 0.0f)
+			{
+				//! Boxes overlap, so bound by the entry nearest the tile's box
+				const struct BGRAf_t *Pal = Palette + i*MaxPalSize;
+				Bound = 8.0e37f;
+				for(j=First; j<MaxPalSize; j++)
+				{
+					float Dst = BoxDistance(&TileMin, &TileMax, &Pal[j], &Pal[j]);
+					if(Dst < Bound) Bound = Dst;
+				}
+			}
+			Bound *= nVisible;
+			for(j=nOrder++; j>0 && Bound < Order[j-1].Bound; j--) Order[j] = Order[j-1];
+			Order[j].Bound = Bound, Order[j].Pal = i;
+		}
+
+		int   Cur     = TilesData->TilePalIdx[t];
+		int   BestPal = Cur;
+		float BestErr = TileRemapError(Px, nPxTile, Palette + Cur*MaxPalSize, First, MaxPalSize, AlphaCut, 8.0e37f);
+		for(i=0; i<nOrder && Order[i].Bound < BestErr; i++) if(Order[i].Pal != Cur)
+		{
+			float Err = TileRemapError(Px, nPxTile, Palette + Order[i].Pal*MaxPalSize, First, MaxPalSize, AlphaCut, BestErr);
+			if(Err < BestErr) BestPal = Order[i].Pal, BestErr = Err;
+		}
+		if(BestPal != Cur)
+		{
+			TilesData->TilePalIdx[t] = BestPal;
+			Changed[Cur] = Changed[BestPal] = 1;
+			nMoved++;
+		}
+	}
+	return nMoved;
+}
+
+int TilesData_QuantizePalettes(struct TilesData_t *TilesData, struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, int PalUnusedEntries)
+{
+	int Pass;
+	if(!TilesData_QuantizeTiles(TilesData, NULL, MaxTilePals, 0))
+		return 0;
+	if(!TilesData_QuantizeColours(TilesData, Palette, MaxTilePals, MaxPalSize, PalUnusedEntries, 0, NULL))
+		return 0;
+
+	//! Tile clustering only sees one value per tile, so check each tile
+	//! against the palettes it actually gets, and refit what changed
+	uint8_t Changed[BMP_PALETTE_COLOURS];
+	for(Pass=0; Pass<TilesData->ReassignPasses; Pass++)
+	{
+		if(!TilesData_ReassignTiles(TilesData, Palette, MaxTilePals, MaxPalSize, PalUnusedEntries, Changed))
+			break;
+		if(!TilesData_QuantizeColours(TilesData, Palette, MaxTilePals, MaxPalSize, PalUnusedEntries, 1, Changed))
+			return 0;
+	}
 	return 1;
 }
@@ -1,8 +1,37 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
-#include "Bitmap.h"
-#include "Colourspace.h"
+#include "bitmap.h"
+#include "colourspace.h"
+
+#define MAX_PALETTE_INDICES_PASSES      32
+#define MAX_PALETTE_QUANTIZATION_PASSES 32
+#define MAX_COARSE_REFINEMENT_PASSES     4 //! Full-resolution passes after coarse clustering
+#define MAX_REFIT_PASSES                 4 //! Seeded passes when refitting palettes after reassignment
+#define MIN_COARSE_POINTS_PER_CLUSTER    8 //! Coarse clustering is skipped below this
+#define TILES_TIME_BUDGET_SHARE       0.25 //! Share of the time to Deadline given to tile clustering
+
+//! Kernels over tile pixels are compiled separately for the common tile
+//! sizes: TILES_DISPATCH() calls Kernel with the tile size appended as
+//! constants for 8x8, 8x16 and 16x16 (so tile loops unroll with constant
+//! strides, and divisions become shifts), or as the runtime values for
+//! any other size
+//! NOTE: Kernels must be TILES_KERNEL, so that each call is inlined
+#if defined(__GNUC__)
+# define TILES_KERNEL static inline __attribute__((always_inline))
+# define TILES_UNROLL _Pragma("GCC unroll 16")
+#else
+# define TILES_KERNEL static inline
+# define TILES_UNROLL
+#endif
+#define TILES_DISPATCH(TileW, TileH, Kernel, ...) \
+	do { \
+		if     ((TileW) ==  8 && (TileH) ==  8) Kernel(__VA_ARGS__,  8,  8); \
+		else if((TileW) ==  8 && (TileH) == 16) Kernel(__VA_ARGS__,  8, 16); \
+		else if((TileW) == 16 && (TileH) == 16) Kernel(__VA_ARGS__, 16, 16); \
+		else Kernel(__VA_ARGS__, (TileW), (TileH)); \
+	} while(0)
 
 union TilePx_t
 {
@@ -17,18 +46,107 @@ struct TilesData_t
 	int TilesX, TilesY;
 	union TilePx_t *TilePxPtr;  //! Tile pixel pointers
 	struct BGRAf_t *TileValue;  //! Tile values (for quantization comparisons)
+	uint8_t        *TileAlpha;  //! Highest alpha of each tile's pixels
 	struct BGRAf_t *PxData;     //! Tile pixel data
 	struct BGRAf_t *PxTemp;     //! Temporary processing data
 	int32_t        *PxTempIdx;  //! Temporary processing data (palette entry indices)
 	int32_t        *TilePalIdx; //! Tile palette indices
+	int             IntegerMode; //! Quantize colours with integer arithmetic (see quantize16.h)
+	int             CoarseFactor; //! Cluster on data downsampled by this factor first (1 = off)
+	double          Deadline;     //! QuantCluster_Time() to finish quantizing by (0 = none)
+	int             TimedOut;     //! Set when Deadline stopped clustering before convergence
+	int             ReassignPasses; //! Passes of error-driven tile reassignment (0 = off)
+	int             AlphaThreshold; //! Pixels with alpha below this are left out of clustering (0 = off)
+	int             ExactTiles;     //! Give tiles with few colours exact palettes (see exact.h)
+	const uint8_t  *TileFixed;      //! Tiles whose palette is already set, left out of clustering (or NULL)
 };
 
+//! Check whether a tile has any pixels at or above the AlphaThreshold
+static inline int TilesData_TileVisible(const struct TilesData_t *TilesData, int Tile)
+{
+	return TilesData->TileAlpha[Tile] >= TilesData->AlphaThreshold;
+}
+
+//! Check whether a tile takes part in clustering (visible, and not fixed)
+static inline int TilesData_TileClustered(const struct TilesData_t *TilesData, int Tile)
+{
+	return TilesData_TileVisible(TilesData, Tile) && !(TilesData->TileFixed && TilesData->TileFixed[Tile]);
+}
+
 //! Convert bitmap to tiles
-//! NOTE: To destroy, call free() on the returned pointer
-struct TilesData_t *TilesData_FromBitmap(const struct BmpCtx_t *Ctx, int TileW, int TileH);
+//! NOTE: IntegerMode quantizes colours with integer arithmetic, which also
+//! halves the size of PxTemp
+//! NOTE: CoarseFactor (1), Deadline (none), ReassignPasses (0),
+//! AlphaThreshold (0), ExactTiles (0) and TileFixed (NULL) may be changed
+//! before quantizing
+//! NOTE: To destroy, call Mem_Free() on the returned pointer
+struct TilesData_t *TilesData_FromBitmap(const struct BmpCtx_t *Ctx, int TileW, int TileH, int IntegerMode);
+
+//! Convert bitmap to tiles in an existing buffer (eg. one kept between
+//! images), of at least TilesData_MemorySize() bytes
+//! NOTE: The returned pointer is Buffer
+struct TilesData_t *TilesData_FromBitmapBuffer(void *Buffer, const struct BmpCtx_t *Ctx, int TileW, int TileH, int IntegerMode);
+
+//! Get the size of the TilesData_FromBitmap() allocation
+size_t TilesData_MemorySize(int w, int h, int TileW, int TileH, int IntegerMode);
+
+//! Convert bitmap to tiles, without the data used while quantizing
+//! NOTE: For users that only read the converted tiles (tile values and
+//! pixels, or TilesData_Share()); PxTemp, PxTempIdx and TilePalIdx are
+//! NULL, so the result must not be quantized itself
+//! NOTE: To destroy, call Mem_Free() on the returned pointer
+struct TilesData_t *TilesData_Convert(const struct BmpCtx_t *Ctx, int TileW, int TileH);
+
+//! Get the size of the TilesData_Convert() allocation
+size_t TilesData_ConvertSize(int w, int h, int TileW, int TileH);
+
+//! Create tile data that shares the converted tiles of Src, with its own
+//! temporary data and palette indices
+//! NOTE: Quantizing only reads the converted tiles, so each thread can
+//! quantize its own share of the same Src (which must outlive the shares)
+//! NOTE: To destroy, call Mem_Free() on the returned pointer
+struct TilesData_t *TilesData_Share(const struct TilesData_t *Src, int IntegerMode);
 
 //! Create quantized palette
 //! NOTE: PalUnusedEntries is used for 'padding', such as on
 //! the GBA/NDS where index 0 of every palette is transparent
 //! NOTE: Palette is generated in YUVA mode
+//! NOTE: With ReassignPasses, each pass moves tiles with
+//! TilesData_ReassignTiles() and refits only the palettes that changed
+//! NOTE: With an AlphaThreshold, tiles with no visible pixels are left
+//! out of every stage (and given palette 0), and transparent pixels are
+//! left out of colour clustering
+//! NOTE: Tiles with TileFixed[n] set keep their palette, and are left out
+//! of every stage (so their palettes should be past MaxTilePals)
 int TilesData_QuantizePalettes(struct TilesData_t *TilesData, struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, int PalUnusedEntries);
+
+//! Assign tiles to palettes (first half of TilesData_QuantizePalettes)
+//! NOTE: With a CoarseFactor, clustering is first done on every
+//! CoarseFactor^2-th tile, and then refined over all tiles
+//! NOTE: With a Deadline, this stage gets TILES_TIME_BUDGET_SHARE of the
+//! time left, and the rest goes to TilesData_QuantizeColours()
+//! NOTE: If Seeded, TileCentroids[0..MaxTilePals-1] are the starting
+//! centroids (eg. from the previous frame of an animation)
+//! NOTE: If TileCentroids is not NULL, it receives the final centroids
+int TilesData_QuantizeTiles(struct TilesData_t *TilesData, struct BGRAf_t *TileCentroids, int MaxTilePals, int Seeded);
+
+//! Quantize the colours of each palette from the tile assignment
+//! NOTE: If Seeded, Palette holds the starting colour centroids (in the
+//! same layout as it is returned); palettes with no tiles are not modified
+//! NOTE: With a CoarseFactor (and not Seeded), colours are first clustered
+//! on each tile downsampled by CoarseFactor in each direction, and then
+//! refined at full resolution; the factor is reduced until it divides the
+//! tile size, and skipped when too few points are left
+//! NOTE: With a Deadline, each palette gets a share of the time left in
+//! proportion to its number of tiles
+//! NOTE: Seeded and CoarseFactor are ignored in IntegerMode
+//! NOTE: If Refit is not NULL, only palettes with Refit[i] set are quantized
+int TilesData_QuantizeColours(struct TilesData_t *TilesData, struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, int PalUnusedEntries, int Seeded, const uint8_t *Refit);
+
+//! Move each tile to the palette that remaps it with the least error
+//! NOTE: Palettes are ruled out by the distance between their bounding box
+//! and the tile's, and remap errors stop once they pass the best so far
+//! NOTE: Changed[i] (MaxTilePals entries) is set for palettes that gained
+//! or lost tiles; stops early at the Deadline
+//! NOTE: Returns the number of tiles moved
+int TilesData_ReassignTiles(struct TilesData_t *TilesData, const struct BGRAf_t *Palette, int MaxTilePals, int MaxPalSize, int PalUnusedEntries, uint8_t *Changed);
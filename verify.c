@@ -0,0 +1,751 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "bitmap.h"
+#include "cache.h"
+#include "colourspace.h"
+#include "mem.h"
+#include "process.h"
+#include "qualetize.h"
+#include "stream.h"
+#include "tiles.h"
+
+#ifdef _WIN32
+# include <io.h>
+# define DUP   _dup
+# define DUP2  _dup2
+# define CLOSE _close
+# define NULL_DEVICE "NUL"
+#else
+# include <unistd.h>
+# define DUP   dup
+# define DUP2  dup2
+# define CLOSE close
+# define NULL_DEVICE "/dev/null"
+#endif
+
+//! Differential tests: generates random images and option sets from a
+//! seed, runs each through the reference path (scalar float pipeline, with
+//! no optional stages) and through each fast path, and checks that the
+//! results are bit-exact where that is promised, and within a PSNR
+//! tolerance of the reference elsewhere
+//! NOTE: Everything is deterministic from the seed, so a failure can be
+//! reproduced with -seed and -case
+
+#define VERIFY_SEED  0x2545F491u
+#define VERIFY_CASES 24
+#define VERIFY_TEMP_DIR "." //! Where files for the file-level checks (and cache entries) go; removed after
+
+//! Clustering heuristics vary a lot on small images, so fast paths that
+//! change clustering are held to their mean PSNR loss over all cases, with
+//! a looser limit on any one case to catch outright breakage
+#define VERIFY_MEAN_TOLERANCE_DB  0.5f  //! Mean PSNR a fast path may lose against the reference
+#define VERIFY_CASE_TOLERANCE_DB  8.0f  //! PSNR it may lose in any one case
+#define VERIFY_PSNR_CAP          60.0f  //! PSNR above this counts as this (near-lossless differences don't matter)
+
+/**************************************/
+
+static uint32_t Rand_Next(uint32_t *State)
+{
+	uint32_t x = *State; //! xorshift32
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *State = x;
+}
+
+static int Rand_Range(uint32_t *State, int n)
+{
+	return (int)(Rand_Next(State) % (uint32_t)n);
+}
+
+static uint8_t Clamp8(int x)
+{
+	return (x < 0) ? 0 : (x > 255) ? 255 : x;
+}
+
+/**************************************/
+
+//! Gradients with grain, so that most pixels differ
+static void Gen_Gradient(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	int x, y;
+	int w = Img->Width, h = Img->Height;
+	int Grain = 1 + Rand_Range(Seed, 24);
+	for(y=0;y<h;y++) for(x=0;x<w;x++)
+	{
+		struct BGRA8_t *p = &Img->PxBGR[(size_t)y*w + x];
+		p->b = Clamp8(x * 255 / w + Rand_Range(Seed, Grain) - Grain/2);
+		p->g = Clamp8(y * 255 / h + Rand_Range(Seed, Grain) - Grain/2);
+		p->r = Clamp8((x + y) * 255 / (w + h) + Rand_Range(Seed, Grain) - Grain/2);
+		p->a = 255;
+	}
+}
+
+//! Random blocks of random colours over a few base colours
+static void Gen_Blocks(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	int i, x, y;
+	int w = Img->Width, h = Img->Height;
+	int nCol = 2 + Rand_Range(Seed, 40);
+	struct BGRA8_t Pal[42];
+	for(i=0;i<nCol;i++) Pal[i] = (struct BGRA8_t){Rand_Next(Seed), Rand_Next(Seed), Rand_Next(Seed), 255};
+
+	for(y=0;y<h;y++) for(x=0;x<w;x++)
+		Img->PxBGR[(size_t)y*w + x] = Pal[((x/8) + (y/8)) % 2];
+
+	int nBlocks = 1 + w*h / 256;
+	for(i=0;i<nBlocks;i++)
+	{
+		int x0 = Rand_Range(Seed, w), y0 = Rand_Range(Seed, h);
+		int x1 = x0 + 1 + Rand_Range(Seed, 24), y1 = y0 + 1 + Rand_Range(Seed, 24);
+		struct BGRA8_t Fill = Pal[Rand_Range(Seed, nCol)];
+		for(y=y0;y<y1 && y<h;y++) for(x=x0;x<x1 && x<w;x++)
+			Img->PxBGR[(size_t)y*w + x] = Fill;
+	}
+}
+
+//! Shaded discs on a transparent background, with soft edges
+static void Gen_Sprites(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	int i, x, y;
+	int w = Img->Width, h = Img->Height;
+	for(y=0;y<h;y++) for(x=0;x<w;x++)
+		Img->PxBGR[(size_t)y*w + x] = (struct BGRA8_t){0,0,0,0};
+
+	int nSprites = 1 + w*h / 1024;
+	for(i=0;i<nSprites;i++)
+	{
+		struct BGRA8_t Base = {Rand_Next(Seed), Rand_Next(Seed), Rand_Next(Seed), 255};
+		int cx = Rand_Range(Seed, w), cy = Rand_Range(Seed, h);
+		int Rad = 3 + Rand_Range(Seed, 12);
+		for(y=cy-Rad;y<=cy+Rad;y++) for(x=cx-Rad;x<=cx+Rad;x++)
+		{
+			int dx = x-cx, dy = y-cy, d2 = dx*dx + dy*dy;
+			if(x < 0 || y < 0 || x >= w || y >= h || d2 >= Rad*Rad) continue;
+
+			int Shade = 64 - (dx + dy) * 64 / Rad / 2;
+			Img->PxBGR[(size_t)y*w + x] = (struct BGRA8_t){
+				Clamp8(Base.b * Shade / 64),
+				Clamp8(Base.g * Shade / 64),
+				Clamp8(Base.r * Shade / 64),
+				(d2 >= (Rad-1)*(Rad-1)) ? 96 : 255
+			};
+		}
+	}
+}
+
+//! Uniform noise (worst case for every heuristic)
+static void Gen_Noise(struct BmpCtx_t *Img, uint32_t *Seed)
+{
+	size_t n, nPx = (size_t)Img->Width * Img->Height;
+	for(n=0;n<nPx;n++)
+		Img->PxBGR[n] = (struct BGRA8_t){Rand_Next(Seed), Rand_Next(Seed), Rand_Next(Seed), 255};
+}
+
+static const struct
+{
+	const char *Name;
+	void (*Generate)(struct BmpCtx_t *Img, uint32_t *Seed);
+} Images[] = {
+	{"gradient", Gen_Gradient},
+	{"blocks",   Gen_Blocks},
+	{"sprites",  Gen_Sprites},
+	{"noise",    Gen_Noise},
+};
+
+//! Tile sizes: the specialised kernels, and others for the generic ones
+static const struct { int tw, th; } TileSizes[] = {
+	{ 8,  8},
+	{ 8, 16},
+	{16, 16},
+	{ 4,  4},
+	{12,  8},
+};
+
+static const struct { int np, ps; } PalConfigs[] = {
+	{16, 16},
+	{ 8, 16},
+	{ 4, 64},
+	{ 1,256},
+	{ 2,  4},
+};
+
+static const struct { const char *Name; int Mode; float Level; } Dithers[] = {
+	{"none",   DITHER_NONE,                0.0f},
+	{"floyd",  DITHER_FLOYDSTEINBERG,      1.0f},
+	{"tfloyd", DITHER_TILE_FLOYDSTEINBERG, 1.0f},
+	{"tserp",  DITHER_TILE_SERPENTINE,     1.0f},
+	{"ord4",   DITHER_ORDERED(2),          0.5f},
+	{"ord8",   DITHER_ORDERED(3),          0.5f},
+};
+
+//! Fast paths checked against a PSNR tolerance
+enum
+{
+	VARIANT_INTEGER,
+	VARIANT_COARSE,
+	VARIANT_REASSIGN,
+	VARIANT_EXACT,
+	VARIANT_ALPHA,
+	VARIANT_STREAM, //! Not an option: Stream_Qualetize() against Process_Image()
+	VARIANT_COUNT
+};
+
+static const char *VariantNames[VARIANT_COUNT] = {
+	"integer pipeline",
+	"coarse clustering",
+	"tile reassignment",
+	"exact palettes",
+	"transparent pixels",
+	"streaming",
+};
+
+static void Variant_Apply(int Variant, struct ProcessOpts_t *Opts)
+{
+	switch(Variant)
+	{
+		case VARIANT_INTEGER:  Opts->IntegerMode    = true; break;
+		case VARIANT_COARSE:   Opts->CoarseFactor   = 2;    break;
+		case VARIANT_REASSIGN: Opts->ReassignPasses = 2;    break;
+		case VARIANT_EXACT:    Opts->ExactTiles     = true; break;
+		case VARIANT_ALPHA:    Opts->AlphaThreshold = 128;  break;
+	}
+}
+
+#define COUNTOF(x) (int)(sizeof(x) / sizeof(x[0]))
+
+/**************************************/
+
+struct Verify_t
+{
+	int Verbose;
+	int nChecks;
+	int nFailed;
+	const char *Case; //! Description of the current case
+	const char *TempDir;
+	double Loss[VARIANT_COUNT]; //! Sum of PSNR lost against the reference
+	int   nLoss[VARIANT_COUNT];
+};
+
+static void Verify_Result(struct Verify_t *V, const char *Check, int Ok, const char *Detail)
+{
+	V->nChecks++;
+	if(!Ok) V->nFailed++;
+	if(!Ok || V->Verbose) printf("%s %s: %s%s%s\n", Ok ? "ok  " : "FAIL", V->Case, Check, Detail ? " - " : "", Detail ? Detail : "");
+}
+
+//! Copy an RGBA image
+static int Verify_Copy(struct BmpCtx_t *Dst, const struct BmpCtx_t *Src)
+{
+	if(!BmpCtx_Create(Dst, Src->Width, Src->Height, 0)) return 0;
+	memcpy(Dst->PxBGR, Src->PxBGR, (size_t)Src->Width*Src->Height * sizeof(struct BGRA8_t));
+	return 1;
+}
+
+//! Make an indexed copy of an RGBA image
+//! NOTE: Returns 0 if it has more than BMP_PALETTE_COLOURS colours
+static int Verify_Index(struct BmpCtx_t *Dst, const struct BmpCtx_t *Src)
+{
+	int i, nCol = 0;
+	size_t n, nPx = (size_t)Src->Width * Src->Height;
+	struct BGRA8_t *ColPal = Mem_Calloc(BMP_PALETTE_COLOURS, sizeof(struct BGRA8_t));
+	uint8_t        *PxIdx  = Mem_Alloc(nPx);
+	if(!ColPal || !PxIdx)
+	{
+		Mem_Free(PxIdx);
+		Mem_Free(ColPal);
+		return 0;
+	}
+	for(n=0;n<nPx;n++)
+	{
+		for(i=0;i<nCol;i++) if(!memcmp(&ColPal[i], &Src->PxBGR[n], sizeof(struct BGRA8_t))) break;
+		if(i == nCol)
+		{
+			if(nCol == BMP_PALETTE_COLOURS)
+			{
+				Mem_Free(PxIdx);
+				Mem_Free(ColPal);
+				return 0;
+			}
+			ColPal[nCol++] = Src->PxBGR[n];
+		}
+		PxIdx[n] = i;
+	}
+	memset(Dst, 0, sizeof(*Dst));
+	Dst->Width  = Src->Width;
+	Dst->Height = Src->Height;
+	BmpCtx_SetIndexed(Dst, ColPal, PxIdx);
+	return 1;
+}
+
+//! Compare two indexed results
+static int Verify_Same(const struct BmpCtx_t *a, const struct BmpCtx_t *b)
+{
+	size_t nPx = (size_t)a->Width * a->Height;
+	return
+		a->Width == b->Width && a->Height == b->Height &&
+		!memcmp(a->ColPal, b->ColPal, BMP_PALETTE_COLOURS * sizeof(struct BGRA8_t)) &&
+		!memcmp(a->PxIdx,  b->PxIdx,  nPx);
+}
+
+//! PSNR (over all channels) of an indexed result against its source
+//! NOTE: Only pixels with alpha of at least MinAlpha count
+static float Verify_PSNR(const struct BmpCtx_t *Src, const struct BmpCtx_t *Out, int MinAlpha)
+{
+	size_t n, nPx = (size_t)Src->Width * Src->Height, nCounted = 0;
+	double SqErr = 0.0;
+	for(n=0;n<nPx;n++)
+	{
+		struct BGRA8_t s = Src->PxBGR[n], o = Out->ColPal[Out->PxIdx[n]];
+		if(s.a < MinAlpha) continue;
+		SqErr += (double)(s.b-o.b)*(s.b-o.b) + (double)(s.g-o.g)*(s.g-o.g) + (double)(s.r-o.r)*(s.r-o.r) + (double)(s.a-o.a)*(s.a-o.a);
+		nCounted += 4;
+	}
+	if(!nCounted || SqErr == 0.0) return INFINITY;
+	return (float)(10.0 * log10(255.0*255.0 * nCounted / SqErr));
+}
+
+//! Process a copy of Src with Opts, storing the result to Out
+static int Verify_Process(struct BmpCtx_t *Out, const struct BmpCtx_t *Src, const struct ProcessOpts_t *Opts)
+{
+	struct BGRAf_t RMSE;
+	if(!Verify_Copy(Out, Src)) return PROCESS_ERR_MEMORY;
+	int Error = Process_Image(Out, Opts, &RMSE, NULL);
+	if(Error != PROCESS_OK) BmpCtx_Destroy(Out);
+	return Error;
+}
+
+//! Check that the result of a fast path is within VERIFY_CASE_TOLERANCE_DB
+//! of the reference, and count its loss towards the mean
+static void Verify_Loss(struct Verify_t *V, int Variant, const struct BmpCtx_t *Src, const struct BmpCtx_t *Ref, const struct BmpCtx_t *Out, int MinAlpha)
+{
+	char Detail[128];
+	float RefPSNR = Verify_PSNR(Src, Ref, MinAlpha);
+	float OutPSNR = Verify_PSNR(Src, Out, MinAlpha);
+	float Loss = fminf(RefPSNR, VERIFY_PSNR_CAP) - fminf(OutPSNR, VERIFY_PSNR_CAP);
+	V->Loss[Variant] += Loss;
+	V->nLoss[Variant]++;
+	snprintf(Detail, sizeof(Detail), "%.3fdB against %.3fdB", OutPSNR, RefPSNR);
+	Verify_Result(V, VariantNames[Variant], Loss <= VERIFY_CASE_TOLERANCE_DB, Detail);
+}
+
+//! Run a fast path (RefOpts with Variant applied), and check it against
+//! the reference
+static void Verify_Variant(struct Verify_t *V, int Variant, const struct BmpCtx_t *Src, const struct BmpCtx_t *Ref, const struct ProcessOpts_t *RefOpts)
+{
+	struct BmpCtx_t Out;
+	struct ProcessOpts_t Opts = *RefOpts;
+	Variant_Apply(Variant, &Opts);
+	int Error = Verify_Process(&Out, Src, &Opts);
+	if(Error != PROCESS_OK)
+	{
+		Verify_Result(V, VariantNames[Variant], 0, Process_ErrorString(Error, &Opts));
+		return;
+	}
+	Verify_Loss(V, Variant, Src, Ref, &Out, Opts.AlphaThreshold);
+	BmpCtx_Destroy(&Out);
+}
+
+/**************************************/
+
+//! Checks at the Process_*() level
+static void Verify_Paths(struct Verify_t *V, const struct BmpCtx_t *Src, const struct ProcessOpts_t *RefOpts)
+{
+	struct BmpCtx_t Ref, Out;
+	struct BGRAf_t RMSE;
+	int Error = Verify_Process(&Ref, Src, RefOpts);
+	if(Error != PROCESS_OK)
+	{
+		Verify_Result(V, "reference", 0, Process_ErrorString(Error, RefOpts));
+		return;
+	}
+
+	//! Exact: kept work buffers (run twice, so the second reuses the first's)
+	struct ProcessWork_t Work;
+	Process_WorkInit(&Work);
+	int Rep, Ok = 1;
+	for(Rep=0;Rep<2;Rep++)
+	{
+		Ok &= Verify_Copy(&Out, Src);
+		Ok &= Ok && Process_ImageWork(&Out, RefOpts, &Work, &RMSE, NULL) == PROCESS_OK;
+		Ok &= Ok && Verify_Same(&Ref, &Out);
+		BmpCtx_Destroy(&Out);
+	}
+	Process_WorkDestroy(&Work);
+	Verify_Result(V, "work buffers are exact", Ok, NULL);
+
+	//! Exact: tiles shared between option sets
+	struct TilesData_t *Tiles = TilesData_Convert(Src, RefOpts->TileW, RefOpts->TileH);
+	Ok = Tiles && Process_ImageShared(Src, Tiles, RefOpts, &Out, &RMSE, NULL) == PROCESS_OK;
+	if(Ok)
+	{
+		Ok = Verify_Same(&Ref, &Out);
+		BmpCtx_Destroy(&Out);
+	}
+	Mem_Free(Tiles);
+	Verify_Result(V, "shared tiles are exact", Ok, NULL);
+
+	//! Exact: indexed input (source colours converted once, and looked up)
+	struct BmpCtx_t Idx;
+	if(Verify_Index(&Idx, Src))
+	{
+		Ok = Process_Image(&Idx, RefOpts, &RMSE, NULL) == PROCESS_OK && Verify_Same(&Ref, &Idx);
+		BmpCtx_Destroy(&Idx);
+		Verify_Result(V, "indexed input is exact", Ok, NULL);
+	}
+
+	//! Within tolerance: everything that changes clustering or arithmetic
+	int Variant;
+	for(Variant=0;Variant<VARIANT_STREAM;Variant++) Verify_Variant(V, Variant, Src, &Ref, RefOpts);
+
+	BmpCtx_Destroy(&Ref);
+}
+
+//! Checks at the Qualetize_*() level, against Qualetize_RemapRows() over
+//! the whole image in one call
+static void Verify_Remap(struct Verify_t *V, const struct BmpCtx_t *Src, const struct ProcessOpts_t *Opts, uint32_t *Seed)
+{
+	int i, x, y;
+	int w = Src->Width, h = Src->Height;
+	int tw = Opts->TileW, th = Opts->TileH;
+	int np = Opts->nPalettes, ps = Opts->nColoursPerPalette, PalUnused = Opts->nUnusedColoursPerPalette;
+	size_t nPx = (size_t)w*h;
+
+	struct TilesData_t *TilesData = TilesData_FromBitmap(Src, tw, th, 0);
+	uint8_t *RefData = Mem_Alloc(nPx);
+	uint8_t *OutData = Mem_Alloc(nPx);
+	struct BGRAf_t *PxDiffuse = Mem_Alloc((size_t)w*2 * sizeof(struct BGRAf_t));
+	if(!TilesData || !RefData || !OutData || !PxDiffuse)
+	{
+		Verify_Result(V, "remap", 0, "out of memory");
+		goto Done;
+	}
+
+	struct BGRAf_t Palette[BMP_PALETTE_COLOURS];
+	struct BGRAf_t PaletteSpread[BMP_PALETTE_COLOURS];
+	memset(Palette, 0, sizeof(Palette));
+	TilesData_QuantizePalettes(TilesData, Palette, np, ps, PalUnused);
+	Qualetize_PreparePalettes(Palette, PaletteSpread, np, ps, PalUnused, &Opts->BitRange, Opts->DitherMode, Opts->DitherLevel, false);
+
+	struct BGRAf_t SqErr = {0,0,0,0};
+	for(i=0;i<w*2;i++) PxDiffuse[i] = (struct BGRAf_t){0,0,0,0};
+	Qualetize_RemapRows(Src->PxBGR, NULL, RefData, w, h, 0, h, tw, th, TilesData->TilePalIdx, NULL, Palette, NULL, PaletteSpread, ps, PalUnused, 0, Opts->DitherMode, Opts->DitherLevel, PxDiffuse, &SqErr);
+
+	//! Exact: bands of whole tile rows (as streamed), with error carried over
+	for(i=0;i<w*2;i++) PxDiffuse[i] = (struct BGRAf_t){0,0,0,0};
+	for(y=0;y<h;)
+	{
+		int nRows = th * (1 + Rand_Range(Seed, 3));
+		if(nRows > h-y) nRows = h-y;
+		Qualetize_RemapRows(Src->PxBGR + (size_t)y*w, NULL, OutData + (size_t)y*w, w, h, y, nRows, tw, th, TilesData->TilePalIdx, NULL, Palette, NULL, PaletteSpread, ps, PalUnused, 0, Opts->DitherMode, Opts->DitherLevel, PxDiffuse, &SqErr);
+		y += nRows;
+	}
+	Verify_Result(V, "remap in bands is exact", !memcmp(RefData, OutData, nPx), NULL);
+
+	//! Exact: tile-local dither, one tile at a time (as for updates)
+	if(DITHER_IS_TILED(Opts->DitherMode))
+	{
+		memset(OutData, 0, nPx);
+		for(y=0;y<h/th;y++) for(x=0;x<w/tw;x++)
+		{
+			int PalIdx = TilesData->TilePalIdx[y*(w/tw) + x];
+			Qualetize_RemapTile(Src->PxBGR, NULL, OutData, w, x, y, tw, th, PalIdx, Palette, NULL, PaletteSpread, ps, PalUnused, 0, Opts->DitherMode, Opts->DitherLevel, PxDiffuse, &SqErr);
+		}
+		Verify_Result(V, "tile-local remap per tile is exact", !memcmp(RefData, OutData, nPx), NULL);
+	}
+
+Done:
+	Mem_Free(PxDiffuse);
+	Mem_Free(OutData);
+	Mem_Free(RefData);
+	Mem_Free(TilesData);
+}
+
+/**************************************/
+
+static void PutLE(uint8_t *Dst, uint32_t x, int nBytes)
+{
+	int i;
+	for(i=0;i<nBytes;i++) Dst[i] = (uint8_t)(x >> (i*8));
+}
+
+//! Write the first w columns of an image as a 24-bit BMP, one byte at a
+//! time (alpha is dropped)
+static int Verify_WriteBmp24(const char *Filename, const struct BmpCtx_t *Src, int w, int TopDown)
+{
+	int x, y, h = Src->Height;
+	size_t Stride = ((size_t)w*3 + 3) & ~(size_t)3;
+	uint8_t Hdr[54];
+	memset(Hdr, 0, sizeof(Hdr));
+	Hdr[0] = 'B', Hdr[1] = 'M';
+	PutLE(Hdr +  2, (uint32_t)(sizeof(Hdr) + Stride*h), 4);
+	PutLE(Hdr + 10, sizeof(Hdr), 4);
+	PutLE(Hdr + 14, 40, 4);
+	PutLE(Hdr + 18, (uint32_t)w, 4);
+	PutLE(Hdr + 22, (uint32_t)(TopDown ? -h : h), 4);
+	PutLE(Hdr + 26, 1, 2);
+	PutLE(Hdr + 28, 24, 2);
+	PutLE(Hdr + 34, (uint32_t)(Stride*h), 4);
+
+	FILE *File = fopen(Filename, "wb");
+	if(!File) return 0;
+	int Ok = fwrite(Hdr, sizeof(Hdr), 1, File) == 1;
+	for(y=0;y<h && Ok;y++)
+	{
+		const struct BGRA8_t *Row = Src->PxBGR + (size_t)(TopDown ? y : h-1-y) * Src->Width;
+		for(x=0;x<w;x++)
+		{
+			fputc(Row[x].b, File);
+			fputc(Row[x].g, File);
+			fputc(Row[x].r, File);
+		}
+		for(x=w*3;(size_t)x<Stride;x++) fputc(0, File);
+		Ok = !ferror(File);
+	}
+	return (fclose(File) == 0) && Ok;
+}
+
+//! Check decoded pixels against the first w columns of Src (opaque)
+static int Verify_SameBGR(const struct BGRA8_t *Px, const struct BmpCtx_t *Src, int w, int y0, int nRows)
+{
+	int x, y;
+	for(y=0;y<nRows;y++) for(x=0;x<w;x++)
+	{
+		struct BGRA8_t s = Src->PxBGR[(size_t)(y0+y)*Src->Width + x], d = Px[(size_t)y*w + x];
+		if(d.b != s.b || d.g != s.g || d.r != s.r || d.a != 255) return 0;
+	}
+	return 1;
+}
+
+//! Keep stdout quiet (for functions that report their progress)
+static int Quiet_Begin(void)
+{
+	fflush(stdout);
+	int Saved = DUP(fileno(stdout));
+	FILE *Null = fopen(NULL_DEVICE, "w");
+	if(Null)
+	{
+		DUP2(fileno(Null), fileno(stdout));
+		fclose(Null);
+	}
+	return Saved;
+}
+
+static void Quiet_End(int Saved)
+{
+	if(Saved < 0) return;
+	fflush(stdout);
+	DUP2(Saved, fileno(stdout));
+	CLOSE(Saved);
+}
+
+//! Checks of the file and cache paths, through files in V->TempDir
+static void Verify_Files(struct Verify_t *V, const struct BmpCtx_t *Src, const struct ProcessOpts_t *Opts, uint32_t *Seed)
+{
+	int y;
+	int w = Src->Width, h = Src->Height;
+	char InFile[4096], OutFile[4096];
+	snprintf(InFile,  sizeof(InFile),  "%s/tilequant_verify_in.bmp",  V->TempDir);
+	snprintf(OutFile, sizeof(OutFile), "%s/tilequant_verify_out.bmp", V->TempDir);
+
+	//! Exact: 24-bit rows expanded on loading (mapped, and streamed in
+	//! strips), against a byte-at-a-time decode; odd widths give padded
+	//! rows and leave a tail after the vector loop
+	int wOdd = w - 1 - Rand_Range(Seed, 3);
+	int TopDown = Rand_Range(Seed, 2);
+	struct BmpCtx_t Img;
+	struct BmpStream_t In;
+	int Ok = Verify_WriteBmp24(InFile, Src, wOdd, TopDown);
+	if(Ok && (Ok = BmpCtx_FromFile(&Img, InFile)) != 0)
+	{
+		Ok = Img.Width == wOdd && Img.Height == h && !Img.ColPal && Verify_SameBGR(Img.PxBGR, Src, wOdd, 0, h);
+		BmpCtx_Destroy(&Img);
+	}
+	Verify_Result(V, "24-bit load is exact", Ok, TopDown ? "top-down" : "bottom-up");
+	if(Ok && (Ok = BmpStream_Open(&In, InFile)) != 0)
+	{
+		struct BGRA8_t *Rows = Mem_Alloc((size_t)wOdd*h * sizeof(struct BGRA8_t));
+		Ok = Rows != NULL;
+		for(y=0;y<h && Ok;)
+		{
+			int nRows = 1 + Rand_Range(Seed, 16);
+			if(nRows > h-y) nRows = h-y;
+			Ok = BmpStream_ReadRows(&In, y, nRows, Rows) && Verify_SameBGR(Rows, Src, wOdd, y, nRows);
+			y += nRows;
+		}
+		Mem_Free(Rows);
+		Ok = BmpStream_Close(&In) && Ok;
+	}
+	Verify_Result(V, "24-bit streamed rows are exact", Ok, NULL);
+
+	//! Within tolerance: streaming (from a 24-bit file, so against an
+	//! opaque copy of the image)
+	struct BmpCtx_t Opaque, Ref, Out;
+	size_t n, nPx = (size_t)w*h;
+	if(!Verify_Copy(&Opaque, Src))
+	{
+		Verify_Result(V, VariantNames[VARIANT_STREAM], 0, "out of memory");
+		return;
+	}
+	for(n=0;n<nPx;n++) Opaque.PxBGR[n].a = 255;
+	int Error = Verify_Process(&Ref, &Opaque, Opts);
+	if(Error != PROCESS_OK)
+	{
+		Verify_Result(V, "opaque reference", 0, Process_ErrorString(Error, Opts));
+		BmpCtx_Destroy(&Opaque);
+		return;
+	}
+	struct BGRAf_t RMSE;
+	int Quiet = Quiet_Begin();
+	Ok = Verify_WriteBmp24(InFile, &Opaque, w, Rand_Range(Seed, 2)) && Stream_Qualetize(
+		InFile,
+		OutFile,
+		Opts->TileW,
+		Opts->TileH,
+		1 + Rand_Range(Seed, 3),
+		STREAM_HISTOGRAM_ENTRIES,
+		Opts->nPalettes,
+		Opts->nColoursPerPalette,
+		Opts->nUnusedColoursPerPalette,
+		&Opts->BitRange,
+		Opts->DitherMode,
+		Opts->DitherLevel,
+		Opts->OrderColours,
+		&RMSE
+	);
+	Quiet_End(Quiet);
+	if(Ok && (Ok = BmpCtx_FromFile(&Out, OutFile)) != 0)
+	{
+		Verify_Loss(V, VARIANT_STREAM, &Opaque, &Ref, &Out, 0);
+		BmpCtx_Destroy(&Out);
+	}
+	else Verify_Result(V, VariantNames[VARIANT_STREAM], 0, "stream failed");
+	remove(OutFile);
+	remove(InFile);
+
+	//! Exact: a cache hit gives what its miss did, and both give Process_Image()
+	//! NOTE: Any entry left by an earlier run is removed first
+	char Entry[4096];
+	struct CacheKey_t Key;
+	struct BmpCtx_t Hit;
+	struct BGRAf_t HitRMSE;
+	int32_t *TilePal = NULL, *HitTilePal = NULL;
+	int WasHit = 0, Ok2 = 0;
+	Cache_Key(&Key, &Opaque, Opts);
+	Cache_EntryPath(Entry, sizeof(Entry), V->TempDir, &Key);
+	remove(Entry);
+	int Copied = Verify_Copy(&Out, &Opaque);
+	Ok = Copied && Cache_ProcessImage(V->TempDir, &Out, Opts, &RMSE, &TilePal, &WasHit) == PROCESS_OK;
+	Ok = Ok && !WasHit && Verify_Same(&Ref, &Out);
+	if(Ok && Verify_Copy(&Hit, &Opaque))
+	{
+		size_t nTiles = (size_t)(w / Opts->TileW) * (h / Opts->TileH);
+		Ok2 =
+			Cache_ProcessImage(V->TempDir, &Hit, Opts, &HitRMSE, &HitTilePal, &WasHit) == PROCESS_OK &&
+			WasHit && Verify_Same(&Out, &Hit) &&
+			!memcmp(&RMSE, &HitRMSE, sizeof(RMSE)) &&
+			!memcmp(TilePal, HitTilePal, nTiles * sizeof(int32_t));
+		BmpCtx_Destroy(&Hit);
+	}
+	if(Copied) BmpCtx_Destroy(&Out);
+	Verify_Result(V, "cache miss is exact", Ok, NULL);
+	Verify_Result(V, "cache hit is exact", Ok2, NULL);
+	Mem_Free(HitTilePal);
+	Mem_Free(TilePal);
+	remove(Entry);
+
+	BmpCtx_Destroy(&Ref);
+	BmpCtx_Destroy(&Opaque);
+}
+
+static int Verify_Case(struct Verify_t *V, uint32_t CaseSeed)
+{
+	char Desc[160];
+	uint32_t Seed = CaseSeed ? CaseSeed : 1;
+	int Image = Rand_Range(&Seed, COUNTOF(Images));
+	int Tile  = Rand_Range(&Seed, COUNTOF(TileSizes));
+	int Pal   = Rand_Range(&Seed, COUNTOF(PalConfigs));
+	int Dith  = Rand_Range(&Seed, COUNTOF(Dithers));
+
+	struct ProcessOpts_t Opts;
+	Process_DefaultOpts(&Opts);
+	Opts.TileW              = TileSizes[Tile].tw;
+	Opts.TileH              = TileSizes[Tile].th;
+	Opts.nPalettes          = PalConfigs[Pal].np;
+	Opts.nColoursPerPalette = PalConfigs[Pal].ps;
+	Opts.DitherMode         = Dithers[Dith].Mode;
+	Opts.DitherLevel        = Dithers[Dith].Level;
+	Opts.OrderColours       = Rand_Range(&Seed, 2);
+
+	struct BmpCtx_t Src;
+	int w = Opts.TileW * (2 + Rand_Range(&Seed, 15));
+	int h = Opts.TileH * (2 + Rand_Range(&Seed, 15));
+	if(!BmpCtx_Create(&Src, w, h, 0)) return 0;
+	Images[Image].Generate(&Src, &Seed);
+
+	snprintf(Desc, sizeof(Desc), "%08X %s %dx%d -np:%d -ps:%d -tw:%d -th:%d -dither:%s%s",
+		CaseSeed, Images[Image].Name, w, h, Opts.nPalettes, Opts.nColoursPerPalette, Opts.TileW, Opts.TileH, Dithers[Dith].Name, Opts.OrderColours ? " -order" : "");
+	V->Case = Desc;
+
+	Verify_Paths(V, &Src, &Opts);
+	Verify_Remap(V, &Src, &Opts, &Seed);
+	Verify_Files(V, &Src, &Opts, &Seed);
+	BmpCtx_Destroy(&Src);
+	return 1;
+}
+
+int main(int argc, const char *argv[])
+{
+	int i;
+	uint32_t Seed = VERIFY_SEED;
+	int nCases = VERIFY_CASES;
+	int OnlyCase = -1;
+	struct Verify_t V;
+	memset(&V, 0, sizeof(V));
+	V.TempDir = VERIFY_TEMP_DIR;
+	for(i=1;i<argc;i++)
+	{
+		if(!strncmp(argv[i], "-seed:", 6)) Seed = (uint32_t)strtoul(argv[i]+6, NULL, 0);
+		else if(!strncmp(argv[i], "-cases:", 7)) nCases = atoi(argv[i]+7);
+		else if(!strncmp(argv[i], "-case:",  6)) OnlyCase = atoi(argv[i]+6);
+		else if(!strncmp(argv[i], "-tmp:",   5)) V.TempDir = argv[i]+5;
+		else if(!strcmp(argv[i], "-v")) V.Verbose = 1;
+		else
+		{
+			fprintf(stderr,
+				"Usage: tilequant_verify [-seed:n] [-cases:n] [-case:n] [-tmp:dir] [-v]\n"
+				"    -seed:n  - Seed all cases are generated from\n"
+				"    -cases:n - Number of cases to run\n"
+				"    -case:n  - Only run case n (to reproduce a failure)\n"
+				"    -tmp:dir - Directory for temporary files (default " VERIFY_TEMP_DIR ")\n"
+				"    -v       - Print passing checks too\n"
+			);
+			return 1;
+		}
+	}
+
+	for(i=0;i<nCases;i++)
+	{
+		if(OnlyCase >= 0 && i != OnlyCase) continue;
+		uint32_t CaseSeed = Seed ^ (uint32_t)(i*0x9E3779B9u);
+		if(!Verify_Case(&V, CaseSeed))
+		{
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+	}
+	V.Case = "all cases";
+	for(i=0;i<VARIANT_COUNT;i++) if(V.nLoss[i])
+	{
+		char Detail[64];
+		float Mean = (float)(V.Loss[i] / V.nLoss[i]);
+		snprintf(Detail, sizeof(Detail), "mean loss %.3fdB", Mean);
+		Verify_Result(&V, VariantNames[i], Mean <= VERIFY_MEAN_TOLERANCE_DB, Detail);
+	}
+	printf("%d checks, %d failed (seed 0x%08X)\n", V.nChecks, V.nFailed, Seed);
+	return V.nFailed ? 1 : 0;
+}